@@ -0,0 +1,217 @@
+#include "libc/libc.h"
+
+/*
+ * Input latency benchmark.
+ * Opens a window and redraws it on every key pressed in it, for two phases of
+ * BENCH_PHASE_TICKS: the first with nothing else running, the second with N
+ * CPU-bound hogs (two per CPU, or argv[1]). Hold a key down in the window for
+ * both phases, so the auto-repeat keeps the events coming.
+ * The kernel times each key from the wakeup of this task to its next draw, see
+ * sched_wake_input; this prints what each phase added to those counters.
+ */
+
+#define BENCH_PHASE_TICKS 1000 // 10 s
+#define BENCH_CALIBRATE_TICKS 20
+#define BENCH_MAX_HOGS 64
+#define BENCH_MAX_CPUS 16
+
+typedef struct InputStats
+{
+    uint64_t frames;
+    uint64_t cycles;
+    uint64_t cycles_max;
+} InputStats;
+
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static int parse_dec(const char *s)
+{
+    int n = 0;
+    while (*s >= '0' && *s <= '9')
+    {
+        n = n * 10 + (*s - '0');
+        s++;
+    }
+    return n;
+}
+
+/**
+ * @return TSC cycles per timer tick, measured over a few ticks.
+ */
+static uint64_t calibrate_tsc(void)
+{
+    uint64_t t0 = get_ticks();
+    while (get_ticks() == t0)
+    {
+    }
+    uint64_t start_tsc = rdtsc();
+    uint64_t start = get_ticks();
+    while (get_ticks() - start < BENCH_CALIBRATE_TICKS)
+    {
+    }
+    return (rdtsc() - start_tsc) / BENCH_CALIBRATE_TICKS;
+}
+
+static void read_stats(InputStats *out)
+{
+    SchedInfo_t info[BENCH_MAX_CPUS];
+    int n = sched_info(info, BENCH_MAX_CPUS);
+
+    out->frames = 0;
+    out->cycles = 0;
+    out->cycles_max = 0;
+    for (int c = 0; c < n; c++)
+    {
+        out->frames += info[c].input_frames;
+        out->cycles += info[c].input_cycles;
+        if (info[c].input_cycles_max > out->cycles_max)
+        {
+            out->cycles_max = info[c].input_cycles_max;
+        }
+    }
+}
+
+static void hog(uint64_t start, uint64_t end)
+{
+    uint64_t now = get_ticks();
+    if (now < start)
+    {
+        sleep((start - now) * 10);
+    }
+
+    volatile uint64_t x = 1;
+    while (get_ticks() < end)
+    {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    exit(0);
+}
+
+static void print_phase(const char *name, const InputStats *before, const InputStats *after, uint64_t tsc_per_tick)
+{
+    uint64_t frames = after->frames - before->frames;
+    uint64_t cycles = after->cycles - before->cycles;
+
+    print(name);
+    print_dec((int)frames);
+    print(" keys");
+    if (frames > 0)
+    {
+        // a tick is 10000 us
+        print(", avg ");
+        print_dec((int)(cycles / frames * 10000 / tsc_per_tick));
+        print(" us");
+    }
+    print("\n");
+}
+
+int main(int argc, char **argv)
+{
+    SchedInfo_t info[BENCH_MAX_CPUS];
+    int nr_cpus = sched_info(info, BENCH_MAX_CPUS);
+    if (nr_cpus <= 0)
+    {
+        print("bench_input: no scheduler stats\n");
+        return 1;
+    }
+
+    int nr_hogs = 2 * nr_cpus;
+    if (argc > 1)
+    {
+        nr_hogs = parse_dec(argv[1]);
+    }
+    if (nr_hogs > BENCH_MAX_HOGS)
+    {
+        print("bench_input: 0 to 64 hogs\n");
+        return 1;
+    }
+
+    uint64_t tsc_per_tick = calibrate_tsc();
+
+    uint64_t start = get_ticks() + 1;
+    uint64_t hogs_start = start + BENCH_PHASE_TICKS;
+    uint64_t end = hogs_start + BENCH_PHASE_TICKS;
+
+    // before the window, so the hogs don't own it
+    int pids[BENCH_MAX_HOGS];
+    int forked = 0;
+    for (int i = 0; i < nr_hogs; i++)
+    {
+        int pid = fork();
+        if (pid == 0)
+        {
+            hog(hogs_start, end);
+        }
+        if (pid < 0)
+        {
+            print("bench_input: fork failed\n");
+            break;
+        }
+        pids[forked++] = pid;
+    }
+
+    WinParams_t params;
+    params.x = 200;
+    params.y = 150;
+    params.width = 200;
+    params.height = 120;
+    params.flags = WIN_MOVABLE;
+    strcpy(params.title, "Input Latency");
+    if (win_create(&params) < 0)
+    {
+        print("bench_input: failed to create the window\n");
+        return 1;
+    }
+    draw_rect(0, 0, params.width, params.height, 0xFF333333);
+
+    print("bench_input: hold a key down in the window for 20 s, ");
+    print_dec(forked);
+    print(" hogs start halfway\n");
+
+    InputStats s0, s1, s2;
+    read_stats(&s0);
+    s1 = s0;
+    int hogs_running = 0;
+    uint32_t color = 0xFFFF0000;
+
+    while (get_ticks() < end)
+    {
+        if (!hogs_running && get_ticks() >= hogs_start)
+        {
+            read_stats(&s1);
+            hogs_running = 1;
+        }
+
+        Event e;
+        if (get_event(&e, O_NONBLOCK) > 0)
+        {
+            if (e.type == EVENT_KEY_PRESSED)
+            {
+                color ^= 0x00FFFF00;
+                draw_rect(50, 30, 100, 60, color);
+            }
+            continue;
+        }
+        sleep(50); // woken early by the next key
+    }
+    read_stats(&s2);
+
+    for (int i = 0; i < forked; i++)
+    {
+        int status;
+        waitpid(pids[i], &status);
+    }
+
+    print_phase("idle:      ", &s0, &s1, tsc_per_tick);
+    print_phase("with hogs: ", &s1, &s2, tsc_per_tick);
+    print("max since boot: ");
+    print_dec((int)(s2.cycles_max * 10000 / tsc_per_tick));
+    print(" us\n");
+
+    return 0;
+}
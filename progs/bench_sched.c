@@ -0,0 +1,135 @@
+#include "libc/libc.h"
+
+/*
+ * Fork-heavy scheduler benchmark.
+ * Forks N CPU-bound workers (BENCH_DEFAULT_WORKERS, or argv[1]), which each
+ * spin through the same amount of work and exit, and waits for them all, for
+ * a few rounds. Prints how long each round took, then what the rounds added
+ * to the counters of each CPU: how busy it was, and how many tasks it stole
+ * when it ran dry or pulled in the periodic rebalance.
+ */
+
+#define BENCH_DEFAULT_WORKERS 8
+#define BENCH_MAX_WORKERS 64
+#define BENCH_ROUNDS 3
+#define BENCH_WORK_ITERS 50000000
+#define BENCH_MAX_CPUS 16
+
+static int parse_dec(const char *s)
+{
+    int n = 0;
+    while (*s >= '0' && *s <= '9')
+    {
+        n = n * 10 + (*s - '0');
+        s++;
+    }
+    return n;
+}
+
+static void worker(int seed)
+{
+    volatile uint64_t x = (uint64_t)seed;
+    for (int i = 0; i < BENCH_WORK_ITERS; i++)
+    {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    exit((int)(x & 1));
+}
+
+static uint64_t run_round(int nr_workers)
+{
+    int pids[BENCH_MAX_WORKERS];
+    uint64_t start = get_ticks();
+
+    int forked = 0;
+    for (int i = 0; i < nr_workers; i++)
+    {
+        int pid = fork();
+        if (pid == 0)
+        {
+            worker(i);
+        }
+        if (pid < 0)
+        {
+            print("bench_sched: fork failed\n");
+            break;
+        }
+        pids[forked++] = pid;
+    }
+
+    for (int i = 0; i < forked; i++)
+    {
+        int status;
+        waitpid(pids[i], &status);
+    }
+
+    return get_ticks() - start;
+}
+
+int main(int argc, char **argv)
+{
+    int nr_workers = BENCH_DEFAULT_WORKERS;
+    if (argc > 1)
+    {
+        nr_workers = parse_dec(argv[1]);
+    }
+    if (nr_workers < 1 || nr_workers > BENCH_MAX_WORKERS)
+    {
+        print("bench_sched: 1 to 64 workers\n");
+        return 1;
+    }
+
+    SchedInfo_t before[BENCH_MAX_CPUS];
+    SchedInfo_t after[BENCH_MAX_CPUS];
+    int nr_cpus = sched_info(before, BENCH_MAX_CPUS);
+    if (nr_cpus <= 0)
+    {
+        print("bench_sched: no scheduler stats\n");
+        return 1;
+    }
+
+    print_dec(nr_workers);
+    print(" CPU-bound workers on ");
+    print_dec(nr_cpus);
+    print(" CPU(s):\n");
+
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+    {
+        uint64_t ticks = run_round(nr_workers);
+        print("  round ");
+        print_dec(r + 1);
+        print(": ");
+        print_dec((int)(ticks * 10));
+        print(" ms\n");
+    }
+
+    sched_info(after, BENCH_MAX_CPUS);
+
+    print("cpu  busy%  steals  rebalanced  stolen  switches\n");
+    for (int c = 0; c < nr_cpus; c++)
+    {
+        if (!after[c].online)
+        {
+            continue;
+        }
+
+        uint64_t ticks = after[c].ticks - before[c].ticks;
+        uint64_t idle = after[c].idle_ticks - before[c].idle_ticks;
+        int busy = ticks == 0 ? 0 : (int)((ticks - idle) * 100 / ticks);
+
+        print_dec(c);
+        print("    ");
+        print_dec(busy);
+        print("    ");
+        print_dec((int)(after[c].steals - before[c].steals));
+        print("    ");
+        print_dec((int)(after[c].balanced - before[c].balanced));
+        print("    ");
+        print_dec((int)(after[c].stolen - before[c].stolen));
+        print("    ");
+        print_dec((int)(after[c].switches - before[c].switches));
+        print("\n");
+    }
+
+    return 0;
+}
@@ -174,6 +174,10 @@ int cmd_help()
     print("  cp <src> <dst> Copy a file\n");
     print("  mv <src> <dst> Move or rename a file\n");
     print("  mkdir <dir>    Create a directory\n");
+    print("  sync           Flush cached disk writes\n");
+    print("  mountopt <sync|writeback> <path>  Set how a mount writes to disk\n");
+    print("  slabinfo       Show the kernel slab caches\n");
+    print("  meminfo        Show free physical memory by block size\n");
     print("  help           Show this message\n");
     print("  <program>      Run executable (e.g. snake.elf)\n");
     return 0;
@@ -373,6 +377,118 @@ int cmd_mv(int argc, char **argv)
     return 0;
 }
 
+int cmd_sync()
+{
+    sync();
+    return 0;
+}
+
+int cmd_mountopt(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        print("Usage: mountopt <sync|writeback> <path>\n");
+        return 1;
+    }
+
+    uint32_t flags;
+    if (strcmp(argv[1], "sync") == 0)
+    {
+        flags = MOUNT_SYNC;
+    }
+    else if (strcmp(argv[1], "writeback") == 0)
+    {
+        flags = MOUNT_WRITEBACK;
+    }
+    else
+    {
+        print("[MOUNTOPT]: unknown mode\n");
+        return 1;
+    }
+
+    if (mount_opt(argv[2], flags) < 0)
+    {
+        print("[MOUNTOPT]: nothing mounted there\n");
+        return 1;
+    }
+    return 0;
+}
+
+#define SHELL_MAX_SLABS 16
+
+int cmd_slabinfo()
+{
+    SlabInfo_t infos[SHELL_MAX_SLABS];
+    int n = slab_info(infos, SHELL_MAX_SLABS);
+    if (n < 0)
+    {
+        print("[SLABINFO]: failed\n");
+        return 1;
+    }
+
+    print("cache            size  active   total  pages  freed\n");
+    for (int i = 0; i < n; i++)
+    {
+        print(infos[i].name);
+        for (int pad = strlen(infos[i].name); pad < 16; pad++)
+        {
+            print(" ");
+        }
+        print(" ");
+        print_dec((int)infos[i].obj_size);
+        print("  ");
+        print_dec((int)infos[i].active_objs);
+        print("  ");
+        print_dec((int)infos[i].total_objs);
+        print("  ");
+        print_dec((int)(infos[i].slabs * infos[i].pages_per_slab));
+        print("  ");
+        print_dec((int)infos[i].pages_freed);
+        print("\n");
+    }
+    return 0;
+}
+
+int cmd_meminfo()
+{
+    MemInfo_t info;
+    if (mem_info(&info) < 0)
+    {
+        print("[MEMINFO]: failed\n");
+        return 1;
+    }
+
+    print("frames: ");
+    print_dec((int)info.free_frames);
+    print(" free of ");
+    print_dec((int)info.total_frames);
+    print(" (");
+    print_dec((int)info.magazine_frames);
+    print(" in the per-CPU caches, ");
+    print_dec((int)info.zeroed_frames);
+    print(" pre-zeroed)");
+    print("\nlargest free block: ");
+    if (info.largest_free_order < 0)
+    {
+        print("none");
+    }
+    else
+    {
+        print_dec(4 << info.largest_free_order);
+        print(" KiB");
+    }
+    print("\nfree blocks by size (KiB):\n");
+    for (int o = 0; o < MEMINFO_NUM_ORDERS; o++)
+    {
+        print("  ");
+        print_dec(4 << o);
+        print(": ");
+        print_dec((int)info.free_blocks[o]);
+        print("\n");
+    }
+    return 0;
+}
+
 int cmd_shutdown()
 {
     print("NyanOS is going to shutdown...Hope I'll see you again :(\n");
@@ -494,6 +610,34 @@ int exec_cmd(int argc, char **argv)
         return 1;
     }
 
+    /* --- SYNC --- */
+    else if (strncmp(argv[0], "sync", 5) == 0)
+    {
+        cmd_sync();
+        return 1;
+    }
+
+    /* --- MOUNTOPT --- */
+    else if (strncmp(argv[0], "mountopt", 9) == 0)
+    {
+        cmd_mountopt(argc, argv);
+        return 1;
+    }
+
+    /* --- SLABINFO --- */
+    else if (strncmp(argv[0], "slabinfo", 9) == 0)
+    {
+        cmd_slabinfo();
+        return 1;
+    }
+
+    /* --- MEMINFO --- */
+    else if (strncmp(argv[0], "meminfo", 8) == 0)
+    {
+        cmd_meminfo();
+        return 1;
+    }
+
     /* --- SHUTDOWN --- */
     else if (strncmp(argv[0], "shutdown", 8) == 0)
     {
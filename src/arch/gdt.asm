@@ -44,6 +44,8 @@ enter_user_mode:
     push 0x33       ; user code segment 0x30 | RPL 3
     push rdi        ; entry
 
+    swapgs          ; keep the per-CPU data in KERNEL_GS_BASE
+
     mov ax, 0x2B    ; user data selector 0x28 | RPL 3
     mov ds, ax
     mov es, ax
@@ -1,5 +1,7 @@
 #include "gdt.h"
 #include "mem/pmm.h"
+#include "cpu.h"
+#include "kern_defs.h"
 
 union gdt_union
 {
@@ -13,15 +15,21 @@ union gdt_union
         struct gdt_entry user_data;
         struct gdt_entry user_code;
     } structured;
-} gdt;
+};
+
+/*
+Every CPU needs a TSS of its own, for its own rsp0, and the TSS descriptor is
+marked busy once loaded, so every CPU loads its own copy of the GDT too.
+The copies only differ in the TSS descriptor.
+*/
+static union gdt_union g_gdts[MAX_CPUS];
+static struct gdt_ptr g_gdt_ptrs[MAX_CPUS];
+static struct tss_t g_tss[MAX_CPUS];
 
-struct gdt_ptr gdt_ptr;
 extern void gdt_set(uint64_t);
 extern void gdt_load_tss(uint16_t selector);
 
-static struct tss_t g_tss;
-
-static void gdt_encode_entry(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran)
+static void gdt_encode_entry(union gdt_union *gdt_u, int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran)
 {
     // Check the limit to make sure that it can be encoded
     // if (limit > 0xFFFFF) 
@@ -30,27 +38,27 @@ static void gdt_encode_entry(int num, uint32_t base, uint32_t limit, uint8_t acc
     // }
 
     // Encode the limit, granularity and flags
-    gdt.entries[num].limit_low = limit & 0xFFFF;
-    gdt.entries[num].granularity = (limit >> 16) & 0x0F;
-    gdt.entries[num].granularity |= gran & 0xF0;
+    gdt_u->entries[num].limit_low = limit & 0xFFFF;
+    gdt_u->entries[num].granularity = (limit >> 16) & 0x0F;
+    gdt_u->entries[num].granularity |= gran & 0xF0;
 
     // Encode the base
-    gdt.entries[num].base_low = base & 0xFFFF;
-    gdt.entries[num].base_middle = (base >> 16) & 0xFF;
-    gdt.entries[num].base_high = (base >> 24) & 0xFF;
+    gdt_u->entries[num].base_low = base & 0xFFFF;
+    gdt_u->entries[num].base_middle = (base >> 16) & 0xFF;
+    gdt_u->entries[num].base_high = (base >> 24) & 0xFF;
 
     // Encode the access byte
-    gdt.entries[num].access = access;
+    gdt_u->entries[num].access = access;
 }
 
-static void gdt_encode_tss(void)
+static void gdt_encode_tss(union gdt_union *gdt_u, struct tss_t *tss)
 {
-    g_tss.rsp0 = 0;
+    tss->rsp0 = 0;
 
-    uint64_t tss_base = (uint64_t)&g_tss;
+    uint64_t tss_base = (uint64_t)tss;
     uint32_t tss_limit = sizeof(struct tss_t) - 1;
 
-    struct gdt_tss_entry* tss_entry = &gdt.structured.tss;
+    struct gdt_tss_entry* tss_entry = &gdt_u->structured.tss;
 
     // assign the base addr
     tss_entry->base_low = tss_base & 0xFFFF;
@@ -70,23 +78,39 @@ static void gdt_encode_tss(void)
     tss_entry->reserved = 0x00;
 }
 
+/**
+ * @brief Sets the stack the CPU running this switches to on an interrupt from user mode.
+ */
 void tss_set_stack(uint64_t stk_ptr)
 {
-    g_tss.rsp0 = stk_ptr;
+    g_tss[cpu_id()].rsp0 = stk_ptr;
+}
+
+struct tss_t *gdt_get_tss(uint32_t cpu)
+{
+    return &g_tss[cpu];
 }
 
-void gdt_init(void)
+/**
+ * @brief Builds the GDT and the TSS of CPU `cpu`, and loads them on the CPU running this.
+ * Runs before the per-CPU data is set up, hence the explicit index.
+ * Loading the segments clears the GS base, which must be set again afterwards.
+ */
+void gdt_init(uint32_t cpu)
 {
-    gdt_ptr.limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
-    gdt_ptr.base = (uint64_t)&gdt;
+    union gdt_union *gdt_u = &g_gdts[cpu];
+    struct gdt_ptr *gdt_ptr = &g_gdt_ptrs[cpu];
+
+    gdt_ptr->limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
+    gdt_ptr->base = (uint64_t)gdt_u;
 
-    gdt_encode_entry(0, 0, 0, 0, 0); // null descriptor
-    gdt_encode_entry(1, 0, 0xFFFFFFFF, GDT_ACCESS_KERNEL_CODE, GDT_GRAN_KERNEL_CODE); // kernel code segment
-    gdt_encode_entry(2, 0, 0xFFFFFFFF, GDT_ACCESS_KERNEL_DATA, GDT_GRAN_KERNEL_DATA); // kernel data
-    gdt_encode_tss();
-    gdt_encode_entry(5, 0, 0xFFFFFFFF, GDT_ACCESS_USER_DATA, GDT_GRAN_USER_DATA); // user code
-    gdt_encode_entry(6, 0, 0xFFFFFFFF, GDT_ACCESS_USER_CODE, GDT_GRAN_USER_CODE); // user code
+    gdt_encode_entry(gdt_u, 0, 0, 0, 0, 0); // null descriptor
+    gdt_encode_entry(gdt_u, 1, 0, 0xFFFFFFFF, GDT_ACCESS_KERNEL_CODE, GDT_GRAN_KERNEL_CODE); // kernel code segment
+    gdt_encode_entry(gdt_u, 2, 0, 0xFFFFFFFF, GDT_ACCESS_KERNEL_DATA, GDT_GRAN_KERNEL_DATA); // kernel data
+    gdt_encode_tss(gdt_u, &g_tss[cpu]);
+    gdt_encode_entry(gdt_u, 5, 0, 0xFFFFFFFF, GDT_ACCESS_USER_DATA, GDT_GRAN_USER_DATA); // user code
+    gdt_encode_entry(gdt_u, 6, 0, 0xFFFFFFFF, GDT_ACCESS_USER_CODE, GDT_GRAN_USER_CODE); // user code
 
-    gdt_set((uint64_t)&gdt_ptr);
+    gdt_set((uint64_t)gdt_ptr);
     gdt_load_tss(GDT_OFFSET_TSS);
 }
\ No newline at end of file
@@ -66,7 +66,7 @@ struct gdt_ptr
     uint64_t base;
 } __attribute__((packed));
 
-void gdt_init(void);
+void gdt_init(uint32_t cpu);
 
 /* TSS */
 struct tss_t
@@ -95,5 +95,6 @@ struct gdt_tss_entry
 } __attribute__((packed));
 
 void tss_set_stack(uint64_t stk_ptr);
+struct tss_t *gdt_get_tss(uint32_t cpu);
 
 #endif
\ No newline at end of file
@@ -23,6 +23,11 @@ isr_stub_%+%1:
 %endmacro
 
 isr_common_stub:
+    ; from user mode, swap in the per-CPU data (CS is above int_no, err_code and RIP)
+    test qword [rsp + 24], 3
+    jz .from_kernel
+    swapgs
+.from_kernel:
     ; save all the GP registers
     push r15
     push r14
@@ -64,6 +69,10 @@ isr_common_stub:
     
     add rsp, 16
 
+    test qword [rsp + 8], 3
+    jz .to_kernel
+    swapgs
+.to_kernel:
     iretq
 
 ; Create the ISR stubs for the first 32 exceptions.
@@ -30,6 +30,8 @@ extern void irq12_stub(void);
 extern void irq13_stub(void);
 extern void irq14_stub(void);
 extern void irq15_stub(void);
+extern void irq16_stub(void);
+extern void irq17_stub(void);
 
 // The Interrupt Descriptor Table (IDT).
 // This is an array of 256 IDT entries, each corresponding to an interrupt vector.
@@ -51,6 +53,16 @@ void exception_handler(registers_t *regs)
 
         uint64_t err_code = (regs->err_code & 0x7);
 
+        // not present: maybe a reserved page touched for the first time,
+        // by the task itself or by the kernel on its behalf
+        if (!(err_code & 0x1) && fault_addr < VMM_USER_END)
+        {
+            if (vmm_handle_demand(fault_addr) == 0)
+            {
+                return;
+            }
+        }
+
         if (err_code == 0x7 || err_code == 0x03)
         {
             if (vmm_handle_cow(fault_addr) == 0)
@@ -155,9 +167,17 @@ void idt_init()
     idt_set_descriptor(45, irq13_stub, 0x8E);
     idt_set_descriptor(46, irq14_stub, 0x8E);
     idt_set_descriptor(47, irq15_stub, 0x8E);
+    idt_set_descriptor(48, irq16_stub, 0x8E); // IRQ_IPI_TLB
+    idt_set_descriptor(49, irq17_stub, 0x8E); // IRQ_IPI_RESCHED
 
     // Load the IDT.
-    __asm__ volatile("lidt %0" : : "m"(idtr));
+    idt_load();
     // Enable interrupts.
     // __asm__ volatile ("sti");
 }
+
+// Loads the IDT on the CPU running this. The CPUs all share the same table.
+void idt_load(void)
+{
+    __asm__ volatile("lidt %0" : : "m"(idtr));
+}
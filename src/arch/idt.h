@@ -65,5 +65,6 @@ void exception_handler(registers_t *regs);
 void idt_set_descriptor(uint8_t vector, void *isr, uint8_t flags);
 
 void idt_init(void);
+void idt_load(void);
 
 #endif
\ No newline at end of file
@@ -5,16 +5,26 @@ extern irq_entry
 
 ; This macro creates a stub for each IRQ.
 ; The stub pushes the IRQ number onto the stack and then calls the common IRQ handler.
+; Coming from user mode, GS holds the user's base: swapgs brings in the per-CPU
+; data on the way in, and gives the user's back on the way out.
 %macro DECLARE_IRQ 1
 global irq%1_stub
 irq%1_stub:
+    test qword [rsp + 8], 3 ; CS of the interrupted code
+    jz %%from_kernel
+    swapgs
+%%from_kernel:
     push %1     ; Push the IRQ number.
     push rax    ; Push a dummy value for alignment.
     mov rax, do_irq     ; Call the common IRQ handler.
     call rax
     pop rax     ; Pop the dummy value.
     add rsp, 8  ; Pop the IRQ number.
-    
+
+    test qword [rsp + 8], 3
+    jz %%to_kernel
+    swapgs
+%%to_kernel:
     iretq       ; Return from the interrupt.
 %endmacro
 
@@ -82,5 +92,7 @@ DECLARE_IRQ 12
 DECLARE_IRQ 13
 DECLARE_IRQ 14
 DECLARE_IRQ 15
+DECLARE_IRQ 16 ; IRQ_IPI_TLB, sent by the other CPUs
+DECLARE_IRQ 17 ; IRQ_IPI_RESCHED
 
 section .note.GNU-stack noalloc noexec nowrite progbits
\ No newline at end of file
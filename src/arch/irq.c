@@ -2,13 +2,13 @@
 #include "drivers/apic.h"
 // #include "pic.h"
 
-// An array of IRQ handlers, one for each of the 16 IRQ lines.
-static irq_handler_t irq_handlers[16];
+// An array of IRQ handlers, one for each of the IRQ lines.
+static irq_handler_t irq_handlers[IRQ_COUNT];
 
 // Registers a handler for a given IRQ.
 void register_irq_handler(int irq, irq_handler_t handler)
 {
-    if (irq < 0 || irq >= 16)
+    if (irq < 0 || irq >= IRQ_COUNT)
     {
         return;
     }
@@ -20,7 +20,7 @@ void register_irq_handler(int irq, irq_handler_t handler)
 // It calls the registered handler for the given IRQ and then sends an EOI to the PIC.
 void irq_dispatch(int irq, void *regs)
 {
-    if (irq < 0 || irq >= 16) 
+    if (irq < 0 || irq >= IRQ_COUNT) 
     {
         return; 
     }
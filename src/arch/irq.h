@@ -3,6 +3,12 @@
 
 #include <stdint.h>
 
+// IRQs 0-15 come from the devices, through the I/O APIC.
+// The ones after are IPIs, sent by the other CPUs.
+#define IRQ_IPI_TLB 16
+#define IRQ_IPI_RESCHED 17
+#define IRQ_COUNT 18
+
 // A function pointer type for IRQ handlers.
 // The `regs` parameter is a pointer to the saved registers on the stack.
 typedef void (*irq_handler_t)(void *regs);
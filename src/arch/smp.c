@@ -0,0 +1,255 @@
+/**
+ * @file smp.c
+ * @brief Brings up the application processors (APs), and keeps the per-CPU data.
+ *
+ * Limine starts every CPU, and parks each AP on the goto_address of its
+ * limine_mp_info. smp_start_aps hands an AP its cpu_local_t through
+ * extra_argument, then writes ap_entry there. The AP loads its own GDT and TSS,
+ * the shared IDT and kernel page tables, turns on its local APIC, and becomes
+ * the idle task of its CPU: the scheduler takes over when it first puts a task
+ * on the CPU's run queue, which kicks it. The BSP is always CPU 0, the APs are numbered from 1 in
+ * the order Limine lists them.
+ *
+ * The kernel half of the page tables is shared by every CPU, so when a CPU
+ * unmaps kernel memory, the others must drop their TLB entries as well: it
+ * raises `tlb_flush_pending` on each of them, sends them IRQ_IPI_TLB and waits
+ * until they have all flushed. A CPU that is spinning on a lock with
+ * interrupts off flushes from the spin loop, so it can't hold the sender up.
+ *
+ * IRQ_IPI_RESCHED makes a CPU run an early tick: when a task is put on the run
+ * queue of a CPU that isn't ticking soon, or one that should run before its
+ * current task is woken up.
+ */
+
+#include "smp.h"
+#include "gdt.h"
+#include "idt.h"
+#include "irq.h"
+#include "syscall.h"
+#include "cpu.h"
+#include "kern_defs.h"
+#include "mem/vmm.h"
+#include "sched/sched.h"
+#include "drivers/apic.h"
+#include "drivers/serial.h"
+#include "drivers/timer.h"
+#include "utils/asm_instrs.h"
+#include "utils/spinlock.h"
+
+#include <limine.h>
+
+#define IA32_GS_BASE 0xC0000101
+#define IA32_KERNEL_GS_BASE 0xC0000102
+
+#define IRQ_VECTOR_BASE 0x20
+#define SMP_AP_TIMEOUT 100000000 // pause loops to wait for an AP before giving up on it
+
+extern uint64_t *kern_pml4;
+
+static cpu_local_t g_cpus[MAX_CPUS];
+static uint32_t g_cpu_count = 1;           // CPUs given a cpu_local_t
+static volatile uint32_t g_cpus_online = 1; // CPUs that finished their init
+
+static spinlock_t g_shootdown_lock = SPINLOCK_INIT;
+static volatile uint32_t g_shootdown_acks = 0; // CPUs yet to flush
+
+/**
+ * @brief Points the GS base of the CPU running this at `cpu`.
+ * The user's GS base starts at 0 in KERNEL_GS_BASE, swapped in on the way to user mode.
+ */
+static void smp_load_gs(cpu_local_t *cpu)
+{
+    wrmsr(IA32_GS_BASE, (uint64_t)cpu);
+    wrmsr(IA32_KERNEL_GS_BASE, 0);
+}
+
+static void smp_resched_ipi_handler(void *regs)
+{
+    (void)regs;
+    lapic_send_eoi(); // before switching away, as the timer does
+    // an early tick: it accounts the time, and arms the timer again
+    if (sched_tick())
+    {
+        schedule();
+    }
+}
+
+/**
+ * @brief Sets up the per-CPU data of the BSP.
+ * Must run right after gdt_init, before anything calls cpu_id().
+ */
+void smp_init_bsp(void)
+{
+    cpu_local_t *cpu = &g_cpus[0];
+    cpu->self = cpu;
+    cpu->id = 0;
+    cpu->tss = gdt_get_tss(0);
+    cpu->online = true;
+    smp_load_gs(cpu);
+
+    // the scheduler kicks CPUs, the BSP included, even with no AP up
+    register_irq_handler(IRQ_IPI_RESCHED, smp_resched_ipi_handler);
+}
+
+void smp_tlb_poll(void)
+{
+    if (g_cpus_online < 2)
+    {
+        return; // also keeps the early boot, before the GS base is set, away from this_cpu()
+    }
+
+    cpu_local_t *cpu = this_cpu();
+    if (__atomic_exchange_n(&cpu->tlb_flush_pending, 0, __ATOMIC_ACQUIRE) != 0)
+    {
+        vmm_flush_all_tlb();
+        __atomic_fetch_sub(&g_shootdown_acks, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void smp_tlb_ipi_handler(void *regs)
+{
+    (void)regs;
+    smp_tlb_poll();
+}
+
+/**
+ * @brief Makes every other online CPU flush its whole TLB, and waits until they have.
+ * The caller flushes its own entries.
+ */
+void smp_tlb_shootdown(void)
+{
+    if (g_cpus_online < 2)
+    {
+        return;
+    }
+
+    uint64_t rflags = spin_lock_irqsave(&g_shootdown_lock);
+
+    uint32_t self = cpu_id();
+    uint32_t targets = 0;
+    for (uint32_t c = 0; c < g_cpu_count; c++)
+    {
+        if (c != self && g_cpus[c].online)
+        {
+            targets++;
+        }
+    }
+    __atomic_store_n(&g_shootdown_acks, targets, __ATOMIC_RELAXED);
+
+    for (uint32_t c = 0; c < g_cpu_count; c++)
+    {
+        if (c != self && g_cpus[c].online)
+        {
+            __atomic_store_n(&g_cpus[c].tlb_flush_pending, 1, __ATOMIC_RELEASE);
+            lapic_send_ipi(g_cpus[c].lapic_id, IRQ_VECTOR_BASE + IRQ_IPI_TLB);
+        }
+    }
+
+    while (__atomic_load_n(&g_shootdown_acks, __ATOMIC_ACQUIRE) != 0)
+    {
+        pause();
+    }
+
+    spin_unlock_irqrestore(&g_shootdown_lock, rflags);
+}
+
+
+/**
+ * @brief Makes the CPU `id` pick its next task now. It may be this CPU, the
+ * IPI then waits for interrupts to be turned back on.
+ */
+void smp_send_resched(uint32_t id)
+{
+    if (!g_cpus[id].online)
+    {
+        return;
+    }
+    lapic_send_ipi(g_cpus[id].lapic_id, IRQ_VECTOR_BASE + IRQ_IPI_RESCHED);
+}
+
+/**
+ * @brief Where an AP starts, on the stack Limine gave it, with interrupts off.
+ */
+static void ap_entry(struct limine_mp_info *info)
+{
+    cpu_local_t *cpu = (cpu_local_t *)info->extra_argument;
+
+    write_cr3(vmm_hhdm_to_phys(kern_pml4));
+    gdt_init(cpu->id);
+    smp_load_gs(cpu);
+    idt_load();
+    enable_sse();
+    vmm_init_cpu();
+    syscall_init();
+    lapic_init_cpu();
+    timer_init_cpu();
+    sched_init_cpu();
+
+    cpu->online = true;
+    __atomic_fetch_add(&g_cpus_online, 1, __ATOMIC_RELEASE);
+
+    task_idle();
+}
+
+/**
+ * @brief Starts every AP Limine found, one after the other.
+ * Runs on the BSP once the scheduler is set up, before interrupts are turned on.
+ */
+void smp_start_aps(struct limine_mp_response *mp_resp)
+{
+    g_cpus[0].lapic_id = mp_resp->bsp_lapic_id;
+    register_irq_handler(IRQ_IPI_TLB, smp_tlb_ipi_handler);
+
+    for (uint64_t i = 0; i < mp_resp->cpu_count; i++)
+    {
+        struct limine_mp_info *info = mp_resp->cpus[i];
+        if (info->lapic_id == mp_resp->bsp_lapic_id)
+        {
+            continue;
+        }
+
+        if (g_cpu_count == MAX_CPUS)
+        {
+            kprint("SMP: more CPUs than MAX_CPUS, the rest stay parked\n");
+            break;
+        }
+
+        cpu_local_t *cpu = &g_cpus[g_cpu_count];
+        cpu->self = cpu;
+        cpu->id = g_cpu_count;
+        cpu->lapic_id = info->lapic_id;
+        cpu->tss = gdt_get_tss(cpu->id);
+        g_cpu_count++;
+
+        info->extra_argument = (uint64_t)cpu;
+        __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_SEQ_CST);
+
+        for (uint64_t spin = 0; !cpu->online && spin < SMP_AP_TIMEOUT; spin++)
+        {
+            pause();
+        }
+        if (!cpu->online)
+        {
+            kprint("SMP: CPU ");
+            kprint_int((int)cpu->id);
+            kprint(" did not come up\n");
+        }
+    }
+
+    kprint("SMP: ");
+    kprint_int((int)g_cpus_online);
+    kprint(" CPU(s) online\n");
+}
+
+/**
+ * @return The number of CPUs given a cpu_local_t; check `online` before using one.
+ */
+uint32_t smp_cpu_count(void)
+{
+    return g_cpu_count;
+}
+
+cpu_local_t *smp_cpu(uint32_t id)
+{
+    return &g_cpus[id];
+}
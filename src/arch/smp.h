@@ -0,0 +1,58 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "gdt.h"
+
+struct Task;
+struct limine_mp_response;
+
+/**
+ * The data each CPU keeps for itself, reached through the GS base.
+ * In the kernel, GS holds the cpu_local_t of the CPU; in user mode it holds
+ * the user's, and the entry stubs swap them with `swapgs`.
+ * The first fields are read by the assembly stubs at fixed offsets.
+ */
+typedef struct cpu_local
+{
+    struct cpu_local *self; // gs:0, turns the GS base into a pointer
+    uint64_t kern_stk_ptr;  // gs:8, the stack syscall_entry switches to
+    uint64_t usr_stk_tmp;   // gs:16, the user rsp while syscall_entry switches stacks
+    uint32_t id;            // gs:24, index into the per-CPU arrays (< MAX_CPUS)
+    uint32_t lapic_id;
+
+    struct Task *curr_tsk;
+    struct Task *idle_tsk; // runs when none of the tasks of this CPU is ready
+    struct Task *prev_tsk; // the task switched away from, until the switch is over
+    struct tss_t *tss;
+
+    volatile uint32_t tlb_flush_pending; // set by another CPU, see smp_tlb_shootdown
+    volatile bool online;
+} cpu_local_t;
+
+#define CPU_LOCAL_KERN_STK 8
+#define CPU_LOCAL_USR_STK 16
+#define CPU_LOCAL_ID 24
+
+_Static_assert(offsetof(cpu_local_t, kern_stk_ptr) == CPU_LOCAL_KERN_STK, "syscall.asm reads gs:8");
+_Static_assert(offsetof(cpu_local_t, usr_stk_tmp) == CPU_LOCAL_USR_STK, "syscall.asm writes gs:16");
+_Static_assert(offsetof(cpu_local_t, id) == CPU_LOCAL_ID, "cpu_id() reads gs:24");
+
+static inline cpu_local_t *this_cpu(void)
+{
+    cpu_local_t *cpu;
+    asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+void smp_init_bsp(void);
+void smp_start_aps(struct limine_mp_response *mp_resp);
+uint32_t smp_cpu_count(void);
+cpu_local_t *smp_cpu(uint32_t id);
+void smp_tlb_shootdown(void);
+void smp_send_resched(uint32_t id);
+
+#endif
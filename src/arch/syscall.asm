@@ -1,11 +1,10 @@
 [BITS 64]
 
-section .bss
-    usr_stk_tmp: resq 1
-    kern_stk_ptr: resq 1
+; offsets in cpu_local_t, see smp.h
+%define CPU_LOCAL_KERN_STK 8
+%define CPU_LOCAL_USR_STK 16
 
 extern syscall_handler
-global kern_stk_ptr
 global syscall_entry
 
 section .text
@@ -23,12 +22,13 @@ section .text
 ;       rax - ret_val
 ;===========================
 syscall_entry:
-    ;   swap the user stack with the kernel stack manually
-    cli
-    mov [usr_stk_tmp], rsp
-    mov rsp, [kern_stk_ptr]
+    ; IA32_FMASK clears IF, so nothing runs on this CPU until the sti below
+    ; swap in the per-CPU data, and the user stack with the kernel stack
+    swapgs
+    mov [gs:CPU_LOCAL_USR_STK], rsp
+    mov rsp, [gs:CPU_LOCAL_KERN_STK]
     
-    push qword [usr_stk_tmp]
+    push qword [gs:CPU_LOCAL_USR_STK]
     sti
 
     ; save the context (CPU-saved and Caller-saved regs)
@@ -73,6 +73,9 @@ syscall_entry:
     pop r11
     pop rcx
 
+    ; sysret restores IF from r11, nothing may interrupt the user GS and stack
+    cli
+    swapgs
     pop rsp
     o64 sysret
 
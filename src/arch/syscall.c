@@ -16,6 +16,7 @@
 #include "mem/kmalloc.h"
 #include "mem/pmm.h"
 #include "mem/vmm.h"
+#include "mem/slab.h"
 #include "gui/window.h"
 #include "kern_defs.h"
 #include "include/syscall_args.h"
@@ -189,7 +190,10 @@ static uint64_t sys_shutdown(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64
     // TODO: Kill all process
 
     kprint("[INFO] Syncing disks to prevent data loss...\n");
-    // TODO: vfs_sync() or fat32_flush_cache()
+    // the ATA driver waits for IRQ 14, so interrupts must be on while flushing
+    sti();
+    vfs_sync();
+    cli();
 
     kprint("[INFO] Powering off. See you next time, Creator!\n");
 
@@ -236,6 +240,66 @@ static uint64_t sys_list_files(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint
     return 0;
 }
 
+static uint64_t sys_sync(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+    UNUSED(arg1);
+    UNUSED(arg2);
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(arg5);
+    vfs_sync();
+    return 0;
+}
+
+static uint64_t sys_fsync(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+    UNUSED(arg2);
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(arg5);
+    int fd = (int)arg1;
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES)
+    {
+        kprint("SYS_FSYNC failed: invalid fd\n");
+        return -1;
+    }
+
+    Task *curr_tsk = get_curr_task();
+    file_handle_t *fh = curr_tsk->fd_tbl[fd];
+    if (fh == NULL)
+    {
+        kprint("SYS_FSYNC failed: invalid file handle\n");
+        return -1;
+    }
+
+    return (uint64_t)(int64_t)vfs_fsync(fh);
+}
+
+/**
+ * @brief Sets the options of a mount point (VFS_MOUNT_SYNC or VFS_MOUNT_WRITEBACK).
+ * @return the previous options, or -1 if nothing is mounted at the path.
+ */
+static uint64_t sys_mount_opt(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(arg5);
+    char *path = (char *)arg1;
+    uint32_t flags = (uint32_t)arg2;
+
+    if (!verify_usr_access((uint64_t)path, 1))
+    {
+        return -1;
+    }
+
+    char k_path[0x40];
+    strncpy(k_path, path, sizeof(k_path) - 1);
+    k_path[sizeof(k_path) - 1] = '\0';
+
+    return (uint64_t)(int64_t)vfs_set_mount_flags(k_path, flags);
+}
+
 static uint64_t sys_fork(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
 {
     UNUSED(arg1);
@@ -308,7 +372,8 @@ static uint64_t sys_exec(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t a
     char *elf_fname = kmalloc(strlen(full_path) + 1);
     strcpy(elf_fname, full_path);
 
-    uint64_t old_pml4 = read_cr3();
+    uint64_t old_cr3 = read_cr3(); // with the PCID, to go back to it as it was
+    uint64_t old_pml4 = pte_get_addr(old_cr3);
 
     uint64_t new_pml4 = vmm_new_pml4(); // copy kernel space, while the user space is empty
     if (new_pml4 == 0)
@@ -331,14 +396,27 @@ static uint64_t sys_exec(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t a
     uint64_t virt_usr_stk_base = USER_STACK_TOP - (PAGE_SIZE * USER_STACK_PAGES);
     uint64_t *new_pml4_hhdm = vmm_phys_to_hhdm(new_pml4);
 
-    for (int i = 0; i < USER_STACK_PAGES; i++)
+    uint64_t usr_stk_frames[USER_STACK_PAGES];
+    if (pmm_alloc_frames_batch(USER_STACK_PAGES, usr_stk_frames) != USER_STACK_PAGES)
     {
-        uint64_t phys_usr_stk_frame = pmm_alloc_frame();
+        kprint("SYS_EXEC failed: OOM for the user stack\n");
+        cli();
+        write_cr3(old_cr3);
+        curr_tsk->pml4 = old_pml4;
+        sti();
+        kfree(argv_buf);
+        kfree(argv_list);
+        kfree(elf_fname);
+        vmm_ret_pml4(new_pml4);
+        return -1;
+    }
 
+    for (int i = 0; i < USER_STACK_PAGES; i++)
+    {
         vmm_map_page(
             new_pml4_hhdm,
             virt_usr_stk_base + (PAGE_SIZE * i),
-            phys_usr_stk_frame,
+            usr_stk_frames[i],
             VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER);
     }
 
@@ -370,7 +448,7 @@ static uint64_t sys_exec(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t a
     if (entry == 0)
     {
         cli();
-        write_cr3(old_pml4);
+        write_cr3(old_cr3);
         curr_tsk->pml4 = old_pml4;
         sti();
         kfree(elf_fname);
@@ -383,18 +461,13 @@ static uint64_t sys_exec(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t a
     curr_tsk->heap_end = USER_HEAP_START;
 
     vmm_cleanup_task(curr_tsk);
-    VmFreeRegion *vm_free_head = (VmFreeRegion *)kmalloc(sizeof(VmFreeRegion));
-    if (vm_free_head == NULL)
+    if (vmm_space_init(&curr_tsk->vm, USER_MMAP_START, USER_MMAP_SIZE) < 0)
     {
         return -1;
     }
-    vm_free_head->addr = USER_MMAP_START;
-    vm_free_head->size = USER_MMAP_SIZE;
-    vm_free_head->next = NULL;
-
-    curr_tsk->vm_free_head = vm_free_head;
-    curr_tsk->vm_alloc_head = NULL;
 
+    // the task's PCID still tags entries of the old address space
+    vmm_pcid_release(curr_tsk);
     vmm_free_table(vmm_phys_to_hhdm(old_pml4), 4);
 
     if (curr_tsk->win != NULL)
@@ -442,10 +515,19 @@ static uint64_t sys_waitpid(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_
         return -1;
     }
 
+    Task *curr_tsk = get_curr_task();
     while (1)
     {
-        if (child->state == TASK_ZOMBIE)
+        // wait first, then look: the child may exit on another CPU in between,
+        // and its wakeup then makes us ready again instead of being lost.
+        // Interrupts stay off, so the timer can't switch us out in between
+        uint64_t rflags = get_rflags();
+        cli();
+        __atomic_store_n(&curr_tsk->state, TASK_WAITING, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&child->state, __ATOMIC_ACQUIRE) == TASK_ZOMBIE)
         {
+            curr_tsk->state = TASK_READY;
+            irq_restore(rflags);
             if (stat != NULL)
             {
                 if (!verify_usr_access((uint64_t)stat, sizeof(int)))
@@ -459,10 +541,9 @@ static uint64_t sys_waitpid(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_
             sched_destroy_task(child);
             return pid;
         }
-        else
-        {
-            sched_block();
-        }
+
+        schedule();
+        irq_restore(rflags);
     }
 }
 
@@ -555,23 +636,15 @@ static uint64_t sys_sbrk(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t a
                                    : (prev_brk + 0xFFF) & ~0xFFF;
     uint64_t end_page_addr = (next_brk + 0xFFF) & ~0xFFF;
 
+    // only reserve the pages, the #PF handler backs them on first touch
+    uint64_t *pml4 = vmm_phys_to_hhdm(curr_tsk->pml4);
     for (uint64_t virt_addr = start_page_addr; virt_addr < end_page_addr; virt_addr += PAGE_SIZE)
     {
-        uint64_t phys_addr = pmm_alloc_frame();
-        if (phys_addr == 0)
+        if (vmm_reserve_page(pml4, virt_addr, VMM_FLAG_WRITABLE | VMM_FLAG_USER) < 0)
         {
             kprint("SYS_BRK: out of memory!\n");
             return -1;
         }
-
-        void *phys_addr_hhdm = vmm_phys_to_hhdm(phys_addr);
-        memset(phys_addr_hhdm, 0, PAGE_SIZE); // Security: Clean the page
-
-        vmm_map_page(
-            vmm_phys_to_hhdm(curr_tsk->pml4),
-            virt_addr,
-            (uint64_t)phys_addr,
-            VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER);
     }
     curr_tsk->heap_end = next_brk;
     return prev_brk;
@@ -771,18 +844,27 @@ static uint64_t sys_mkdir(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t
     strcpy(new_dir_name, &full_path[last_slash + 1]);
 
     vfs_node_t *parent_node = vfs_navigate(parent_path);
+    if (parent_node == NULL)
+    {
+        return -1;
+    }
 
-    if (parent_node != NULL && parent_node->ops != NULL && parent_node->ops->create != NULL)
+    vfs_node_t *new_node = vfs_create(parent_node, new_dir_name, flags);
+    vfs_node_put(parent_node);
+    if (new_node == NULL)
     {
-        vfs_node_t *new_node = parent_node->ops->create(parent_node, new_dir_name, flags);
-        vfs_node_t *chk_node = vfs_navigate(full_path);
-        if (new_node != NULL && chk_node != NULL)
-        {
-            return 0;
-        }
+        return -1;
     }
+    vfs_node_put(new_node);
 
-    return -1;
+    vfs_node_t *chk_node = vfs_navigate(full_path);
+    if (chk_node == NULL)
+    {
+        return -1;
+    }
+    vfs_node_put(chk_node);
+
+    return 0;
 }
 
 static uint64_t sys_pipe(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
@@ -805,7 +887,7 @@ static uint64_t sys_pipe(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t a
     {
         return -1;
     }
-    file_handle_t *handle_read = (file_handle_t *)kmalloc(sizeof(file_handle_t));
+    file_handle_t *handle_read = (file_handle_t *)kmem_cache_alloc(&g_file_handle_cache);
     if (handle_read == NULL)
     {
         kprint("SYS_PIPE failed: out of memory\n");
@@ -817,16 +899,16 @@ static uint64_t sys_pipe(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t a
     if (write_fd < 0)
     {
         curr_tsk->fd_tbl[read_fd] = NULL;
-        kfree(handle_read);
+        kmem_cache_free(&g_file_handle_cache, handle_read);
         return -1;
     }
 
-    file_handle_t *handle_write = (file_handle_t *)kmalloc(sizeof(file_handle_t));
+    file_handle_t *handle_write = (file_handle_t *)kmem_cache_alloc(&g_file_handle_cache);
     if (handle_write == NULL)
     {
         kprint("SYS_PIPE failed: out of memory\n");
         curr_tsk->fd_tbl[read_fd] = NULL;
-        kfree(handle_read);
+        kmem_cache_free(&g_file_handle_cache, handle_read);
         return -1;
     }
 
@@ -836,50 +918,53 @@ static uint64_t sys_pipe(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t a
 
     if (pipe == NULL)
     {
-        // kfree already checks if the ptr is NULL, so it's consise to kfree 3
         kprint("SYS_PIPE failed: out of memory\n");
-        kfree(handle_read);
-        kfree(handle_write);
+        kmem_cache_free(&g_file_handle_cache, handle_read);
+        kmem_cache_free(&g_file_handle_cache, handle_write);
         curr_tsk->fd_tbl[read_fd] = NULL;
         curr_tsk->fd_tbl[write_fd] = NULL;
         return -1;
     }
 
     // Set up Pipe
+    pipe->lock = (spinlock_t)SPINLOCK_INIT;
     rb_init(&pipe->buf);
     pipe->reader_pid = -1;
     pipe->writer_pid = -1;
     pipe->flags = READ_OPEN | WRITE_OPEN;
 
-    vfs_node_t *node_read = (vfs_node_t *)kmalloc(sizeof(vfs_node_t));
+    vfs_node_t *node_read = (vfs_node_t *)kmem_cache_alloc(&g_vfs_node_cache);
     if (node_read == NULL)
     {
         kprint("SYS_PIPE failed: out of memory\n");
         kfree(pipe);
-        kfree(handle_read);
-        kfree(handle_write);
+        kmem_cache_free(&g_file_handle_cache, handle_read);
+        kmem_cache_free(&g_file_handle_cache, handle_write);
         curr_tsk->fd_tbl[read_fd] = NULL;
         curr_tsk->fd_tbl[write_fd] = NULL;
         return -1;
     }
 
-    vfs_node_t *node_write = (vfs_node_t *)kmalloc(sizeof(vfs_node_t));
+    vfs_node_t *node_write = (vfs_node_t *)kmem_cache_alloc(&g_vfs_node_cache);
     if (node_write == NULL)
     {
         kprint("SYS_PIPE failed: out of memory\n");
         kfree(pipe);
-        kfree(handle_read);
-        kfree(handle_write);
-        kfree(node_read);
+        kmem_cache_free(&g_file_handle_cache, handle_read);
+        kmem_cache_free(&g_file_handle_cache, handle_write);
+        kmem_cache_free(&g_vfs_node_cache, node_read);
         curr_tsk->fd_tbl[read_fd] = NULL;
         curr_tsk->fd_tbl[write_fd] = NULL;
         return -1;
     }
+    memset(node_read, 0, sizeof(vfs_node_t));
+    memset(node_write, 0, sizeof(vfs_node_t));
 
     // Set up Read End
     strcpy(node_read->name, "pipe_read_end");
     node_read->flags = VFS_CHAR_DEVICE | VFS_NODE_AUTOFREE;
     node_read->length = 0;
+    node_read->ref_count = 1; // the handle's, its close frees the node
     node_read->device_data = pipe;
     node_read->ops = &pipe_read_ops;
 
@@ -887,6 +972,7 @@ static uint64_t sys_pipe(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t a
     strcpy(node_write->name, "pipe_write_end");
     node_write->flags = VFS_CHAR_DEVICE | VFS_NODE_AUTOFREE;
     node_write->length = 0;
+    node_write->ref_count = 1;
     node_write->device_data = pipe;
     node_write->ops = &pipe_write_ops;
 
@@ -895,11 +981,13 @@ static uint64_t sys_pipe(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t a
     handle_read->mode = 1; // any works
     handle_read->offset = 0;
     handle_read->ref_count = 1;
+    handle_read->mount = NULL;
 
     handle_write->node = node_write;
     handle_write->mode = 2; // any works
     handle_write->offset = 0;
     handle_write->ref_count = 1;
+    handle_write->mount = NULL;
 
     fd_ptr[0] = read_fd;
     fd_ptr[1] = write_fd;
@@ -1043,12 +1131,12 @@ static uint64_t sys_shm_open(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64
 
     vfs_node_t *node = shm_create_vfs_node(name, flags);
 
-    file_handle_t *handle = (file_handle_t *)kmalloc(sizeof(file_handle_t));
+    file_handle_t *handle = (file_handle_t *)kmem_cache_alloc(&g_file_handle_cache);
     if (handle == NULL)
     {
         kprint("SYS_SHM_OPEN failed: OOM\n");
-        kfree(node);
         ((SharedMem_t *)(node->device_data))->ref_count--;
+        kmem_cache_free(&g_vfs_node_cache, node);
         return -1;
     }
 
@@ -1056,6 +1144,7 @@ static uint64_t sys_shm_open(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64
     handle->offset = 0;
     handle->mode = mode;
     handle->ref_count = 1;
+    handle->mount = NULL;
 
     Task *curr_tsk = get_curr_task();
 
@@ -1096,6 +1185,92 @@ static uint64_t sys_ftruncate(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint6
     return shm_set_size(shm, (uint32_t)length);
 }
 
+/**
+ * @brief Copies the stats of up to `arg2` slab caches into the user buffer at `arg1`.
+ * @return the number of entries filled, or -1.
+ */
+static uint64_t sys_slab_info(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(arg5);
+    SlabInfo_t *out = (SlabInfo_t *)arg1;
+    int max = (int)arg2;
+
+    if (max <= 0 || !verify_usr_access(arg1, (uint64_t)max * sizeof(SlabInfo_t)))
+    {
+        kprint("SYS_SLAB_INFO failed: invalid buffer\n");
+        return -1;
+    }
+
+    return (uint64_t)kmem_get_stats(out, max);
+}
+
+/**
+ * @brief Copies the physical memory stats into the user buffer at `arg1`.
+ */
+static uint64_t sys_mem_info(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+    UNUSED(arg2);
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(arg5);
+
+    if (!verify_usr_access(arg1, sizeof(MemInfo_t)))
+    {
+        kprint("SYS_MEM_INFO failed: invalid buffer\n");
+        return -1;
+    }
+
+    pmm_get_stats((MemInfo_t *)arg1);
+    return 0;
+}
+
+/**
+ * @brief Copies the scheduler counters of up to `arg2` CPUs into the user buffer at `arg1`.
+ */
+static uint64_t sys_sched_info(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(arg5);
+    SchedInfo_t *out = (SchedInfo_t *)arg1;
+    int max = (int)arg2;
+
+    if (max <= 0 || !verify_usr_access(arg1, (uint64_t)max * sizeof(SchedInfo_t)))
+    {
+        kprint("SYS_SCHED_INFO failed: invalid buffer\n");
+        return -1;
+    }
+
+    return (uint64_t)sched_get_stats(out, max);
+}
+
+/**
+ * @brief Sets the scheduling class (SCHED_RT, SCHED_NORMAL, SCHED_IDLE) and the
+ * nice level (NICE_MIN to NICE_MAX) of the task `pid`, the caller's with 0.
+ */
+static uint64_t sys_set_priority(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+    UNUSED(arg4);
+    UNUSED(arg5);
+    int pid = (int)arg1;
+    int policy = (int)arg2;
+    int nice = (int)arg3;
+
+    if (pid == 0)
+    {
+        pid = get_curr_task()->pid;
+    }
+
+    if (sched_set_priority(pid, policy, nice) < 0)
+    {
+        kprint("SYS_SET_PRIORITY failed: no such task, or bad class or nice\n");
+        return -1;
+    }
+    return 0;
+}
+
 static uint64_t sys_mmap(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
 {
     UNUSED(arg1);
@@ -1127,16 +1302,20 @@ static uint64_t sys_mmap(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t a
 
     // find free addresses from virtual space
     // which is large enough
-    VmFreeRegion **free_head;
-    VmAllocatedList **alloc_head;
-
-    // could've called get `get_vm_ctx(&free_head, &alloc_head);`
+    // could've called `get_vm_space()`
     // but we already have curr_tsk, save a bit of cycles :)))
-    free_head = &curr_tsk->vm_free_head;
-    alloc_head = &curr_tsk->vm_alloc_head;
+    VmSpace *vs = &curr_tsk->vm;
 
     size_t aligned_len = (length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-    uint64_t virt_start_addr = find_free_addr(free_head, aligned_len);
+    uint64_t virt_start_addr = 0;
+    if (aligned_len >= HUGE_PAGE_SIZE)
+    {
+        virt_start_addr = find_free_addr_aligned(vs, aligned_len, HUGE_PAGE_SIZE);
+    }
+    if (virt_start_addr == 0)
+    {
+        virt_start_addr = find_free_addr(vs, aligned_len);
+    }
 
     if (virt_start_addr == 0)
     {
@@ -1146,20 +1325,40 @@ static uint64_t sys_mmap(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t a
 
     // manually map by unrolling inconsecutive phys pages
     // to consecutive virt addrs
-    uint64_t *pml4 = vmm_phys_to_hhdm(read_cr3());
+    uint64_t *pml4 = vmm_phys_to_hhdm(pte_get_addr(read_cr3()));
 
-    for (uint32_t i = 0; i < shm->page_count; i++)
+    uint32_t i = 0;
+    while (i < shm->page_count)
     {
         uint64_t phys_addr = shm->phys_pages[i];
         uint64_t virt_addr = virt_start_addr + i * PAGE_SIZE;
+
+        // a run of 512 consecutive frames, 2 MiB-aligned on both sides, takes a single 2 MiB page
+        uint32_t run = 0;
+        if (((virt_addr | phys_addr) & (HUGE_PAGE_SIZE - 1)) == 0 && shm->page_count - i >= ENTRIES_NUM)
+        {
+            while (run < ENTRIES_NUM && shm->phys_pages[i + run] == phys_addr + (uint64_t)run * PAGE_SIZE)
+            {
+                run++;
+            }
+        }
+
+        if (run == ENTRIES_NUM &&
+            vmm_map_huge_page(pml4, virt_addr, phys_addr, VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER) == 0)
+        {
+            i += ENTRIES_NUM;
+            continue;
+        }
+
         vmm_map_page(
             pml4,
             virt_addr,
             phys_addr,
             VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER);
+        i++;
     }
 
-    vmm_add_allocated_mem(alloc_head, virt_start_addr, aligned_len, VMM_FLAG_SHM);
+    vmm_add_allocated_mem(vs, virt_start_addr, aligned_len, VMM_FLAG_SHM);
 
     return virt_start_addr;
 }
@@ -1227,7 +1426,7 @@ static uint64_t sys_fstat(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t
         }
         st->st_mode = S_IFCHR | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
     }
-    else if (fh->node->flags == VFS_DIRECTORY)
+    else if ((fh->node->flags & VFS_TYPE_MASK) == VFS_DIRECTORY)
     {
         // Is Directory
         st->st_size = 0;
@@ -1360,10 +1559,21 @@ static uint64_t sys_draw_rect(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint6
     }
 
     win_fill_rect(curr_tsk->win, x, y, w, h, color);
+    sched_task_drew();
 
     return 0;
 }
 
+static uint64_t sys_get_ticks(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+    UNUSED(arg1);
+    UNUSED(arg2);
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(arg5);
+    return timer_get_ticks();
+}
+
 static uint64_t sys_sleep(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
 {
     UNUSED(arg2);
@@ -1374,7 +1584,7 @@ static uint64_t sys_sleep(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t
 
     Task *curr_tsk = get_curr_task();
 
-    uint64_t ticks_to_wait = ms / 10;
+    uint64_t ticks_to_wait = ms * 1000 / TIMER_TICK_US;
     if (ticks_to_wait == 0)
     {
         ticks_to_wait = 1;
@@ -1409,6 +1619,7 @@ static uint64_t sys_blit(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t a
     }
 
     win_draw_bitmap(curr_tsk->win, x, y, w, h, buf);
+    sched_task_drew();
     return 0;
 }
 
@@ -1431,16 +1642,28 @@ static uint64_t sys_get_event(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint6
 
     while (1)
     {
+        // wait first, then look, as in sys_waitpid: the kernel loop may push
+        // the event and wake us from another CPU in between
+        uint64_t rflags = get_rflags();
+        cli();
+        if (!(flags & O_NONBLOCK))
+        {
+            __atomic_store_n(&curr_tsk->state, TASK_WAITING, __ATOMIC_SEQ_CST);
+        }
         if (event_queue_pop(curr_tsk->event_queue, &e) == 1)
         {
+            curr_tsk->state = TASK_READY;
+            irq_restore(rflags);
             break;
         }
 
         if (flags & O_NONBLOCK)
         {
+            irq_restore(rflags);
             return 0;
         }
-        sched_block();
+        schedule();
+        irq_restore(rflags);
     }
 
     memcpy(user_event, &e, sizeof(Event));
@@ -1474,7 +1697,7 @@ static uint64_t sys_kill_fg(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_
     if (tsk != NULL && tsk->fg_pid != -1)
     {
         sched_send_signal(tsk->fg_pid, SIGINT);
-        sched_wake_pid(tsk->fg_pid);
+        sched_wake_input(tsk->fg_pid);
         return 1;
     }
     return 0;
@@ -1561,16 +1784,23 @@ static syscall_ptr_t syscall_table[MAX_SYSCALLS] = {
     [SYS_PIPE] = sys_pipe,
     [SYS_DUP2] = sys_dup2,
     [SYS_LIST_FILES] = sys_list_files,
+    [SYS_SYNC] = sys_sync,
+    [SYS_FSYNC] = sys_fsync,
+    [SYS_MOUNT_OPT] = sys_mount_opt,
     [SYS_FORK] = sys_fork,
     [SYS_EXEC] = sys_exec,
     [SYS_EXIT] = sys_exit,
     [SYS_WAITPID] = sys_waitpid,
     [SYS_GETPID] = sys_getpid,
     [SYS_SLEEP] = sys_sleep,
+    [SYS_SCHED_INFO] = sys_sched_info,
+    [SYS_SET_PRIORITY] = sys_set_priority,
     [SYS_SBRK] = sys_sbrk,
     [SYS_MMAP] = sys_mmap,
     [SYS_MUNMAP] = sys_munmap,
     [SYS_FTRUNCATE] = sys_ftruncate,
+    [SYS_SLAB_INFO] = sys_slab_info,
+    [SYS_MEM_INFO] = sys_mem_info,
     [SYS_SHM_OPEN] = sys_shm_open,
     [SYS_MQ_OPEN] = sys_mq_open,
     [SYS_MQ_SEND] = sys_mq_send,
@@ -1588,6 +1818,7 @@ static syscall_ptr_t syscall_table[MAX_SYSCALLS] = {
     [SYS_SHUTDOWN] = sys_shutdown,
     [SYS_GET_TIME] = sys_get_time,
     [SYS_GET_KEY] = sys_get_key,
+    [SYS_GET_TICKS] = sys_get_ticks,
     [SYS_KPRINT] = sys_kprint,
     [SYS_KPRINT_INT] = sys_kprint_int,
     [SYS_CLEAR] = sys_clear,
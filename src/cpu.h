@@ -163,4 +163,18 @@ static inline void enable_sse(void)
     write_cr4(cr4);
 }
 
-#endif
\ No newline at end of file
+// --- Per-CPU ---
+
+/**
+ * @brief Index of the CPU running this code, for the per-CPU arrays (< MAX_CPUS).
+ * Read from the cpu_local_t that GS points to in the kernel (see arch/smp.h).
+ * Only stable while the caller can't be moved to another CPU, e.g. with interrupts off.
+ */
+static inline uint32_t cpu_id(void)
+{
+    uint32_t id;
+    asm volatile("movl %%gs:24, %0" : "=r"(id));
+    return id;
+}
+
+#endif
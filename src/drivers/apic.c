@@ -19,8 +19,13 @@
 #define EOI_REG_OFFSET 0xB0
 #define TIMER_OFFSET 0x320
 #define INITIAL_COUNT_OFFSET 0x380
+#define CURRENT_COUNT_OFFSET 0x390
 #define DIVIDE_CONFIG_OFFSET 0x3E0
 #define TPR_OFFSET 0x80
+#define LAPIC_ID_OFFSET 0x20
+#define ICR_LOW_OFFSET 0x300
+#define ICR_HIGH_OFFSET 0x310
+#define ICR_DELIVERY_PENDING (1 << 12)
 #define IOREGSEL_OFFSET 0x00
 #define IOWIN_OFFSET 0x10
 
@@ -86,14 +91,7 @@ void apic_init()
 
     g_lapic_regs = (volatile uint32_t *)virt_addr;
 
-    // Enable LAPIC in the CPU
-    g_lapic_regs[SPURIOUS_INT_REG_OFFSET / sizeof(uint32_t)] |= (IA32_APIC_BASE_BSP | 0xFF);
-    g_lapic_regs[TPR_OFFSET / sizeof(uint32_t)] = 0;
-
-    // Timer
-    g_lapic_regs[TIMER_OFFSET / sizeof(uint32_t)] = (0x20 | (1 << 17)); // Set up the timer, 0x20 is our irq0_stub, bit 17 is the "Periodic" mode
-    g_lapic_regs[DIVIDE_CONFIG_OFFSET / sizeof(uint32_t)] |= 0x03;      // divide config to /16
-    g_lapic_regs[INITIAL_COUNT_OFFSET / sizeof(uint32_t)] = 0x80000;    // initial count
+    lapic_init_cpu();
 
     // get the phys_addr and virt_addr of DEFAULT_IOAPICBASE, and do mapping
     uint64_t ioapic_phys = DEFAULT_IOAPICBASE;
@@ -123,6 +121,71 @@ void apic_init()
     ioapic_write(0x2d, 0x00);
 }
 
+/**
+ * @brief Enables the local APIC of the CPU running this, and sets up its timer,
+ * stopped. Every CPU sees its own local APIC at the same address, so the mapping
+ * done by apic_init on the BSP serves the APs too.
+ */
+void lapic_init_cpu(void)
+{
+    // Enable LAPIC in the CPU
+    g_lapic_regs[SPURIOUS_INT_REG_OFFSET / sizeof(uint32_t)] |= (IA32_APIC_BASE_BSP | 0xFF);
+    g_lapic_regs[TPR_OFFSET / sizeof(uint32_t)] = 0;
+
+    // Timer, one-shot: the scheduler arms it for its next deadline, see timer_arm
+    g_lapic_regs[TIMER_OFFSET / sizeof(uint32_t)] = 0x20;         // 0x20 is our irq0_stub, bits 17-18 clear is the "One-shot" mode
+    g_lapic_regs[DIVIDE_CONFIG_OFFSET / sizeof(uint32_t)] = 0x03; // divide config to /16
+    g_lapic_regs[INITIAL_COUNT_OFFSET / sizeof(uint32_t)] = 0;    // stopped
+}
+
+/**
+ * @brief Starts the timer of this CPU, to fire once after `count` timer clocks.
+ * 0 stops it.
+ */
+void lapic_timer_oneshot(uint32_t count)
+{
+    g_lapic_regs[INITIAL_COUNT_OFFSET / sizeof(uint32_t)] = count;
+}
+
+/**
+ * @brief Switches the timer of this CPU to periodic mode, firing every `count`
+ * timer clocks.
+ */
+void lapic_timer_periodic(uint32_t count)
+{
+    g_lapic_regs[TIMER_OFFSET / sizeof(uint32_t)] = 0x20 | (1 << 17); // bit 17 is the "Periodic" mode
+    g_lapic_regs[INITIAL_COUNT_OFFSET / sizeof(uint32_t)] = count;
+}
+
+/**
+ * @return The timer clocks left before the timer of this CPU fires.
+ */
+uint32_t lapic_timer_current(void)
+{
+    return g_lapic_regs[CURRENT_COUNT_OFFSET / sizeof(uint32_t)];
+}
+
+uint32_t lapic_get_id(void)
+{
+    return g_lapic_regs[LAPIC_ID_OFFSET / sizeof(uint32_t)] >> 24;
+}
+
+/**
+ * @brief Sends the interrupt `vector` to the CPU whose local APIC has the id `lapic_id`.
+ * Called with interrupts off: an IPI sent from a handler in between would change the target.
+ */
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector)
+{
+    // the high half picks the target, writing the low half sends
+    g_lapic_regs[ICR_HIGH_OFFSET / sizeof(uint32_t)] = lapic_id << 24;
+    g_lapic_regs[ICR_LOW_OFFSET / sizeof(uint32_t)] = vector; // fixed delivery, physical destination
+
+    while (g_lapic_regs[ICR_LOW_OFFSET / sizeof(uint32_t)] & ICR_DELIVERY_PENDING)
+    {
+        asm volatile("pause");
+    }
+}
+
 void lapic_send_eoi(void)
 {
     g_lapic_regs[EOI_REG_OFFSET / sizeof(uint32_t)] = 0;
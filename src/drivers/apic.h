@@ -1,7 +1,15 @@
 #ifndef APIC_H
 #define APIC_H
 
+#include <stdint.h>
+
 void apic_init(void);
+void lapic_init_cpu(void);
+uint32_t lapic_get_id(void);
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector);
 void lapic_send_eoi(void);
+void lapic_timer_oneshot(uint32_t count);
+uint32_t lapic_timer_current(void);
+void lapic_timer_periodic(uint32_t count);
 
 #endif
\ No newline at end of file
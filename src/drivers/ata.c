@@ -7,6 +7,12 @@
 #include "mem/vmm.h"
 #include "mem/kmalloc.h"
 #include "fs/dev.h"
+#include "fs/bcache.h"
+#include "drivers/pci.h"
+#include "drivers/blkq.h"
+#include "mem/pmm.h"
+#include "cpu.h"
+#include "kern_defs.h"
 #include "../string.h"
 
 #include <stdint.h>
@@ -24,33 +30,78 @@
 #define ATA_REG_STATUS 0x07
 
 #define ATA_CMD_IDENTIFY 0xEC
+#define ATA_CMD_READ_PIO 0x20
+#define ATA_CMD_WRITE_PIO 0x30
+#define ATA_CMD_READ_DMA 0xC8
+#define ATA_CMD_WRITE_DMA 0xCA
+#define ATA_CMD_READ_PIO_EXT 0x24
+#define ATA_CMD_WRITE_PIO_EXT 0x34
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_FLUSH 0xE7
+#define ATA_CMD_FLUSH_EXT 0xEA
 #define ATA_SR_BSY 0x80 // busy?
 #define ATA_SR_DRQ 0x08 // data request ready
 #define ATA_SR_ERR 0x01 // error
 
-static volatile uint8_t ata_drq = 0;
-static volatile uint8_t ata_err = 0;
+#define ATA_LBA28_LIMIT 0x10000000ULL  // first sector a 28-bit command can't address
+#define ATA_LBA28_MAX_COUNT 0x100      // sector count 0 means 256
+#define ATA_LBA48_MAX_COUNT 0x10000    // sector count 0 means 65536
+#define ATA_ID_CMDSET2 83              // IDENTIFY word: command sets supported
+#define ATA_ID_CMDSET2_LBA48 (1 << 10)
 
-static void ata_handler()
+#define ATA_LOWER_HALF_END 0x0000800000000000ULL
+#define ATA_FS_CHUNK_SECTORS 0x80 // bounce buffer of the partition nodes: 64 KiB
+
+#define ATA_MODE_PIO 0x0
+#define ATA_MODE_DMA 0x1
+
+/* Bus Master IDE registers, relative to BAR4 of the IDE controller (primary channel) */
+#define BMIDE_REG_CMD 0x00
+#define BMIDE_REG_STATUS 0x02
+#define BMIDE_REG_PRDT 0x04
+
+#define BMIDE_CMD_START 0x01
+#define BMIDE_CMD_READ 0x08 // direction: device -> memory
+#define BMIDE_SR_ACTIVE 0x01
+#define BMIDE_SR_ERR 0x02
+#define BMIDE_SR_IRQ 0x04
+
+#define PRD_EOT 0x8000
+#define ATA_PRD_MAX (PAGE_SIZE / sizeof(PrdEntry))
+#define ATA_DMA_MAX_SECTORS (ATA_PRD_MAX * PAGE_SIZE / SECTOR_SIZE) // worst case: one PRD per page
+
+/**
+ * Physical Region Descriptor: one physically contiguous piece of a DMA transfer.
+ * A region must not cross a 64 KiB boundary, and byte_count == 0 means 64 KiB.
+ */
+typedef struct
 {
-    // when this is called, the hard disk
-    // has already, so the BSY bit is switched off.
-    // we care ERR and DRQ only.
+    uint32_t phys_addr;
+    uint16_t byte_count;
+    uint16_t flags; // bit 15 = End Of Table
+} __attribute__((packed)) PrdEntry;
 
-    uint8_t stat = inb(ATA_PRIMARY_IO + ATA_REG_STATUS);
+static uint8_t g_lba48[2] = {0, 0}; // does the master/slave drive support the 48-bit commands?
 
-    if (stat & ATA_SR_ERR)
-    {
-        // todo handle error
-    }
+static uint16_t g_bmide_base = 0;
+static PrdEntry *g_prdt = NULL;
+static uint32_t g_prdt_phys = 0;
+static uint8_t g_dma_enabled = 0;
 
-    if (stat & ATA_SR_DRQ)
-    {
-        ata_drq = 1;
-    }
+// the command on the wire, driven by IRQ 14
+static BlkRequest *g_cur_batch = NULL;
+static uint8_t g_cur_mode = ATA_MODE_PIO;
+static uint8_t g_cur_lba48 = 0;
+static BlkRequest *g_pio_req = NULL; // request of the chain the next PIO sector belongs to
+static uint32_t g_pio_sec = 0;       // sector index inside g_pio_req
 
-    lapic_send_eoi();
-}
+// the last user page ata_pio_map looked up
+static uint64_t g_pio_page_virt = 0;
+static uint64_t g_pio_page_pml4 = 0;
+static uint8_t *g_pio_page = NULL;
+
+static void ata_handler();
 
 void ata_wait_bsy()
 {
@@ -112,6 +163,12 @@ void ata_identify(uint8_t drive_sel)
     kprint(model);
     kprint("\n");
 
+    g_lba48[drive_sel & 0x01] = (dst[ATA_ID_CMDSET2] & ATA_ID_CMDSET2_LBA48) != 0;
+    if (g_lba48[drive_sel & 0x01])
+    {
+        kprint("ATA: LBA48 supported\n");
+    }
+
     outb(ATA_PRIMARY_CTRL, 0x00);
     register_irq_handler(0xe, ata_handler);
 }
@@ -127,10 +184,28 @@ void ata_string_swap(char *dst, uint16_t *src, int len)
     *dst = '\0';
 }
 
-void ata_read_sectors(uint16_t *dst, uint32_t lba, uint8_t sec_count, uint8_t drive_sel)
+/**
+ * @brief Loads the task file registers for a `sec_count` sectors transfer at `lba`.
+ *
+ * @details With LBA48, the sector count and the 3 LBA registers are 2 bytes deep:
+ * the high order bytes go in first, and are pushed back when the low order
+ * bytes are written. A count of 0 means 256 sectors (LBA28) or 65536 (LBA48).
+ */
+static void ata_setup_lba(uint64_t lba, uint32_t sec_count, uint8_t drive_sel, uint8_t lba48)
 {
-    ata_wait_bsy();
-    ata_drq = 0;
+    if (lba48)
+    {
+        outb(ATA_PRIMARY_IO + ATA_REG_DRIVE, 0x40 | ((drive_sel & 0x01) << 4)); // LBA mode, no address bits here
+        outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, (sec_count >> 8) & 0xFF);
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA_LO, (lba >> 24) & 0xFF);
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA_MID, (lba >> 32) & 0xFF);
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA_HI, (lba >> 40) & 0xFF);
+        outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, sec_count & 0xFF);
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA_LO, lba & 0xFF);
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA_MID, (lba >> 8) & 0xFF);
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA_HI, (lba >> 16) & 0xFF);
+        return;
+    }
 
     // split the lba (28-bit) to the 4 ports
     outb(ATA_PRIMARY_IO + ATA_REG_LBA_LO, lba & 0xFF);
@@ -139,147 +214,597 @@ void ata_read_sectors(uint16_t *dst, uint32_t lba, uint8_t sec_count, uint8_t dr
     outb(ATA_PRIMARY_IO + ATA_REG_DRIVE, ((lba >> 24) & 0x0F) | 0xE0 | ((drive_sel & 0x01) << 4)); // 0xE0 sets bits 5, 6, and 7 (LBA mode)
 
     // send the sec_count to the sector count port
-    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, sec_count);
+    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, sec_count & 0xFF);
+}
 
-    // send the 0x20 command to read the sec count
-    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, 0x20);
+static uint32_t ata_batch_sectors(BlkRequest *batch)
+{
+    uint32_t total = 0;
+    for (BlkRequest *r = batch; r != NULL; r = r->merge_next)
+    {
+        total += r->count;
+    }
+    return total;
+}
 
-    // because each sector is done being read
-    // it sets the drq, and clears the bsy to continue
-    // reading the next sector, we need to wait
-    // in a loop
-    for (int i = 0; i < sec_count; i++)
+/**
+ * @brief Finds where `virt`, in the address space of `req`, is in the HHDM.
+ *
+ * @details We're usually in the IRQ handler, on behalf of a task that is asleep,
+ * so a buffer in the lower half isn't mapped in the current address space. Its
+ * page is looked up once, through the submitter's page tables, and kept for the
+ * next sectors of that page, rather than switching CR3 around each copy, which
+ * would flush the TLB of the task we interrupted. The higher half is the same in
+ * all of them. The pages are present: blkq_submit faulted them in beforehand.
+ *
+ * @return The address to copy through, or NULL if the page is not mapped.
+ */
+static uint8_t *ata_pio_map(BlkRequest *req, uint64_t virt)
+{
+    if (virt >= ATA_LOWER_HALF_END)
+    {
+        return (uint8_t *)virt;
+    }
+
+    uint64_t page = virt & ~(uint64_t)(PAGE_SIZE - 1);
+    if (page != g_pio_page_virt || req->pml4 != g_pio_page_pml4)
+    {
+        uint64_t phys = vmm_virt2phys(vmm_phys_to_hhdm(req->pml4), page);
+        g_pio_page_virt = page;
+        g_pio_page_pml4 = req->pml4;
+        g_pio_page = phys != 0 ? (uint8_t *)vmm_phys_to_hhdm(phys) : NULL;
+    }
+
+    return g_pio_page != NULL ? g_pio_page + (virt - page) : NULL;
+}
+
+/**
+ * @brief Moves one sector between the data port and the buffer of `req`.
+ * A sector of a buffer that isn't page aligned is copied in two pieces.
+ */
+static void ata_pio_move(BlkRequest *req, uint32_t sec, uint8_t is_write)
+{
+    uint64_t virt = (uint64_t)req->buf + (uint64_t)sec * SECTOR_SIZE;
+    uint32_t j = 0;
+    while (j < 256)
     {
-        while (!ata_drq)
+        uint64_t at = virt + (uint64_t)j * 2;
+        uint16_t *p = (uint16_t *)ata_pio_map(req, at);
+        uint32_t n = (uint32_t)((PAGE_SIZE - (at & (PAGE_SIZE - 1))) / 2);
+        if (n > 256 - j)
         {
-            hlt();
+            n = 256 - j;
         }
 
-        ata_drq = 0;
-        for (int j = 0; j < 256; j++)
+        // the drive moves the words anyway, an unmapped page just loses them
+        for (uint32_t k = 0; k < n; k++)
         {
-            dst[i * 256 + j] = inw(ATA_PRIMARY_IO + ATA_REG_DATA);
+            if (is_write)
+            {
+                outw(ATA_PRIMARY_IO + ATA_REG_DATA, p != NULL ? p[k] : 0);
+            }
+            else
+            {
+                uint16_t w = inw(ATA_PRIMARY_IO + ATA_REG_DATA);
+                if (p != NULL)
+                {
+                    p[k] = w;
+                }
+            }
         }
+        j += n;
     }
 }
 
-void ata_write_sectors(uint16_t *src, uint32_t lba, uint8_t sec_count, uint8_t drive_sel)
+static void ata_pio_advance(void)
 {
-    if (sec_count == 0)
+    g_pio_sec++;
+    if (g_pio_sec == g_pio_req->count)
     {
-        return;
+        g_pio_req = g_pio_req->merge_next;
+        g_pio_sec = 0;
     }
-    ata_wait_bsy();
-    ata_drq = 0;
+}
 
-    // split the lba (28-bit) to the 4 ports
-    outb(ATA_PRIMARY_IO + ATA_REG_LBA_LO, lba & 0xFF);
-    outb(ATA_PRIMARY_IO + ATA_REG_LBA_MID, (lba >> 8) & 0xFF);
-    outb(ATA_PRIMARY_IO + ATA_REG_LBA_HI, (lba >> 16) & 0xFF);
-    outb(ATA_PRIMARY_IO + ATA_REG_DRIVE, ((lba >> 24) & 0x0F) | 0xE0 | ((drive_sel & 0x01) << 4));
+/**
+ * @brief Issues a READ/WRITE SECTORS command for the whole chain.
+ *
+ * @details With PIO, the drive raises IRQ 14 each time a sector is ready to be
+ * read, or has been written. The handler moves one sector per interrupt.
+ * For a write, the first sector must be sent before any interrupt comes.
+ */
+static void ata_pio_start(BlkRequest *batch, uint8_t lba48)
+{
+    uint8_t is_write = batch->op == BLK_OP_WRITE;
 
-    // send the sec_count to the sector count port
-    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, sec_count);
+    g_cur_mode = ATA_MODE_PIO;
+    g_pio_req = batch;
+    g_pio_sec = 0;
+    g_pio_page_pml4 = 0; // the page tables may have changed since the last command
 
-    // send the 0x30 command to write the sec count
-    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, 0x30);
+    ata_wait_bsy();
+    ata_setup_lba(batch->lba, ata_batch_sectors(batch), batch->drive, lba48);
+
+    if (is_write)
+    {
+        // send the 0x30 (0x34) command to write the sec count
+        outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, lba48 ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO);
+        ata_wait_drq();
+        ata_pio_move(g_pio_req, g_pio_sec, 1);
+        ata_pio_advance();
+    }
+    else
+    {
+        // send the 0x20 (0x24) command to read the sec count
+        outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, lba48 ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO);
+    }
+}
 
-    // because each sector is done being written to
-    // it sets the drq, and clears the bsy to continue
-    // writing to the next sector, we need to wait
-    // in a loop
+/**
+ * @brief Translates a buffer address, in the address space of `pml4_phys`,
+ * to a physical address the DMA engine can use.
+ *
+ * @return uint64_t The physical address, or 0 if the buffer can't be used for DMA
+ * (unmapped, above 4 GiB, or in the kernel image whose mapping we don't walk).
+ */
+static uint64_t ata_dma_virt2phys(uint64_t pml4_phys, uint64_t virt)
+{
+    uint64_t phys;
+    if (virt >= KERN_HEAP_START || virt < ATA_LOWER_HALF_END)
+    {
+        uint64_t *pml4 = vmm_phys_to_hhdm(pml4_phys);
+        phys = vmm_virt2phys(pml4, virt);
+    }
+    else if (virt >= 0xFFFFFFFF80000000ULL)
+    {
+        return 0;
+    }
+    else if (virt >= hhdm_offset)
+    {
+        phys = vmm_hhdm_to_phys((void *)virt);
+    }
+    else
+    {
+        return 0;
+    }
 
-    ata_wait_drq();
-    for (int j = 0; j < 256; j++)
+    if (phys == 0 || phys >= 0x100000000ULL)
     {
-        outw(ATA_PRIMARY_IO + ATA_REG_DATA, src[j]);
+        return 0;
     }
+    return phys;
+}
+
+/**
+ * @brief Fills the PRD table to describe the buffers of the whole chain.
+ *
+ * @details MECHANISM:
+ * The buffers are only contiguous virtually, so they're walked page by page and
+ * every page is translated to its frame. Frames that happen to follow each
+ * other are merged into one region, as long as it stays within a 64 KiB window.
+ *
+ * @return int 0 on success, -1 if the buffers can't be described (fall back to PIO).
+ */
+static int ata_build_prdt(BlkRequest *batch)
+{
+    uint32_t n = 0;
+    uint32_t last_len = 0;
 
-    for (int i = 1; i < sec_count; i++)
+    for (BlkRequest *r = batch; r != NULL; r = r->merge_next)
     {
-        while (!ata_drq)
+        uint64_t virt = (uint64_t)r->buf;
+        uint32_t bytes = r->count * SECTOR_SIZE;
+        if (virt & 1)
         {
-            hlt();
+            return -1;
         }
-        ata_drq = 0;
-        for (int j = 0; j < 256; j++)
+
+        while (bytes > 0)
         {
-            outw(ATA_PRIMARY_IO + ATA_REG_DATA, src[i * 256 + j]);
+            uint64_t phys = ata_dma_virt2phys(r->pml4, virt);
+            if (phys == 0)
+            {
+                return -1;
+            }
+
+            uint32_t chunk = PAGE_SIZE - (virt & 0xFFF);
+            if (chunk > bytes)
+            {
+                chunk = bytes;
+            }
+
+            if (n > 0 && g_prdt[n - 1].phys_addr + last_len == phys && last_len + chunk <= 0x10000 && (g_prdt[n - 1].phys_addr >> 16) == ((phys + chunk - 1) >> 16))
+            {
+                last_len += chunk;
+            }
+            else
+            {
+                if (n == ATA_PRD_MAX)
+                {
+                    return -1;
+                }
+                g_prdt[n].phys_addr = (uint32_t)phys;
+                g_prdt[n].flags = 0;
+                last_len = chunk;
+                n++;
+            }
+            g_prdt[n - 1].byte_count = (uint16_t)(last_len & 0xFFFF); // 0x10000 wraps to 0, which means 64 KiB
+
+            virt += chunk;
+            bytes -= chunk;
         }
     }
 
+    g_prdt[n - 1].flags = PRD_EOT;
+    return 0;
+}
+
+/**
+ * @brief Issues one READ/WRITE DMA command for the whole chain.
+ *
+ * @details MECHANISM:
+ * 1. Describe the buffers in the PRD table, and hand the table to the controller.
+ * 2. Set the direction, and clear the Error/Interrupt bits (write 1 to clear).
+ * 3. Program the drive like for PIO, but with the DMA command.
+ * 4. Set the Start bit: the controller now moves the data on its own.
+ * 5. When the drive raises IRQ 14, the handler sees the Interrupt bit and ends the command.
+ *
+ * @return int 0 if the command is running, -1 if the chain can't be done with DMA.
+ */
+static int ata_dma_start(BlkRequest *batch, uint8_t lba48)
+{
+    if (ata_build_prdt(batch) < 0)
+    {
+        return -1;
+    }
+
+    uint8_t is_write = batch->op == BLK_OP_WRITE;
+    g_cur_mode = ATA_MODE_DMA;
+
     ata_wait_bsy();
-    ata_flush();
+
+    outb(g_bmide_base + BMIDE_REG_CMD, 0);
+    outl(g_bmide_base + BMIDE_REG_PRDT, g_prdt_phys);
+    outb(g_bmide_base + BMIDE_REG_CMD, is_write ? 0 : BMIDE_CMD_READ);
+    outb(g_bmide_base + BMIDE_REG_STATUS, inb(g_bmide_base + BMIDE_REG_STATUS) | BMIDE_SR_ERR | BMIDE_SR_IRQ);
+
+    ata_setup_lba(batch->lba, ata_batch_sectors(batch), batch->drive, lba48);
+
+    if (lba48)
+    {
+        outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, is_write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+    }
+    else
+    {
+        outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, is_write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+    }
+    outb(g_bmide_base + BMIDE_REG_CMD, inb(g_bmide_base + BMIDE_REG_CMD) | BMIDE_CMD_START);
+
+    return 0;
+}
+
+/**
+ * @brief Finds the PCI IDE controller, and sets up Bus Master DMA on the primary channel.
+ *
+ * @details BAR4 holds the I/O base of the Bus Master registers. The PRD table
+ * lives in its own frame: it must be dword aligned and can't cross 64 KiB.
+ * If anything's missing, the driver just keeps using PIO.
+ */
+void ata_dma_init()
+{
+    PciDevice ide;
+    if (pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &ide) < 0)
+    {
+        kprint("ATA_DMA: no PCI IDE controller, using PIO\n");
+        return;
+    }
+
+    uint32_t bar4 = pci_read32(ide.bus, ide.dev, ide.func, PCI_REG_BAR4);
+    if ((bar4 & 0x1) == 0 || (bar4 & ~0x3u) == 0)
+    {
+        kprint("ATA_DMA: no Bus Master I/O base, using PIO\n");
+        return;
+    }
+    g_bmide_base = (uint16_t)(bar4 & 0xFFFC);
+
+    uint16_t cmd = pci_read16(ide.bus, ide.dev, ide.func, PCI_REG_COMMAND);
+    pci_write16(ide.bus, ide.dev, ide.func, PCI_REG_COMMAND, cmd | PCI_CMD_IO_SPACE | PCI_CMD_BUS_MASTER);
+
+    uint64_t prdt_phys = pmm_alloc_frame();
+    if (prdt_phys == 0 || prdt_phys >= 0x100000000ULL)
+    {
+        kprint("ATA_DMA: can't allocate the PRD table, using PIO\n");
+        return;
+    }
+    g_prdt_phys = (uint32_t)prdt_phys;
+    g_prdt = (PrdEntry *)vmm_phys_to_hhdm(prdt_phys);
+    memset(g_prdt, 0, PAGE_SIZE);
+
+    g_dma_enabled = 1;
+    kprint("ATA_DMA: Bus Master DMA enabled\n");
+}
+
+void ata_set_dma(uint8_t enable)
+{
+    g_dma_enabled = enable && g_prdt != NULL;
+}
+
+uint8_t ata_dma_available()
+{
+    return g_prdt != NULL;
+}
+
+/**
+ * @brief Starts the command for a chain handed over by the block queue.
+ *
+ * @details The 28-bit command is used when it fits (shorter to program), the
+ * 48-bit one when the chain is too long or goes past the first 128 GiB.
+ * DMA is tried first, PIO takes over if the buffers can't be used for DMA.
+ */
+static int ata_start(BlkRequest *batch)
+{
+    uint8_t has_lba48 = g_lba48[batch->drive & 0x01];
+
+    if (batch->op == BLK_OP_FLUSH)
+    {
+        g_cur_batch = batch;
+        ata_wait_bsy();
+        outb(ATA_PRIMARY_IO + ATA_REG_DRIVE, 0xE0 | ((batch->drive & 0x01) << 4));
+        outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, has_lba48 ? ATA_CMD_FLUSH_EXT : ATA_CMD_FLUSH);
+        return 0;
+    }
+
+    uint32_t total = ata_batch_sectors(batch);
+    uint8_t lba48 = total > ATA_LBA28_MAX_COUNT || batch->lba + total > ATA_LBA28_LIMIT;
+    if (lba48 && !has_lba48)
+    {
+        kprint("ATA: LBA out of the 28-bit range, and the drive has no LBA48\n");
+        return -1;
+    }
+
+    g_cur_batch = batch;
+    g_cur_lba48 = lba48;
+    if (!g_dma_enabled || ata_dma_start(batch, lba48) < 0)
+    {
+        ata_pio_start(batch, lba48);
+    }
+    return 0;
+}
+
+/**
+ * @brief Longest command, in sectors: 256 with LBA28, 65536 with LBA48,
+ * and no more than the PRD table can describe when DMA is on.
+ */
+static uint32_t ata_max_sectors(uint8_t drive_sel)
+{
+    if (!g_lba48[drive_sel & 0x01])
+    {
+        return ATA_LBA28_MAX_COUNT;
+    }
+    return g_dma_enabled ? ATA_DMA_MAX_SECTORS : ATA_LBA48_MAX_COUNT;
+}
+
+static void ata_end_batch(int status)
+{
+    g_cur_batch = NULL;
+    g_pio_req = NULL;
+    blkq_complete(status);
+}
+
+static void ata_dma_irq(uint8_t stat)
+{
+    uint8_t bm_stat = inb(g_bmide_base + BMIDE_REG_STATUS);
+    if (!(bm_stat & (BMIDE_SR_IRQ | BMIDE_SR_ERR)))
+    {
+        return;
+    }
+
+    outb(g_bmide_base + BMIDE_REG_CMD, inb(g_bmide_base + BMIDE_REG_CMD) & ~BMIDE_CMD_START);
+    outb(g_bmide_base + BMIDE_REG_STATUS, bm_stat | BMIDE_SR_ERR | BMIDE_SR_IRQ);
+
+    if ((bm_stat & BMIDE_SR_ERR) || (stat & ATA_SR_ERR))
+    {
+        kprint("ATA_DMA: transfer failed, falling back to PIO\n");
+        ata_pio_start(g_cur_batch, g_cur_lba48);
+        return;
+    }
+
+    ata_end_batch(0);
+}
+
+static void ata_pio_irq(uint8_t stat)
+{
+    if (stat & ATA_SR_ERR)
+    {
+        ata_end_batch(-1);
+        return;
+    }
+
+    if (g_cur_batch->op == BLK_OP_WRITE)
+    {
+        // the previous sector is on the disk
+        if (g_pio_req == NULL)
+        {
+            ata_end_batch(0);
+            return;
+        }
+        ata_pio_move(g_pio_req, g_pio_sec, 1);
+        ata_pio_advance();
+        return;
+    }
+
+    if (!(stat & ATA_SR_DRQ))
+    {
+        return;
+    }
+    ata_pio_move(g_pio_req, g_pio_sec, 0);
+    ata_pio_advance();
+    if (g_pio_req == NULL)
+    {
+        ata_end_batch(0);
+    }
+}
+
+static void ata_handler()
+{
+    // reading the status also acknowledges the interrupt on the drive side
+    uint8_t stat = inb(ATA_PRIMARY_IO + ATA_REG_STATUS);
+
+    if (g_cur_batch != NULL)
+    {
+        if (g_cur_batch->op == BLK_OP_FLUSH)
+        {
+            ata_end_batch((stat & ATA_SR_ERR) ? -1 : 0);
+        }
+        else if (g_cur_mode == ATA_MODE_DMA)
+        {
+            ata_dma_irq(stat);
+        }
+        else
+        {
+            ata_pio_irq(stat);
+        }
+    }
+
+    lapic_send_eoi();
+}
+
+static blk_driver_ops_t ata_blk_ops = {
+    .start = ata_start,
+    .max_sectors = ata_max_sectors,
+};
+
+/**
+ * @brief Plugs the driver into the block request queue.
+ * From now on, all the transfers go through it.
+ */
+void ata_queue_init()
+{
+    blkq_init(&ata_blk_ops);
+}
+
+void ata_read_sectors(uint16_t *dst, uint64_t lba, uint32_t sec_count, uint8_t drive_sel)
+{
+    if (blkq_rw(BLK_OP_READ, drive_sel, lba, sec_count, dst) < 0)
+    {
+        kprint("ATA_READ_SECTORS failed\n");
+    }
+}
+
+void ata_write_sectors(uint16_t *src, uint64_t lba, uint32_t sec_count, uint8_t drive_sel)
+{
+    if (sec_count == 0)
+    {
+        return;
+    }
+
+    if (blkq_rw(BLK_OP_WRITE, drive_sel, lba, sec_count, src) < 0)
+    {
+        kprint("ATA_WRITE_SECTORS failed\n");
+    }
+}
+
+/**
+ * @brief Sectors moved per bcache call by the partition nodes, so the bounce
+ * buffer stays small whatever the size of the request.
+ */
+static uint32_t ata_fs_chunk(uint8_t drive_sel)
+{
+    uint32_t max = ata_max_sectors(drive_sel);
+    return max < ATA_FS_CHUNK_SECTORS ? max : ATA_FS_CHUNK_SECTORS;
 }
 
 /**
  * @brief Reads with vfs-based
+ * Goes through the block cache a chunk at a time.
  */
 static uint64_t ata_fs_read(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buf)
 {
     PartitionDevice *part_dev = (PartitionDevice *)node->device_data;
-    uint64_t dev_lba = part_dev->start_lba;
-    uint64_t sec_idx = offset / SECTOR_SIZE;
-    uint64_t start_lba = dev_lba + sec_idx;
-    uint64_t end_offset = offset + size - 1;
-    uint64_t end_lba = dev_lba + end_offset / SECTOR_SIZE;
-    uint64_t num_sectors = end_lba - start_lba + 1;
-    if (num_sectors > 255)
-    {
-        kprint("ATA_FS_READ failed: num_sectors is too large\n");
+    if (size == 0)
+    {
         return 0;
     }
-    int sec_offset = offset % SECTOR_SIZE;
-    uint16_t *tmp_buf = vmm_alloc(sizeof(uint16_t) * num_sectors * 256);
+
+    uint64_t chunk_bytes = (uint64_t)ata_fs_chunk(part_dev->drive_sel) * SECTOR_SIZE;
+    uint8_t *tmp_buf = (uint8_t *)kmalloc(chunk_bytes);
     if (tmp_buf == NULL)
     {
         kprint("ATA_FS_READ failed: OOM\n");
         return 0;
     }
 
-    /* READ */
-    ata_read_sectors(tmp_buf, start_lba, num_sectors, part_dev->drive_sel);
-    memcpy(buf, (uint8_t *)tmp_buf + sec_offset, size);
-    vmm_free(tmp_buf);
+    uint64_t done = 0;
+    while (done < size)
+    {
+        uint64_t pos = offset + done;
+        uint64_t lba = part_dev->start_lba + pos / SECTOR_SIZE;
+        uint64_t sec_offset = pos % SECTOR_SIZE;
+        uint64_t len = size - done;
+        if (len > chunk_bytes - sec_offset)
+        {
+            len = chunk_bytes - sec_offset;
+        }
+        uint32_t num_sectors = (uint32_t)((sec_offset + len + SECTOR_SIZE - 1) / SECTOR_SIZE);
+
+        /* READ */
+        bcache_read(part_dev->drive_sel, lba, num_sectors, tmp_buf);
+        memcpy(buf + done, tmp_buf + sec_offset, len);
+        done += len;
+    }
+    kfree(tmp_buf);
 
     return size;
 }
 
 /**
  * @brief Writes with vfs-based
- * Uses the read-modify-write strategy
+ * Uses the read-modify-write strategy, a chunk at a time. Only a chunk that
+ * starts or ends inside a sector needs to be read first.
  */
 static uint64_t ata_fs_write(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buf)
 {
     PartitionDevice *part_dev = (PartitionDevice *)node->device_data;
-    uint64_t dev_lba = part_dev->start_lba;
-    uint64_t sec_idx = offset / SECTOR_SIZE;
-    uint64_t start_lba = dev_lba + sec_idx;
-    uint64_t end_offset = offset + size - 1;
-    uint64_t end_lba = dev_lba + end_offset / SECTOR_SIZE;
-    uint64_t num_sectors = end_lba - start_lba + 1;
-    if (num_sectors > 255)
-    {
-        kprint("ATA_FS_WRITE failed: num_sectors is too large\n");
+    if (size == 0)
+    {
         return 0;
     }
-    int sec_offset = offset % SECTOR_SIZE;
-    uint16_t *tmp_buf = vmm_alloc(sizeof(uint16_t) * num_sectors * 256);
+
+    uint64_t chunk_bytes = (uint64_t)ata_fs_chunk(part_dev->drive_sel) * SECTOR_SIZE;
+    uint8_t *tmp_buf = (uint8_t *)kmalloc(chunk_bytes);
     if (tmp_buf == NULL)
     {
         kprint("ATA_FS_WRITE failed: OOM\n");
         return 0;
     }
 
-    /* READ */
-    ata_read_sectors(tmp_buf, start_lba, num_sectors, part_dev->drive_sel);
+    uint64_t done = 0;
+    while (done < size)
+    {
+        uint64_t pos = offset + done;
+        uint64_t lba = part_dev->start_lba + pos / SECTOR_SIZE;
+        uint64_t sec_offset = pos % SECTOR_SIZE;
+        uint64_t len = size - done;
+        if (len > chunk_bytes - sec_offset)
+        {
+            len = chunk_bytes - sec_offset;
+        }
+        uint32_t num_sectors = (uint32_t)((sec_offset + len + SECTOR_SIZE - 1) / SECTOR_SIZE);
+
+        /* READ */
+        if (sec_offset != 0 || len % SECTOR_SIZE != 0)
+        {
+            bcache_read(part_dev->drive_sel, lba, num_sectors, tmp_buf);
+        }
 
-    /* MODIFY */
-    memcpy((uint8_t *)tmp_buf + sec_offset, buf, size);
+        /* MODIFY */
+        memcpy(tmp_buf + sec_offset, buf + done, len);
 
-    /* WRITE */
-    ata_write_sectors(tmp_buf, start_lba, num_sectors, part_dev->drive_sel);
-    vmm_free(tmp_buf);
+        /* WRITE */
+        bcache_write(part_dev->drive_sel, lba, num_sectors, tmp_buf);
+        done += len;
+    }
+    kfree(tmp_buf);
 
     return size;
 }
@@ -304,18 +829,19 @@ vfs_fs_ops_t ata_ops = {
 
 void ata_fs_init()
 {
-    vfs_node_t *root = (vfs_node_t *)kmalloc(sizeof(vfs_node_t));
+    vfs_node_t *root = (vfs_node_t *)kmem_cache_alloc(&g_vfs_node_cache);
     if (root == NULL)
     {
         kprint("ATA_FS_INIT failed: OOM\n");
         return;
     }
+    memset(root, 0, sizeof(vfs_node_t));
 
     PartitionDevice *part_dev = (PartitionDevice *)kmalloc(sizeof(PartitionDevice));
     if (part_dev == NULL)
     {
         kprint("ATA_FS_INIT failed: OOM\n");
-        kfree(root);
+        kmem_cache_free(&g_vfs_node_cache, root);
         return;
     }
 
@@ -346,18 +872,19 @@ void ata_probe_partitions(uint8_t drive_sel)
         PartitionEntry part_entry = part_list[i];
         if (part_entry.partition_type != 0)
         {
-            vfs_node_t *hda = (vfs_node_t *)kmalloc(sizeof(vfs_node_t));
+            vfs_node_t *hda = (vfs_node_t *)kmem_cache_alloc(&g_vfs_node_cache);
             if (hda == NULL)
             {
                 kprint("ATA_PROBE_PARTITIONS failed: OOM\n");
                 return;
             }
+            memset(hda, 0, sizeof(vfs_node_t));
 
             PartitionDevice *part_dev = (PartitionDevice *)kmalloc(sizeof(PartitionDevice));
             if (part_dev == NULL)
             {
                 kprint("ATA_PROBE_PARTITIONS failed: OOM\n");
-                kfree(hda);
+                kmem_cache_free(&g_vfs_node_cache, hda);
                 return;
             }
 
@@ -392,11 +919,14 @@ void ata_probe_partitions(uint8_t drive_sel)
     }
 }
 
-void ata_flush()
+/**
+ * @brief Asks the drive to write its own cache to the media.
+ * Goes through the queue as a barrier, after everything submitted so far.
+ * Writes don't flush by themselves, it's up to the callers (sync, fsync).
+ */
+void ata_flush(uint8_t drive_sel)
 {
-    ata_wait_bsy();
-    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, 0xE7);
-    ata_wait_bsy();
+    blkq_rw(BLK_OP_FLUSH, drive_sel, 0, 0, NULL);
 }
 
 /*
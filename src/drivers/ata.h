@@ -28,11 +28,15 @@ void ata_wait_bsy(void);
 void ata_wait_drq(void);
 void ata_identify(uint8_t drive_sel);
 void ata_string_swap(char *dst, uint16_t *src, int len);
-void ata_read_sectors(uint16_t *dst, uint32_t lba, uint8_t sec_count, uint8_t drive_sel);
-void ata_write_sectors(uint16_t *src, uint32_t lba, uint8_t sec_count, uint8_t drive_sel);
+void ata_read_sectors(uint16_t *dst, uint64_t lba, uint32_t sec_count, uint8_t drive_sel);
+void ata_write_sectors(uint16_t *src, uint64_t lba, uint32_t sec_count, uint8_t drive_sel);
 void ata_fs_init(void);
 void ata_probe_partitions(uint8_t drive_sel);
-void ata_flush(void);
+void ata_flush(uint8_t drive_sel);
+void ata_dma_init(void);
+void ata_queue_init(void);
+void ata_set_dma(uint8_t enable);
+uint8_t ata_dma_available(void);
 
 extern vfs_fs_ops_t ata_ops;
 
@@ -0,0 +1,450 @@
+/**
+ * @file blkq.c
+ * @brief The block request queue, sitting between the block cache and the disk driver.
+ *
+ * Any task can submit requests. They're kept sorted by LBA and handed to the
+ * driver one command at a time, in elevator (C-LOOK) order: the head sweeps
+ * upwards, then jumps back to the lowest pending LBA. Requests that continue
+ * each other are merged into one command. A request left waiting longer than
+ * BLKQ_DEADLINE_TICKS is served first, so a busy region can't starve the rest
+ * of the disk.
+ *
+ * The driver runs the command on its own, and calls `blkq_complete` from its
+ * IRQ handler, which wakes the waiting tasks and dispatches the next command.
+ * Meanwhile, the submitters sleep, and the CPU runs other tasks.
+ *
+ * The queue is shared by every CPU and the IRQ handler, so it's guarded by
+ * g_blkq_lock, always taken with interrupts off.
+ */
+
+#include "blkq.h"
+#include "drivers/timer.h"
+#include "drivers/serial.h"
+#include "mem/vmm.h"
+#include "kern_defs.h"
+#include "sched/sched.h"
+#include "utils/asm_instrs.h"
+#include "utils/spinlock.h"
+#include "cpu.h"
+#include "../string.h"
+
+#include <stddef.h>
+
+#define BLKQ_SUBMIT_BATCH 0x8 // chunks of one blkq_rw call in flight at once
+
+static blk_driver_ops_t *g_ops = NULL;
+
+static BlkRequest *g_pending = NULL;  // sorted by (drive, lba)
+static BlkRequest *g_barriers = NULL; // flushes, in submission order
+static BlkRequest *g_active = NULL;   // the chain the driver is working on
+
+static uint64_t g_next_seq = 0;
+static uint8_t g_head_drive = 0;
+static uint64_t g_head_lba = 0; // where the last command ended
+
+static BlkqStats g_stats;
+
+static spinlock_t g_blkq_lock = SPINLOCK_INIT;
+
+void blkq_init(blk_driver_ops_t *ops)
+{
+    g_ops = ops;
+    g_pending = NULL;
+    g_barriers = NULL;
+    g_active = NULL;
+    memset(&g_stats, 0, sizeof(BlkqStats));
+}
+
+static inline int blkq_key_cmp(uint8_t drive_a, uint64_t lba_a, uint8_t drive_b, uint64_t lba_b)
+{
+    if (drive_a != drive_b)
+    {
+        return drive_a < drive_b ? -1 : 1;
+    }
+    if (lba_a != lba_b)
+    {
+        return lba_a < lba_b ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Can `req` run now? Requests submitted after a pending flush must wait for it.
+ */
+static inline int blkq_eligible(BlkRequest *req)
+{
+    return g_barriers == NULL || req->seq < g_barriers->seq;
+}
+
+static void blkq_unlink(BlkRequest *req)
+{
+    BlkRequest **pp = &g_pending;
+    while (*pp != NULL)
+    {
+        if (*pp == req)
+        {
+            *pp = req->next;
+            req->next = NULL;
+            return;
+        }
+        pp = &(*pp)->next;
+    }
+}
+
+static void blkq_insert_sorted(BlkRequest *req)
+{
+    BlkRequest **pp = &g_pending;
+    while (*pp != NULL && blkq_key_cmp((*pp)->drive, (*pp)->lba, req->drive, req->lba) <= 0)
+    {
+        pp = &(*pp)->next;
+    }
+    req->next = *pp;
+    *pp = req;
+}
+
+/**
+ * @brief Chooses the next request to run.
+ *
+ * @details MECHANISM:
+ * 1. If the oldest eligible request has passed its deadline, take it.
+ * 2. Otherwise, take the first eligible request at or after the head (C-LOOK),
+ * wrapping around to the lowest one.
+ */
+static BlkRequest *blkq_pick(void)
+{
+    uint64_t now = timer_get_ticks();
+    BlkRequest *oldest = NULL;
+    BlkRequest *first = NULL;
+    BlkRequest *ahead = NULL;
+
+    for (BlkRequest *r = g_pending; r != NULL; r = r->next)
+    {
+        if (!blkq_eligible(r))
+        {
+            continue;
+        }
+        if (first == NULL)
+        {
+            first = r;
+        }
+        if (ahead == NULL && blkq_key_cmp(r->drive, r->lba, g_head_drive, g_head_lba) >= 0)
+        {
+            ahead = r;
+        }
+        if (oldest == NULL || r->submit_tick < oldest->submit_tick)
+        {
+            oldest = r;
+        }
+    }
+
+    if (oldest != NULL && now - oldest->submit_tick >= BLKQ_DEADLINE_TICKS)
+    {
+        g_stats.deadline_hits++;
+        return oldest;
+    }
+    return ahead != NULL ? ahead : first;
+}
+
+/**
+ * @brief Chains the pending requests that continue `head` behind it,
+ * as long as the whole chain fits in one driver command.
+ */
+static void blkq_merge(BlkRequest *head)
+{
+    uint32_t max = g_ops->max_sectors(head->drive);
+    uint32_t total = head->count;
+    BlkRequest *tail = head;
+
+    for (;;)
+    {
+        BlkRequest *r = g_pending;
+        while (r != NULL && !(r->drive == head->drive && r->op == head->op && r->lba == tail->lba + tail->count && blkq_eligible(r)))
+        {
+            r = r->next;
+        }
+        if (r == NULL || total + r->count > max)
+        {
+            return;
+        }
+
+        blkq_unlink(r);
+        tail->merge_next = r;
+        tail = r;
+        total += r->count;
+        g_stats.merged++;
+    }
+}
+
+static void blkq_finish_chain(BlkRequest *chain, int status)
+{
+    while (chain != NULL)
+    {
+        // the waiter may free the request as soon as it's marked done
+        BlkRequest *next = chain->merge_next;
+        int pid = chain->waiter_pid;
+        chain->status = status;
+        chain->done = 1;
+        if (pid >= 0)
+        {
+            sched_wake_pid(pid);
+        }
+        chain = next;
+    }
+}
+
+/**
+ * @brief Hands the next command to the driver if it's idle.
+ * Must be called with g_blkq_lock held.
+ */
+static void blkq_dispatch(void)
+{
+    while (g_active == NULL)
+    {
+        BlkRequest *req = blkq_pick();
+        if (req != NULL)
+        {
+            blkq_unlink(req);
+            blkq_merge(req);
+        }
+        else if (g_barriers != NULL)
+        {
+            // nothing older than the flush is left
+            req = g_barriers;
+            g_barriers = req->next;
+            req->next = NULL;
+        }
+        else
+        {
+            return;
+        }
+
+        g_active = req;
+        g_stats.dispatched++;
+        if (req->op != BLK_OP_FLUSH)
+        {
+            BlkRequest *tail = req;
+            while (tail->merge_next != NULL)
+            {
+                tail = tail->merge_next;
+            }
+            g_head_drive = req->drive;
+            g_head_lba = tail->lba + tail->count;
+        }
+
+        if (g_ops->start(req) < 0)
+        {
+            g_active = NULL;
+            g_stats.errors++;
+            blkq_finish_chain(req, -1);
+        }
+    }
+}
+
+/**
+ * @brief Makes every page of a user buffer present and, for a read, writable.
+ *
+ * @details The driver may copy to and from the buffer in its IRQ handler,
+ * where a #PF can't be served. So the demand-paged and Copy-on-Write pages are
+ * faulted in here, from the submitting task, by touching one byte of each.
+ */
+static void blkq_prefault(BlkRequest *req)
+{
+    uint64_t start = (uint64_t)req->buf;
+    uint64_t end = start + (uint64_t)req->count * BLK_SECTOR_SIZE;
+    if (req->buf == NULL || start >= VMM_USER_END)
+    {
+        return;
+    }
+
+    for (uint64_t page = start & ~(uint64_t)(PAGE_SIZE - 1); page < end; page += PAGE_SIZE)
+    {
+        volatile uint8_t *p = (volatile uint8_t *)(page < start ? start : page);
+        uint8_t v = *p;
+        if (req->op == BLK_OP_READ)
+        {
+            *p = v;
+        }
+    }
+}
+
+/**
+ * @brief Queues `req` without waiting for it.
+ * `op`, `drive`, `lba`, `count` and `buf` must be filled in by the caller,
+ * who must not be killable until it's done, see sched_defer_kill.
+ * Called from the task, with interrupts on.
+ */
+void blkq_submit(BlkRequest *req)
+{
+    blkq_prefault(req);
+
+    req->pml4 = read_cr3() & ~0xFFFULL;
+    req->submit_tick = timer_get_ticks();
+    req->waiter_pid = (int)get_curr_task_pid();
+    req->done = 0;
+    req->status = 0;
+    req->next = NULL;
+    req->merge_next = NULL;
+
+    uint64_t rflags = spin_lock_irqsave(&g_blkq_lock);
+    req->seq = g_next_seq++;
+    g_stats.submitted++;
+
+    if (req->op == BLK_OP_FLUSH)
+    {
+        BlkRequest **pp = &g_barriers;
+        while (*pp != NULL)
+        {
+            pp = &(*pp)->next;
+        }
+        *pp = req;
+    }
+    else
+    {
+        blkq_insert_sorted(req);
+    }
+
+    blkq_dispatch();
+    spin_unlock_irqrestore(&g_blkq_lock, rflags);
+}
+
+/**
+ * @brief Sleeps until `req` is done.
+ *
+ * @details The state is checked and the task put to sleep under g_blkq_lock,
+ * so the completion can't slip in between. If there's nobody else to run,
+ * the scheduler comes straight back, and we just halt until the next IRQ.
+ *
+ * @return int the status of the request.
+ */
+int blkq_wait(BlkRequest *req)
+{
+    uint64_t rflags = spin_lock_irqsave(&g_blkq_lock);
+    while (!req->done)
+    {
+        Task *curr_tsk = get_curr_task();
+        if (curr_tsk != NULL)
+        {
+            curr_tsk->state = TASK_WAITING;
+        }
+        spin_unlock(&g_blkq_lock);
+
+        if (curr_tsk != NULL)
+        {
+            schedule();
+        }
+        if (!req->done)
+        {
+            sti();
+            hlt();
+            cli();
+        }
+        spin_lock(&g_blkq_lock);
+    }
+
+    Task *curr_tsk = get_curr_task();
+    if (curr_tsk != NULL && curr_tsk->state == TASK_WAITING)
+    {
+        curr_tsk->state = TASK_READY;
+    }
+    spin_unlock_irqrestore(&g_blkq_lock, rflags);
+
+    return req->status;
+}
+
+/**
+ * @brief Reads or writes `count` sectors, and sleeps until it's done.
+ *
+ * @details The transfer is cut into chunks the driver can take in one command.
+ * Up to BLKQ_SUBMIT_BATCH chunks are submitted before waiting, so the queue
+ * always has the next one at hand when a command completes.
+ * The requests live on our stack, so the task can't be killed until they're done.
+ *
+ * @return int 0 on success, -1 if any chunk failed.
+ */
+int blkq_rw(uint8_t op, uint8_t drive, uint64_t lba, uint32_t count, void *buf)
+{
+    if (g_ops == NULL)
+    {
+        kprint("BLKQ: no driver\n");
+        return -1;
+    }
+
+    if (op == BLK_OP_FLUSH)
+    {
+        BlkRequest req;
+        req.op = op;
+        req.drive = drive;
+        req.lba = 0;
+        req.count = 0;
+        req.buf = NULL;
+        sched_defer_kill();
+        blkq_submit(&req);
+        int status = blkq_wait(&req);
+        sched_allow_kill();
+        return status;
+    }
+
+    uint32_t max = g_ops->max_sectors(drive);
+    uint8_t *cur = (uint8_t *)buf;
+    int ret = 0;
+
+    sched_defer_kill();
+    while (count > 0)
+    {
+        BlkRequest reqs[BLKQ_SUBMIT_BATCH];
+        int n = 0;
+        while (count > 0 && n < BLKQ_SUBMIT_BATCH)
+        {
+            uint32_t chunk = count < max ? count : max;
+            reqs[n].op = op;
+            reqs[n].drive = drive;
+            reqs[n].lba = lba;
+            reqs[n].count = chunk;
+            reqs[n].buf = cur;
+            blkq_submit(&reqs[n]);
+
+            cur += (uint64_t)chunk * BLK_SECTOR_SIZE;
+            lba += chunk;
+            count -= chunk;
+            n++;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            if (blkq_wait(&reqs[i]) < 0)
+            {
+                ret = -1;
+            }
+        }
+    }
+    sched_allow_kill();
+
+    return ret;
+}
+
+/**
+ * @brief Called by the driver, with interrupts off, when the active command is over.
+ */
+void blkq_complete(int status)
+{
+    spin_lock(&g_blkq_lock);
+    BlkRequest *chain = g_active;
+    g_active = NULL;
+    if (status < 0)
+    {
+        g_stats.errors++;
+    }
+
+    blkq_finish_chain(chain, status);
+    blkq_dispatch();
+    spin_unlock(&g_blkq_lock);
+}
+
+void blkq_get_stats(BlkqStats *out)
+{
+    if (out == NULL)
+    {
+        return;
+    }
+    memcpy(out, &g_stats, sizeof(BlkqStats));
+}
@@ -0,0 +1,67 @@
+#ifndef BLKQ_H
+#define BLKQ_H
+
+#include <stdint.h>
+
+#define BLK_OP_READ 0x0
+#define BLK_OP_WRITE 0x1
+#define BLK_OP_FLUSH 0x2 // barrier: runs after everything submitted before it
+
+#define BLK_SECTOR_SIZE 0x200
+#define BLKQ_DEADLINE_TICKS 50 // a request waiting longer than this is served first
+
+/**
+ * One block I/O request.
+ * Pending requests are kept in a list sorted by (drive, lba). When a request is
+ * dispatched, the adjacent requests it could be merged with are chained behind it
+ * through `merge_next`, and the driver runs the whole chain as one command.
+ */
+typedef struct BlkRequest
+{
+    uint8_t op;
+    uint8_t drive;
+    uint64_t lba;
+    uint32_t count; // sectors
+    void *buf;
+    uint64_t pml4; // phys_addr of the pml4 `buf` is mapped in
+
+    uint64_t seq;         // submission order, used for the barriers
+    uint64_t submit_tick; // used for the deadline
+    int waiter_pid;       // -1 if nobody sleeps on it
+
+    volatile uint8_t done;
+    int status; // 0 or -1, valid once done
+
+    struct BlkRequest *next;
+    struct BlkRequest *merge_next;
+} BlkRequest;
+
+/**
+ * What the queue needs from a block driver.
+ * `start` is called with interrupts off, from the submitting task or from the
+ * driver's IRQ handler, and must not block. The driver reports the end of the
+ * command with `blkq_complete`.
+ */
+typedef struct
+{
+    int (*start)(BlkRequest *batch);
+    uint32_t (*max_sectors)(uint8_t drive); // longest command the driver takes
+} blk_driver_ops_t;
+
+typedef struct BlkqStats
+{
+    uint64_t submitted;
+    uint64_t dispatched; // commands sent to the driver
+    uint64_t merged;     // requests that rode along with another one
+    uint64_t deadline_hits;
+    uint64_t errors;
+} BlkqStats;
+
+void blkq_init(blk_driver_ops_t *ops);
+void blkq_submit(BlkRequest *req);
+int blkq_wait(BlkRequest *req);
+int blkq_rw(uint8_t op, uint8_t drive, uint64_t lba, uint32_t count, void *buf);
+void blkq_complete(int status);
+void blkq_get_stats(BlkqStats *out);
+
+#endif
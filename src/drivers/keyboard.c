@@ -4,6 +4,7 @@
 #include "serial.h"
 #include "video.h"
 #include "utils/ring_buf.h"
+#include "utils/spinlock.h"
 #include "event/event.h"
 // #include "pic.h"
 
@@ -26,6 +27,7 @@ typedef struct
 
 static volatile uint8_t scancode = 0;
 static volatile KeyboardDevice kbd_dev;
+static spinlock_t g_kbd_lock = SPINLOCK_INIT; // the IRQ fills buf on the BSP, readers may be on any CPU
 
 #define PS2_DATA_PORT 0x60
 #define KBD_TBL_SIZE 0x80 // 128
@@ -209,7 +211,9 @@ static void send_ansi_sequence(const char *seq)
             .key = c,
         };
 
+        spin_lock(&g_kbd_lock);
         rb_push((RingBuf *)&kbd_dev.buf, c);
+        spin_unlock(&g_kbd_lock);
         seq++;
         event_queue_push(&g_event_queue, e);
     }
@@ -335,7 +339,9 @@ static void keyboard_handler(void *regs)
                 e.modifiers |= MOD_SHIFT;
             }
 
+            spin_lock(&g_kbd_lock);
             rb_push((RingBuf *)&kbd_dev.buf, ascii_char);
+            spin_unlock(&g_kbd_lock);
 
             event_queue_push(&g_event_queue, e);
             // if (kbd_dev.waiting_pid != -1)
@@ -354,12 +360,11 @@ void keyboard_set_waiting(int64_t pid)
 
 char keyboard_get_char()
 {
-    char c;
-    if (rb_pop((RingBuf *)&kbd_dev.buf, &c))
-    {
-        return c;
-    }
-    return 0;
+    char c = 0;
+    uint64_t rflags = spin_lock_irqsave(&g_kbd_lock);
+    rb_pop((RingBuf *)&kbd_dev.buf, &c);
+    spin_unlock_irqrestore(&g_kbd_lock, rflags);
+    return c;
 }
 
 void keyboard_init(void)
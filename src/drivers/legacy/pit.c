@@ -20,7 +20,9 @@
 #define PIT_DATA_2 (PIT_DATA_0+2)
 #define PIT_COMMAND (PIT_DATA_0+3)
 #define PIT_CONTROL_BYTE 0x36    /* channel0, lobyte/hibyte, mode3, binary */
+#define PIT_ONESHOT_CH2  0xB0    /* channel2, lobyte/hibyte, mode0, binary */
 #define PIT_INPUT_CLOCK  1193182 /* Hz */
+#define PIT_PORT_B       0x61    /* bit 0: channel 2 gate, bit 1: speaker, bit 5: channel 2 output */
 
 static volatile uint64_t ticks = 0; /* 64-bit tick counter used by pit_get_ticks */
 
@@ -65,4 +67,27 @@ void pit_init(uint32_t freq_hz)
 uint32_t pit_get_ticks(void)
 {
     return ticks;
+}
+
+/* Busy-waits `us` microseconds (at most PIT_MAX_WAIT_US) on channel 2, which
+ * raises no IRQ: its output is read back on port 0x61. Used to calibrate the
+ * other timers, with interrupts off.
+ */
+void pit_wait_us(uint32_t us)
+{
+    if (us > PIT_MAX_WAIT_US)
+        us = PIT_MAX_WAIT_US;
+
+    uint32_t count = (uint32_t)((uint64_t)PIT_INPUT_CLOCK * us / 1000000);
+    if (count == 0)
+        count = 1;
+
+    /* gate on, speaker off; in mode 0 the output goes high when the count hits 0 */
+    outb(PIT_PORT_B, (inb(PIT_PORT_B) & ~0x02) | 0x01);
+    outb(PIT_COMMAND, PIT_ONESHOT_CH2);
+    outb(PIT_DATA_2, count & 0xFF);         /* low byte */
+    outb(PIT_DATA_2, (count >> 8) & 0xFF);  /* high byte */
+
+    while (!(inb(PIT_PORT_B) & 0x20))
+        asm volatile ("pause");
 }
\ No newline at end of file
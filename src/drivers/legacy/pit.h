@@ -8,11 +8,15 @@
 
 #include <stdint.h>
 
+#define PIT_MAX_WAIT_US 54000 /* a 16-bit count at 1.193182 MHz lasts 54.9 ms */
+
 /* PIT (8253/8254) interface.
  * - pit_init(freq_hz): program channel 0 to generate periodic IRQ0 at `freq_hz`.
  * - pit_get_ticks():  return monotonic tick counter (32-bit).
+ * - pit_wait_us(us):  busy-wait on channel 2, to calibrate the other timers.
  */
 void pit_init(uint32_t freq_hz);
 uint32_t pit_get_ticks(void);
+void pit_wait_us(uint32_t us);
 
 #endif
\ No newline at end of file
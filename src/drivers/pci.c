@@ -0,0 +1,85 @@
+#include "pci.h"
+#include "../io.h"
+
+/**
+ * @brief Builds the value written to CONFIG_ADDRESS (port 0xCF8).
+ *
+ * | Bit 31 | Bits 23-16 | Bits 15-11 | Bits 10-8 | Bits 7-0        |
+ * |--------|------------|------------|-----------|-----------------|
+ * | Enable | Bus        | Device     | Function  | Register offset |
+ */
+static inline uint32_t pci_addr(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset)
+{
+    return (1u << 31) | ((uint32_t)bus << 16) | ((uint32_t)(dev & 0x1F) << 11) | ((uint32_t)(func & 0x07) << 8) | (offset & 0xFC);
+}
+
+uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset)
+{
+    outl(PCI_CONFIG_ADDRESS, pci_addr(bus, dev, func, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+void pci_write32(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset, uint32_t val)
+{
+    outl(PCI_CONFIG_ADDRESS, pci_addr(bus, dev, func, offset));
+    outl(PCI_CONFIG_DATA, val);
+}
+
+uint16_t pci_read16(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset)
+{
+    uint32_t val = pci_read32(bus, dev, func, offset);
+    return (uint16_t)(val >> ((offset & 2) * 8));
+}
+
+void pci_write16(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset, uint16_t val)
+{
+    uint32_t old = pci_read32(bus, dev, func, offset);
+    uint32_t shift = (offset & 2) * 8;
+    old &= ~(0xFFFFu << shift);
+    old |= (uint32_t)val << shift;
+    pci_write32(bus, dev, func, offset, old);
+}
+
+/**
+ * @brief Brute-force scans the PCI buses for the first function of a given class.
+ *
+ * @return int 0 if found (and `out` is filled), -1 otherwise.
+ */
+int pci_find_class(uint8_t class_code, uint8_t subclass, PciDevice *out)
+{
+    for (uint16_t bus = 0; bus < 256; bus++)
+    {
+        for (uint8_t dev = 0; dev < 32; dev++)
+        {
+            uint16_t vendor = pci_read16(bus, dev, 0, PCI_REG_VENDOR_ID);
+            if (vendor == 0xFFFF)
+            {
+                continue;
+            }
+
+            // only multi-function devices (bit 7 of the header type) have functions 1-7
+            uint8_t func_count = (pci_read16(bus, dev, 0, PCI_REG_HEADER_TYPE) & 0x80) ? 8 : 1;
+            for (uint8_t func = 0; func < func_count; func++)
+            {
+                uint32_t id = pci_read32(bus, dev, func, PCI_REG_VENDOR_ID);
+                if ((id & 0xFFFF) == 0xFFFF)
+                {
+                    continue;
+                }
+
+                uint32_t class_reg = pci_read32(bus, dev, func, PCI_REG_CLASS);
+                if ((class_reg >> 24) == class_code && ((class_reg >> 16) & 0xFF) == subclass)
+                {
+                    out->bus = bus;
+                    out->dev = dev;
+                    out->func = func;
+                    out->vendor_id = id & 0xFFFF;
+                    out->device_id = id >> 16;
+                    return 0;
+                }
+            }
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,37 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+#define PCI_REG_VENDOR_ID 0x00
+#define PCI_REG_COMMAND 0x04
+#define PCI_REG_CLASS 0x08 // revision, prog-if, subclass, class
+#define PCI_REG_HEADER_TYPE 0x0E
+#define PCI_REG_BAR0 0x10
+#define PCI_REG_BAR4 0x20
+
+#define PCI_CMD_IO_SPACE 0x01
+#define PCI_CMD_BUS_MASTER 0x04
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+
+typedef struct
+{
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t func;
+    uint16_t vendor_id;
+    uint16_t device_id;
+} PciDevice;
+
+uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset);
+void pci_write32(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset, uint32_t val);
+uint16_t pci_read16(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset);
+void pci_write16(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset, uint16_t val);
+int pci_find_class(uint8_t class_code, uint8_t subclass, PciDevice *out);
+
+#endif
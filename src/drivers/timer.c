@@ -4,26 +4,169 @@
 #include "drivers/serial.h"
 #include "drivers/apic.h"
 #include "drivers/video.h"
+#include "drivers/legacy/pit.h"
 #include "gui/window.h"
+#include "utils/asm_instrs.h"
+#include "cpu.h"
 
-static volatile uint64_t g_ticks = 0;
+/*
+The time comes from the TSC, which every CPU reads at the same rate, so no CPU
+has to take an interrupt to keep it. Each CPU's local APIC timer runs in
+one-shot mode, and the scheduler arms it for its next deadline only: the end of
+the current slice, the next sleeper to wake up or the next rebalance. A CPU with
+nothing to do doesn't tick at all. Both timers are calibrated against the PIT
+at boot, so a tick is TIMER_TICK_US whatever the machine.
+
+That needs an invariant TSC (CPUID.80000007H:EDX[8]): an older one may stop or
+change rate with the power state. Without it, every CPU ticks periodically, the
+BSP's interrupts count the time, and timer_arm does nothing.
+*/
+
+#define TIMER_CALIBRATE_US 10000
+#define TIMER_MIN_ARM_US 50 // a deadline already past still fires, right away
+
+static uint64_t g_tsc_base = 0;
+static uint64_t g_tsc_per_us = 0;
+static uint64_t g_lapic_per_ms = 0; // local APIC timer clocks, divided by 16
+
+static bool g_periodic = false;
+static uint32_t g_periodic_count = 0; // local APIC timer clocks per tick
+static volatile uint64_t g_ticks = 0; // counted by the BSP, when periodic
+
+static bool timer_tsc_invariant(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, &eax, &ecx, &edx, &ebx);
+    if (eax < 0x80000007)
+    {
+        return false;
+    }
+
+    cpuid(0x80000007, &eax, &ecx, &edx, &ebx);
+    return (edx & (1 << 8)) != 0;
+}
 
 static void timer_handler(void *regs)
 {
     (void)regs;
-    g_ticks++;
+
+    if (g_periodic && cpu_id() == 0)
+    {
+        g_ticks++;
+    }
 
     lapic_send_eoi();
-    sched_check_sleeping_tasks();
-    schedule();
+    // arms the next deadline
+    if (sched_tick())
+    {
+        schedule();
+    }
 }
 
+/**
+ * @brief Measures the TSC and the local APIC timer against the PIT, then arms
+ * the first tick of the BSP, or starts it ticking periodically if the TSC
+ * can't keep the time. Runs with interrupts off.
+ */
 void timer_init()
 {
     register_irq_handler(0, timer_handler);
+
+    lapic_timer_oneshot(UINT32_MAX);
+    uint64_t tsc_start = rdtsc();
+    pit_wait_us(TIMER_CALIBRATE_US);
+    uint32_t lapic_left = lapic_timer_current();
+    uint64_t tsc_end = rdtsc();
+    lapic_timer_oneshot(0);
+
+    g_tsc_per_us = (tsc_end - tsc_start) / TIMER_CALIBRATE_US;
+    g_lapic_per_ms = (uint64_t)(UINT32_MAX - lapic_left) * 1000 / TIMER_CALIBRATE_US;
+    if (g_tsc_per_us == 0)
+    {
+        g_tsc_per_us = 1;
+    }
+    g_tsc_base = tsc_end;
+
+    kprint("TIMER: TSC ");
+    kprint_int((int)g_tsc_per_us);
+    kprint(" MHz, LAPIC timer ");
+    kprint_int((int)g_lapic_per_ms);
+    kprint(" kHz\n");
+
+    if (!timer_tsc_invariant())
+    {
+        kprint("TIMER: no invariant TSC, ticking periodically\n");
+        uint64_t count = (uint64_t)TIMER_TICK_US * g_lapic_per_ms / 1000;
+        g_periodic_count = count > UINT32_MAX ? UINT32_MAX : (count == 0 ? 1 : (uint32_t)count);
+        g_periodic = true;
+        lapic_timer_periodic(g_periodic_count);
+        return;
+    }
+
+    timer_arm(1);
+}
+
+/**
+ * @brief Starts the timer of an AP, after lapic_init_cpu. A one-shot timer
+ * waits for the scheduler to arm it, a periodic one starts ticking.
+ */
+void timer_init_cpu(void)
+{
+    if (g_periodic)
+    {
+        lapic_timer_periodic(g_periodic_count);
+    }
+}
+
+/**
+ * @return The microseconds since timer_init.
+ */
+uint64_t timer_get_us(void)
+{
+    if (g_periodic)
+    {
+        return g_ticks * TIMER_TICK_US;
+    }
+
+    uint64_t tsc = rdtsc();
+    if (g_tsc_per_us == 0 || tsc < g_tsc_base)
+    {
+        return 0;
+    }
+    return (tsc - g_tsc_base) / g_tsc_per_us;
 }
 
 uint64_t timer_get_ticks()
 {
-    return g_ticks;
-}
\ No newline at end of file
+    return timer_get_us() / TIMER_TICK_US;
+}
+
+/**
+ * @brief Makes this CPU's timer fire at the start of the tick `deadline_tick`,
+ * or never with TIMER_NEVER. Replaces the deadline armed before.
+ * A periodic timer just keeps ticking.
+ */
+void timer_arm(uint64_t deadline_tick)
+{
+    if (g_periodic)
+    {
+        return;
+    }
+
+    if (deadline_tick == TIMER_NEVER)
+    {
+        lapic_timer_oneshot(0);
+        return;
+    }
+
+    uint64_t now = timer_get_us();
+    uint64_t at = deadline_tick * TIMER_TICK_US;
+    uint64_t us = at > now + TIMER_MIN_ARM_US ? at - now : TIMER_MIN_ARM_US;
+
+    uint64_t count = us * g_lapic_per_ms / 1000;
+    if (count > UINT32_MAX)
+    {
+        count = UINT32_MAX;
+    }
+    lapic_timer_oneshot(count == 0 ? 1 : (uint32_t)count);
+}
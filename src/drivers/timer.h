@@ -3,7 +3,13 @@
 
 #include <stdint.h>
 
+#define TIMER_TICK_US 10000       // a tick is 10 ms
+#define TIMER_NEVER UINT64_MAX    // deadline for timer_arm: don't fire
+
 void timer_init();
+void timer_init_cpu(void);
 uint64_t timer_get_ticks();
+uint64_t timer_get_us(void);
+void timer_arm(uint64_t deadline_tick);
 
-#endif
\ No newline at end of file
+#endif
@@ -145,7 +145,7 @@ void video_init_buf()
             kern_pml4,
             buf_virt_addr,
             phys_addr,
-            VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE);
+            VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_GLOBAL);
     }
 }
 
@@ -11,6 +11,8 @@
 
 #include <stddef.h>
 
+#define ELF_FRAME_BATCH 32 // frames taken from the PMM at once for a segment
+
 extern uint64_t *kern_pml4;
 
 uint64_t elf_load(const char *fname)
@@ -36,11 +38,17 @@ uint64_t elf_load(const char *fname)
         return 0;
     }
 
-    uint64_t curr_pml4_phys = read_cr3();
+    uint64_t curr_pml4_phys = pte_get_addr(read_cr3());
     uint64_t *curr_pml4_virt = vmm_phys_to_hhdm(curr_pml4_phys);
 
     uint16_t phdrs_size = elf_hdr.e_phnum * elf_hdr.e_phentsize;
-    Elf64_Phdr *phdr = (Elf64_Phdr *)vmm_alloc(phdrs_size);
+    Elf64_Phdr *phdr = (Elf64_Phdr *)kmalloc(phdrs_size);
+    if (phdr == NULL)
+    {
+        kprint("ELF: Out of memory!\n");
+        vfs_close(file);
+        return 0;
+    }
     vfs_seek(file, elf_hdr.e_phoff);
     vfs_read(file, phdrs_size, (uint8_t *)phdr);
 
@@ -54,17 +62,47 @@ uint64_t elf_load(const char *fname)
             // uint64_t offset = phdr[i].p_offset;
 
             uint64_t npages = (mem_size + PAGE_SIZE - 1) / PAGE_SIZE;
+            uint64_t file_pages = (file_size + PAGE_SIZE - 1) / PAGE_SIZE;
+            if (file_pages > npages)
+            {
+                file_pages = npages;
+            }
+
+            // pages with file data are read over, so they come unzeroed in batches;
+            // the pages past it (.bss) come from the pre-zeroed pool
+            uint64_t frames[ELF_FRAME_BATCH];
             for (size_t j = 0; j < npages; j++)
             {
-                uint64_t phys_addr = pmm_alloc_frame();
-                if (phys_addr == 0)
+                uint64_t phys_addr;
+                if (j < file_pages)
                 {
-                    kprint("ELF: Out of memory!\n");
-                    return 0;
+                    size_t slot = j % ELF_FRAME_BATCH;
+                    if (slot == 0)
+                    {
+                        size_t want = file_pages - j < ELF_FRAME_BATCH ? file_pages - j : ELF_FRAME_BATCH;
+                        if (pmm_alloc_frames_batch(want, frames) != want)
+                        {
+                            kprint("ELF: Out of memory!\n");
+                            kfree(phdr);
+                            vfs_close(file);
+                            return 0;
+                        }
+                    }
+                    phys_addr = frames[slot];
+                }
+                else
+                {
+                    phys_addr = pmm_alloc_zeroed_frame();
+                    if (phys_addr == 0)
+                    {
+                        kprint("ELF: Out of memory!\n");
+                        kfree(phdr);
+                        vfs_close(file);
+                        return 0;
+                    }
                 }
 
                 void *loc_virt_addr = (void *)vmm_phys_to_hhdm(phys_addr);
-                memset(loc_virt_addr, 0, PAGE_SIZE);
 
                 uint64_t targt_addr = vaddr + (j * PAGE_SIZE);
 
@@ -81,18 +119,17 @@ uint64_t elf_load(const char *fname)
                     uint64_t remaining_bytes = file_size - page_offset;
                     uint64_t bytes_to_cpy = remaining_bytes > PAGE_SIZE ? PAGE_SIZE : remaining_bytes;
 
-                    if (bytes_to_cpy > 0)
+                    vfs_seek(file, phdr[i].p_offset + page_offset);
+                    uint64_t bytes_read = vfs_read(file, bytes_to_cpy, (uint8_t *)loc_virt_addr);
+                    if (bytes_read > bytes_to_cpy)
                     {
-                        vfs_seek(file, phdr[i].p_offset + page_offset);
-                        uint8_t *tmp_buf = (uint8_t *)vmm_alloc(bytes_to_cpy);
-                        vfs_read(file, bytes_to_cpy, tmp_buf);
-                        memcpy(loc_virt_addr, tmp_buf, bytes_to_cpy);
-                        vmm_free(tmp_buf);
+                        bytes_read = 0;
                     }
 
-                    if (bytes_to_cpy < PAGE_SIZE)
+                    // the frame isn't zeroed: clear whatever the file didn't fill
+                    if (bytes_read < PAGE_SIZE)
                     {
-                        memset((uint8_t *)loc_virt_addr + bytes_to_cpy, 0, PAGE_SIZE - bytes_to_cpy);
+                        memset((uint8_t *)loc_virt_addr + bytes_read, 0, PAGE_SIZE - bytes_read);
                     }
                 }
 
@@ -103,7 +140,7 @@ uint64_t elf_load(const char *fname)
         }
     }
 
-    vmm_free(phdr);
+    kfree(phdr);
     vfs_close(file);
     kprint("ELF: Loaded successfully. Entry: ");
     kprint_hex_64(elf_hdr.e_entry);
@@ -2,6 +2,7 @@
 #define EVENT_H
 
 #include <stdint.h>
+#include "utils/spinlock.h"
 
 #define EVENT_QUEUE_SIZE 0x100 // 256
 
@@ -39,6 +40,7 @@ typedef struct Event
 
 typedef struct EventBuf
 {
+    spinlock_t lock; // pushed from IRQs and the kernel loop, popped on any CPU
     Event queue[EVENT_QUEUE_SIZE];
     uint8_t head;
     uint8_t tail;
@@ -54,10 +56,12 @@ static inline void event_queue_init(EventBuf *event_queue)
 
     event_queue->head = 0;
     event_queue->tail = 0;
+    event_queue->lock = (spinlock_t)SPINLOCK_INIT;
 }
 
 static inline void event_queue_push(EventBuf *event_queue, Event e)
 {
+    uint64_t rflags = spin_lock_irqsave(&event_queue->lock);
     uint64_t *dest = (uint64_t *)&event_queue->queue[event_queue->head];
     uint64_t *src = (uint64_t *)&e;
     dest[0] = src[0];
@@ -69,12 +73,15 @@ static inline void event_queue_push(EventBuf *event_queue, Event e)
     {
         event_queue->tail = (event_queue->tail + 1) % EVENT_QUEUE_SIZE;
     }
+    spin_unlock_irqrestore(&event_queue->lock, rflags);
 }
 
 static inline int event_queue_pop(EventBuf *event_queue, Event *e)
 {
+    uint64_t rflags = spin_lock_irqsave(&event_queue->lock);
     if (event_queue->head == event_queue->tail)
     {
+        spin_unlock_irqrestore(&event_queue->lock, rflags);
         return 0;
     }
 
@@ -85,6 +92,7 @@ static inline int event_queue_pop(EventBuf *event_queue, Event *e)
     dest[2] = src[2];
 
     event_queue->tail = (event_queue->tail + 1) % EVENT_QUEUE_SIZE;
+    spin_unlock_irqrestore(&event_queue->lock, rflags);
     return 1;
 }
 
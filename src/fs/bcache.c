@@ -0,0 +1,499 @@
+/**
+ * @file bcache.c
+ * @brief A write-back sector cache sitting between the file systems and the ATA driver.
+ *
+ * Every sector that goes through `bcache_read`/`bcache_write` is kept in RAM,
+ * keyed by (drive, lba). Lookups go through a small hash table, and all entries
+ * are chained in an LRU list so that the least recently used sector is evicted
+ * first once the memory budget is reached.
+ *
+ * Writes only touch the cached copy and mark it dirty. Dirty sectors reach the
+ * disk when they get evicted, when `bcache_sync` is called (sync syscall,
+ * shutdown) or when the kernel loop fires its periodic write-back.
+ */
+
+#include "bcache.h"
+#include "drivers/ata.h"
+#include "drivers/serial.h"
+#include "mem/slab.h"
+#include "mem/vmm.h"
+#include "sched/sched.h"
+#include "sched/mutex.h"
+#include "utils/asm_instrs.h"
+#include "../string.h"
+
+static BufEntry *g_hash_tbl[BCACHE_HASH_SIZE];
+static BufEntry *g_lru_head = NULL; // most recently used
+static BufEntry *g_lru_tail = NULL; // least recently used
+
+// entries have their own cache: in kmalloc-1024, each one would take 1 KiB for 552 bytes
+static kmem_cache_t g_entry_cache = KMEM_CACHE_INIT("BufEntry", BufEntry, NULL);
+
+static size_t g_max_blocks = BCACHE_DEFAULT_BUDGET / sizeof(BufEntry);
+static BcacheStats g_stats;
+
+// on the kernel heap, so the disk can DMA from and into them
+static uint8_t *g_flush_buf = NULL;
+static uint8_t *g_prefetch_buf = NULL;
+
+/*
+The ATA driver waits for IRQ 14 with interrupts on, so we cannot keep them off
+for the whole operation. Instead, the cache is owned by one task at a time, on
+any CPU, and the others sleep until the owner is done.
+*/
+static mutex_t g_bcache_lock = MUTEX_INIT;
+
+static uint8_t g_unflushed_drives = 0; // bit per drive written since its last FLUSH CACHE
+
+static inline uint32_t bcache_hash(uint8_t drive, uint64_t lba)
+{
+    return (uint32_t)((lba ^ (lba >> 8) ^ ((uint64_t)drive << 7)) & (BCACHE_HASH_SIZE - 1));
+}
+
+static BufEntry *bcache_lookup(uint8_t drive, uint64_t lba)
+{
+    BufEntry *e = g_hash_tbl[bcache_hash(drive, lba)];
+    while (e != NULL)
+    {
+        if (e->lba == lba && e->drive == drive)
+        {
+            return e;
+        }
+        e = e->hash_next;
+    }
+    return NULL;
+}
+
+static void lru_unlink(BufEntry *e)
+{
+    if (e->lru_prev != NULL)
+    {
+        e->lru_prev->lru_next = e->lru_next;
+    }
+    else
+    {
+        g_lru_head = e->lru_next;
+    }
+
+    if (e->lru_next != NULL)
+    {
+        e->lru_next->lru_prev = e->lru_prev;
+    }
+    else
+    {
+        g_lru_tail = e->lru_prev;
+    }
+
+    e->lru_prev = NULL;
+    e->lru_next = NULL;
+}
+
+static void lru_push_front(BufEntry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = g_lru_head;
+    if (g_lru_head != NULL)
+    {
+        g_lru_head->lru_prev = e;
+    }
+    g_lru_head = e;
+    if (g_lru_tail == NULL)
+    {
+        g_lru_tail = e;
+    }
+}
+
+static inline void lru_touch(BufEntry *e)
+{
+    if (g_lru_head == e)
+    {
+        return;
+    }
+    lru_unlink(e);
+    lru_push_front(e);
+}
+
+static void hash_remove(BufEntry *e)
+{
+    BufEntry **pp = &g_hash_tbl[bcache_hash(e->drive, e->lba)];
+    while (*pp != NULL)
+    {
+        if (*pp == e)
+        {
+            *pp = e->hash_next;
+            e->hash_next = NULL;
+            return;
+        }
+        pp = &(*pp)->hash_next;
+    }
+}
+
+static inline void mark_clean(BufEntry *e)
+{
+    if (e->dirty)
+    {
+        e->dirty = 0;
+        g_stats.dirty_blocks--;
+    }
+}
+
+/**
+ * @brief Writes a dirty entry, merged with its dirty neighbours, to the disk.
+ *
+ * @details MECHANISM:
+ * 1. Walk backwards from `e` while the previous LBA is cached and dirty,
+ * so the run starts at the lowest dirty sector.
+ * 2. Walk forwards and copy up to BCACHE_FLUSH_RUN consecutive dirty sectors
+ * into `g_flush_buf`.
+ * 3. Issue one multi-sector write, and mark the whole run clean.
+ * Without `g_flush_buf`, `e` is written alone.
+ */
+static void bcache_writeback_run(BufEntry *e)
+{
+    if (g_flush_buf == NULL)
+    {
+        ata_write_sectors((uint16_t *)e->data, e->lba, 1, e->drive);
+        g_unflushed_drives |= 1 << e->drive;
+        mark_clean(e);
+        g_stats.writebacks++;
+        return;
+    }
+
+    uint64_t start = e->lba;
+    while (start > 0 && e->lba - start < BCACHE_FLUSH_RUN - 1)
+    {
+        BufEntry *prev = bcache_lookup(e->drive, start - 1);
+        if (prev == NULL || !prev->dirty)
+        {
+            break;
+        }
+        start--;
+    }
+
+    BufEntry *run[BCACHE_FLUSH_RUN];
+    uint32_t n = 0;
+    while (n < BCACHE_FLUSH_RUN)
+    {
+        BufEntry *cur = bcache_lookup(e->drive, start + n);
+        if (cur == NULL || !cur->dirty)
+        {
+            break;
+        }
+        memcpy(&g_flush_buf[n * SECTOR_SIZE], cur->data, SECTOR_SIZE);
+        run[n++] = cur;
+    }
+
+    ata_write_sectors((uint16_t *)g_flush_buf, start, n, e->drive);
+    g_unflushed_drives |= 1 << e->drive;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        mark_clean(run[i]);
+    }
+    g_stats.writebacks += n;
+}
+
+/**
+ * @brief Drops least recently used entries until there is room for one more.
+ * Dirty victims are written back before they're freed.
+ */
+static void bcache_reclaim(void)
+{
+    while (g_stats.used_blocks >= g_max_blocks && g_lru_tail != NULL)
+    {
+        BufEntry *victim = g_lru_tail;
+        if (victim->dirty)
+        {
+            bcache_writeback_run(victim);
+        }
+
+        lru_unlink(victim);
+        hash_remove(victim);
+        kmem_cache_free(&g_entry_cache, victim);
+        g_stats.used_blocks--;
+        g_stats.evictions++;
+    }
+}
+
+/**
+ * @brief Creates a new entry for (drive, lba) and links it into the cache.
+ * The content of `data` is left to the caller.
+ */
+static BufEntry *bcache_insert(uint8_t drive, uint64_t lba)
+{
+    bcache_reclaim();
+
+    BufEntry *e = (BufEntry *)kmem_cache_alloc(&g_entry_cache);
+    if (e == NULL)
+    {
+        return NULL;
+    }
+
+    e->drive = drive;
+    e->lba = lba;
+    e->dirty = 0;
+
+    uint32_t h = bcache_hash(drive, lba);
+    e->hash_next = g_hash_tbl[h];
+    g_hash_tbl[h] = e;
+    lru_push_front(e);
+
+    g_stats.used_blocks++;
+    return e;
+}
+
+/**
+ * @brief Creates the entries for `count` sectors just read from the disk into `src`.
+ * @return 0 on success, -1 if an entry couldn't be allocated.
+ */
+static int bcache_fill(uint8_t drive, uint64_t lba, uint32_t count, const uint8_t *src)
+{
+    for (uint32_t j = 0; j < count; j++)
+    {
+        BufEntry *new_e = bcache_insert(drive, lba + j);
+        if (new_e == NULL)
+        {
+            return -1;
+        }
+        memcpy(new_e->data, src + (uint64_t)j * SECTOR_SIZE, SECTOR_SIZE);
+    }
+    return 0;
+}
+
+void bcache_init(size_t budget_bytes)
+{
+    for (int i = 0; i < BCACHE_HASH_SIZE; i++)
+    {
+        g_hash_tbl[i] = NULL;
+    }
+    g_lru_head = NULL;
+    g_lru_tail = NULL;
+    memset(&g_stats, 0, sizeof(BcacheStats));
+    bcache_set_budget(budget_bytes);
+
+    g_flush_buf = (uint8_t *)vmm_alloc_global(BCACHE_FLUSH_RUN * SECTOR_SIZE);
+    if (g_flush_buf == NULL)
+    {
+        kprint("BCACHE_INIT: no flush buffer, write-back goes a sector at a time\n");
+    }
+
+    g_prefetch_buf = (uint8_t *)vmm_alloc_global(BCACHE_PREFETCH_RUN * SECTOR_SIZE);
+    if (g_prefetch_buf == NULL)
+    {
+        kprint("BCACHE_INIT: no prefetch buffer, readahead is off\n");
+    }
+}
+
+/**
+ * @brief Sets how much RAM the cache may use, counting whole entries, not just their sector data.
+ * Shrinking the budget evicts (and writes back) entries right away.
+ */
+void bcache_set_budget(size_t budget_bytes)
+{
+    size_t blocks = budget_bytes / sizeof(BufEntry);
+    if (blocks < BCACHE_FLUSH_RUN)
+    {
+        blocks = BCACHE_FLUSH_RUN;
+    }
+
+    mutex_lock(&g_bcache_lock);
+    g_max_blocks = blocks;
+    g_stats.max_blocks = blocks;
+    while (g_stats.used_blocks > g_max_blocks)
+    {
+        bcache_reclaim();
+    }
+    mutex_unlock(&g_bcache_lock);
+}
+
+/**
+ * @brief Reads `count` sectors starting at `lba` into `buf`.
+ *
+ * @details MECHANISM:
+ * Cached sectors are copied straight out of the cache. Consecutive misses
+ * are grouped and fetched with a single ATA request directly into `buf`,
+ * then copied into freshly inserted cache entries.
+ *
+ * @return 0 on success, -1 if the cache couldn't allocate an entry
+ * (the data in `buf` is still valid in that case).
+ */
+int bcache_read(uint8_t drive, uint64_t lba, uint32_t count, void *buf)
+{
+    uint8_t *dst = (uint8_t *)buf;
+    int ret = 0;
+
+    mutex_lock(&g_bcache_lock);
+
+    uint32_t i = 0;
+    while (i < count)
+    {
+        BufEntry *e = bcache_lookup(drive, lba + i);
+        if (e != NULL)
+        {
+            memcpy(dst + (uint64_t)i * SECTOR_SIZE, e->data, SECTOR_SIZE);
+            lru_touch(e);
+            g_stats.hits++;
+            i++;
+            continue;
+        }
+
+        // gather the run of misses
+        uint32_t run = 1;
+        while (i + run < count && bcache_lookup(drive, lba + i + run) == NULL)
+        {
+            run++;
+        }
+
+        uint8_t *run_dst = dst + (uint64_t)i * SECTOR_SIZE;
+        ata_read_sectors((uint16_t *)run_dst, lba + i, run, drive);
+        g_stats.misses += run;
+
+        if (bcache_fill(drive, lba + i, run, run_dst) < 0)
+        {
+            ret = -1;
+        }
+
+        i += run;
+    }
+
+    mutex_unlock(&g_bcache_lock);
+    return ret;
+}
+
+/**
+ * @brief Brings `count` sectors starting at `lba` into the cache, for a read
+ * that's expected soon.
+ *
+ * @details Sectors already cached are skipped, and each run of misses is read
+ * with one multi-sector command. The prefetch never takes more than half of
+ * the cache, so it can't push out what it just brought in.
+ *
+ * @return uint32_t the number of sectors read from the disk.
+ */
+uint32_t bcache_prefetch(uint8_t drive, uint64_t lba, uint32_t count)
+{
+    if (g_prefetch_buf == NULL)
+    {
+        return 0;
+    }
+
+    mutex_lock(&g_bcache_lock);
+
+    if (count > g_max_blocks / 2)
+    {
+        count = g_max_blocks / 2;
+    }
+
+    uint32_t fetched = 0;
+    uint32_t i = 0;
+    while (i < count)
+    {
+        if (bcache_lookup(drive, lba + i) != NULL)
+        {
+            i++;
+            continue;
+        }
+
+        uint32_t run = 1;
+        while (i + run < count && run < BCACHE_PREFETCH_RUN && bcache_lookup(drive, lba + i + run) == NULL)
+        {
+            run++;
+        }
+
+        ata_read_sectors((uint16_t *)g_prefetch_buf, lba + i, run, drive);
+        if (bcache_fill(drive, lba + i, run, g_prefetch_buf) < 0)
+        {
+            break;
+        }
+        fetched += run;
+        i += run;
+    }
+
+    g_stats.prefetched += fetched;
+    mutex_unlock(&g_bcache_lock);
+    return fetched;
+}
+
+/**
+ * @brief Writes `count` full sectors from `buf` into the cache.
+ *
+ * @details The sectors are only marked dirty, the disk is updated later by
+ * eviction or `bcache_sync`. If an entry can't be allocated we fall back
+ * to a direct write so no data is lost.
+ */
+int bcache_write(uint8_t drive, uint64_t lba, uint32_t count, const void *buf)
+{
+    const uint8_t *src = (const uint8_t *)buf;
+
+    mutex_lock(&g_bcache_lock);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        BufEntry *e = bcache_lookup(drive, lba + i);
+        if (e == NULL)
+        {
+            e = bcache_insert(drive, lba + i);
+        }
+        else
+        {
+            lru_touch(e);
+        }
+
+        if (e == NULL)
+        {
+            kprint("BCACHE_WRITE: OOM, writing through\n");
+            ata_write_sectors((uint16_t *)(src + (uint64_t)i * SECTOR_SIZE), lba + i, 1, drive);
+            g_unflushed_drives |= 1 << drive;
+            continue;
+        }
+
+        memcpy(e->data, src + (uint64_t)i * SECTOR_SIZE, SECTOR_SIZE);
+        if (!e->dirty)
+        {
+            e->dirty = 1;
+            g_stats.dirty_blocks++;
+        }
+    }
+
+    mutex_unlock(&g_bcache_lock);
+    return 0;
+}
+
+/**
+ * @brief Writes every dirty sector back to the disk, then flushes the
+ * write cache of the drives that got written to, so the data is durable.
+ */
+void bcache_sync(void)
+{
+    mutex_lock(&g_bcache_lock);
+
+    BufEntry *e = g_lru_head;
+    while (e != NULL && g_stats.dirty_blocks > 0)
+    {
+        if (e->dirty)
+        {
+            bcache_writeback_run(e);
+        }
+        e = e->lru_next;
+    }
+
+    for (uint8_t drive = 0; drive < 8; drive++)
+    {
+        if (g_unflushed_drives & (1 << drive))
+        {
+            ata_flush(drive);
+        }
+    }
+    g_unflushed_drives = 0;
+
+    mutex_unlock(&g_bcache_lock);
+}
+
+void bcache_get_stats(BcacheStats *out)
+{
+    if (out == NULL)
+    {
+        return;
+    }
+    memcpy(out, &g_stats, sizeof(BcacheStats));
+}
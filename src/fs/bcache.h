@@ -0,0 +1,51 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BCACHE_DEFAULT_BUDGET (1024 * 1024) // 1 MiB of entries
+#define BCACHE_HASH_SIZE 0x100
+#define BCACHE_FLUSH_RUN 0x10        // max sectors merged into one write-back command
+#define BCACHE_FLUSH_INTERVAL 500    // ticks between periodic write-backs
+#define BCACHE_PREFETCH_RUN 0x80     // max sectors read by one prefetch command
+
+/**
+ * One cached sector.
+ * An entry lives in exactly one hash bucket (keyed by drive + lba)
+ * and in the global LRU list (head = most recently used).
+ */
+typedef struct BufEntry
+{
+    uint64_t lba;
+    uint8_t drive;
+    uint8_t dirty;
+
+    struct BufEntry *hash_next;
+    struct BufEntry *lru_prev;
+    struct BufEntry *lru_next;
+
+    uint8_t data[0x200];
+} BufEntry;
+
+typedef struct BcacheStats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;
+    uint64_t evictions;
+    uint64_t prefetched; // sectors brought in ahead of time
+    size_t used_blocks;
+    size_t max_blocks;
+    size_t dirty_blocks;
+} BcacheStats;
+
+void bcache_init(size_t budget_bytes);
+void bcache_set_budget(size_t budget_bytes);
+int bcache_read(uint8_t drive, uint64_t lba, uint32_t count, void *buf);
+int bcache_write(uint8_t drive, uint64_t lba, uint32_t count, const void *buf);
+void bcache_sync(void);
+uint32_t bcache_prefetch(uint8_t drive, uint64_t lba, uint32_t count);
+void bcache_get_stats(BcacheStats *out);
+
+#endif
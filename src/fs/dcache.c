@@ -0,0 +1,297 @@
+/**
+ * @file dcache.c
+ * @brief Directory entry cache: memoizes `finddir(parent, name)` lookups.
+ *
+ * Without it, every path walk asks the file system to scan each directory
+ * again, and every lookup hands back a brand-new vfs_node_t. With the cache,
+ * the same (parent, name) always resolves to the same node, so two opens of a
+ * file share its node and metadata. Names that don't exist are cached too
+ * (negative entries), which makes repeated failing lookups (like the shell
+ * probing for a program) cheap.
+ *
+ * Nodes are reference counted (see `vfs_node_get`/`vfs_node_put`), and an entry
+ * holds one reference on its node. An entry is only evicted when nothing else
+ * references its node, i.e. the file isn't open and none of its children is cached.
+ *
+ * The hash table and the LRU list are shared by every CPU, and guarded by
+ * g_dcache_lock.
+ */
+
+#include "dcache.h"
+#include "mem/kmalloc.h"
+#include "drivers/serial.h"
+#include "utils/spinlock.h"
+#include "../string.h"
+
+static dentry_t *g_dentry_hash[DCACHE_HASH_SIZE];
+static dentry_t *g_lru_head = NULL; // most recently used
+static dentry_t *g_lru_tail = NULL; // least recently used
+static DcacheStats g_stats;
+static spinlock_t g_dcache_lock = SPINLOCK_INIT;
+
+static uint32_t dcache_hash(vfs_node_t *parent, const char *name)
+{
+    // FNV-1a over the name, mixed with the parent's address
+    uint32_t h = 2166136261u;
+    for (const char *c = name; *c != '\0'; c++)
+    {
+        h ^= (uint8_t)*c;
+        h *= 16777619u;
+    }
+    h ^= (uint32_t)((uint64_t)parent >> 4);
+    return h & (DCACHE_HASH_SIZE - 1);
+}
+
+static dentry_t *dcache_find(vfs_node_t *parent, const char *name)
+{
+    dentry_t *d = g_dentry_hash[dcache_hash(parent, name)];
+    while (d != NULL)
+    {
+        if (d->parent == parent && strcmp(d->name, name) == 0)
+        {
+            return d;
+        }
+        d = d->hash_next;
+    }
+    return NULL;
+}
+
+static void lru_unlink(dentry_t *d)
+{
+    if (d->lru_prev != NULL)
+    {
+        d->lru_prev->lru_next = d->lru_next;
+    }
+    else
+    {
+        g_lru_head = d->lru_next;
+    }
+
+    if (d->lru_next != NULL)
+    {
+        d->lru_next->lru_prev = d->lru_prev;
+    }
+    else
+    {
+        g_lru_tail = d->lru_prev;
+    }
+
+    d->lru_prev = NULL;
+    d->lru_next = NULL;
+}
+
+static void lru_push_front(dentry_t *d)
+{
+    d->lru_prev = NULL;
+    d->lru_next = g_lru_head;
+    if (g_lru_head != NULL)
+    {
+        g_lru_head->lru_prev = d;
+    }
+    g_lru_head = d;
+    if (g_lru_tail == NULL)
+    {
+        g_lru_tail = d;
+    }
+}
+
+static void hash_remove(dentry_t *d)
+{
+    dentry_t **pp = &g_dentry_hash[dcache_hash(d->parent, d->name)];
+    while (*pp != NULL)
+    {
+        if (*pp == d)
+        {
+            *pp = d->hash_next;
+            d->hash_next = NULL;
+            return;
+        }
+        pp = &(*pp)->hash_next;
+    }
+}
+
+/**
+ * @brief Unlinks an entry from the cache and drops what it holds.
+ *
+ * @details The node is marked VFS_NODE_AUTOFREE before the entry drops its
+ * reference, so whichever `vfs_node_put` is the last, ours or a holder's on
+ * another CPU, frees it. The reference on the parent is dropped last.
+ */
+static void dcache_remove(dentry_t *d)
+{
+    hash_remove(d);
+    lru_unlink(d);
+    g_stats.entries--;
+
+    if (d->node != NULL)
+    {
+        d->node->dentry = NULL;
+        __atomic_fetch_or(&d->node->flags, VFS_NODE_AUTOFREE, __ATOMIC_RELEASE);
+        vfs_node_put(d->node);
+    }
+
+    vfs_node_put(d->parent);
+    kfree(d);
+}
+
+/**
+ * @brief Evicts least recently used entries nobody references, until there's room.
+ */
+static void dcache_reclaim(void)
+{
+    dentry_t *d = g_lru_tail;
+    while (g_stats.entries >= DCACHE_MAX_ENTRIES && d != NULL)
+    {
+        dentry_t *prev = d->lru_prev;
+        // only the entry's own reference left
+        if (d->node == NULL || __atomic_load_n(&d->node->ref_count, __ATOMIC_RELAXED) == 1)
+        {
+            dcache_remove(d);
+            g_stats.evictions++;
+        }
+        d = prev;
+    }
+}
+
+/**
+ * @brief Looks up (parent, name) in the cache.
+ *
+ * @param out_node Receives the cached node, with a reference taken,
+ * or NULL for a negative entry.
+ * @return int 1 if the cache knows the answer (positive or negative), 0 on a miss.
+ */
+int dcache_lookup(vfs_node_t *parent, const char *name, vfs_node_t **out_node)
+{
+    uint64_t rflags = spin_lock_irqsave(&g_dcache_lock);
+    dentry_t *d = dcache_find(parent, name);
+    if (d == NULL)
+    {
+        g_stats.misses++;
+        spin_unlock_irqrestore(&g_dcache_lock, rflags);
+        return 0;
+    }
+
+    lru_unlink(d);
+    lru_push_front(d);
+
+    if (d->node != NULL)
+    {
+        __atomic_fetch_add(&d->node->ref_count, 1, __ATOMIC_RELAXED);
+        g_stats.hits++;
+    }
+    else
+    {
+        g_stats.neg_hits++;
+    }
+
+    *out_node = d->node;
+    spin_unlock_irqrestore(&g_dcache_lock, rflags);
+    return 1;
+}
+
+/**
+ * @brief Caches the result of a `finddir(parent, name)`.
+ *
+ * @details If another task inserted the same name in the meantime, its node
+ * wins, and `node` is freed, so there's only ever one node per name.
+ *
+ * @param node The node found, or NULL to record that the name doesn't exist.
+ * @return vfs_node_t* The cached node with a reference taken (NULL for negative entries).
+ */
+vfs_node_t *dcache_insert(vfs_node_t *parent, const char *name, vfs_node_t *node)
+{
+    if (strlen(name) >= sizeof(((dentry_t *)0)->name))
+    {
+        // not cached
+        if (node != NULL)
+        {
+            node->flags |= VFS_NODE_AUTOFREE;
+            node->ref_count++;
+        }
+        return node;
+    }
+
+    uint64_t rflags = spin_lock_irqsave(&g_dcache_lock);
+    dentry_t *d = dcache_find(parent, name);
+    if (d != NULL)
+    {
+        if (d->node == NULL && node != NULL)
+        {
+            // the name was created since we cached it as missing
+            d->node = node;
+            node->dentry = d;
+            node->ref_count++; // the entry's
+        }
+        else if (node != NULL && d->node != node)
+        {
+            vfs_free_node(node);
+        }
+
+        if (d->node != NULL)
+        {
+            __atomic_fetch_add(&d->node->ref_count, 1, __ATOMIC_RELAXED);
+        }
+        vfs_node_t *res = d->node;
+        spin_unlock_irqrestore(&g_dcache_lock, rflags);
+        return res;
+    }
+
+    dcache_reclaim();
+
+    d = (dentry_t *)kmalloc(sizeof(dentry_t));
+    if (d == NULL)
+    {
+        spin_unlock_irqrestore(&g_dcache_lock, rflags);
+        // still usable, just not cached
+        if (node != NULL)
+        {
+            node->flags |= VFS_NODE_AUTOFREE;
+            node->ref_count++;
+        }
+        return node;
+    }
+
+    memset(d, 0, sizeof(dentry_t));
+    d->parent = parent;
+    strcpy(d->name, name);
+    d->node = node;
+    __atomic_fetch_add(&parent->ref_count, 1, __ATOMIC_RELAXED);
+
+    uint32_t h = dcache_hash(parent, name);
+    d->hash_next = g_dentry_hash[h];
+    g_dentry_hash[h] = d;
+    lru_push_front(d);
+    g_stats.entries++;
+
+    if (node != NULL)
+    {
+        node->dentry = d;
+        node->ref_count += 2; // the entry's and the caller's
+    }
+
+    spin_unlock_irqrestore(&g_dcache_lock, rflags);
+    return node;
+}
+
+/**
+ * @brief Forgets (parent, name), e.g. after it's been created or unlinked.
+ */
+void dcache_invalidate(vfs_node_t *parent, const char *name)
+{
+    uint64_t rflags = spin_lock_irqsave(&g_dcache_lock);
+    dentry_t *d = dcache_find(parent, name);
+    if (d != NULL)
+    {
+        dcache_remove(d);
+    }
+    spin_unlock_irqrestore(&g_dcache_lock, rflags);
+}
+
+void dcache_get_stats(DcacheStats *out)
+{
+    if (out == NULL)
+    {
+        return;
+    }
+    memcpy(out, &g_stats, sizeof(DcacheStats));
+}
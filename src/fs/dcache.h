@@ -0,0 +1,41 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "fs/vfs.h"
+#include <stdint.h>
+
+#define DCACHE_MAX_ENTRIES 0x100
+#define DCACHE_HASH_SIZE 0x40
+
+/**
+ * A cached result of `finddir(parent, name)`.
+ * `node` is NULL for a negative entry (the name is known not to exist).
+ * Every entry holds a reference on its parent, so a directory can't be
+ * evicted while some of its children are still cached.
+ */
+typedef struct dentry
+{
+    vfs_node_t *parent;
+    char name[128];
+    vfs_node_t *node;
+
+    struct dentry *hash_next;
+    struct dentry *lru_prev;
+    struct dentry *lru_next;
+} dentry_t;
+
+typedef struct DcacheStats
+{
+    uint64_t hits;
+    uint64_t neg_hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint32_t entries;
+} DcacheStats;
+
+int dcache_lookup(vfs_node_t *parent, const char *name, vfs_node_t **out_node);
+vfs_node_t *dcache_insert(vfs_node_t *parent, const char *name, vfs_node_t *node);
+void dcache_invalidate(vfs_node_t *parent, const char *name);
+void dcache_get_stats(DcacheStats *out);
+
+#endif
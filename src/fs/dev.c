@@ -91,8 +91,9 @@ uint64_t stdin_read(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *b
                 keyboard_set_waiting(pid);
             }
 
-            sti();
+            // still with interrupts off, so no key can slip in before we sleep
             sched_block();
+            sti();
         }
 
         buf[i] = c;
@@ -143,13 +144,15 @@ static vfs_fs_ops_t stdin_ops =
  */
 void dev_init_stdio()
 {
-    g_stdin_node = kmalloc(sizeof(vfs_node_t));
+    g_stdin_node = (vfs_node_t *)kmem_cache_alloc(&g_vfs_node_cache);
+    memset(g_stdin_node, 0, sizeof(vfs_node_t));
     strcpy(g_stdin_node->name, "stdin");
     g_stdin_node->flags = VFS_CHAR_DEVICE;
     g_stdin_node->length = 0;
     g_stdin_node->ops = &stdin_ops;
 
-    g_stdout_node = kmalloc(sizeof(vfs_node_t));
+    g_stdout_node = (vfs_node_t *)kmem_cache_alloc(&g_vfs_node_cache);
+    memset(g_stdout_node, 0, sizeof(vfs_node_t));
     strcpy(g_stdout_node->name, "stdout");
     g_stdout_node->flags = VFS_CHAR_DEVICE;
     g_stdout_node->length = 0;
@@ -164,27 +167,33 @@ void dev_attach_stdio(file_handle_t **fd_tbl)
     }
 
     // FD 0: stdin
-    file_handle_t *h_in = kmalloc(sizeof(file_handle_t));
+    file_handle_t *h_in = (file_handle_t *)kmem_cache_alloc(&g_file_handle_cache);
+    vfs_node_get(g_stdin_node);
     h_in->node = g_stdin_node;
     h_in->offset = 0;
     h_in->mode = 1; // read mode
     h_in->ref_count = 1;
+    h_in->mount = NULL;
     fd_tbl[0] = h_in;
 
     // FD 1: stdout
-    file_handle_t *h_out = kmalloc(sizeof(file_handle_t));
+    file_handle_t *h_out = (file_handle_t *)kmem_cache_alloc(&g_file_handle_cache);
+    vfs_node_get(g_stdout_node);
     h_out->node = g_stdout_node;
     h_out->offset = 0;
     h_out->mode = 2; // write mode
     h_out->ref_count = 1;
+    h_out->mount = NULL;
     fd_tbl[1] = h_out;
 
     // FD 2: stderr (temporary shared with stdout :3 )
-    file_handle_t *h_err = kmalloc(sizeof(file_handle_t));
+    file_handle_t *h_err = (file_handle_t *)kmem_cache_alloc(&g_file_handle_cache);
+    vfs_node_get(g_stdout_node);
     h_err->node = g_stdout_node;
     h_err->offset = 0;
     h_err->mode = 2;
     h_err->ref_count = 1;
+    h_err->mount = NULL;
     fd_tbl[2] = h_err;
 }
 
@@ -1,13 +1,18 @@
 #include "fat32.h"
 #include "drivers/ata.h"
+#include "fs/bcache.h"
 #include "string.h"
 #include "fs/vfs.h"
 #include "mem/kmalloc.h"
 #include "mem/vmm.h"
 #include "drivers/serial.h"
 #include "utils/math.h"
+#include "utils/asm_instrs.h"
+#include "sched/sched.h"
+#include "sched/mutex.h"
 
 #define EOC 0x0FFFFFF8
+#define FAT32_SCRATCH_BUFS 4 // cluster-sized scratch buffers kept for the mount
 
 static fat32_bpb g_bpb;
 static uint32_t g_data_start_lba;
@@ -15,6 +20,24 @@ static uint32_t g_partition_lba;
 static uint8_t g_drive_sel;
 static uint64_t g_bytes_per_cluster;
 
+/*
+ * In-memory copy of the first FAT.
+ * `g_free_bitmap` has one bit per cluster (1 = in use), `g_fat_dirty` one bit
+ * per FAT sector that changed since the last flush.
+ */
+static uint32_t *g_fat = NULL;
+static uint64_t *g_free_bitmap = NULL;
+static uint8_t *g_fat_dirty = NULL;
+static uint32_t g_total_clusters; // valid cluster ids are [2, g_total_clusters)
+static uint32_t g_next_free_hint = 2;
+static uint32_t g_free_count;
+
+static uint8_t *g_scratch_pool[FAT32_SCRATCH_BUFS];
+static mutex_t g_scratch_locks[FAT32_SCRATCH_BUFS]; // one per pool buffer
+static uint32_t g_scratch_next = 0;                  // the buffer to wait for when all are taken
+
+static mutex_t g_fat32_lock = MUTEX_INIT; // the mount lock, see fat32_lock
+
 /**
  * @brief Converts a Cluster Number to a Physical LBA (Logical Block Address).
  *
@@ -40,9 +63,33 @@ static inline uint32_t fat32_cluster_to_lba(uint32_t cluster)
     return g_data_start_lba + (cluster - 2) * (uint32_t)g_bpb.sectors_per_cluster;
 }
 
+/**
+ * @brief Takes the mount for the current task.
+ *
+ * @details The in-memory FAT, the free bitmap and the extent maps of the nodes
+ * are shared by every task, and the paths updating them wait for the disk, so
+ * a spinlock won't do. Like the block cache, the mount is owned by one task at
+ * a time and the others sleep until it's done. Every VFS entry point takes it;
+ * the `_locked` functions and the FAT helpers expect it held.
+ */
+static void fat32_lock(void)
+{
+    mutex_lock(&g_fat32_lock);
+}
+
+static void fat32_unlock(void)
+{
+    mutex_unlock(&g_fat32_lock);
+}
+
 /* START: VFS */
 
 extern vfs_fs_ops_t fat32_ops;
+static int fat32_sync_locked(vfs_node_t *node);
+static void fat32_release(vfs_node_t *node);
+static int fat32_readdir_locked(vfs_node_t *node, uint32_t idx, dirent_t *out);
+static vfs_node_t *fat32_create_locked(vfs_node_t *parent, const char *fname, uint32_t flags);
+static void fat32_unlink_locked(vfs_node_t *node);
 
 /**
  * @brief VFS Find Directory: Looks for a child file within a node.
@@ -52,7 +99,7 @@ extern vfs_fs_ops_t fat32_ops;
  * If found, it creates a new `vfs_node_t`, populates it with the file's
  * metadata (size, start cluster), and returns it.
  */
-static vfs_node_t *fat32_finddir(vfs_node_t *node, const char *name)
+static vfs_node_t *fat32_finddir_locked(vfs_node_t *node, const char *name)
 {
     fat32_node_data *node_data = (fat32_node_data *)node->device_data;
     uint32_t cluster = node_data->first_cluster;
@@ -65,20 +112,22 @@ static vfs_node_t *fat32_finddir(vfs_node_t *node, const char *name)
         return NULL;
     }
 
-    vfs_node_t *new_node = (vfs_node_t *)kmalloc(sizeof(vfs_node_t));
+    vfs_node_t *new_node = (vfs_node_t *)kmem_cache_alloc(&g_vfs_node_cache);
     if (new_node == NULL)
     {
         kprint("FAT32_FINDDIR failed: OOM\n");
         return NULL;
     }
+    memset(new_node, 0, sizeof(vfs_node_t));
 
     fat32_node_data *new_node_data = (fat32_node_data *)kmalloc(sizeof(fat32_node_data));
     if (new_node_data == NULL)
     {
         kprint("FAT32_FINDDIR failed: OOM\n");
-        kfree(new_node);
+        kmem_cache_free(&g_vfs_node_cache, new_node);
         return NULL;
     }
+    memset(new_node_data, 0, sizeof(fat32_node_data));
 
     strcpy(new_node->name, name);
     new_node->length = dir_entry.file_size;
@@ -95,21 +144,259 @@ static vfs_node_t *fat32_finddir(vfs_node_t *node, const char *name)
     return new_node;
 }
 
+/**
+ * @brief Appends one disk cluster at the end of a node's extent map.
+ * If it directly follows the last run on the disk, the run just grows.
+ */
+static int fat32_extent_push(fat32_node_data *data, uint32_t disk_cluster)
+{
+    if (data->extent_count > 0)
+    {
+        fat32_extent_t *last = &data->extents[data->extent_count - 1];
+        if (last->disk_cluster + last->len == disk_cluster)
+        {
+            last->len++;
+            data->mapped_clusters++;
+            return 0;
+        }
+    }
+
+    if (data->extent_count == data->extent_cap)
+    {
+        uint32_t new_cap = data->extent_cap == 0 ? 4 : data->extent_cap * 2;
+        fat32_extent_t *new_ext = (fat32_extent_t *)kmalloc(new_cap * sizeof(fat32_extent_t));
+        if (new_ext == NULL)
+        {
+            return -1;
+        }
+        if (data->extents != NULL)
+        {
+            memcpy(new_ext, data->extents, data->extent_count * sizeof(fat32_extent_t));
+            kfree(data->extents);
+        }
+        data->extents = new_ext;
+        data->extent_cap = new_cap;
+    }
+
+    fat32_extent_t *ext = &data->extents[data->extent_count++];
+    ext->file_cluster = data->mapped_clusters;
+    ext->disk_cluster = disk_cluster;
+    ext->len = 1;
+    data->mapped_clusters++;
+    return 0;
+}
+
+/**
+ * @brief Walks the part of the cluster chain that isn't in the extent map yet.
+ *
+ * @details On the first call, the walk starts at `first_cluster`. Afterwards it
+ * resumes right after the last mapped cluster, so clusters appended to the
+ * file are picked up without walking the chain again from the start.
+ */
+static int fat32_load_extents(fat32_node_data *data)
+{
+    uint32_t curr_cluster;
+    if (data->extent_count == 0)
+    {
+        curr_cluster = data->first_cluster;
+    }
+    else
+    {
+        fat32_extent_t *last = &data->extents[data->extent_count - 1];
+        curr_cluster = fat32_read_fat(last->disk_cluster + last->len - 1);
+    }
+
+    while (curr_cluster >= 2 && curr_cluster < EOC)
+    {
+        if (fat32_extent_push(data, curr_cluster) < 0)
+        {
+            kprint("FAT32_LOAD_EXTENTS failed: OOM\n");
+            return -1;
+        }
+        curr_cluster = fat32_read_fat(curr_cluster);
+    }
+
+    return 0;
+}
+
+static void fat32_free_extents(fat32_node_data *data)
+{
+    if (data->extents != NULL)
+    {
+        kfree(data->extents);
+    }
+    data->extents = NULL;
+    data->extent_count = 0;
+    data->extent_cap = 0;
+    data->mapped_clusters = 0;
+}
+
+/**
+ * @brief Resolves a cluster index inside a file to its cluster on the disk.
+ *
+ * @details MECHANISM:
+ * Binary search over the extent map for the run holding `file_cluster`.
+ * The map is extended first if the index is past what's been mapped so far.
+ *
+ * @param data The node's FAT32 data.
+ * @param file_cluster Cluster index inside the file (offset / bytes_per_cluster).
+ * @param out_run Receives how many clusters, starting at the returned one, are contiguous on the disk.
+ * @return uint32_t The disk cluster, or 0 if the file is shorter than that.
+ */
+static uint32_t fat32_map_cluster(fat32_node_data *data, uint32_t file_cluster, uint32_t *out_run)
+{
+    if (file_cluster >= data->mapped_clusters)
+    {
+        fat32_load_extents(data);
+        if (file_cluster >= data->mapped_clusters)
+        {
+            return 0;
+        }
+    }
+
+    uint32_t lo = 0;
+    uint32_t hi = data->extent_count;
+    while (lo + 1 < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (data->extents[mid].file_cluster <= file_cluster)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    fat32_extent_t *ext = &data->extents[lo];
+    uint32_t idx = file_cluster - ext->file_cluster;
+    *out_run = ext->len - idx;
+    return ext->disk_cluster + idx;
+}
+
+/**
+ * @brief Takes a cluster-sized scratch buffer from the mount's pool.
+ *
+ * @details The pool is allocated once in `fat32_init_fs`, so the read/write
+ * paths don't map and unmap fresh pages on every call. If every buffer is
+ * taken, we sleep until one of them, picked in turn, is released.
+ */
+static uint8_t *fat32_scratch_get(void)
+{
+    for (int i = 0; i < FAT32_SCRATCH_BUFS; i++)
+    {
+        if (mutex_trylock(&g_scratch_locks[i]))
+        {
+            return g_scratch_pool[i];
+        }
+    }
+
+    uint32_t i = __atomic_fetch_add(&g_scratch_next, 1, __ATOMIC_RELAXED) % FAT32_SCRATCH_BUFS;
+    mutex_lock(&g_scratch_locks[i]);
+    return g_scratch_pool[i];
+}
+
+static void fat32_scratch_put(uint8_t *buf)
+{
+    for (int i = 0; i < FAT32_SCRATCH_BUFS; i++)
+    {
+        if (g_scratch_pool[i] == buf)
+        {
+            mutex_unlock(&g_scratch_locks[i]);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Reads `len` bytes from the disk, starting `sec_off` bytes into sector `lba`.
+ *
+ * @details Whole sectors go straight into `dst`. Only a partially covered
+ * head or tail sector passes through `scratch`.
+ */
+static void fat32_read_span(uint32_t lba, uint64_t sec_off, uint64_t len, uint8_t *dst, uint8_t *scratch)
+{
+    if (sec_off != 0 || len < SECTOR_SIZE)
+    {
+        uint64_t n = uint64_min(len, SECTOR_SIZE - sec_off);
+        bcache_read(g_drive_sel, lba, 1, scratch);
+        memcpy(dst, scratch + sec_off, n);
+        dst += n;
+        len -= n;
+        lba++;
+    }
+
+    uint32_t full = len / SECTOR_SIZE;
+    if (full > 0)
+    {
+        bcache_read(g_drive_sel, lba, full, dst);
+        dst += (uint64_t)full * SECTOR_SIZE;
+        len -= (uint64_t)full * SECTOR_SIZE;
+        lba += full;
+    }
+
+    if (len > 0)
+    {
+        bcache_read(g_drive_sel, lba, 1, scratch);
+        memcpy(dst, scratch, len);
+    }
+}
+
+/**
+ * @brief Writes `len` bytes to the disk, starting `sec_off` bytes into sector `lba`.
+ *
+ * @details Whole sectors are written straight from `src`. A partially covered
+ * head or tail sector is read into `scratch` first (Read-Modify-Write).
+ */
+static void fat32_write_span(uint32_t lba, uint64_t sec_off, uint64_t len, const uint8_t *src, uint8_t *scratch)
+{
+    if (sec_off != 0 || len < SECTOR_SIZE)
+    {
+        uint64_t n = uint64_min(len, SECTOR_SIZE - sec_off);
+        bcache_read(g_drive_sel, lba, 1, scratch);
+        memcpy(scratch + sec_off, src, n);
+        bcache_write(g_drive_sel, lba, 1, scratch);
+        src += n;
+        len -= n;
+        lba++;
+    }
+
+    uint32_t full = len / SECTOR_SIZE;
+    if (full > 0)
+    {
+        bcache_write(g_drive_sel, lba, full, src);
+        src += (uint64_t)full * SECTOR_SIZE;
+        len -= (uint64_t)full * SECTOR_SIZE;
+        lba += full;
+    }
+
+    if (len > 0)
+    {
+        bcache_read(g_drive_sel, lba, 1, scratch);
+        memcpy(scratch, src, len);
+        bcache_write(g_drive_sel, lba, 1, scratch);
+    }
+}
+
 /**
  * @brief VFS Read: Reads data from a file into a buffer.
  *
- * @details MECHANISM (Cluster Chasing):
- * 1. Start at the file's `first_cluster`.
- * 2. Traverse the FAT chain to skip clusters until reaching `offset`.
- * 3. Read data cluster-by-cluster, copying it into `buffer`.
- * 4. Use `fat32_read_fat` to jump to the next cluster in the chain.
+ * @details MECHANISM (Extent Map):
+ * 1. Resolve the cluster holding `offset` through the node's extent map,
+ * no FAT chain walking from `first_cluster` needed.
+ * 2. The extent also tells how many following clusters are contiguous on
+ * the disk, so the whole run (limited to the requested range) is read with
+ * a single multi-sector transfer.
+ * 3. Whole sectors land directly in `buffer`, only a partial head or tail
+ * sector goes through a scratch buffer.
  *
  * @param node The file node to read from.
  * @param offset The byte offset to start reading.
  * @param size How many bytes to read.
  * @param buffer The destination buffer.
  */
-static uint64_t fat32_read(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer)
+static uint64_t fat32_read_locked(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer)
 {
     if (offset >= node->length)
     {
@@ -122,37 +409,75 @@ static uint64_t fat32_read(vfs_node_t *node, uint64_t offset, uint64_t size, uin
     }
 
     fat32_node_data *node_data = (fat32_node_data *)(node->device_data);
-    uint32_t curr_cluster = node_data->first_cluster;
+    uint8_t *scratch = fat32_scratch_get();
 
-    for (uint64_t i = 0; i < offset / g_bytes_per_cluster; i++)
+    uint64_t rem_size = size;
+    uint64_t pos = offset;
+    while (rem_size > 0)
     {
-        curr_cluster = fat32_read_fat(curr_cluster);
+        uint32_t run;
+        uint32_t cluster = fat32_map_cluster(node_data, pos / g_bytes_per_cluster, &run);
+        if (cluster == 0)
+        {
+            kprint("FAT32_READ failed: cluster chain is shorter than the file\n");
+            break;
+        }
+
+        // the part of [pos, pos + rem_size) that lies in this run
+        uint64_t in_cluster = pos % g_bytes_per_cluster;
+        uint64_t copy_size = uint64_min(rem_size, (uint64_t)run * g_bytes_per_cluster - in_cluster);
+        uint32_t lba = fat32_cluster_to_lba(cluster) + in_cluster / SECTOR_SIZE;
+
+        fat32_read_span(lba, in_cluster % SECTOR_SIZE, copy_size, buffer, scratch);
+
+        buffer += copy_size;
+        rem_size -= copy_size;
+        pos += copy_size;
     }
 
-    uint32_t read_offset = offset % g_bytes_per_cluster;
+    fat32_scratch_put(scratch);
+    return size - rem_size;
+}
 
-    uint8_t *tmp_buf = (uint8_t *)vmm_alloc(g_bytes_per_cluster);
-    if (tmp_buf == NULL)
+/**
+ * @brief Prefetches the sectors holding [offset, offset + size) of the file
+ * into the block cache. Each contiguous run of clusters is one command.
+ */
+static void fat32_readahead_locked(vfs_node_t *node, uint64_t offset, uint64_t size)
+{
+    if (offset >= node->length)
     {
-        kprint("FAT32_READ failed: OOM\n");
-        return 0;
+        return;
+    }
+
+    if (offset + size > node->length)
+    {
+        size = node->length - offset;
     }
 
+    fat32_node_data *node_data = (fat32_node_data *)(node->device_data);
+
     uint64_t rem_size = size;
+    uint64_t pos = offset;
     while (rem_size > 0)
     {
-        uint64_t copy_size = uint64_min(rem_size, g_bytes_per_cluster - read_offset);
-        uint32_t lba = fat32_cluster_to_lba(curr_cluster);
-        ata_read_sectors((uint16_t *)tmp_buf, lba, g_bpb.sectors_per_cluster, g_drive_sel);
-        memcpy(buffer, tmp_buf + read_offset, copy_size);
-        buffer += copy_size;
-        rem_size -= copy_size;
-        read_offset = 0;
-        curr_cluster = fat32_read_fat(curr_cluster);
-    }
+        uint32_t run;
+        uint32_t cluster = fat32_map_cluster(node_data, pos / g_bytes_per_cluster, &run);
+        if (cluster == 0)
+        {
+            break;
+        }
+
+        uint64_t in_cluster = pos % g_bytes_per_cluster;
+        uint64_t span = uint64_min(rem_size, (uint64_t)run * g_bytes_per_cluster - in_cluster);
+        uint32_t lba = fat32_cluster_to_lba(cluster) + in_cluster / SECTOR_SIZE;
+        uint32_t sectors = (in_cluster % SECTOR_SIZE + span + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+        bcache_prefetch(g_drive_sel, lba, sectors);
 
-    vmm_free(tmp_buf);
-    return size;
+        rem_size -= span;
+        pos += span;
+    }
 }
 
 static void fat32_update_size(vfs_node_t *node, uint64_t new_size)
@@ -162,10 +487,10 @@ static void fat32_update_size(vfs_node_t *node, uint64_t new_size)
     uint8_t tmp_buf[SECTOR_SIZE];
     memset(tmp_buf, 0, SECTOR_SIZE);
 
-    ata_read_sectors((uint16_t *)tmp_buf, node_data->sector_lba, 1, g_drive_sel);
+    bcache_read(g_drive_sel, node_data->sector_lba, 1, tmp_buf);
     DirectoryEntry *dir_entry = (DirectoryEntry *)(tmp_buf + node_data->offset);
     dir_entry->file_size = (uint32_t)new_size;
-    ata_write_sectors((uint16_t *)tmp_buf, node_data->sector_lba, 1, g_drive_sel);
+    bcache_write(g_drive_sel, node_data->sector_lba, 1, tmp_buf);
     node->length = new_size;
 }
 
@@ -179,18 +504,20 @@ static void fat32_update_size(vfs_node_t *node, uint64_t new_size)
  * - Checks if the write goes beyond the current file size (`node->length`).
  * - If the file is empty (`first_cluster == 0`), it allocates the first cluster
  * and updates the Directory Entry on the disk.
- * - If the file exists but needs more space, it traverses the FAT chain to the
- * end, calculates how many new clusters are needed, and appends them to the chain.
+ * - If the file exists but needs more space, the extent map gives the last
+ * cluster, and the missing clusters are appended to the chain in one go.
  * - Updates the file size in the Directory Entry via `fat32_update_size`.
  *
  * 2. DATA WRITING (Read-Modify-Write):
- * - Traverses the FAT chain to find the start cluster corresponding to `offset`.
- * - Since FAT32 works with clusters (e.g., 4096 bytes), we cannot write just a few bytes
- * directly without overwriting the rest of the sector/cluster with garbage.
- * - We perform a Read-Modify-Write cycle:
- * a. READ the entire cluster from disk into a buffer.
+ * - Resolves the cluster corresponding to `offset` through the extent map,
+ * and writes each contiguous run with a single multi-sector transfer.
+ * - The disk only writes full sectors, so we cannot write just a few bytes
+ * directly without overwriting the rest of the sector with garbage.
+ * - Whole sectors are written directly from `buffer`. Only the partially
+ * covered first and last sectors go through a Read-Modify-Write cycle:
+ * a. READ the sector into a scratch buffer.
  * b. MODIFY only the requested bytes in the buffer.
- * c. WRITE the entire buffer back to disk.
+ * c. WRITE the sector back.
  *
  * @param node   The file node to write to.
  * @param offset The offset in bytes where writing begins.
@@ -198,7 +525,7 @@ static void fat32_update_size(vfs_node_t *node, uint64_t new_size)
  * @param buffer The source buffer containing data.
  * @return uint64_t The number of bytes successfully written.
  */
-static uint64_t fat32_write(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer)
+static uint64_t fat32_write_locked(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer)
 {
     fat32_node_data *node_data = (fat32_node_data *)(node->device_data);
 
@@ -206,101 +533,143 @@ static uint64_t fat32_write(vfs_node_t *node, uint64_t offset, uint64_t size, ui
     {
         uint8_t tmp_buf[SECTOR_SIZE];
 
+        uint32_t needed_clusters = (offset + size + g_bytes_per_cluster - 1) / g_bytes_per_cluster;
+        if (needed_clusters == 0)
+        {
+            needed_clusters = 1;
+        }
+
         if (node_data->first_cluster == 0) // A brand new file, so no cluster attached
         {
-            int64_t free_cluster_id = fat32_find_free_cluster();
+            int64_t free_cluster_id = fat32_alloc_clusters(0, needed_clusters);
             if (free_cluster_id < 0)
             {
-                kprint("FAT32_CREATE failed: No free cluster id found!\n");
+                kprint("FAT32_WRITE failed: No free cluster id found!\n");
                 return 0;
             }
 
-            ata_read_sectors((uint16_t *)tmp_buf, node_data->sector_lba, 1, g_drive_sel);
+            bcache_read(g_drive_sel, node_data->sector_lba, 1, tmp_buf);
             DirectoryEntry *dirent = (DirectoryEntry *)(tmp_buf + node_data->offset);
             dirent->first_cluster_high = (free_cluster_id >> 16) & 0xFFFF;
             dirent->first_cluster_low = free_cluster_id & 0xFFFF;
-            ata_write_sectors((uint16_t *)tmp_buf, node_data->sector_lba, 1, g_drive_sel);
+            bcache_write(g_drive_sel, node_data->sector_lba, 1, tmp_buf);
 
-            fat32_write_fat_entry(free_cluster_id, EOC);
             node_data->first_cluster = free_cluster_id;
         }
         else // file exists, but content overflows
         {
-            uint32_t curr_cluster = node_data->first_cluster;
-            uint32_t prev_cluster = 0;
-            uint32_t cluster_count = 0;
-            while (curr_cluster >= 2 && curr_cluster < EOC)
-            {
-                prev_cluster = curr_cluster;
-                curr_cluster = fat32_read_fat(curr_cluster);
-                cluster_count++;
-            }
-
-            if (prev_cluster < 2)
+            fat32_load_extents(node_data);
+            uint32_t cluster_count = node_data->mapped_clusters;
+            if (cluster_count == 0)
             {
                 kprint("FAT32_WRITE failed: failed trace last cluster of a file\n");
                 return 0;
             }
 
-            uint32_t occupied_cluster_bytes = cluster_count * g_bytes_per_cluster;
-            if ((offset + size) >= occupied_cluster_bytes)
+            if (needed_clusters > cluster_count)
             {
-                uint32_t size_left = (offset + size) - occupied_cluster_bytes;
-                uint32_t cluster_count_left = (size_left + g_bytes_per_cluster - 1) / g_bytes_per_cluster;
-
-                for (uint32_t i = 0; i < cluster_count_left; i++)
+                fat32_extent_t *last = &node_data->extents[node_data->extent_count - 1];
+                uint32_t prev_cluster = last->disk_cluster + last->len - 1;
+                if (fat32_alloc_clusters(prev_cluster, needed_clusters - cluster_count) < 0)
                 {
-                    int64_t free_cluster_id = fat32_find_free_cluster();
-                    if (free_cluster_id < 0)
-                    {
-                        kprint("FAT32_CREATE failed: No free cluster id found!\n");
-                        return 0;
-                    }
-
-                    fat32_write_fat_entry(prev_cluster, free_cluster_id);
-                    prev_cluster = free_cluster_id;
+                    kprint("FAT32_WRITE failed: No free cluster id found!\n");
+                    return 0;
                 }
-
-                fat32_write_fat_entry(prev_cluster, EOC);
             }
         }
 
         fat32_update_size(node, offset + size);
     }
 
-    uint32_t curr_cluster = node_data->first_cluster;
+    uint8_t *scratch = fat32_scratch_get();
 
-    for (uint64_t i = 0; i < offset / g_bytes_per_cluster; i++)
+    uint64_t rem_size = size;
+    uint64_t pos = offset;
+    while (rem_size > 0)
     {
-        curr_cluster = fat32_read_fat(curr_cluster);
-    }
+        uint32_t run;
+        uint32_t cluster = fat32_map_cluster(node_data, pos / g_bytes_per_cluster, &run);
+        if (cluster == 0)
+        {
+            kprint("FAT32_WRITE failed: cluster chain is shorter than the file\n");
+            break;
+        }
 
-    uint32_t read_offset = offset % g_bytes_per_cluster;
+        uint64_t in_cluster = pos % g_bytes_per_cluster;
+        uint64_t copy_size = uint64_min(rem_size, (uint64_t)run * g_bytes_per_cluster - in_cluster);
+        uint32_t lba = fat32_cluster_to_lba(cluster) + in_cluster / SECTOR_SIZE;
 
-    uint8_t *tmp_buf = (uint8_t *)vmm_alloc(g_bytes_per_cluster);
-    if (tmp_buf == NULL)
-    {
-        kprint("FAT32_READ failed: OOM\n");
-        return 0;
-    }
-    memset(tmp_buf, 0, g_bytes_per_cluster);
+        fat32_write_span(lba, in_cluster % SECTOR_SIZE, copy_size, buffer, scratch);
 
-    uint64_t rem_size = size;
-    while (rem_size > 0)
-    {
-        uint64_t copy_size = uint64_min(rem_size, g_bytes_per_cluster - read_offset);
-        uint32_t lba = fat32_cluster_to_lba(curr_cluster);
-        ata_read_sectors((uint16_t *)tmp_buf, lba, g_bpb.sectors_per_cluster, g_drive_sel);
-        memcpy(tmp_buf + read_offset, buffer, copy_size);
-        ata_write_sectors((uint16_t *)tmp_buf, lba, g_bpb.sectors_per_cluster, g_drive_sel);
         buffer += copy_size;
         rem_size -= copy_size;
-        read_offset = 0;
-        curr_cluster = fat32_read_fat(curr_cluster);
+        pos += copy_size;
     }
 
-    vmm_free(tmp_buf);
-    return size;
+    fat32_scratch_put(scratch);
+    return size - rem_size;
+}
+
+static vfs_node_t *fat32_finddir(vfs_node_t *node, const char *name)
+{
+    fat32_lock();
+    vfs_node_t *found = fat32_finddir_locked(node, name);
+    fat32_unlock();
+    return found;
+}
+
+static uint64_t fat32_read(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer)
+{
+    fat32_lock();
+    uint64_t done = fat32_read_locked(node, offset, size, buffer);
+    fat32_unlock();
+    return done;
+}
+
+static void fat32_readahead(vfs_node_t *node, uint64_t offset, uint64_t size)
+{
+    fat32_lock();
+    fat32_readahead_locked(node, offset, size);
+    fat32_unlock();
+}
+
+static uint64_t fat32_write(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer)
+{
+    fat32_lock();
+    uint64_t done = fat32_write_locked(node, offset, size, buffer);
+    fat32_unlock();
+    return done;
+}
+
+static int fat32_sync(vfs_node_t *node)
+{
+    fat32_lock();
+    int ret = fat32_sync_locked(node);
+    fat32_unlock();
+    return ret;
+}
+
+int fat32_readdir(vfs_node_t *node, uint32_t idx, dirent_t *out)
+{
+    fat32_lock();
+    int ret = fat32_readdir_locked(node, idx, out);
+    fat32_unlock();
+    return ret;
+}
+
+vfs_node_t *fat32_create(vfs_node_t *parent, const char *fname, uint32_t flags)
+{
+    fat32_lock();
+    vfs_node_t *created = fat32_create_locked(parent, fname, flags);
+    fat32_unlock();
+    return created;
+}
+
+void fat32_unlink(vfs_node_t *node)
+{
+    fat32_lock();
+    fat32_unlink_locked(node);
+    fat32_unlock();
 }
 
 vfs_fs_ops_t fat32_ops = {
@@ -312,34 +681,182 @@ vfs_fs_ops_t fat32_ops = {
     .close = NULL,
     .create = fat32_create,
     .unlink = fat32_unlink,
+    .sync = fat32_sync,
+    .release = fat32_release,
+    .readahead = fat32_readahead,
 };
 
 /* END: VFS */
 
+static inline void fat32_mark_used(uint32_t cluster)
+{
+    g_free_bitmap[cluster / 64] |= (1ULL << (cluster % 64));
+}
+
+static inline void fat32_mark_free(uint32_t cluster)
+{
+    g_free_bitmap[cluster / 64] &= ~(1ULL << (cluster % 64));
+}
+
+static inline int fat32_is_used(uint32_t cluster)
+{
+    return (g_free_bitmap[cluster / 64] >> (cluster % 64)) & 1;
+}
+
 /**
  * @brief Reads the next cluster in the chain from the FAT Table.
  *
  * @details MECHANISM:
- * The FAT Table is an array of 32-bit integers stored sequentially on disk.
- * To find the entry for a specific cluster:
- * 1. Calculate the byte offset: cluster_index * 4 bytes.
- * 2. Locate the specific Sector (Page) in the FAT Region containing this offset.
- * 3. Read that Sector into a buffer.
- * 4. Extract the 4-byte value at the calculated offset within that sector.
+ * The whole FAT is loaded into `g_fat` at mount time, so looking up the
+ * next cluster is just an array access, no disk I/O involved.
  *
  * @param cluster The current cluster number (index).
  * @return uint32_t The next cluster number, or EOC (0x0FFFFFFF) if end of chain.
  */
 uint32_t fat32_read_fat(uint32_t cluster)
 {
-    uint32_t fat_offset = cluster * sizeof(uint32_t);
-    uint32_t fat_sector = g_bpb.reserved_sectors + (fat_offset / g_bpb.bytes_per_sector);
-    uint32_t ent_offset = fat_offset % g_bpb.bytes_per_sector;
+    if (cluster >= g_total_clusters)
+    {
+        return 0x0FFFFFFF;
+    }
+
+    return g_fat[cluster] & 0x0FFFFFFF;
+}
+
+/**
+ * @brief Loads the first FAT into memory and builds the free-cluster bitmap.
+ *
+ * @details MECHANISM:
+ * 1. Allocates room for `sectors_per_fat32` sectors and reads the FAT once.
+ * 2. Computes how many clusters the data region really has, since the
+ * FAT is usually a bit larger than needed.
+ * 3. Sets a bit in `g_free_bitmap` for every cluster whose entry is not 0.
+ * Clusters 0 and 1 are reserved, so they're always marked as used.
+ *
+ * @return int 0 on success, -1 on OOM.
+ */
+static int fat32_load_fat(void)
+{
+    uint64_t fat_bytes = (uint64_t)g_bpb.sectors_per_fat32 * SECTOR_SIZE;
+    g_fat = (uint32_t *)vmm_alloc_global(fat_bytes);
+    if (g_fat == NULL)
+    {
+        return -1;
+    }
+
+    uint32_t fat_start_lba = g_partition_lba + g_bpb.reserved_sectors;
+    uint32_t sec_done = 0;
+    while (sec_done < g_bpb.sectors_per_fat32)
+    {
+        uint32_t cnt = uint32_min(g_bpb.sectors_per_fat32 - sec_done, 0x80);
+        bcache_read(g_drive_sel, fat_start_lba + sec_done, cnt, (uint8_t *)g_fat + (uint64_t)sec_done * SECTOR_SIZE);
+        sec_done += cnt;
+    }
+
+    uint32_t total_sectors = g_bpb.total_sectors_32 != 0 ? g_bpb.total_sectors_32 : g_bpb.total_sectors_16;
+    uint32_t data_sectors = total_sectors - (g_data_start_lba - g_partition_lba);
+    g_total_clusters = data_sectors / g_bpb.sectors_per_cluster + 2;
+    g_total_clusters = uint32_min(g_total_clusters, (uint32_t)(fat_bytes / sizeof(uint32_t)));
+
+    uint64_t bitmap_bytes = ((g_total_clusters + 63) / 64) * sizeof(uint64_t);
+    g_free_bitmap = (uint64_t *)vmm_alloc_global(bitmap_bytes);
+    g_fat_dirty = (uint8_t *)kmalloc((g_bpb.sectors_per_fat32 + 7) / 8);
+    if (g_free_bitmap == NULL || g_fat_dirty == NULL)
+    {
+        return -1;
+    }
+    memset(g_free_bitmap, 0, bitmap_bytes);
+    memset(g_fat_dirty, 0, (g_bpb.sectors_per_fat32 + 7) / 8);
+
+    g_free_count = 0;
+    fat32_mark_used(0);
+    fat32_mark_used(1);
+    for (uint32_t c = 2; c < g_total_clusters; c++)
+    {
+        if ((g_fat[c] & 0x0FFFFFFF) != 0)
+        {
+            fat32_mark_used(c);
+        }
+        else
+        {
+            g_free_count++;
+        }
+    }
 
-    uint16_t tmp_buf[SECTOR_SIZE / 2];
-    ata_read_sectors(tmp_buf, fat_sector, 1, g_drive_sel);
+    // the tail of the last bitmap word has no clusters behind it
+    for (uint32_t c = g_total_clusters; c % 64 != 0; c++)
+    {
+        fat32_mark_used(c);
+    }
 
-    return *((uint32_t *)((uint8_t *)tmp_buf + ent_offset)) & 0x0FFFFFFF;
+    g_next_free_hint = 2;
+    return 0;
+}
+
+/**
+ * @brief Writes every dirty FAT sector back, to all `fats_num` copies of the FAT.
+ *
+ * @details Consecutive dirty sectors are merged into a single write.
+ * The data only reaches the block cache here, `bcache_sync` pushes it to disk.
+ */
+void fat32_flush_fat(void)
+{
+    if (g_fat == NULL)
+    {
+        return;
+    }
+
+    uint32_t fat_start_lba = g_partition_lba + g_bpb.reserved_sectors;
+    uint32_t sec = 0;
+    while (sec < g_bpb.sectors_per_fat32)
+    {
+        if ((g_fat_dirty[sec / 8] & (1 << (sec % 8))) == 0)
+        {
+            sec++;
+            continue;
+        }
+
+        uint32_t run = 0;
+        while (sec + run < g_bpb.sectors_per_fat32 && (g_fat_dirty[(sec + run) / 8] & (1 << ((sec + run) % 8))))
+        {
+            g_fat_dirty[(sec + run) / 8] &= ~(1 << ((sec + run) % 8));
+            run++;
+        }
+
+        uint8_t *src = (uint8_t *)g_fat + (uint64_t)sec * SECTOR_SIZE;
+        for (uint8_t copy = 0; copy < g_bpb.fats_num; copy++)
+        {
+            uint32_t lba = fat_start_lba + (uint32_t)copy * g_bpb.sectors_per_fat32 + sec;
+            bcache_write(g_drive_sel, lba, run, src);
+        }
+
+        sec += run;
+    }
+}
+
+static int fat32_sync_locked(vfs_node_t *node)
+{
+    (void)node;
+    fat32_flush_fat();
+    return 0;
+}
+
+/**
+ * @brief Frees the FAT32 data of a node dropped by the VFS.
+ * Nobody else holds the node anymore, and nothing shared is touched, so the
+ * mount isn't locked.
+ */
+static void fat32_release(vfs_node_t *node)
+{
+    fat32_node_data *node_data = (fat32_node_data *)node->device_data;
+    if (node_data == NULL)
+    {
+        return;
+    }
+
+    fat32_free_extents(node_data);
+    kfree(node_data);
+    node->device_data = NULL;
 }
 
 /**
@@ -365,24 +882,43 @@ vfs_node_t *fat32_init_fs(uint32_t partition_lba, uint8_t drive_sel)
     g_drive_sel = drive_sel;
     g_partition_lba = partition_lba;
     uint16_t tmp_buf[SECTOR_SIZE / sizeof(uint16_t)];
-    ata_read_sectors(tmp_buf, partition_lba, 1, g_drive_sel);
+    bcache_read(g_drive_sel, partition_lba, 1, tmp_buf);
     memcpy(&g_bpb, tmp_buf, sizeof(fat32_bpb));
 
     uint32_t fats_region = (uint32_t)g_bpb.fats_num * g_bpb.sectors_per_fat32;
     g_data_start_lba = partition_lba + (uint32_t)g_bpb.reserved_sectors + fats_region;
     g_bytes_per_cluster = g_bpb.sectors_per_cluster * g_bpb.bytes_per_sector;
 
-    vfs_node_t *root = (vfs_node_t *)kmalloc(sizeof(vfs_node_t));
+    if (fat32_load_fat() < 0)
+    {
+        kprint("FAT32_INIT failed: OOM while loading the FAT\n");
+        return NULL;
+    }
+
+    for (int i = 0; i < FAT32_SCRATCH_BUFS; i++)
+    {
+        g_scratch_pool[i] = (uint8_t *)vmm_alloc_global(g_bytes_per_cluster);
+        if (g_scratch_pool[i] == NULL)
+        {
+            kprint("FAT32_INIT failed: OOM while allocating scratch buffers\n");
+            return NULL;
+        }
+        g_scratch_locks[i] = (mutex_t)MUTEX_INIT;
+    }
+
+    vfs_node_t *root = (vfs_node_t *)kmem_cache_alloc(&g_vfs_node_cache);
     if (root == NULL)
     {
         return NULL;
     }
+    memset(root, 0, sizeof(vfs_node_t));
     fat32_node_data *node_data = (fat32_node_data *)kmalloc(sizeof(fat32_node_data));
     if (node_data == NULL)
     {
-        kfree(root);
+        kmem_cache_free(&g_vfs_node_cache, root);
         return NULL;
     }
+    memset(node_data, 0, sizeof(fat32_node_data));
 
     strcpy(root->name, "fat32_root");
     root->flags = VFS_DIRECTORY;
@@ -581,7 +1117,7 @@ int fat32_iterate(uint32_t cluster, fat32_entry_cb_t entry_cb, void *ctx)
         for (int i = 0; i < g_bpb.sectors_per_cluster; i++)
         {
             uint32_t curr_lba = root_lba + i;
-            ata_read_sectors(tmp_buf, curr_lba, 1, g_drive_sel);
+            bcache_read(g_drive_sel, curr_lba, 1, tmp_buf);
 
             DirectoryEntry *dir_entries = (DirectoryEntry *)tmp_buf;
             for (size_t j = 0; j < g_bpb.bytes_per_sector / sizeof(DirectoryEntry); j++)
@@ -622,7 +1158,10 @@ int fat32_iterate(uint32_t cluster, fat32_entry_cb_t entry_cb, void *ctx)
 
 uint8_t *fat32_read_file(DirectoryEntry *entry)
 {
-    uint8_t *buf = (uint8_t *)vmm_alloc(entry->file_size + 1);
+    // bcache_read fills whole clusters, so round the buffer up to them
+    uint32_t cluster_bytes = g_bpb.bytes_per_sector * g_bpb.sectors_per_cluster;
+    uint32_t nr_clusters = (uint32_t)(((uint64_t)entry->file_size + cluster_bytes - 1) / cluster_bytes);
+    uint8_t *buf = (uint8_t *)kmalloc((uint64_t)nr_clusters * cluster_bytes + 1);
     if (buf == NULL)
     {
         return NULL;
@@ -631,11 +1170,12 @@ uint8_t *fat32_read_file(DirectoryEntry *entry)
     uint32_t curr_cluster = (entry->first_cluster_high << 0x10) | entry->first_cluster_low;
     uint8_t *buf_cur = buf;
 
-    while (curr_cluster < EOC)
+    // a chain longer than the file size claims is not read past the buffer
+    for (uint32_t i = 0; i < nr_clusters && curr_cluster < EOC; i++)
     {
         uint32_t lba = fat32_cluster_to_lba(curr_cluster);
-        ata_read_sectors((uint16_t *)buf_cur, lba, g_bpb.sectors_per_cluster, g_drive_sel);
-        buf_cur += g_bpb.bytes_per_sector * g_bpb.sectors_per_cluster;
+        bcache_read(g_drive_sel, lba, g_bpb.sectors_per_cluster, buf_cur);
+        buf_cur += cluster_bytes;
         curr_cluster = fat32_read_fat(curr_cluster);
     }
 
@@ -701,7 +1241,7 @@ int readdir_cb(DirectoryEntry *entry, fat32_location_t *loc, void *p)
  * until it reaches the requested `idx`. When the target index is reached,
  * it populates the `dirent_t` structure.
  */
-int fat32_readdir(vfs_node_t *node, uint32_t idx, dirent_t *out)
+static int fat32_readdir_locked(vfs_node_t *node, uint32_t idx, dirent_t *out)
 {
     fat32_node_data *data = (fat32_node_data *)node->device_data;
 
@@ -735,9 +1275,9 @@ int fat32_readdir(vfs_node_t *node, uint32_t idx, dirent_t *out)
  * @param parent Pointer to the parent directory node (vfs_node_t).
  * @param fname  The name of the new file (e.g., "test.txt").
  * @param flags  Creation flags (currently unused).
- * @return vfs_node_t* NULL (relies on vfs_navigate to find the created node).
+ * @return vfs_node_t* The new node (the VFS caches it in the dcache), or NULL on failure.
  */
-vfs_node_t *fat32_create(vfs_node_t *parent, const char *fname, uint32_t flags)
+static vfs_node_t *fat32_create_locked(vfs_node_t *parent, const char *fname, uint32_t flags)
 {
     char name[8];
     char ext[3];
@@ -770,12 +1310,7 @@ vfs_node_t *fat32_create(vfs_node_t *parent, const char *fname, uint32_t flags)
         return NULL;
     }
 
-    uint8_t *tmp_buf = (uint8_t *)kmalloc(SECTOR_SIZE);
-    if (tmp_buf == NULL)
-    {
-        kprint("FAT32_CREATE: OOM\n");
-        return NULL;
-    }
+    uint8_t *tmp_buf = fat32_scratch_get();
     memset(tmp_buf, 0, SECTOR_SIZE);
 
     DirectoryEntry new_entry;
@@ -787,7 +1322,7 @@ vfs_node_t *fat32_create(vfs_node_t *parent, const char *fname, uint32_t flags)
     new_entry.first_cluster_high = (free_cluster_id >> 16) & 0xFFFF;
     new_entry.first_cluster_low = free_cluster_id & 0xFFFF;
 
-    if (flags & VFS_DIRECTORY)
+    if ((flags & VFS_TYPE_MASK) == VFS_DIRECTORY)
     {
         new_entry.attributes = 0x10;
 
@@ -813,18 +1348,18 @@ vfs_node_t *fat32_create(vfs_node_t *parent, const char *fname, uint32_t flags)
         memcpy(tmp_buf + sizeof(DirectoryEntry), &two_dot_entry, sizeof(DirectoryEntry));
 
         uint32_t lba = fat32_cluster_to_lba(free_cluster_id);
-        ata_write_sectors((uint16_t *)tmp_buf, lba, 1, g_drive_sel);
+        bcache_write(g_drive_sel, lba, 1, tmp_buf);
     }
 
-    ata_read_sectors((uint16_t *)tmp_buf, loc.sector_lba, 1, g_drive_sel);
+    bcache_read(g_drive_sel, loc.sector_lba, 1, tmp_buf);
     memcpy(&tmp_buf[loc.offset], &new_entry, sizeof(DirectoryEntry));
-    ata_write_sectors((uint16_t *)tmp_buf, loc.sector_lba, 1, g_drive_sel);
+    bcache_write(g_drive_sel, loc.sector_lba, 1, tmp_buf);
 
     fat32_write_fat_entry(free_cluster_id, EOC);
 
-    kfree(tmp_buf);
+    fat32_scratch_put(tmp_buf);
 
-    vfs_node_t *new_node = (vfs_node_t *)kmalloc(sizeof(vfs_node_t));
+    vfs_node_t *new_node = (vfs_node_t *)kmem_cache_alloc(&g_vfs_node_cache);
     if (new_node == NULL)
     {
         return NULL;
@@ -832,17 +1367,20 @@ vfs_node_t *fat32_create(vfs_node_t *parent, const char *fname, uint32_t flags)
 
     memset(new_node, 0, sizeof(vfs_node_t));
     strncpy(new_node->name, fname, 127);
-    new_node->flags = flags;
+    new_node->flags = ((flags & VFS_TYPE_MASK) == VFS_DIRECTORY) ? VFS_DIRECTORY : VFS_FILE;
     new_node->length = 0;
     new_node->ops = &fat32_ops;
 
     fat32_node_data *new_data = (fat32_node_data *)kmalloc(sizeof(fat32_node_data));
     if (new_data == NULL)
     {
-        kfree(new_node);
+        kmem_cache_free(&g_vfs_node_cache, new_node);
         return NULL;
     }
+    memset(new_data, 0, sizeof(fat32_node_data));
     new_data->first_cluster = free_cluster_id;
+    new_data->sector_lba = loc.sector_lba;
+    new_data->offset = loc.offset;
     new_node->device_data = new_data;
 
     return new_node;
@@ -851,68 +1389,177 @@ vfs_node_t *fat32_create(vfs_node_t *parent, const char *fname, uint32_t flags)
 /**
  * @brief Updates a specific entry in the FAT Table (Write).
  *
- * @details MECHANISM (Read-Modify-Write):
- * Hard disks only write in full Sectors (512 bytes). We cannot write just 4 bytes.
- * 1. Calculate which Sector contains the entry for this cluster.
- * 2. READ the entire sector into memory.
- * 3. MODIFY the specific 32-bit integer at the correct offset.
- * 4. WRITE the entire sector back to disk.
+ * @details MECHANISM:
+ * Only the in-memory FAT is modified. The sector holding the entry is marked
+ * dirty, and `fat32_flush_fat` writes it to every FAT copy later, so many
+ * updates to the same sector cost a single disk write.
+ * The free-cluster bitmap is kept in sync with the new value.
  *
  * @param cluster The cluster number (index) to update.
  * @param value The new value to write (e.g., Next Cluster ID or EOC).
  */
 void fat32_write_fat_entry(uint32_t cluster, uint32_t value)
 {
-    uint32_t fat_start_lba = g_partition_lba + g_bpb.reserved_sectors;
-
-    uint32_t fat_sector_offset = (cluster * 4) / SECTOR_SIZE;
-    uint32_t entry_offset = (cluster * 4) % SECTOR_SIZE;
-    uint32_t target_lba = fat_start_lba + fat_sector_offset;
+    if (cluster < 2 || cluster >= g_total_clusters)
+    {
+        return;
+    }
 
-    uint8_t tmp_buf[SECTOR_SIZE] = {0};
-    ata_read_sectors((uint16_t *)tmp_buf, target_lba, 1, g_drive_sel);
+    // the upper 4 bits are reserved, and must be preserved
+    g_fat[cluster] = (g_fat[cluster] & 0xF0000000) | (value & 0x0FFFFFFF);
 
-    *(uint32_t *)&tmp_buf[entry_offset] = value;
+    uint32_t fat_sector = (cluster * 4) / SECTOR_SIZE;
+    g_fat_dirty[fat_sector / 8] |= (1 << (fat_sector % 8));
 
-    ata_write_sectors((uint16_t *)tmp_buf, target_lba, 1, g_drive_sel);
+    if ((value & 0x0FFFFFFF) == 0)
+    {
+        if (fat32_is_used(cluster))
+        {
+            fat32_mark_free(cluster);
+            g_free_count++;
+        }
+    }
+    else if (!fat32_is_used(cluster))
+    {
+        fat32_mark_used(cluster);
+        g_free_count--;
+    }
 }
 
 /**
- * @brief Scans the FAT table to find the first available (free) cluster.
+ * @brief Finds the next free run of clusters, starting from the next-fit hint.
  *
  * @details MECHANISM:
- * Iterates through every sector of the FAT region. Within each sector,
- * it checks every 32-bit entry.
- * - A value of 0x00000000 indicates a free cluster.
- * - Skips cluster 0 and 1 as they are reserved in FAT32.
+ * Scans the free-cluster bitmap 64 clusters at a time, skipping full words.
+ * Once a free cluster is found, the run is extended while the following
+ * clusters are free, up to `max_len`. Wraps around to cluster 2 once.
  *
- * @return int64_t The cluster number if found, or -1 if the disk is full.
+ * @param max_len The longest run the caller wants.
+ * @param out_len Receives the length of the run found.
+ * @return int64_t The first cluster of the run, or -1 if the disk is full.
  */
-int64_t fat32_find_free_cluster()
+static int64_t fat32_find_free_run(uint32_t max_len, uint32_t *out_len)
 {
-    uint8_t tmp_buf[SECTOR_SIZE] = {0};
-    for (uint32_t i = 0; i < g_bpb.sectors_per_fat32; i++)
+    if (g_free_count == 0)
     {
-        uint32_t lba = g_partition_lba + g_bpb.reserved_sectors + i;
-        ata_read_sectors((uint16_t *)tmp_buf, lba, 1, g_drive_sel);
+        return -1;
+    }
 
-        for (uint32_t j = 0; j < SECTOR_SIZE / sizeof(uint32_t); j++)
+    uint32_t start = g_next_free_hint;
+    if (start < 2 || start >= g_total_clusters)
+    {
+        start = 2;
+    }
+
+    for (uint32_t pass = 0; pass < 2; pass++)
+    {
+        uint32_t c = pass == 0 ? start : 2;
+        uint32_t end = pass == 0 ? g_total_clusters : start;
+
+        while (c < end)
         {
-            uint32_t cluster_id = i * 128 + j;
-            if (i == 0 && cluster_id < 2)
+            if (c % 64 == 0 && g_free_bitmap[c / 64] == ~0ULL)
+            {
+                c += 64;
+                continue;
+            }
+
+            if (fat32_is_used(c))
             {
+                c++;
                 continue;
             }
 
-            if (((uint32_t *)tmp_buf)[j] == 0)
+            uint32_t len = 1;
+            while (len < max_len && c + len < g_total_clusters && !fat32_is_used(c + len))
             {
-                return cluster_id;
+                len++;
             }
+
+            *out_len = len;
+            return c;
         }
     }
+
     return -1;
 }
 
+/**
+ * @brief Scans the free-cluster bitmap for an available cluster.
+ *
+ * @details Starts at the next-fit hint rather than at cluster 2, so
+ * consecutive allocations don't rescan the used part of the disk.
+ * The cluster is NOT marked as used until its FAT entry is written.
+ *
+ * @return int64_t The cluster number if found, or -1 if the disk is full.
+ */
+int64_t fat32_find_free_cluster()
+{
+    uint32_t len;
+    int64_t cluster = fat32_find_free_run(1, &len);
+    if (cluster >= 0)
+    {
+        g_next_free_hint = (uint32_t)cluster + 1;
+    }
+    return cluster;
+}
+
+/**
+ * @brief Allocates `count` clusters and links them into a chain.
+ *
+ * @details MECHANISM:
+ * 1. Grabs the longest contiguous free runs available from the next-fit hint,
+ * until `count` clusters are collected.
+ * 2. Links every cluster to the next one, and terminates the chain with EOC.
+ * 3. If `prev` is a valid cluster, it gets linked to the new chain.
+ *
+ * @param prev The current last cluster of a file, or 0 for a fresh chain.
+ * @param count The number of clusters to allocate.
+ * @return int64_t The first cluster of the new chain, or -1 if there's not enough space.
+ */
+int64_t fat32_alloc_clusters(uint32_t prev, uint32_t count)
+{
+    if (count == 0 || count > g_free_count)
+    {
+        return -1;
+    }
+
+    int64_t first = -1;
+    uint32_t last = prev;
+    uint32_t left = count;
+    while (left > 0)
+    {
+        uint32_t len;
+        int64_t run = fat32_find_free_run(left, &len);
+        if (run < 0)
+        {
+            // can't happen as long as g_free_count is right
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < len; i++)
+        {
+            uint32_t cluster = (uint32_t)run + i;
+            if (last >= 2)
+            {
+                fat32_write_fat_entry(last, cluster);
+            }
+            if (first < 0)
+            {
+                first = cluster;
+            }
+            // mark it right away, so the next search doesn't return it again
+            fat32_write_fat_entry(cluster, EOC);
+            last = cluster;
+        }
+
+        left -= len;
+        g_next_free_hint = (uint32_t)run + len;
+    }
+
+    return first;
+}
+
 /**
  * @brief Finds a free directory entry slot in a specific directory.
  *
@@ -940,7 +1587,7 @@ int fat32_find_free_directory_entry(uint32_t dir_cluster, fat32_location_t *out_
         for (int i = 0; i < g_bpb.sectors_per_cluster; i++)
         {
             uint32_t curr_lba = root_lba + i;
-            ata_read_sectors(tmp_buf, curr_lba, 1, g_drive_sel);
+            bcache_read(g_drive_sel, curr_lba, 1, tmp_buf);
 
             DirectoryEntry *dir_entries = (DirectoryEntry *)tmp_buf;
             for (size_t j = 0; j < g_bpb.bytes_per_sector / sizeof(DirectoryEntry); j++)
@@ -962,14 +1609,16 @@ int fat32_find_free_directory_entry(uint32_t dir_cluster, fat32_location_t *out_
     return -1;
 }
 
-void fat32_unlink(vfs_node_t *node)
+static void fat32_unlink_locked(vfs_node_t *node)
 {
     fat32_node_data *node_data = (fat32_node_data *)node->device_data;
-    uint8_t *tmp_buf = (uint8_t *)kmalloc(SECTOR_SIZE);
-    ata_read_sectors((uint16_t *)tmp_buf, node_data->sector_lba, 1, g_drive_sel);
+    uint8_t *tmp_buf = fat32_scratch_get();
+    bcache_read(g_drive_sel, node_data->sector_lba, 1, tmp_buf);
     ((DirectoryEntry *)(tmp_buf + node_data->offset))->name[0] = 0xE5;
-    ata_write_sectors((uint16_t *)tmp_buf, node_data->sector_lba, 1, g_drive_sel);
-    kfree(tmp_buf);
+    bcache_write(g_drive_sel, node_data->sector_lba, 1, tmp_buf);
+    fat32_scratch_put(tmp_buf);
+
+    fat32_free_extents(node_data);
 
     uint32_t curr_cluster = node_data->first_cluster;
 
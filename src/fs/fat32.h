@@ -48,11 +48,28 @@ typedef struct
     uint32_t file_size;
 } __attribute__((packed)) DirectoryEntry; // 32 bytes in total
 
+/**
+ * A run of clusters that are contiguous both in the file and on the disk.
+ * File cluster `file_cluster + i` lives at disk cluster `disk_cluster + i`, for i < len.
+ */
+typedef struct
+{
+    uint32_t file_cluster;
+    uint32_t disk_cluster;
+    uint32_t len;
+} fat32_extent_t;
+
 typedef struct
 {
     uint32_t first_cluster;
     uint32_t sector_lba;
     uint32_t offset;
+
+    // extent map of the cluster chain, built lazily
+    fat32_extent_t *extents;
+    uint32_t extent_count;
+    uint32_t extent_cap;
+    uint32_t mapped_clusters; // how many file clusters the extents cover
 } fat32_node_data;
 
 typedef struct
@@ -71,6 +88,8 @@ typedef struct
 
 typedef int (*fat32_entry_cb_t)(DirectoryEntry *, fat32_location_t *loc, void *);
 
+// fat32_readdir, fat32_create and fat32_unlink lock the mount; the helpers
+// expect it held, the VFS reaches them through fat32_ops
 uint32_t fat32_read_fat(uint32_t cluster);
 vfs_node_t *fat32_init_fs(uint32_t partition_lba, uint8_t drive_sel);
 void fat32_list_root(void);
@@ -82,6 +101,8 @@ int fat32_readdir(vfs_node_t *node, uint32_t idx, dirent_t *out);
 vfs_node_t *fat32_create(vfs_node_t *parent, const char *name, uint32_t flags);
 void fat32_write_fat_entry(uint32_t cluster, uint32_t value);
 int64_t fat32_find_free_cluster(void);
+int64_t fat32_alloc_clusters(uint32_t prev, uint32_t count);
+void fat32_flush_fat(void);
 int fat32_find_free_directory_entry(uint32_t dir_cluster, fat32_location_t *out_loc);
 void fat32_unlink(vfs_node_t *node);
 
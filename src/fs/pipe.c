@@ -3,6 +3,20 @@
 #include "utils/asm_instrs.h"
 #include "drivers/serial.h"
 
+/**
+ * @brief Puts the current task to sleep until the other end wakes it.
+ * Called with the pipe locked and interrupts off, and returns the same way. The
+ * task is marked waiting before the lock is dropped, so a wake-up from another
+ * CPU in between isn't lost.
+ */
+static void pipe_sleep(Pipe *pipe)
+{
+    get_curr_task()->state = TASK_WAITING;
+    spin_unlock(&pipe->lock);
+    schedule();
+    spin_lock(&pipe->lock);
+}
+
 uint64_t pipe_read(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buf)
 {
     (void)offset;
@@ -10,9 +24,9 @@ uint64_t pipe_read(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *bu
     Pipe *pipe = (Pipe *)node->device_data;
     uint64_t read_count = 0;
 
+    uint64_t rflags = spin_lock_irqsave(&pipe->lock);
     while (read_count < size)
     {
-        cli();
         char c;
 
         /*
@@ -29,8 +43,6 @@ uint64_t pipe_read(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *bu
                 sched_wake_pid(pipe->writer_pid);
                 pipe->writer_pid = -1;
             }
-
-            sti();
             continue;
         }
 
@@ -42,29 +54,26 @@ uint64_t pipe_read(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *bu
 
             if (read_count > 0)
             {
-                sti();
-                return read_count;
+                break;
             }
 
             Task *curr_tsk = get_curr_task();
             if (curr_tsk == NULL)
             {
                 kprint("ALERT: no task running while reading pipe.\n");
-                sti();
-                return read_count;
+                break;
             }
             pipe->reader_pid = curr_tsk->pid;
-            sched_block();
-            sti();
+            pipe_sleep(pipe);
             continue;
         }
         else
         {
             // the write_end is officially closed, we're done reading
-            sti();
-            return read_count;
+            break;
         }
     }
+    spin_unlock_irqrestore(&pipe->lock, rflags);
 
     return read_count;
 }
@@ -81,47 +90,31 @@ uint64_t pipe_write(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *b
     If in the middle of the way, we have read_end being closed, return immediately.
     */
 
-    while (write_count < size)
+    uint64_t rflags = spin_lock_irqsave(&pipe->lock);
+    while (write_count < size && (pipe->flags & READ_OPEN))
     {
-        if (pipe->flags & READ_OPEN)
+        if (rb_is_full(&pipe->buf))
         {
-            cli();
-            while (rb_is_full(&pipe->buf))
-            {
-                if (!(pipe->flags & READ_OPEN))
-                {
-                    // hey, the read_end is closed already, no need to write anymore
-                    sti();
-                    return write_count;
-                }
-
-                Task *curr_tsk = get_curr_task();
-                if (curr_tsk == NULL)
-                {
-                    sti();
-                    return write_count;
-                }
-                pipe->writer_pid = curr_tsk->pid;
-                sched_block();
-                sti();
-                cli();
-            }
-
-            // RingBuf has space, and read_end is still ON here
-            rb_push(&pipe->buf, buf[write_count++]);
-            if (pipe->reader_pid != -1)
+            Task *curr_tsk = get_curr_task();
+            if (curr_tsk == NULL)
             {
-                sched_wake_pid(pipe->reader_pid);
-                pipe->reader_pid = -1;
+                break;
             }
-            sti();
+            pipe->writer_pid = curr_tsk->pid;
+            pipe_sleep(pipe);
+            // the read_end may have been closed while we slept
+            continue;
         }
-        else
+
+        // RingBuf has space, and read_end is still ON here
+        rb_push(&pipe->buf, buf[write_count++]);
+        if (pipe->reader_pid != -1)
         {
-            // read_end is closed
-            return write_count;
+            sched_wake_pid(pipe->reader_pid);
+            pipe->reader_pid = -1;
         }
     }
+    spin_unlock_irqrestore(&pipe->lock, rflags);
 
     return write_count;
 }
@@ -130,7 +123,7 @@ void pipe_close_reader(vfs_node_t *node)
 {
     Pipe *pipe = (Pipe *)node->device_data;
 
-    cli();
+    uint64_t rflags = spin_lock_irqsave(&pipe->lock);
 
     pipe->flags &= ~READ_OPEN;
 
@@ -140,14 +133,14 @@ void pipe_close_reader(vfs_node_t *node)
         pipe->writer_pid = -1;
     }
 
-    sti();
+    spin_unlock_irqrestore(&pipe->lock, rflags);
 }
 
 void pipe_close_writer(vfs_node_t *node)
 {
     Pipe *pipe = (Pipe *)node->device_data;
 
-    cli();
+    uint64_t rflags = spin_lock_irqsave(&pipe->lock);
 
     pipe->flags &= ~WRITE_OPEN;
 
@@ -157,21 +150,16 @@ void pipe_close_writer(vfs_node_t *node)
         pipe->reader_pid = -1;
     }
 
-    sti();
+    spin_unlock_irqrestore(&pipe->lock, rflags);
 }
 
 int pipe_check_ready(struct vfs_node *node)
 {
     Pipe *pipe = (Pipe *)node->device_data;
-    cli();
-    if (!rb_is_empty(&pipe->buf))
-    {
-        sti();
-        return 1;
-    }
-    if (!(pipe->flags & WRITE_OPEN))
+    uint64_t rflags = spin_lock_irqsave(&pipe->lock);
+    if (!rb_is_empty(&pipe->buf) || !(pipe->flags & WRITE_OPEN))
     {
-        sti();
+        spin_unlock_irqrestore(&pipe->lock, rflags);
         return 1;
     }
 
@@ -181,7 +169,7 @@ int pipe_check_ready(struct vfs_node *node)
         pipe->reader_pid = curr_tsk->pid;
     }
 
-    sti();
+    spin_unlock_irqrestore(&pipe->lock, rflags);
     return 0;
 }
 
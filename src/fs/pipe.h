@@ -3,12 +3,14 @@
 
 #include "vfs.h"
 #include "utils/ring_buf.h"
+#include "utils/spinlock.h"
 
 #define READ_OPEN (1 << 0)
 #define WRITE_OPEN (1 << 1)
 
 typedef struct Pipe
 {
+    spinlock_t lock; // the two ends may be used from different CPUs
     RingBuf buf;
     int reader_pid;
     int writer_pid;
@@ -29,7 +29,8 @@ vfs_node_t *tar_fs_init(void *tar_addr)
     g_tar_base_addr = (tar_header_t *)tar_addr;
     tar_init(tar_addr);
 
-    vfs_node_t *root = (vfs_node_t *)kmalloc(sizeof(vfs_node_t));
+    vfs_node_t *root = (vfs_node_t *)kmem_cache_alloc(&g_vfs_node_cache);
+    memset(root, 0, sizeof(vfs_node_t));
     strcpy(root->name, "/");
     root->flags = VFS_DIRECTORY;
     root->length = 0;
@@ -41,7 +42,7 @@ vfs_node_t *tar_fs_init(void *tar_addr)
 
 uint64_t tar_vfs_read(vfs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer)
 {
-    if (node->flags & VFS_DIRECTORY)
+    if ((node->flags & VFS_TYPE_MASK) == VFS_DIRECTORY)
     {
         return 0;
     }
@@ -113,14 +114,19 @@ vfs_node_t *tar_vfs_finddir(vfs_node_t *node, const char *name)
 
         if (match)
         {
-            vfs_node_t *_node = kmalloc(sizeof(vfs_node_t));
+            vfs_node_t *_node = (vfs_node_t *)kmem_cache_alloc(&g_vfs_node_cache);
+            if (_node == NULL)
+            {
+                return NULL;
+            }
 
             if (strlen(name) >= 128)
             {
                 kprint("Name is too long\n");
-                kfree(_node);
+                kmem_cache_free(&g_vfs_node_cache, _node);
                 return NULL;
             }
+            memset(_node, 0, sizeof(vfs_node_t));
 
             strcpy(_node->name, name);
             _node->length = oct2bin(iter->size, 11);
@@ -2,19 +2,37 @@
 #include "mem/kmalloc.h"
 #include "drivers/serial.h"
 #include "dev.h"
+#include "dcache.h"
+#include "bcache.h"
 #include "../string.h"
 
+#include <stdbool.h>
+
 #define MAX_MOUNTPOINTS 4
 
-typedef struct
+typedef struct mount_point
 {
     char path[0x40];
     vfs_node_t *root;
+    uint32_t flags; // VFS_MOUNT_*
 } mount_point_t;
 
 static mount_point_t g_mounts[MAX_MOUNTPOINTS];
 static int8_t g_mount_count = 0;
 
+static void vfs_node_ctor(void *obj)
+{
+    memset(obj, 0, sizeof(vfs_node_t));
+}
+
+static void file_handle_ctor(void *obj)
+{
+    memset(obj, 0, sizeof(file_handle_t));
+}
+
+kmem_cache_t g_vfs_node_cache = KMEM_CACHE_INIT("vfs_node_t", vfs_node_t, vfs_node_ctor);
+kmem_cache_t g_file_handle_cache = KMEM_CACHE_INIT("file_handle_t", file_handle_t, file_handle_ctor);
+
 void vfs_init()
 {
     g_mount_count = 0;
@@ -22,10 +40,11 @@ void vfs_init()
     {
         g_mounts[i].path[0] = 0;
         g_mounts[i].root = NULL;
+        g_mounts[i].flags = 0;
     }
 }
 
-int vfs_mount(const char *path, vfs_node_t *fs_root)
+int vfs_mount(const char *path, vfs_node_t *fs_root, uint32_t flags)
 {
     if (g_mount_count >= MAX_MOUNTPOINTS)
     {
@@ -34,11 +53,154 @@ int vfs_mount(const char *path, vfs_node_t *fs_root)
     }
 
     strcpy(g_mounts[g_mount_count].path, path);
+    g_mounts[g_mount_count].flags = flags;
     g_mounts[g_mount_count++].root = fs_root;
 
     return 0;
 }
 
+/**
+ * @brief Switches a mount point between the sync and writeback modes.
+ * Going to sync mode also writes back what is pending.
+ *
+ * @return int the previous flags, or -1 if nothing is mounted at `path`.
+ */
+int vfs_set_mount_flags(const char *path, uint32_t flags)
+{
+    for (int8_t i = 0; i < g_mount_count; i++)
+    {
+        if (strcmp(g_mounts[i].path, path) == 0)
+        {
+            int old_flags = (int)g_mounts[i].flags;
+            g_mounts[i].flags = flags;
+            if (flags & VFS_MOUNT_SYNC)
+            {
+                vfs_sync();
+            }
+            return old_flags;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Finds the mount point with the longest path `path` starts with.
+ * @param out_len where to store the length of the mount path, may be NULL.
+ */
+static mount_point_t *vfs_find_mount(const char *path, int *out_len)
+{
+    mount_point_t *best_mount = NULL;
+    int best_match_len = -1;
+
+    for (int8_t i = 0; i < g_mount_count; i++)
+    {
+        // if mount = "/data", path is "/data/test.txt" -> matched!
+        int mount_len = strlen(g_mounts[i].path);
+
+        if (strncmp(path, g_mounts[i].path, mount_len) == 0)
+        {
+            /*
+            in case mount="/d", path="/data"
+            but this is wrong.
+            so we check if the next char is "/", or "\0".
+            */
+            char next_char = path[mount_len];
+            if (next_char == '/' || next_char == '\0' || mount_len == 1)
+            {
+                if (mount_len > best_match_len)
+                {
+                    best_match_len = mount_len;
+                    best_mount = &g_mounts[i];
+                }
+            }
+        }
+    }
+
+    if (out_len != NULL)
+    {
+        *out_len = best_match_len;
+    }
+    return best_mount;
+}
+
+/**
+ * @brief Takes a reference on a node, so it can't be evicted from the dcache.
+ */
+void vfs_node_get(vfs_node_t *node)
+{
+    if (node != NULL)
+    {
+        __atomic_fetch_add(&node->ref_count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Drops a reference on a node.
+ * Nodes that aren't owned by the dcache anymore (VFS_NODE_AUTOFREE) are freed
+ * by whoever takes the count from 1 to 0. A cached node can't get there: its
+ * dcache entry holds a reference until it sets VFS_NODE_AUTOFREE.
+ */
+void vfs_node_put(vfs_node_t *node)
+{
+    if (node == NULL)
+    {
+        return;
+    }
+
+    // the count may drop on another CPU at the same time, never below 0
+    uint32_t old = __atomic_load_n(&node->ref_count, __ATOMIC_RELAXED);
+    do
+    {
+        if (old == 0)
+        {
+            kprint("VFS: put on a node with no reference\n");
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&node->ref_count, &old, old - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    if (old == 1 && (__atomic_load_n(&node->flags, __ATOMIC_ACQUIRE) & VFS_NODE_AUTOFREE))
+    {
+        vfs_free_node(node);
+    }
+}
+
+/**
+ * @brief Frees a node, and lets its file system free the device data.
+ */
+void vfs_free_node(vfs_node_t *node)
+{
+    if (node->ops && node->ops->release)
+    {
+        node->ops->release(node);
+    }
+    kmem_cache_free(&g_vfs_node_cache, node);
+}
+
+/**
+ * @brief Creates `name` in `parent`, and caches the new node.
+ * @return vfs_node_t* The new node with a reference taken, or NULL if the file system
+ * couldn't create it or doesn't return the node.
+ */
+vfs_node_t *vfs_create(vfs_node_t *parent, const char *name, uint32_t flags)
+{
+    if (parent == NULL || parent->ops == NULL || parent->ops->create == NULL)
+    {
+        return NULL;
+    }
+
+    vfs_node_t *created = parent->ops->create(parent, name, flags);
+
+    // a negative entry may say the name doesn't exist
+    dcache_invalidate(parent, name);
+
+    if (created == NULL)
+    {
+        return NULL;
+    }
+
+    return dcache_insert(parent, name, created);
+}
+
 void vfs_retain(file_handle_t *file)
 {
     if (file == NULL)
@@ -70,15 +232,18 @@ file_handle_t *vfs_open(const char *filename, uint32_t mode)
             node->length = 0;
         }
 
-        file_handle_t *fhandle = kmalloc(sizeof(file_handle_t));
+        file_handle_t *fhandle = (file_handle_t *)kmem_cache_alloc(&g_file_handle_cache);
         if (fhandle == NULL)
         {
             kprint("vfs_open failed: out of mem!\n");
             return NULL;
         }
+        vfs_node_get(node);
         fhandle->node = node;
         fhandle->mode = mode;
         fhandle->ref_count = 1;
+        fhandle->mount = NULL;
+        memset(&fhandle->ra, 0, sizeof(readahead_t));
         fhandle->offset = (mode & O_APPEND)
                               ? node->length
                               : 0;
@@ -133,13 +298,11 @@ file_handle_t *vfs_open(const char *filename, uint32_t mode)
                 return NULL;
             }
 
-            if (parent_node->ops && parent_node->ops->create)
+            node = vfs_create(parent_node, child_name, mode);
+            vfs_node_put(parent_node);
+            if (node == NULL)
             {
-                vfs_node_t *created = parent_node->ops->create(parent_node, child_name, mode);
-                if (created == NULL)
-                {
-                    node = vfs_navigate(filename);
-                }
+                node = vfs_navigate(filename);
             }
 
             if (node == NULL)
@@ -165,16 +328,20 @@ file_handle_t *vfs_open(const char *filename, uint32_t mode)
         node->length = 0;
     }
 
-    file_handle_t *fhandle = kmalloc(sizeof(file_handle_t));
+    file_handle_t *fhandle = (file_handle_t *)kmem_cache_alloc(&g_file_handle_cache);
     if (fhandle == NULL)
     {
         kprint("vfs_open failed: out of mem!\n");
+        vfs_node_put(node);
         return NULL;
     }
 
+    // the reference from vfs_navigate now belongs to the handle
     fhandle->node = node;
     fhandle->mode = mode;
     fhandle->ref_count = 1;
+    fhandle->mount = vfs_find_mount(filename, NULL);
+    memset(&fhandle->ra, 0, sizeof(readahead_t));
     fhandle->offset = (mode & O_APPEND)
                           ? node->length
                           : 0;
@@ -182,6 +349,55 @@ file_handle_t *vfs_open(const char *filename, uint32_t mode)
     return fhandle;
 }
 
+/**
+ * @brief Updates the readahead window of `file` for a read of `size` bytes
+ * at its current offset, and prefetches if the window runs past what's cached.
+ *
+ * @details MECHANISM:
+ * 1. A read starting where the last one ended (or the first read of the file)
+ * is sequential: the window starts at VFS_RA_MIN and doubles up to VFS_RA_MAX.
+ * 2. Any other read resets the window, random access gets no readahead.
+ * 3. Once less than half of the window is left ahead of the read, the file
+ * system is asked to fetch up to `offset + size + window`. The request itself
+ * is part of that range, so it's read in the same command as the readahead.
+ */
+static void vfs_readahead(file_handle_t *file, uint64_t size)
+{
+    vfs_node_t *node = file->node;
+    readahead_t *ra = &file->ra;
+    uint64_t offset = file->offset;
+
+    if (offset == ra->next_offset)
+    {
+        ra->window = ra->window == 0 ? VFS_RA_MIN : ra->window * 2;
+        if (ra->window > VFS_RA_MAX)
+        {
+            ra->window = VFS_RA_MAX;
+        }
+    }
+    else
+    {
+        ra->window = 0;
+        ra->prefetch_end = 0;
+    }
+    ra->next_offset = offset + size;
+
+    if (ra->window == 0 || offset >= node->length)
+    {
+        return;
+    }
+
+    uint64_t target = offset + size + ra->window;
+    if (ra->prefetch_end > offset && ra->prefetch_end >= offset + size + ra->window / 2)
+    {
+        return;
+    }
+
+    uint64_t start = ra->prefetch_end > offset ? ra->prefetch_end : offset;
+    node->ops->readahead(node, start, target - start);
+    ra->prefetch_end = target;
+}
+
 uint64_t vfs_read(file_handle_t *file, uint64_t size, uint8_t *buffer)
 {
     if (file == NULL)
@@ -192,6 +408,11 @@ uint64_t vfs_read(file_handle_t *file, uint64_t size, uint8_t *buffer)
 
     if (file->node && file->node->ops && file->node->ops->read)
     {
+        if (file->node->ops->readahead != NULL)
+        {
+            vfs_readahead(file, size);
+        }
+
         uint64_t nbytes = file->node->ops->read(file->node, file->offset, size, buffer);
         file->offset += nbytes;
         return nbytes;
@@ -212,6 +433,11 @@ uint64_t vfs_write(file_handle_t *file, uint64_t size, uint8_t *buffer)
     {
         uint64_t nbytes = file->node->ops->write(file->node, file->offset, size, buffer);
         file->offset += nbytes;
+
+        if (nbytes > 0 && file->mount != NULL && (file->mount->flags & VFS_MOUNT_SYNC))
+        {
+            vfs_fsync(file);
+        }
         return nbytes;
     }
 
@@ -238,12 +464,9 @@ void vfs_close(file_handle_t *file)
         file->node->ops->close(file->node);
     }
 
-    if (file->node && (file->node->flags & VFS_NODE_AUTOFREE))
-    {
-        kfree((void *)file->node);
-    }
+    vfs_node_put(file->node);
 
-    kfree((void *)file);
+    kmem_cache_free(&g_file_handle_cache, file);
 }
 
 void vfs_seek(file_handle_t *file, uint64_t new_offset)
@@ -253,45 +476,23 @@ void vfs_seek(file_handle_t *file, uint64_t new_offset)
 
 /**
  * @brief Path Walking to return the target vfs_node
+ *
+ * @details Each component is looked up in the dcache first, and only a miss
+ * asks the file system's `finddir`. The result, found or not, is cached.
+ * The returned node has a reference taken, release it with `vfs_node_put`.
  */
 vfs_node_t *vfs_navigate(const char *path)
 {
-    vfs_node_t *best_mount_root = NULL;
-    // const char *best_mount_path = "";
-    int best_match_len = -1;
-
     /*
     Firstly, find the best match Mount Point
     */
-    for (int8_t i = 0; i < g_mount_count; i++)
-    {
-        // if mount = "/data", path is "/data/test.txt" -> matched!
-        int mount_len = strlen(g_mounts[i].path);
-
-        if (strncmp(path, g_mounts[i].path, mount_len) == 0)
-        {
-            /*
-            in case mount="/d", path="/data"
-            but this is wrong.
-            so we check if the next char is "/", or "\0".
-            */
-            char next_char = path[mount_len];
-            if (next_char == '/' || next_char == '\0' || mount_len == 1)
-            {
-                if (mount_len > best_match_len)
-                {
-                    best_match_len = mount_len;
-                    best_mount_root = g_mounts[i].root;
-                    // best_mount_path = g_mounts[i].path;
-                }
-            }
-        }
-    }
-
-    if (best_mount_root == NULL)
+    int best_match_len = -1;
+    mount_point_t *best_mount = vfs_find_mount(path, &best_match_len);
+    if (best_mount == NULL || best_mount->root == NULL)
     {
         return NULL;
     }
+    vfs_node_t *best_mount_root = best_mount->root;
 
     /*
     Secondly, parse the remaining Relative Path
@@ -303,6 +504,7 @@ vfs_node_t *vfs_navigate(const char *path)
     // rel_path is empty, or just "/", return the root right away
     if (*rel_path == '\0')
     {
+        vfs_node_get(best_mount_root);
         return best_mount_root;
     }
 
@@ -310,6 +512,7 @@ vfs_node_t *vfs_navigate(const char *path)
     Thirdly, find the node, starting from best_mount_root.
     */
     vfs_node_t *curr_node = best_mount_root;
+    vfs_node_get(curr_node);
     char name[128];
     int i = 0;
     while (rel_path[i] != '\0')
@@ -337,18 +540,27 @@ vfs_node_t *vfs_navigate(const char *path)
         }
         name[j] = '\0';
 
-        if (curr_node->flags != VFS_DIRECTORY)
+        if ((curr_node->flags & VFS_TYPE_MASK) != VFS_DIRECTORY)
         {
             kprint("VFS: Not a directory, cannot navigate further.\n");
+            vfs_node_put(curr_node);
             return NULL;
         }
 
         if (curr_node->ops->finddir == NULL)
         {
+            vfs_node_put(curr_node);
             return NULL;
         }
 
-        vfs_node_t *next_node = curr_node->ops->finddir(curr_node, name);
+        vfs_node_t *next_node;
+        if (!dcache_lookup(curr_node, name, &next_node))
+        {
+            next_node = curr_node->ops->finddir(curr_node, name);
+            next_node = dcache_insert(curr_node, name, next_node);
+        }
+
+        vfs_node_put(curr_node);
         if (next_node == NULL)
         {
             return NULL;
@@ -367,7 +579,7 @@ int vfs_readdir(vfs_node_t *node, uint32_t index, dirent_t *out)
         return -1;
     }
 
-    if ((node->flags & VFS_DIRECTORY) == 0)
+    if ((node->flags & VFS_TYPE_MASK) != VFS_DIRECTORY)
     {
         return -1;
     }
@@ -388,7 +600,58 @@ int vfs_unlink(const char *path)
         node->ops->unlink(node);
     }
 
-    kfree(node);
+    if (node->dentry != NULL)
+    {
+        char name[128];
+        strcpy(name, node->dentry->name);
+        dcache_invalidate(node->dentry->parent, name);
+    }
+
+    // frees the node, unless it's still open somewhere
+    vfs_node_put(node);
+    return 0;
+}
+
+/**
+ * @brief Flushes every mounted file system to disk.
+ * Each file system first pushes its own metadata (e.g. the FAT) into the
+ * block cache, then the block cache writes all dirty sectors back.
+ */
+void vfs_sync()
+{
+    for (int8_t i = 0; i < g_mount_count; i++)
+    {
+        vfs_node_t *root = g_mounts[i].root;
+        if (root != NULL && root->ops != NULL && root->ops->sync != NULL)
+        {
+            root->ops->sync(root);
+        }
+    }
+
+    bcache_sync();
+}
+
+/**
+ * @brief Makes the writes done through `file` durable.
+ *
+ * @details The block cache doesn't know which sectors belong to which file,
+ * so this writes back the file system metadata and every dirty sector,
+ * then has the drive flush its own cache.
+ */
+int vfs_fsync(file_handle_t *file)
+{
+    if (file == NULL || file->node == NULL)
+    {
+        return -1;
+    }
+
+    vfs_node_t *node = file->node;
+    if (node->ops != NULL && node->ops->sync != NULL)
+    {
+        node->ops->sync(node);
+    }
+    bcache_sync();
+
     return 0;
 }
 
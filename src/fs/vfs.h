@@ -4,11 +4,23 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#include "mem/slab.h"
+
 #define VFS_FILE 0x01
 #define VFS_DIRECTORY 0x02
 #define VFS_CHAR_DEVICE 0x03
 #define VFS_BLOCK_DEVICE 0x04
 #define VFS_NODE_AUTOFREE 0x10
+// the node type, one of VFS_FILE..VFS_BLOCK_DEVICE; the bits above it are flags
+#define VFS_TYPE_MASK 0x0F
+
+// readahead window, in bytes, past the end of a sequential read
+#define VFS_RA_MIN 0x4000  // 16 KiB, first window once a handle reads sequentially
+#define VFS_RA_MAX 0x40000 // 256 KiB
+
+// mount options
+#define VFS_MOUNT_WRITEBACK 0x0 // writes stay in the block cache until a sync
+#define VFS_MOUNT_SYNC 0x1      // every write is on the media before it returns
 
 #define O_RDONLY 0x0
 #define O_WRONLY 0x1
@@ -19,6 +31,7 @@
 #define O_APPEND 0x40
 
 struct vfs_node;
+struct mount_point;
 
 typedef struct dirent
 {
@@ -38,6 +51,9 @@ typedef struct vfs_fs_ops
     int (*readdir)(struct vfs_node *node, uint32_t index, struct dirent *out);
     void (*unlink)(struct vfs_node *node);
     int (*check_ready)(struct vfs_node *node);
+    int (*sync)(struct vfs_node *node);
+    void (*release)(struct vfs_node *node); // frees device_data when the node is dropped
+    void (*readahead)(struct vfs_node *node, uint64_t offset, uint64_t size); // prefetches into the block cache
 } vfs_fs_ops_t;
 
 typedef struct vfs_node
@@ -49,20 +65,46 @@ typedef struct vfs_node
     vfs_fs_ops_t *ops;
     void *device_data;
     struct vfs_node *next;
+
+    uint32_t ref_count;    // its dcache entry + open handles + cached children
+    struct dentry *dentry; // the dcache entry owning this node, if any
 } vfs_node_t;
 
+/**
+ * Readahead state of a file handle.
+ * The window doubles each time a read starts where the previous one ended,
+ * and is dropped on a seek or any other out-of-order read.
+ */
+typedef struct readahead
+{
+    uint64_t next_offset;  // where a sequential read would start
+    uint64_t prefetch_end; // how far the file has been prefetched
+    uint32_t window;       // 0 means no readahead
+} readahead_t;
+
 typedef struct file_handle
 {
     vfs_node_t *node;
     uint64_t offset;
     uint32_t mode;
     int ref_count;
+    struct mount_point *mount; // NULL if not on a mounted file system
+    readahead_t ra;
 } file_handle_t;
 
+// every vfs_node_t and file_handle_t comes from these, zero-filled
+extern kmem_cache_t g_vfs_node_cache;
+extern kmem_cache_t g_file_handle_cache;
+
 void vfs_init();
-int vfs_mount(const char *path, vfs_node_t *fs_root);
+int vfs_mount(const char *path, vfs_node_t *fs_root, uint32_t flags);
+int vfs_set_mount_flags(const char *path, uint32_t flags);
 void vfs_retain(file_handle_t *file);
 vfs_node_t *vfs_navigate(const char *path);
+void vfs_node_get(vfs_node_t *node);
+void vfs_node_put(vfs_node_t *node);
+void vfs_free_node(vfs_node_t *node);
+vfs_node_t *vfs_create(vfs_node_t *parent, const char *name, uint32_t flags);
 file_handle_t *vfs_open(const char *filename, uint32_t mode);
 void vfs_close(file_handle_t *file);
 uint64_t vfs_read(file_handle_t *file, uint64_t size, uint8_t *buffer);
@@ -71,6 +113,8 @@ void vfs_seek(file_handle_t *file, uint64_t new_offset);
 vfs_node_t *vfs_navigate(const char *path);
 int vfs_readdir(vfs_node_t *node, uint32_t index, dirent_t *out);
 int vfs_unlink(const char *path);
+void vfs_sync();
+int vfs_fsync(file_handle_t *file);
 void resolve_path(const char *cwd, const char *inp_path, char *out_buf);
 
 #endif
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "drivers/mouse.h"
 #include "mem/kmalloc.h"
 #include "mem/vmm.h"
+#include "mem/slab.h"
 #include "kern_defs.h"
 #include "sched/sched.h"
 #include "../string.h"
@@ -11,7 +12,7 @@
 #include "drivers/serial.h" // debugging
 #include "kern_defs.h"
 #include "cursor.h"
-#include "utils/asm_instrs.h"
+#include "utils/spinlock.h"
 
 #include <stddef.h>
 
@@ -21,21 +22,23 @@ extern EventBuf g_event_queue;
 
 static Window *g_win_list = NULL; // Bottom / Head of lis
 static Window *g_win_top = NULL;  // Top / Tail of List to focus
+static spinlock_t g_win_lock = SPINLOCK_INIT; // the list, and the windows on it
 Window *g_desktop_win;
 
 /*
 Window uses Rects a lot, especially when win_stain_list runs.
-Kmalloc them is a waste of time, we can use the Rect Pool.
-Here I use Static Array as the memory storage of Rects, no need to alloc;
-and I keep track of free rect list wih Linked List.
+Kmalloc them is a waste of time, so they come from their own slab cache:
+O(1) alloc/free, no fixed cap, and the pages go back to the PMM once
+a burst of stains is over.
 */
 
-#define MAX_RECT_POOL 2000
+static void rect_ctor(void *obj)
+{
+    ((Rect *)obj)->next = NULL;
+}
 
-static Rect g_rect_storage[MAX_RECT_POOL];
-static Rect *g_rect_free_list = NULL;
+static kmem_cache_t g_rect_cache = KMEM_CACHE_INIT("Rect", Rect, rect_ctor);
 
-static void init_rect_pool(void);
 Rect *rect_alloc(void);
 void rect_free(Rect *r);
 
@@ -288,8 +291,7 @@ Window *win_create(int64_t x, int64_t y, uint64_t width, uint64_t height, const
     win->pixels_size = pixel_buf_size;
     init_win_pixels(win);
 
-    uint64_t rflags = get_rflags();
-    cli();
+    uint64_t rflags = spin_lock_irqsave(&g_win_lock);
     // link it to the list
     // the latest created win is always
     // on top
@@ -307,10 +309,7 @@ Window *win_create(int64_t x, int64_t y, uint64_t width, uint64_t height, const
         g_win_top->next = win;
         g_win_top = win;
     }
-    if (rflags & (1 << 9))
-    {
-        sti();
-    }
+    spin_unlock_irqrestore(&g_win_lock, rflags);
 
     Task *tsk = get_curr_task();
     if (tsk == NULL)
@@ -349,7 +348,6 @@ Window *win_create(int64_t x, int64_t y, uint64_t width, uint64_t height, const
 
 void init_win_manager(void)
 {
-    init_rect_pool();
     init_desktop();
     win_paint();
     kprint("Window manager inited!\n");
@@ -362,8 +360,7 @@ bool check_win_drag(Window *win, int64_t mouse_x, int64_t mouse_y)
 
 void win_paint()
 {
-    uint64_t rflags = get_rflags();
-    cli();
+    uint64_t rflags = spin_lock_irqsave(&g_win_lock);
     Window *curr = g_win_list;
     while (curr != NULL)
     {
@@ -375,10 +372,7 @@ void win_paint()
         }
         curr = curr->next;
     }
-    if (rflags & (1 << 9))
-    {
-        sti();
-    }
+    spin_unlock_irqrestore(&g_win_lock, rflags);
 }
 
 Window *get_win_at(int64_t mx, int64_t my)
@@ -440,8 +434,7 @@ void win_focus(Window *win)
 
 void win_close(Window *win)
 {
-    uint64_t rflags = get_rflags();
-    cli();
+    uint64_t rflags = spin_lock_irqsave(&g_win_lock);
     video_add_dirty_rect(win->x, win->y, win->width, win->height);
 
     if (win == drag_ctx.target)
@@ -476,10 +469,7 @@ void win_close(Window *win)
         win->next->prev = win->prev;
     }
 
-    if (rflags & (1 << 9))
-    {
-        sti();
-    }
+    spin_unlock_irqrestore(&g_win_lock, rflags);
 
     if (win->pixels != NULL)
     {
@@ -568,7 +558,8 @@ void win_put_char(Window *win, char c)
 static uint8_t prev_left_btn = 0;
 void win_update(void)
 {
-    cli();
+    uint64_t rflags = spin_lock_irqsave(&g_win_lock);
+    int kill_pid = -1; // killed once the lock is dropped, since that closes the window
 
     int64_t mstat = mouse_get_stat();
     int64_t mx = mouse_get_x();
@@ -673,7 +664,7 @@ void win_update(void)
                 {
                     if (is_point_in_rect(off_mx, off_my, close_btn_x, 0, btn_size, btn_size))
                     {
-                        sched_kill(curr_win->owner_pid);
+                        kill_pid = (int)curr_win->owner_pid;
                         btn_clicked = 1;
                     }
                     else if ((curr_win->flags & WIN_RESIZABLE) && is_point_in_rect(off_mx, off_my, max_btn_x, 0, btn_size, btn_size))
@@ -759,7 +750,12 @@ void win_update(void)
     prev_left_btn = is_left_btn;
     cursor_set_shape(nxt_cursor_typ);
 
-    sti();
+    spin_unlock_irqrestore(&g_win_lock, rflags);
+
+    if (kill_pid != -1)
+    {
+        sched_kill(kill_pid);
+    }
 }
 
 Window *win_get_active()
@@ -1005,41 +1001,19 @@ void win_resize(Window *win, int64_t new_x, int64_t new_y, int64_t new_w, int64_
     }
 }
 
-static void init_rect_pool(void)
-{
-    for (int i = 0; i < MAX_RECT_POOL - 1; i++)
-    {
-        g_rect_storage[i].next = &g_rect_storage[i + 1];
-    }
-    g_rect_storage[MAX_RECT_POOL - 1].next = NULL;
-
-    g_rect_free_list = &g_rect_storage[0];
-}
-
 Rect *rect_alloc(void)
 {
-    if (g_rect_free_list == NULL)
+    Rect *r = (Rect *)kmem_cache_alloc(&g_rect_cache);
+    if (r == NULL)
     {
-        kprint("ALERT: Rect Pool exhausted!\n");
-        return NULL;
+        kprint("ALERT: Rect cache out of memory!\n");
     }
-
-    Rect *r = g_rect_free_list;
-
-    g_rect_free_list = g_rect_free_list->next;
-    r->next = NULL;
     return r;
 }
 
 void rect_free(Rect *r)
 {
-    if (r == NULL)
-    {
-        return;
-    }
-
-    r->next = g_rect_free_list;
-    g_rect_free_list = r;
+    kmem_cache_free(&g_rect_cache, r);
 }
 
 int win_toggle_maximize(Window *win)
@@ -0,0 +1,18 @@
+#ifndef MEMINFO_H
+#define MEMINFO_H
+
+#include <stdint.h>
+
+#define MEMINFO_NUM_ORDERS 11 // free blocks of 2^0 .. 2^10 frames
+
+typedef struct MemInfo
+{
+    uint64_t total_frames;
+    uint64_t free_frames;
+    uint64_t magazine_frames;                 // free, but held by the per-CPU caches
+    uint64_t zeroed_frames;                   // free, and already cleared
+    uint64_t free_blocks[MEMINFO_NUM_ORDERS]; // free blocks of each order
+    int32_t largest_free_order;               // -1 if memory is full
+} MemInfo_t;
+
+#endif
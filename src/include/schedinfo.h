@@ -0,0 +1,34 @@
+#ifndef SCHEDINFO_H
+#define SCHEDINFO_H
+
+#include <stdint.h>
+
+// scheduling classes, in the order they run
+#define SCHED_RT 0     // ahead of everything else, round robin
+#define SCHED_NORMAL 1 // shares the CPU by nice level
+#define SCHED_IDLE 2   // only when nothing else is ready
+
+#define NICE_MIN -20
+#define NICE_MAX 19
+
+typedef struct SchedInfo
+{
+    uint32_t cpu;
+    uint32_t online;
+    uint64_t nr_tasks;   // on the run queue of the CPU, whatever their state
+    uint64_t nr_ready;   // ready to run, the running one included
+    uint64_t load_avg;   // nr_ready averaged over the last ticks, in hundredths of a task
+    uint64_t ticks;      // ticks accounted on the CPU, ticking or not
+    uint64_t idle_ticks; // of those, the ones it spent on its idle task
+    uint64_t switches;
+    uint64_t steals;   // tasks it took from another CPU when it had nothing to run
+    uint64_t balanced; // tasks it took from a busier CPU in the periodic rebalance
+    uint64_t stolen;   // its tasks that other CPUs took
+
+    // input events answered on this CPU: from the wakeup of the task to its next draw
+    uint64_t input_frames;
+    uint64_t input_cycles; // summed, in TSC cycles
+    uint64_t input_cycles_max;
+} SchedInfo_t;
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef SLABINFO_H
+#define SLABINFO_H
+
+#include <stdint.h>
+
+#define SLABINFO_NAME_LEN 24
+
+typedef struct SlabInfo
+{
+    char name[SLABINFO_NAME_LEN];
+    uint64_t obj_size;
+    uint64_t objs_per_slab;
+    uint64_t pages_per_slab;
+    uint64_t active_objs; // objects handed out
+    uint64_t total_objs;  // objects in all the slabs, free or not
+    uint64_t slabs;       // slabs held by the cache
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t pages_freed; // slabs that emptied and went back to the PMM
+} SlabInfo_t;
+
+#endif
@@ -15,6 +15,9 @@
 #define SYS_PIPE 10
 #define SYS_DUP2 11
 #define SYS_LIST_FILES 12
+#define SYS_SYNC 13
+#define SYS_FSYNC 14
+#define SYS_MOUNT_OPT 15
 
 // === PROCESS & TASK (20 - 29) ===
 #define SYS_FORK 20
@@ -23,12 +26,16 @@
 #define SYS_WAITPID 23
 #define SYS_GETPID 24
 #define SYS_SLEEP 25
+#define SYS_SCHED_INFO 26
+#define SYS_SET_PRIORITY 27
 
 // === MEMORY MANAGEMENT (30 - 39) ===
 #define SYS_SBRK 30
 #define SYS_MMAP 31
 #define SYS_MUNMAP 32
 #define SYS_FTRUNCATE 33
+#define SYS_SLAB_INFO 34
+#define SYS_MEM_INFO 35
 
 // === IPC (SHM & Message Queue) (40 - 49) ===
 #define SYS_SHM_OPEN 40
@@ -52,6 +59,7 @@
 #define SYS_SHUTDOWN 61
 #define SYS_GET_TIME 62
 #define SYS_GET_KEY 63
+#define SYS_GET_TICKS 64
 
 // === DEBUG & MISC (70 - 79) ===
 #define SYS_KPRINT 70
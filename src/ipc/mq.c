@@ -1,18 +1,54 @@
 #include "mq.h"
 #include "mem/kmalloc.h"
+#include "mem/slab.h"
 #include "../string.h"
 #include "drivers/serial.h"
+#include "utils/spinlock.h"
 
 static MessageQueue_t *g_mq_root = NULL;
+static kmem_cache_t g_msg_cache = KMEM_CACHE_INIT("Message_t", Message_t, NULL);
+static spinlock_t g_mq_lock = SPINLOCK_INIT; // the list of queues, and what's in them
+
+/**
+ * @brief Puts the current task on `wait_list`, and sleeps until it's woken.
+ * Called with g_mq_lock held and interrupts off, and returns the same way.
+ */
+static void mq_sleep(Task **wait_list)
+{
+    Task *curr_tsk = get_curr_task();
+    curr_tsk->wait_next = *wait_list;
+    *wait_list = curr_tsk;
+    curr_tsk->state = TASK_WAITING;
+
+    spin_unlock(&g_mq_lock);
+    schedule();
+    spin_lock(&g_mq_lock);
+}
+
+/**
+ * @brief Wakes the first task on `wait_list`, if any.
+ */
+static void mq_wake_one(Task **wait_list)
+{
+    Task *t = *wait_list;
+    if (t != NULL)
+    {
+        *wait_list = t->wait_next;
+        t->wait_next = NULL;
+        sched_wake_pid(t->pid);
+    }
+}
 
 MessageQueue_t *mq_open(const char *name, int flags)
 {
     (void)flags;
+    uint64_t rflags = spin_lock_irqsave(&g_mq_lock);
     MessageQueue_t *curr = g_mq_root;
     while (curr != NULL)
     {
         if (strcmp(name, curr->name) == 0)
         {
+            spin_unlock_irqrestore(&g_mq_lock, rflags);
             return curr;
         }
         curr = curr->next;
@@ -21,6 +57,7 @@ MessageQueue_t *mq_open(const char *name, int flags)
     MessageQueue_t *new_mq = (MessageQueue_t *)kmalloc(sizeof(MessageQueue_t));
     if (new_mq == NULL)
     {
+        spin_unlock_irqrestore(&g_mq_lock, rflags);
         kprint("MQ_OPEN failed: OOM\n");
         return NULL;
     }
@@ -31,27 +68,20 @@ MessageQueue_t *mq_open(const char *name, int flags)
     new_mq->msg_count = 0;
     new_mq->head = NULL;
     new_mq->tail = NULL;
+    new_mq->waiting_receivers = NULL;
+    new_mq->waiting_senders = NULL;
 
     new_mq->next = g_mq_root;
     g_mq_root = new_mq;
+    spin_unlock_irqrestore(&g_mq_lock, rflags);
 
     return new_mq;
 }
 
 int mq_send(MessageQueue_t *mq, const void *data, size_t size)
 {
-    while (mq->msg_count >= mq->max_msgs)
-    {
-        kprint("MQ_SEND: OOR\n");
-
-        Task *curr_tsk = get_curr_task();
-        curr_tsk->wait_next = mq->waiting_senders;
-        mq->waiting_senders = curr_tsk;
-
-        sched_block();
-    }
-
-    Message_t *msg = (Message_t *)kmalloc(sizeof(Message_t));
+    // the message is built before the queue is locked, so the lock isn't held across the copy
+    Message_t *msg = (Message_t *)kmem_cache_alloc(&g_msg_cache);
     if (msg == NULL)
     {
         kprint("MQ_SEND: OOM\n");
@@ -61,7 +91,7 @@ int mq_send(MessageQueue_t *mq, const void *data, size_t size)
     if (msg_data == NULL)
     {
         kprint("MQ_SEND: OOM\n");
-        kfree(msg);
+        kmem_cache_free(&g_msg_cache, msg);
         return -1;
     }
 
@@ -71,6 +101,13 @@ int mq_send(MessageQueue_t *mq, const void *data, size_t size)
     msg->size = size;
     msg->next = NULL;
 
+    uint64_t rflags = spin_lock_irqsave(&g_mq_lock);
+    while (mq->msg_count >= mq->max_msgs)
+    {
+        kprint("MQ_SEND: OOR\n");
+        mq_sleep(&mq->waiting_senders);
+    }
+
     if (mq->head == NULL)
     {
         mq->head = msg;
@@ -84,29 +121,19 @@ int mq_send(MessageQueue_t *mq, const void *data, size_t size)
 
     mq->msg_count += 1;
 
-    if (mq->waiting_receivers != NULL)
-    {
-        Task *t = mq->waiting_receivers;
-        mq->waiting_receivers = t->wait_next;
-
-        t->state = TASK_READY;
-        t->wait_next = NULL;
-    }
+    mq_wake_one(&mq->waiting_receivers);
+    spin_unlock_irqrestore(&g_mq_lock, rflags);
 
     return 0;
 }
 
 int mq_receive(MessageQueue_t *mq, void *buf, size_t len)
 {
+    uint64_t rflags = spin_lock_irqsave(&g_mq_lock);
     while (mq->head == NULL)
     {
         kprint("MQ_RECEIVE: Empty list\n");
-
-        Task *curr_tsk = get_curr_task();
-        curr_tsk->wait_next = mq->waiting_receivers;
-        mq->waiting_receivers = curr_tsk;
-
-        sched_block();
+        mq_sleep(&mq->waiting_receivers);
     }
 
     Message_t *msg = mq->head;
@@ -120,26 +147,21 @@ int mq_receive(MessageQueue_t *mq, void *buf, size_t len)
 
     mq->msg_count -= 1;
 
+    mq_wake_one(&mq->waiting_senders);
+    spin_unlock_irqrestore(&g_mq_lock, rflags);
+
     int read_size = msg->size < len ? msg->size : len;
     memcpy(buf, msg->data, read_size);
 
     kfree(msg->data);
-    kfree(msg);
-
-    if (mq->waiting_senders != NULL)
-    {
-        Task *t = mq->waiting_senders;
-        mq->waiting_senders = t->wait_next;
-
-        t->state = TASK_READY;
-        t->wait_next = NULL;
-    }
+    kmem_cache_free(&g_msg_cache, msg);
 
     return read_size;
 }
 
 int mq_unlink(const char *name)
 {
+    uint64_t rflags = spin_lock_irqsave(&g_mq_lock);
     MessageQueue_t *curr = g_mq_root;
     MessageQueue_t *prev = NULL;
 
@@ -155,6 +177,7 @@ int mq_unlink(const char *name)
 
     if (curr == NULL)
     {
+        spin_unlock_irqrestore(&g_mq_lock, rflags);
         return -1;
     }
 
@@ -167,13 +190,14 @@ int mq_unlink(const char *name)
         prev->next = curr->next;
         curr->next = NULL;
     }
+    spin_unlock_irqrestore(&g_mq_lock, rflags);
 
     Message_t *curr_msg = curr->head;
     while (curr_msg != NULL)
     {
         Message_t *next = curr_msg->next;
         kfree(curr_msg->data);
-        kfree(curr_msg);
+        kmem_cache_free(&g_msg_cache, curr_msg);
         curr_msg = next;
     }
 
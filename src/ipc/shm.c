@@ -119,9 +119,23 @@ int shm_set_size(SharedMem_t *shm, uint32_t new_size)
         return -1;
     }
 
-    for (uint32_t i = 0; i < num_pages; i++)
+    uint32_t i = 0;
+    while (i < num_pages)
     {
-        uint64_t phys_addr = pmm_alloc_frame();
+        // big segments take whole 2 MiB blocks, so sys_mmap can map them with 2 MiB pages
+        uint32_t count = 1;
+        uint64_t phys_addr = 0;
+        if (num_pages - i >= HUGE_PAGE_SIZE / PAGE_SIZE)
+        {
+            phys_addr = pmm_alloc_frames(HUGE_PAGE_ORDER);
+            count = HUGE_PAGE_SIZE / PAGE_SIZE;
+        }
+        if (phys_addr == 0)
+        {
+            phys_addr = pmm_alloc_frame();
+            count = 1;
+        }
+
         if (phys_addr == 0)
         {
             kprint("SHM: OOM during shm_set_size\n");
@@ -134,8 +148,11 @@ int shm_set_size(SharedMem_t *shm, uint32_t new_size)
         }
 
         void *virt_addr = (void *)vmm_phys_to_hhdm(phys_addr);
-        memset(virt_addr, 0, PAGE_SIZE);
-        page_list[i] = phys_addr;
+        memset(virt_addr, 0, (uint64_t)count * PAGE_SIZE);
+        for (uint32_t j = 0; j < count; j++)
+        {
+            page_list[i++] = phys_addr + (uint64_t)j * PAGE_SIZE;
+        }
     }
 
     shm->size = new_size;
@@ -155,7 +172,7 @@ vfs_node_t *shm_create_vfs_node(const char *name, int flags)
     }
     shm->ref_count++;
 
-    vfs_node_t *node = (vfs_node_t *)kmalloc(sizeof(vfs_node_t));
+    vfs_node_t *node = (vfs_node_t *)kmem_cache_alloc(&g_vfs_node_cache);
     if (node == NULL)
     {
         kprint("SHM_CREATE_VFS_NODE failed: OOM\n");
@@ -166,6 +183,7 @@ vfs_node_t *shm_create_vfs_node(const char *name, int flags)
     strncpy(node->name, name, strlen(name));
     node->flags = flags;
     node->length = 0;
+    node->ref_count = 1; // the handle's
     node->ops = &shm_ops;
     node->next = NULL;
     node->device_data = (void *)shm;
@@ -8,11 +8,14 @@
 #define PAGE_SIZE 0x1000
 #define KERN_BASE 0xFFFFFFFF80000000
 #define KERN_HEAP_START 0xFFFFFFFF90000000
+#define KERN_HEAP_SIZE 0x10000000 // 256MB
 #define USER_HEAP_START 0x20000000
 #define USER_MMAP_START 0x40000000
 #define USER_MMAP_SIZE 0x40000000
 #define USER_STACK_PAGES 0x2
 
+#define MAX_CPUS 16
+
 #define O_NONBLOCK 0x1
 
 #define CHAR_W 8 // based on the font.h
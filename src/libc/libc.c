@@ -219,6 +219,46 @@ int shutdown(void)
     syscall(SYS_SHUTDOWN, 0, 0, 0, 0, 0, 0);
 }
 
+void sync(void)
+{
+    syscall(SYS_SYNC, 0, 0, 0, 0, 0, 0);
+}
+
+int fsync(int fd)
+{
+    return (int)syscall(SYS_FSYNC, (uint64_t)fd, 0, 0, 0, 0, 0);
+}
+
+int mount_opt(const char *path, uint32_t flags)
+{
+    return (int)syscall(SYS_MOUNT_OPT, (uint64_t)path, (uint64_t)flags, 0, 0, 0, 0);
+}
+
+uint64_t get_ticks(void)
+{
+    return syscall(SYS_GET_TICKS, 0, 0, 0, 0, 0, 0);
+}
+
+int slab_info(SlabInfo_t *out, int max)
+{
+    return (int)syscall(SYS_SLAB_INFO, (uint64_t)out, (uint64_t)max, 0, 0, 0, 0);
+}
+
+int mem_info(MemInfo_t *out)
+{
+    return (int)syscall(SYS_MEM_INFO, (uint64_t)out, 0, 0, 0, 0, 0);
+}
+
+int sched_info(SchedInfo_t *out, int max)
+{
+    return (int)syscall(SYS_SCHED_INFO, (uint64_t)out, (uint64_t)max, 0, 0, 0, 0);
+}
+
+int set_priority(int pid, int policy, int nice)
+{
+    return (int)syscall(SYS_SET_PRIORITY, (uint64_t)pid, (uint64_t)policy, (uint64_t)nice, 0, 0, 0);
+}
+
 int win_create(WinParams_t *win_params)
 {
     return (int)syscall(SYS_CREATE_WIN, (uint64_t)win_params, 0, 0, 0, 0, 0);
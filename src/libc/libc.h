@@ -5,6 +5,9 @@
 #include "stat.h"
 #include "../include/time.h"
 #include "../include/event.h"
+#include "../include/slabinfo.h"
+#include "../include/meminfo.h"
+#include "../include/schedinfo.h"
 #include "../include/syscall_nums.h"
 
 #include <stdint.h>
@@ -23,6 +26,9 @@
 
 #define O_NONBLOCK 0x1
 
+#define MOUNT_WRITEBACK 0x0
+#define MOUNT_SYNC 0x1
+
 typedef struct dirent
 {
     char name[128];
@@ -67,6 +73,14 @@ int kill_fg(int shell_pid);
 int await_io(int *fds, int num_fds, int await_gui, int non_block);
 int win_get_size(int *w, int *h);
 int shutdown(void);
+void sync(void);
+int fsync(int fd);
+int mount_opt(const char *path, uint32_t flags);
+uint64_t get_ticks(void);
+int slab_info(SlabInfo_t *out, int max);
+int mem_info(MemInfo_t *out);
+int sched_info(SchedInfo_t *out, int max);
+int set_priority(int pid, int policy, int nice);
 
 char *strcpy(char *dest, const char *src);
 char *strncpy(char *dest, const char *src, size_t n);
@@ -6,6 +6,7 @@
 #include "arch/gdt.h"
 #include "arch/idt.h"
 #include "arch/syscall.h"
+#include "arch/smp.h"
 #include "mem/pmm.h"
 #include "mem/vmm.h"
 #include "mem/kmalloc.h"
@@ -26,6 +27,7 @@
 #include "fs/vfs.h"
 #include "fs/tar_fs.h"
 #include "fs/fat32.h"
+#include "fs/bcache.h"
 #include "cpu.h"
 #include "./string.h"
 #include "gui/window.h"
@@ -59,12 +61,17 @@ __attribute__((used, section(".limine_requests"))) static volatile struct limine
         .id = LIMINE_MODULE_REQUEST_ID,
         .revision = 0};
 
+__attribute__((used, section(".limine_requests"))) static volatile struct limine_mp_request mp_request =
+    {
+        .id = LIMINE_MP_REQUEST_ID,
+        .revision = 0,
+        .flags = 0}; // xAPIC: the local APIC is driven through its MMIO registers
+
 __attribute__((used, section(".limine_requests_start"))) static volatile uint64_t limine_requests_start_marker[4] = LIMINE_REQUESTS_START_MARKER;
 
 __attribute__((used, section(".limine_requests_end"))) static volatile uint64_t limine_requests_end_marker[2] = LIMINE_REQUESTS_END_MARKER;
 
 extern uint64_t *kern_pml4;
-extern uint64_t kern_stk_ptr;
 extern void enter_user_mode(uint64_t entry, uint64_t usr_stk_ptr);
 extern EventBuf g_event_queue;
 extern Window *g_desktop_win;
@@ -130,7 +137,7 @@ void k_ls(const char *path)
         return;
     }
 
-    if ((f->node->flags & VFS_DIRECTORY) == 0)
+    if ((f->node->flags & VFS_TYPE_MASK) != VFS_DIRECTORY)
     {
         kprint("k_ls: Not a directory!\n");
         vfs_close(f);
@@ -275,6 +282,224 @@ void test_fat32(vfs_node_t *fat_root)
     }
 }
 
+#ifdef ATA_BENCH
+/**
+ * @brief Sequential read benchmark of the data disk, PIO vs Bus Master DMA.
+ * Reads the first ATA_BENCH_BYTES of drive 1 with 64 KiB commands, bypassing
+ * the block cache. Build with `make CFLAGS+=-DATA_BENCH` to run it at boot.
+ */
+#define ATA_BENCH_BYTES (8 * 1024 * 1024)
+#define ATA_BENCH_CHUNK_SECTORS 0x80
+
+static uint64_t bench_ata_seq_read(uint8_t *buf)
+{
+    uint64_t start = timer_get_ticks();
+    for (uint32_t lba = 0; lba < ATA_BENCH_BYTES / SECTOR_SIZE; lba += ATA_BENCH_CHUNK_SECTORS)
+    {
+        ata_read_sectors((uint16_t *)buf, lba, ATA_BENCH_CHUNK_SECTORS, 1);
+    }
+    return timer_get_ticks() - start;
+}
+
+void bench_ata_dma()
+{
+    uint8_t *buf = (uint8_t *)vmm_alloc_global(ATA_BENCH_CHUNK_SECTORS * SECTOR_SIZE);
+    if (buf == NULL)
+    {
+        kprint("ATA BENCH: OOM\n");
+        return;
+    }
+
+    ata_set_dma(0);
+    uint64_t pio_ticks = bench_ata_seq_read(buf);
+
+    uint64_t dma_ticks = 0;
+    if (ata_dma_available())
+    {
+        ata_set_dma(1);
+        dma_ticks = bench_ata_seq_read(buf);
+    }
+
+    kprint("ATA BENCH: sequential read of ");
+    kprint_int(ATA_BENCH_BYTES / 1024);
+    kprint(" KiB\n  PIO: ");
+    kprint_int(pio_ticks);
+    kprint(" ticks\n  DMA: ");
+    kprint_int(dma_ticks);
+    kprint(" ticks\n");
+
+    vmm_free(buf);
+}
+#endif
+
+#ifdef PMM_BENCH
+/**
+ * @brief Frame allocation benchmark at different occupancies of the PMM.
+ * Takes every free frame, gives back a scattered share of them so the
+ * wanted fraction stays used, then counts alloc/free rounds of PMM_BENCH_BATCH
+ * frames for PMM_BENCH_TICKS. Build with `make CFLAGS+=-DPMM_BENCH` to run it at boot.
+ */
+#define PMM_BENCH_TICKS 50 // 10 ms per tick
+#define PMM_BENCH_BATCH 64
+
+// the frames held by the benchmark are chained through their first 8 bytes
+static uint64_t bench_pmm_take_all(void)
+{
+    uint64_t head = 0;
+    uint64_t phys;
+    while ((phys = pmm_alloc_frame()) != 0)
+    {
+        *(uint64_t *)vmm_phys_to_hhdm(phys) = head;
+        head = phys;
+    }
+    return head;
+}
+
+/**
+ * @brief Frees the held frames except `keep_pct` out of every 100, spread over the list.
+ */
+static uint64_t bench_pmm_thin_out(uint64_t head, uint32_t keep_pct)
+{
+    uint64_t kept = 0;
+    uint32_t i = 0;
+    while (head != 0)
+    {
+        uint64_t next = *(uint64_t *)vmm_phys_to_hhdm(head);
+        if (i % 100 < keep_pct)
+        {
+            *(uint64_t *)vmm_phys_to_hhdm(head) = kept;
+            kept = head;
+        }
+        else
+        {
+            pmm_free_frame(head);
+        }
+        head = next;
+        i++;
+    }
+    return kept;
+}
+
+static uint64_t bench_pmm_allocs_per_sec(void)
+{
+    uint64_t frames[PMM_BENCH_BATCH];
+    uint64_t allocs = 0;
+    uint64_t start = timer_get_ticks();
+    uint64_t elapsed = 0;
+    while (elapsed < PMM_BENCH_TICKS)
+    {
+        for (int i = 0; i < PMM_BENCH_BATCH; i++)
+        {
+            frames[i] = pmm_alloc_frame();
+        }
+        for (int i = 0; i < PMM_BENCH_BATCH; i++)
+        {
+            pmm_free_frame(frames[i]);
+        }
+        allocs += PMM_BENCH_BATCH;
+        elapsed = timer_get_ticks() - start;
+    }
+    return allocs * 100 / elapsed;
+}
+
+void bench_pmm()
+{
+    static const uint32_t occupancy[] = {10, 50, 95};
+
+    kprint("PMM BENCH: frame allocs per second\n");
+    for (uint32_t k = 0; k < sizeof(occupancy) / sizeof(occupancy[0]); k++)
+    {
+        uint64_t held = bench_pmm_thin_out(bench_pmm_take_all(), occupancy[k]);
+        uint64_t rate = bench_pmm_allocs_per_sec();
+        bench_pmm_thin_out(held, 0);
+
+        kprint("  ");
+        kprint_int(occupancy[k]);
+        kprint("% used: ");
+        kprint_int(rate);
+        kprint("\n");
+    }
+}
+#endif
+
+#ifdef HUGEPAGE_BENCH
+/**
+ * @brief Window blit benchmark, with 4 KiB pages vs 2 MiB pages.
+ * Copies a HUGEPAGE_BENCH_W x HUGEPAGE_BENCH_H window between two kernel
+ * buffers for HUGEPAGE_BENCH_TICKS, one narrow column strip at a time, the way
+ * a tall damaged rect is copied. Each row of a strip is on another 4 KiB page,
+ * so with small pages the copy needs far more TLB entries than the TLB holds.
+ * Build with `make CFLAGS+=-DHUGEPAGE_BENCH` to run it at boot.
+ */
+#define HUGEPAGE_BENCH_TICKS 100 // 10 ms per tick
+#define HUGEPAGE_BENCH_W 1024    // pixels, a row is one 4 KiB page
+#define HUGEPAGE_BENCH_H 1024
+#define HUGEPAGE_BENCH_STRIP 16 // pixels copied per row before moving down
+
+static void bench_blit_window(uint32_t *dst, const uint32_t *src)
+{
+    for (uint32_t x = 0; x < HUGEPAGE_BENCH_W; x += HUGEPAGE_BENCH_STRIP)
+    {
+        for (uint32_t y = 0; y < HUGEPAGE_BENCH_H; y++)
+        {
+            uint32_t off = y * HUGEPAGE_BENCH_W + x;
+            memcpy(&dst[off], &src[off], HUGEPAGE_BENCH_STRIP * sizeof(uint32_t));
+        }
+    }
+}
+
+static uint64_t bench_blits_per_sec(bool huge)
+{
+    size_t size = HUGEPAGE_BENCH_W * HUGEPAGE_BENCH_H * sizeof(uint32_t);
+
+    vmm_set_huge_pages(huge);
+    uint32_t *src = (uint32_t *)vmm_alloc_global(size);
+    uint32_t *dst = (uint32_t *)vmm_alloc_global(size);
+    vmm_set_huge_pages(true);
+
+    if (src == NULL || dst == NULL)
+    {
+        kprint("HUGEPAGE BENCH: OOM\n");
+        vmm_free(src);
+        vmm_free(dst);
+        return 0;
+    }
+
+    memset(src, 0x5A, size);
+    memset(dst, 0, size);
+
+    uint64_t blits = 0;
+    uint64_t start = timer_get_ticks();
+    uint64_t elapsed = 0;
+    while (elapsed < HUGEPAGE_BENCH_TICKS)
+    {
+        bench_blit_window(dst, src);
+        blits++;
+        elapsed = timer_get_ticks() - start;
+    }
+
+    vmm_free(src);
+    vmm_free(dst);
+    return blits * 100 / elapsed;
+}
+
+void bench_hugepage()
+{
+    uint64_t small_rate = bench_blits_per_sec(false);
+    uint64_t huge_rate = bench_blits_per_sec(true);
+
+    kprint("HUGEPAGE BENCH: ");
+    kprint_int(HUGEPAGE_BENCH_W);
+    kprint("x");
+    kprint_int(HUGEPAGE_BENCH_H);
+    kprint(" window blits per second\n  4 KiB pages: ");
+    kprint_int(small_rate);
+    kprint("\n  2 MiB pages: ");
+    kprint_int(huge_rate);
+    kprint("\n");
+}
+#endif
+
 static uint64_t prev_tick = 0;
 void update_clock(int clock_x, int clock_y)
 {
@@ -358,7 +583,8 @@ void kmain(void)
         hcf();
     }
 
-    gdt_init();
+    gdt_init(0);
+    smp_init_bsp();
     idt_init();
     enable_sse();
 
@@ -383,8 +609,15 @@ void kmain(void)
     syscall_init();
     dev_init_stdio();
     sched_init();
+    if (mp_request.response != NULL)
+    {
+        smp_start_aps(mp_request.response);
+    }
     ata_identify(1);
+    ata_dma_init();
+    ata_queue_init();
     sti();
+    bcache_init(BCACHE_DEFAULT_BUDGET);
     ata_fs_init();
 
     // check if we have the framebuffer to render on screen
@@ -410,7 +643,7 @@ void kmain(void)
         vfs_init();
 
         vfs_node_t *tar_root = tar_fs_init(tar_file->address);
-        vfs_mount("/", tar_root);
+        vfs_mount("/", tar_root, VFS_MOUNT_WRITEBACK);
 
         test_tar_fs();
     }
@@ -420,10 +653,22 @@ void kmain(void)
     }
 
     vfs_node_t *fat_root = fat32_init_fs(0, 1);
-    vfs_mount("/data", fat_root);
+    vfs_mount("/data", fat_root, VFS_MOUNT_WRITEBACK);
 
     test_fat32(fat_root);
 
+#ifdef ATA_BENCH
+    bench_ata_dma();
+#endif
+
+#ifdef PMM_BENCH
+    bench_pmm();
+#endif
+
+#ifdef HUGEPAGE_BENCH
+    bench_hugepage();
+#endif
+
     cursor_init();
 
     // test kprint
@@ -436,8 +681,17 @@ void kmain(void)
     // int clock_x = (int)video_get_width() - 80;
     // int clock_y = (int)video_get_height() - 80;
 
+    uint64_t last_flush_tick = timer_get_ticks();
+
     while (true)
     {
+        // write back the dirty disk blocks every once in a while
+        if (timer_get_ticks() - last_flush_tick >= BCACHE_FLUSH_INTERVAL)
+        {
+            vfs_sync();
+            last_flush_tick = timer_get_ticks();
+        }
+
         // Event Loop
         Event e;
         if (event_queue_pop(&g_event_queue, &e))
@@ -464,7 +718,7 @@ void kmain(void)
                         if (tsk != NULL && tsk->event_queue != NULL)
                         {
                             event_queue_push(tsk->event_queue, e);
-                            sched_wake_pid(top_win->owner_pid);
+                            sched_wake_input(top_win->owner_pid);
                         }
                     }
                 }
@@ -495,6 +749,8 @@ void kmain(void)
         cursor_paint();
         video_swap();
 
+        // nothing else to do until the next interrupt: zero some frames ahead
+        pmm_refill_zeroed();
         hlt();
     }
 }
@@ -1,87 +1,58 @@
+/**
+ * @file kmalloc.c
+ * @brief The general-purpose kernel allocator.
+ *
+ * Small requests go to size-class bins: the size is rounded up to the next
+ * power of two, and the bin is found from its bit length in O(1). Each bin is
+ * a slab cache, so alloc and free are O(1) too, and a bin gives its pages back
+ * to the PMM as they empty.
+ *
+ * Requests above KMALLOC_MAX_SMALL are mapped as contiguous virtual pages in the
+ * kernel heap region (vmm_alloc_global), which is shared by every address space.
+ * kfree tells the two apart by the address: slab objects live in the HHDM.
+ */
+
 #include <stddef.h>
 #include <stdint.h>
 
 #include "kmalloc.h"
-#include "pmm.h"
+#include "slab.h"
 #include "vmm.h"
-#include "drivers/serial.h" // debugging
 #include "kern_defs.h"
+#include "drivers/serial.h" // debugging
 
-extern uint64_t hhdm_offset;
-
-static FreeBlock *g_free_list_head = NULL;
-
-void kfree(void *ptr);
+static kmem_cache_t g_kmalloc_caches[KMALLOC_NUM_CLASSES] = {
+    KMEM_CACHE_INIT_SIZE("kmalloc-8", 8, NULL),
+    KMEM_CACHE_INIT_SIZE("kmalloc-16", 16, NULL),
+    KMEM_CACHE_INIT_SIZE("kmalloc-32", 32, NULL),
+    KMEM_CACHE_INIT_SIZE("kmalloc-64", 64, NULL),
+    KMEM_CACHE_INIT_SIZE("kmalloc-128", 128, NULL),
+    KMEM_CACHE_INIT_SIZE("kmalloc-256", 256, NULL),
+    KMEM_CACHE_INIT_SIZE("kmalloc-512", 512, NULL),
+    KMEM_CACHE_INIT_SIZE("kmalloc-1024", 1024, NULL),
+    KMEM_CACHE_INIT_SIZE("kmalloc-2048", 2048, NULL),
+};
 
-// Request a new page frame and update the g_free_list_head
-void *request_new_page()
+/**
+ * @brief Index of the smallest size class holding `size` bytes.
+ * E.G. 100 -> 128 = 1 << 7 -> class 7 - KMALLOC_MIN_SHIFT.
+ */
+static inline uint32_t kmalloc_class(size_t size)
 {
-    uint64_t phys_addr = pmm_alloc_frame();
-
-    if (phys_addr == 0)
-    {
-        return NULL;
-    }
-
-    FreeBlock *ptr = (FreeBlock *)vmm_phys_to_hhdm(phys_addr);
-
-    if (ptr == NULL)
-    {
-        return NULL;
-    }
-
-    // we need to convertthe phys_addr to virt_addr
-    if ((uint64_t)ptr < hhdm_offset)
+    if (size <= KMALLOC_MIN_SIZE)
     {
-        ptr = vmm_phys_to_hhdm((uint64_t)ptr);
+        return 0;
     }
-
-    FreeBlock *new_page = (FreeBlock *)ptr;
-    new_page->size = PAGE_SIZE;
-    kfree((void *)((uint8_t *)new_page + sizeof(FreeBlock)));
-
-    return new_page;
+    uint32_t shift = 64 - __builtin_clzll(size - 1);
+    return shift - KMALLOC_MIN_SHIFT;
 }
 
-// Walks through the free list to take the free block out
-// The block must be enough size for both data and header (FreeBlock)
-FreeBlock *find_free_block(size_t size)
+static inline int kmalloc_is_large(void *ptr)
 {
-    FreeBlock *prev_blk = NULL;
-    FreeBlock *cur_blk = g_free_list_head;
-
-    while (cur_blk != NULL)
-    {
-        if (cur_blk->size >= size + sizeof(FreeBlock))
-        {
-            if (prev_blk == NULL)
-            {
-                g_free_list_head = cur_blk->next;
-            }
-            else
-            {
-                prev_blk->next = cur_blk->next;
-            }
-            cur_blk->next = NULL;
-            return cur_blk;
-        }
-        prev_blk = cur_blk;
-        cur_blk = cur_blk->next;
-    }
-
-    return NULL;
+    uint64_t addr = (uint64_t)ptr;
+    return addr >= KERN_HEAP_START && addr < KERN_HEAP_START + KERN_HEAP_SIZE;
 }
 
-/**
- * Allocate space for the requested size.
- * If the requested size is larger than 4096 + header size,
- * we'll handle them differently, later...
- * Otherwise, we find the free block from the list.
- * If not found, request the block.
- * The returned address is the found block + header size.
- * If the remaining is large enough for header, we split the block,
- * and return the remaining free space to the list.
- */
 void *kmalloc(size_t size)
 {
     if (size == 0)
@@ -89,45 +60,12 @@ void *kmalloc(size_t size)
         return NULL;
     }
 
-    // round up to multiple of 8
-    size = (size + 7) & ~7;
-
-    if (size >= (PAGE_SIZE - sizeof(FreeBlock)))
+    if (size > KMALLOC_MAX_SMALL)
     {
-        return NULL; // TODO: we'll handle the edge case of allocating larger size later.
+        return vmm_alloc_global(size);
     }
 
-    FreeBlock *blk = find_free_block(size);
-    if (blk == NULL)
-    {
-        if (request_new_page() == NULL)
-        {
-            return NULL;
-        }
-        blk = find_free_block(size);
-        if (blk == NULL)
-        {
-            return NULL;
-        }
-    }
-
-    size_t allocated_size = sizeof(FreeBlock) + size;
-    size_t remaining_size = blk->size - allocated_size;
-    blk->size = allocated_size;
-    void *ptr = (uint8_t *)blk + sizeof(FreeBlock);
-
-    if (remaining_size >= sizeof(FreeBlock))
-    {
-        FreeBlock *remaining = (FreeBlock *)((uint8_t *)blk + allocated_size);
-        remaining->size = remaining_size;
-        kfree((void *)((uint8_t *)remaining + sizeof(FreeBlock)));
-    }
-    else
-    {
-        blk->size += remaining_size;
-    }
-
-    return ptr;
+    return kmem_cache_alloc(&g_kmalloc_caches[kmalloc_class(size)]);
 }
 
 void kfree(void *ptr)
@@ -137,55 +75,17 @@ void kfree(void *ptr)
         return;
     }
 
-    FreeBlock *blk_to_free = (FreeBlock *)((void *)ptr - sizeof(FreeBlock));
-
-    // coalescing
-    if (blk_to_free->size == 0)
+    if (kmalloc_is_large(ptr))
     {
+        vmm_free(ptr);
         return;
     }
 
-    // 1. find the predecessor
-    FreeBlock *prev = g_free_list_head;
-
-    // case 1:  in head of the list
-    if (g_free_list_head == NULL || (uint64_t)blk_to_free < (uint64_t)g_free_list_head)
+    kmem_cache_t *cache = kmem_cache_of(ptr);
+    if (cache < &g_kmalloc_caches[0] || cache >= &g_kmalloc_caches[KMALLOC_NUM_CLASSES])
     {
-        blk_to_free->next = g_free_list_head;
-        g_free_list_head = blk_to_free;
-
-        // merge right
-        if (blk_to_free->next != NULL &&
-            ((uint64_t)blk_to_free + blk_to_free->size) == (uint64_t)blk_to_free->next)
-        {
-            blk_to_free->size += blk_to_free->next->size;
-            blk_to_free->next = blk_to_free->next->next;
-        }
+        kprint("KFREE: pointer wasn't allocated by kmalloc\n");
         return;
     }
-
-    // case 2: insert in the middle, or end
-    while (prev->next != NULL && (uint64_t)prev->next < (uint64_t)blk_to_free)
-    {
-        prev = prev->next;
-    }
-
-    // 2. insert the blk_to_free after pred
-    blk_to_free->next = prev->next;
-    prev->next = blk_to_free;
-
-    // 3. merge right - blk_to_free /w next?
-    if (blk_to_free->next != NULL &&
-        ((uint64_t)blk_to_free + blk_to_free->size) == (uint64_t)blk_to_free->next)
-    {
-        blk_to_free->size += blk_to_free->next->size;
-        blk_to_free->next = blk_to_free->next->next;
-    }
-
-    // 4. merge left - pred /w blk_to_free
-    if (((uint64_t)prev + prev->size) == (uint64_t)blk_to_free)
-    {
-        prev->size += blk_to_free->size;
-        prev->next = blk_to_free->next;
-    }
-}
\ No newline at end of file
+    kmem_cache_free(cache, ptr);
+}
@@ -5,17 +5,17 @@
 #include <stdint.h>
 
 /**
- * We'll use Singly Linked List to 
- * manage the free blocks of memory
+ * Small sizes are rounded up to a power of two, from KMALLOC_MIN_SIZE
+ * to KMALLOC_MAX_SMALL, and served by one slab cache per size class.
+ * Anything larger is mapped as whole pages in the kernel heap.
  */
-
-typedef struct FreeBlock
-{
-    size_t size;
-    struct FreeBlock* next;
-} FreeBlock;
+#define KMALLOC_MIN_SHIFT 3
+#define KMALLOC_MAX_SHIFT 11
+#define KMALLOC_MIN_SIZE (1UL << KMALLOC_MIN_SHIFT)
+#define KMALLOC_MAX_SMALL (1UL << KMALLOC_MAX_SHIFT)
+#define KMALLOC_NUM_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
 
 void* kmalloc(size_t size);
 void kfree(void* blk_to_free);
 
-#endif
\ No newline at end of file
+#endif
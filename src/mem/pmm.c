@@ -1,43 +1,114 @@
 /**
  * @file pmm.c
- * @brief A bitmap-based Physical Memory Manager (PMM).
+ * @brief A buddy Physical Memory Manager (PMM), backed by a bitmap.
  *
  * The PMM is responsible for one of the most critical tasks in the kernel:
  * managing the machine's physical memory. It allows the kernel to allocate
  * and free physical memory in fixed-size chunks called "frames" (or "pages").
  *
- * This implementation uses a bitmap, which is a simple and efficient way to
- * track the status of every single page frame. Each bit in the bitmap corresponds
- * to a physical page: if the bit is 1, the page is used; if it's 0, it's free.
+ * Free memory is kept in blocks of 2^order frames, aligned to their size, with
+ * one free list per order. An allocation takes a block of the smallest order
+ * that fits, splitting a bigger one in halves (buddies) if needed. A freed
+ * block is merged with its buddy whenever the buddy is free too, and so on
+ * upwards. Both take at most PMM_MAX_ORDER steps, i.e. O(log n).
+ *
+ * The bitmap still tracks every single frame: if the bit is 1, the page is
+ * used; if it's 0, it's free. The head frame of each free block is tagged
+ * in `ref_counts` with its order, which is how a buddy is found free.
+ *
+ * In front of the buddy lists, each CPU keeps a magazine: a small stack of free
+ * frames. Single frames are taken from and given back to it, and it's refilled
+ * and drained PMM_MAG_BATCH frames at a time, so most frame allocations never
+ * touch the shared lists. The frames in a magazine stay marked used in the
+ * bitmap, with a ref_count of 0.
+ *
+ * The buddy lists, the bitmap and the zeroed pool are shared by the CPUs, under
+ * `g_pmm_lock`. Each magazine has a lock of its own, which only another CPU
+ * draining it contends for; it's taken before `g_pmm_lock`. Frames can be
+ * shared between tasks running on different CPUs, so ref_counts change atomically.
+ *
+ * A pool of frames that are already zeroed sits next to the magazines, for the
+ * allocations that need a clean page (page tables, ELF segments, first-touch
+ * user pages). The idle loop tops it up, clearing the frames with
+ * non-temporal stores so the zeroing doesn't evict the cache. Pool frames are
+ * also marked used in the bitmap with a ref_count of 0.
+ *
+ * The bitmap is scanned a 64-bit word at a time, and a summary bitmap above it
+ * has one bit per word that is completely used, so a scan skips 4096 used
+ * frames per summary word, and finds the first free frame with tzcnt.
  */
 
 #include "pmm.h"
 #include "kern_defs.h"
 #include "vmm.h"
+#include "utils/asm_instrs.h"
+#include "utils/spinlock.h"
+#include "cpu.h"
 #include "../string.h"
 
 #include <limine.h>
 #include <stddef.h>
 
+#define PMM_FREE_TAG 0x80000000 // ref_counts of a free block's head frame: PMM_FREE_TAG | order
+
+#define PMM_MAG_SIZE 64       // frames a CPU keeps at hand
+#define PMM_MAG_BATCH_ORDER 5 // frames move between a magazine and the buddy lists 2^5 at a time
+#define PMM_MAG_BATCH (1 << PMM_MAG_BATCH_ORDER)
+
+#define PMM_ZERO_POOL_SIZE 256 // zeroed frames kept ready, 1 MiB
+#define PMM_ZERO_REFILL 16     // frames zeroed per idle pass
+
 // Global variables that manage the state of our physical memory
 
 uint64_t hhdm_offset = 0; // the begin of the virtual address provided by limine, this is a shared by other components as well
-static uint8_t *bitmap = NULL;
+static uint64_t *bitmap = NULL;
+static uint64_t *summary = NULL; // bit set: that bitmap word is all used
 static uint32_t *ref_counts = NULL;
 static uint64_t highest_addr = 0;
-static size_t bitmap_size = 0;
-static size_t bitmap_page_count = 0;
+static size_t bitmap_words = 0;
+static size_t summary_words = 0;
+static size_t meta_page_count = 0; // pages holding the bitmap, the summary and the ref_counts
 static size_t total_pages = 0;
-static size_t last_free_page = 0; // speed up allocation searches
 static size_t ref_counts_size = 0;
-static size_t ref_counts_page_count = 0;
+
+// a free block is linked through its first frame, reached via the HHDM
+typedef struct pmm_free_block
+{
+    struct pmm_free_block *prev;
+    struct pmm_free_block *next;
+} pmm_free_block_t;
+
+static spinlock_t g_pmm_lock = SPINLOCK_INIT;
+
+static pmm_free_block_t *g_free_area[PMM_MAX_ORDER + 1];
+static uint64_t g_free_count[PMM_MAX_ORDER + 1]; // blocks on each list
+static uint32_t g_area_mask = 0;                  // bit `order` set: that list isn't empty
+static size_t g_free_frames = 0; // on the buddy lists
+
+typedef struct pmm_magazine
+{
+    spinlock_t lock;
+    uint64_t frames[PMM_MAG_SIZE]; // physical addresses
+    uint32_t count;
+} pmm_magazine_t;
+
+static pmm_magazine_t g_mags[MAX_CPUS];
+static size_t g_mag_frames = 0; // free frames sitting in the magazines, changed atomically
+
+static uint64_t g_zero_pool[PMM_ZERO_POOL_SIZE]; // physical addresses of zeroed frames
+static size_t g_zero_frames = 0;
 
 /**
  * @brief Sets a bit in the bitmap to mark a page is used
  */
 void bitmap_set(size_t bit)
 {
-    bitmap[bit / 8] |= (1 << (bit % 8));
+    size_t w = bit / 64;
+    bitmap[w] |= 1ULL << (bit % 64);
+    if (bitmap[w] == ~0ULL)
+    {
+        summary[w / 64] |= 1ULL << (w % 64);
+    }
 }
 
 /**
@@ -45,7 +116,9 @@ void bitmap_set(size_t bit)
  */
 void bitmap_clear(size_t bit)
 {
-    bitmap[bit / 8] &= ~(1 << (bit % 8));
+    size_t w = bit / 64;
+    bitmap[w] &= ~(1ULL << (bit % 64));
+    summary[w / 64] &= ~(1ULL << (w % 64));
 }
 
 /**
@@ -53,7 +126,201 @@ void bitmap_clear(size_t bit)
  */
 bool bitmap_test(size_t bit)
 {
-    return bitmap[bit / 8] & (1 << (bit % 8));
+    return bitmap[bit / 64] & (1ULL << (bit % 64));
+}
+
+/**
+ * @brief Finds the first free frame at or after `from`.
+ *
+ * @details MECHANISM:
+ * 1. Check the rest of the word `from` is in.
+ * 2. Then find the next word that isn't all used, from the summary:
+ * each summary word covers 64 bitmap words, and tzcnt of its inverse
+ * gives the first of them with a free frame.
+ * 3. tzcnt of that word's inverse gives the frame.
+ *
+ * @return size_t the frame index, or total_pages if there's none.
+ */
+static size_t bitmap_find_free(size_t from)
+{
+    if (from >= total_pages)
+    {
+        return total_pages;
+    }
+
+    size_t w = from / 64;
+    uint64_t free_bits = ~bitmap[w] & (~0ULL << (from % 64));
+    if (free_bits != 0)
+    {
+        size_t bit = w * 64 + __builtin_ctzll(free_bits);
+        return bit < total_pages ? bit : total_pages;
+    }
+
+    w++;
+    while (w < bitmap_words)
+    {
+        size_t s = w / 64;
+        uint64_t open_words = ~summary[s] & (~0ULL << (w % 64));
+        if (open_words == 0)
+        {
+            w = (s + 1) * 64; // all 64 words of this summary word are used
+            continue;
+        }
+
+        w = s * 64 + __builtin_ctzll(open_words);
+        size_t bit = w * 64 + __builtin_ctzll(~bitmap[w]);
+        return bit < total_pages ? bit : total_pages;
+    }
+    return total_pages;
+}
+
+static inline pmm_free_block_t *pmm_block_at(size_t idx)
+{
+    return (pmm_free_block_t *)vmm_phys_to_hhdm((uint64_t)idx * PAGE_SIZE);
+}
+
+static inline size_t pmm_block_idx(pmm_free_block_t *blk)
+{
+    return vmm_hhdm_to_phys(blk) / PAGE_SIZE;
+}
+
+/**
+ * @brief Puts the free block at frame `idx` on the list of `order`.
+ */
+static void pmm_area_push(size_t idx, uint32_t order)
+{
+    pmm_free_block_t *blk = pmm_block_at(idx);
+    blk->prev = NULL;
+    blk->next = g_free_area[order];
+    if (blk->next != NULL)
+    {
+        blk->next->prev = blk;
+    }
+    g_free_area[order] = blk;
+    g_free_count[order]++;
+    g_area_mask |= 1U << order;
+    ref_counts[idx] = PMM_FREE_TAG | order;
+}
+
+static void pmm_area_remove(size_t idx, uint32_t order)
+{
+    pmm_free_block_t *blk = pmm_block_at(idx);
+    if (blk->prev != NULL)
+    {
+        blk->prev->next = blk->next;
+    }
+    else
+    {
+        g_free_area[order] = blk->next;
+        if (blk->next == NULL)
+        {
+            g_area_mask &= ~(1U << order);
+        }
+    }
+    if (blk->next != NULL)
+    {
+        blk->next->prev = blk->prev;
+    }
+    g_free_count[order]--;
+    ref_counts[idx] = 0;
+}
+
+/**
+ * @brief Gives the block of 2^order frames at `idx` back to the free lists,
+ * merging it with its buddy for as long as the buddy is a free block of the same order.
+ * The frames must already be marked free in the bitmap.
+ */
+static void pmm_buddy_free(size_t idx, uint32_t order)
+{
+    while (order < PMM_MAX_ORDER)
+    {
+        size_t buddy = idx ^ ((size_t)1 << order);
+        if (buddy >= total_pages || ref_counts[buddy] != (PMM_FREE_TAG | order))
+        {
+            break;
+        }
+        pmm_area_remove(buddy, order);
+        if (buddy < idx)
+        {
+            idx = buddy;
+        }
+        order++;
+    }
+    pmm_area_push(idx, order);
+}
+
+/**
+ * @brief Takes a free block of 2^order frames, splitting a bigger one if needed.
+ * @return size_t the index of the first frame, or 0 if none is left (frame 0 is never free).
+ */
+static size_t pmm_buddy_alloc(uint32_t order)
+{
+    // the smallest order with a free block, without walking the empty lists
+    uint32_t avail = g_area_mask >> order;
+    if (avail == 0)
+    {
+        return 0;
+    }
+    uint32_t o = order + __builtin_ctz(avail);
+
+    size_t idx = pmm_block_idx(g_free_area[o]);
+    pmm_area_remove(idx, o);
+
+    // keep the lower half, give the upper half back
+    while (o > order)
+    {
+        o--;
+        pmm_area_push(idx + ((size_t)1 << o), o);
+    }
+    return idx;
+}
+
+/**
+ * @brief Are the `count` frames from `idx` all free in the bitmap?
+ */
+static bool pmm_range_is_free(size_t idx, size_t count)
+{
+    size_t end = idx + count;
+    while (idx < end)
+    {
+        size_t bits = 64 - idx % 64;
+        if (bits > end - idx)
+        {
+            bits = end - idx;
+        }
+        uint64_t mask = (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) << (idx % 64);
+        if (bitmap[idx / 64] & mask)
+        {
+            return false;
+        }
+        idx += bits;
+    }
+    return true;
+}
+
+/**
+ * @brief Builds the free lists from the bitmap, using the largest aligned blocks that fit.
+ */
+static void pmm_seed_free_areas(void)
+{
+    size_t i = bitmap_find_free(0);
+    while (i < total_pages)
+    {
+        uint32_t order = PMM_MAX_ORDER;
+        while (order > 0)
+        {
+            size_t count = (size_t)1 << order;
+            if ((i & (count - 1)) == 0 && i + count <= total_pages && pmm_range_is_free(i, count))
+            {
+                break;
+            }
+            order--;
+        }
+
+        pmm_area_push(i, order);
+        g_free_frames += (size_t)1 << order;
+        i = bitmap_find_free(i + ((size_t)1 << order));
+    }
 }
 
 /**
@@ -95,22 +362,24 @@ void pmm_init(struct limine_memmap_response *memmap_resp, struct limine_hhdm_res
     total_pages = highest_addr / PAGE_SIZE;
 
     // compute the size of the bitmap needed to track all pages.
-    // each bit is to track 1 page, so we divide the byte by 8 bits
-    bitmap_size = total_pages / 8;
-    bitmap_page_count = (bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    // each bit is to track 1 page, in 64-bit words; the summary has a bit per word
+    bitmap_words = (total_pages + 63) / 64;
+    summary_words = (bitmap_words + 63) / 64;
 
     // compute the size of the ref_count map.
     ref_counts_size = total_pages * sizeof(uint32_t);
-    ref_counts_page_count = (ref_counts_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t meta_size = (bitmap_words + summary_words) * sizeof(uint64_t) + ref_counts_size;
+    meta_page_count = (meta_size + PAGE_SIZE - 1) / PAGE_SIZE;
 
     // find a chunk of PM that is large enough to store the bitmap
     for (uint64_t i = 0; i < memmap_entries_cnt; i++)
     {
         struct limine_memmap_entry *entry = memmap[i];
-        if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= ((bitmap_page_count * PAGE_SIZE) + (ref_counts_page_count * PAGE_SIZE)))
+        if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= meta_page_count * PAGE_SIZE)
         {
-            bitmap = (uint8_t *)vmm_phys_to_hhdm(entry->base);
-            ref_counts = (uint32_t *)(bitmap + bitmap_size);
+            bitmap = (uint64_t *)vmm_phys_to_hhdm(entry->base);
+            summary = bitmap + bitmap_words;
+            ref_counts = (uint32_t *)(summary + summary_words);
             break;
         }
     }
@@ -124,10 +393,14 @@ void pmm_init(struct limine_memmap_response *memmap_resp, struct limine_hhdm_res
         }
     }
 
-    // marks all pages to be used
-    for (size_t i = 0; i < bitmap_size; i++)
+    // marks all pages to be used, including the bits past the last page
+    for (size_t i = 0; i < bitmap_words; i++)
     {
-        bitmap[i] = 0xFF;
+        bitmap[i] = ~0ULL;
+    }
+    for (size_t i = 0; i < summary_words; i++)
+    {
+        summary[i] = ~0ULL;
     }
 
     // we iterate through each entry, check if it's usable; if yes, make it as free
@@ -144,7 +417,7 @@ void pmm_init(struct limine_memmap_response *memmap_resp, struct limine_hhdm_res
     }
 
     // remember we store bitmap in the usable memory? we mark the page to be used as well.
-    for (size_t i = 0; i < bitmap_page_count + ref_counts_page_count; i++)
+    for (size_t i = 0; i < meta_page_count; i++)
     {
         bitmap_set((vmm_hhdm_to_phys((uint64_t *)bitmap) / PAGE_SIZE) + i);
     }
@@ -156,61 +429,406 @@ void pmm_init(struct limine_memmap_response *memmap_resp, struct limine_hhdm_res
     }
 
     memset(ref_counts, 0, ref_counts_size);
+    pmm_seed_free_areas();
+}
+
+/**
+ * @brief Moves the free block of 2^order frames at `idx` into `mag`.
+ * This and the other pmm_mag_ helpers run with both `mag` and `g_pmm_lock` held.
+ * The lowest frame ends up on top, so the frames are handed out in order.
+ */
+static void pmm_mag_fill(pmm_magazine_t *mag, size_t idx, uint32_t order)
+{
+    size_t count = (size_t)1 << order;
+    for (size_t i = idx + count; i > idx; i--)
+    {
+        bitmap_set(i - 1);
+        mag->frames[mag->count++] = (uint64_t)(i - 1) * PAGE_SIZE;
+    }
+    g_free_frames -= count;
+    __atomic_fetch_add(&g_mag_frames, count, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Refills an empty magazine with a batch from the buddy lists:
+ * one block of PMM_MAG_BATCH frames if there's one, frame by frame otherwise.
+ */
+static void pmm_mag_refill(pmm_magazine_t *mag)
+{
+    size_t idx = pmm_buddy_alloc(PMM_MAG_BATCH_ORDER);
+    if (idx != 0)
+    {
+        pmm_mag_fill(mag, idx, PMM_MAG_BATCH_ORDER);
+        return;
+    }
+
+    while (mag->count < PMM_MAG_BATCH && (idx = pmm_buddy_alloc(0)) != 0)
+    {
+        pmm_mag_fill(mag, idx, 0);
+    }
+}
+
+/**
+ * @brief Gives the top `count` frames of `mag` back to the buddy lists.
+ */
+static void pmm_mag_drain(pmm_magazine_t *mag, uint32_t count)
+{
+    while (count > 0 && mag->count > 0)
+    {
+        size_t idx = mag->frames[--mag->count] / PAGE_SIZE;
+        bitmap_clear(idx);
+        pmm_buddy_free(idx, 0);
+        g_free_frames++;
+        __atomic_fetch_sub(&g_mag_frames, 1, __ATOMIC_RELAXED);
+        count--;
+    }
+}
+
+/**
+ * @brief Gives every frame of the zeroed pool back to the buddy lists.
+ * Called with `g_pmm_lock` held, when memory is too short to keep them aside.
+ */
+static void pmm_zero_drain(void)
+{
+    while (g_zero_frames > 0)
+    {
+        size_t idx = g_zero_pool[--g_zero_frames] / PAGE_SIZE;
+        bitmap_clear(idx);
+        pmm_buddy_free(idx, 0);
+        g_free_frames++;
+    }
+}
+
+/**
+ * @brief Clears a frame with non-temporal stores, which bypass the cache:
+ * the frame is zeroed ahead of time, and filling the cache with it would
+ * only evict the data of whoever runs next.
+ */
+static void pmm_clear_frame_nt(void *frame)
+{
+    uint64_t *p = (uint64_t *)frame;
+    uint64_t *end = p + PAGE_SIZE / sizeof(uint64_t);
+    for (; p < end; p += 4)
+    {
+        asm volatile(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)"
+            :
+            : "r"(p), "r"(0ULL)
+            : "memory");
+    }
+    asm volatile("sfence" ::: "memory");
+}
+
+/**
+ * @brief Takes a frame from the zeroed pool.
+ * @return Its physical address, with a ref_count still at 0, or 0 if the pool is empty.
+ */
+static uint64_t pmm_zero_pop(void)
+{
+    uint64_t phys = 0;
+    spin_lock(&g_pmm_lock);
+    if (g_zero_frames > 0)
+    {
+        phys = g_zero_pool[--g_zero_frames];
+    }
+    spin_unlock(&g_pmm_lock);
+    return phys;
 }
 
 /**
- * @brief Allocates a single physical memory frame.
+ * @brief Allocates 2^order physically contiguous frames, aligned to their size.
+ * Every frame of the block starts with a ref_count of 1, and can be freed on its own.
+ * @return The physical address of the first frame, or 0 if there's no such block left.
+ */
+uint64_t pmm_alloc_frames(uint32_t order)
+{
+    if (order == 0)
+    {
+        return pmm_alloc_frame();
+    }
+    if (order > PMM_MAX_ORDER)
+    {
+        return 0;
+    }
+
+    uint64_t rflags = spin_lock_irqsave(&g_pmm_lock);
+
+    size_t idx = pmm_buddy_alloc(order);
+    if (idx == 0 && __atomic_load_n(&g_mag_frames, __ATOMIC_RELAXED) + g_zero_frames > 0)
+    {
+        // the frames held by the magazines may be what keeps the block from merging
+        spin_unlock(&g_pmm_lock);
+        for (uint32_t c = 0; c < MAX_CPUS; c++)
+        {
+            spin_lock(&g_mags[c].lock);
+            spin_lock(&g_pmm_lock);
+            pmm_mag_drain(&g_mags[c], PMM_MAG_SIZE);
+            spin_unlock(&g_pmm_lock);
+            spin_unlock(&g_mags[c].lock);
+        }
+        spin_lock(&g_pmm_lock);
+        pmm_zero_drain();
+        idx = pmm_buddy_alloc(order);
+    }
+    if (idx == 0)
+    {
+        spin_unlock_irqrestore(&g_pmm_lock, rflags);
+        return 0; // mem is full
+    }
+
+    size_t count = (size_t)1 << order;
+    for (size_t i = idx; i < idx + count; i++)
+    {
+        bitmap_set(i);
+        ref_counts[i] = 1;
+    }
+    g_free_frames -= count;
+
+    spin_unlock_irqrestore(&g_pmm_lock, rflags);
+    return (uint64_t)idx * PAGE_SIZE;
+}
+
+/**
+ * @brief Allocates a single physical memory frame, from this CPU's magazine.
  * @return A physical address to the start of the allocated 4KB frame, or NULL if out of memory.
  */
 uint64_t pmm_alloc_frame(void)
 {
-    // starts scanning from the last known free page, do not start the scanning from the beginning
-    for (size_t i = last_free_page; i < total_pages; i++)
+    uint64_t rflags = get_rflags();
+    cli();
+
+    pmm_magazine_t *mag = &g_mags[cpu_id()];
+    spin_lock(&mag->lock);
+    if (mag->count == 0)
+    {
+        spin_lock(&g_pmm_lock);
+        pmm_mag_refill(mag);
+        spin_unlock(&g_pmm_lock);
+    }
+
+    uint64_t phys = 0;
+    if (mag->count > 0)
+    {
+        phys = mag->frames[--mag->count];
+        __atomic_fetch_sub(&g_mag_frames, 1, __ATOMIC_RELAXED);
+    }
+    spin_unlock(&mag->lock);
+
+    if (phys == 0)
+    {
+        phys = pmm_zero_pop(); // the last free frames may be zeroed ones
+    }
+    if (phys == 0)
+    {
+        irq_restore(rflags);
+        return 0; // mem is full
+    }
+    ref_counts[phys / PAGE_SIZE] = 1;
+
+    irq_restore(rflags);
+    return phys;
+}
+
+/**
+ * @brief Allocates a single frame filled with zeros.
+ * It comes from the zeroed pool when there's one ready, and is cleared on the spot otherwise.
+ * @return The physical address of the frame, or 0 if out of memory.
+ */
+uint64_t pmm_alloc_zeroed_frame(void)
+{
+    uint64_t rflags = get_rflags();
+    cli();
+    uint64_t phys = pmm_zero_pop();
+    irq_restore(rflags);
+
+    if (phys != 0)
     {
-        if (!bitmap_test(i))
-        { // page is free?
-            bitmap_set(i);
-            ref_counts[i] = 1;
-            last_free_page = i + 1;
-            return (uint64_t)(i * PAGE_SIZE); // convert to a virtual address.
+        ref_counts[phys / PAGE_SIZE] = 1;
+        return phys;
+    }
+
+    phys = pmm_alloc_frame();
+    if (phys != 0)
+    {
+        memset(vmm_phys_to_hhdm(phys), 0, PAGE_SIZE);
+    }
+    return phys;
+}
+
+/**
+ * @brief Zeroes up to PMM_ZERO_REFILL free frames into the zeroed pool.
+ * Meant for the idle loop: the frames are cleared with interrupts on, so a
+ * wakeup is never held back by more than one frame.
+ */
+void pmm_refill_zeroed(void)
+{
+    for (uint32_t n = 0; n < PMM_ZERO_REFILL; n++)
+    {
+        if (g_zero_frames >= PMM_ZERO_POOL_SIZE)
+        {
+            return;
+        }
+
+        uint64_t phys = pmm_alloc_frame();
+        if (phys == 0)
+        {
+            return;
+        }
+
+        pmm_clear_frame_nt(vmm_phys_to_hhdm(phys));
+
+        uint64_t rflags = spin_lock_irqsave(&g_pmm_lock);
+        if (g_zero_frames < PMM_ZERO_POOL_SIZE)
+        {
+            ref_counts[phys / PAGE_SIZE] = 0;
+            g_zero_pool[g_zero_frames++] = phys;
+            spin_unlock_irqrestore(&g_pmm_lock, rflags);
+        }
+        else
+        {
+            spin_unlock_irqrestore(&g_pmm_lock, rflags);
+            pmm_free_frame(phys);
+            return;
         }
     }
+}
+
+/**
+ * @brief Allocates `n` frames at once, not necessarily contiguous, into `out`.
+ * For callers that need many frames right away (ELF segments, stacks): the
+ * magazine is emptied and refilled in batches instead of frame by frame.
+ * @return size_t `n`, or 0 if there weren't enough frames (none are kept then).
+ */
+size_t pmm_alloc_frames_batch(size_t n, uint64_t *out)
+{
+    uint64_t rflags = get_rflags();
+    cli();
 
-    // if the above failed, we start from the beginning. Why? there might be a page freed before the last_free_page
-    for (size_t i = 0; i < last_free_page; i++)
+    pmm_magazine_t *mag = &g_mags[cpu_id()];
+    spin_lock(&mag->lock);
+    size_t got = 0;
+    while (got < n)
     {
-        if (!bitmap_test(i))
+        if (mag->count == 0)
         {
-            bitmap_set(i);
-            ref_counts[i] = 1;
-            last_free_page = i + 1;
-            return (uint64_t)(i * PAGE_SIZE);
+            spin_lock(&g_pmm_lock);
+            pmm_mag_refill(mag);
+            spin_unlock(&g_pmm_lock);
+            if (mag->count == 0)
+            {
+                break;
+            }
+        }
+
+        while (got < n && mag->count > 0)
+        {
+            uint64_t phys = mag->frames[--mag->count];
+            ref_counts[phys / PAGE_SIZE] = 1;
+            out[got++] = phys;
+            __atomic_fetch_sub(&g_mag_frames, 1, __ATOMIC_RELAXED);
         }
     }
 
-    return 0; // mem is full
+    spin_unlock(&mag->lock);
+    irq_restore(rflags);
+
+    if (got < n)
+    {
+        for (size_t i = 0; i < got; i++)
+        {
+            pmm_free_frame(out[i]);
+        }
+        return 0;
+    }
+    return n;
 }
 
 /**
- * @brief Frees a previously allocated physical memory frame.
+ * @brief Drops a reference on a frame, and frees it with the last one.
+ * The frame goes to this CPU's magazine; a full magazine drains half of it first.
  * @param frame_addr The physical address of the frame to free.
  */
 void pmm_free_frame(uint64_t phys_addr)
 {
-    // convert back from VM addr to PM addr, and compute the bit index in the bitmap
     size_t bit = phys_addr / PAGE_SIZE;
-    if (bitmap_test(bit))
+    if (bit >= total_pages)
     {
-        // mark it as free
-        ref_counts[bit] -= 1;
-        if (ref_counts[bit] == 0)
+        return;
+    }
+
+    if (!bitmap_test(bit) || __atomic_load_n(&ref_counts[bit], __ATOMIC_RELAXED) == 0)
+    {
+        return;
+    }
+    if (__atomic_sub_fetch(&ref_counts[bit], 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+
+    uint64_t rflags = get_rflags();
+    cli();
+
+    pmm_magazine_t *mag = &g_mags[cpu_id()];
+    spin_lock(&mag->lock);
+    if (mag->count == PMM_MAG_SIZE)
+    {
+        spin_lock(&g_pmm_lock);
+        pmm_mag_drain(mag, PMM_MAG_BATCH);
+        spin_unlock(&g_pmm_lock);
+    }
+    mag->frames[mag->count++] = (uint64_t)bit * PAGE_SIZE;
+    __atomic_fetch_add(&g_mag_frames, 1, __ATOMIC_RELAXED);
+    spin_unlock(&mag->lock);
+
+    irq_restore(rflags);
+}
+
+/**
+ * @brief Frees a block from `pmm_alloc_frames`.
+ * If no frame of it is shared anymore, the whole block goes back at once;
+ * otherwise every frame drops its own reference.
+ */
+void pmm_free_frames(uint64_t phys_addr, uint32_t order)
+{
+    size_t idx = phys_addr / PAGE_SIZE;
+    size_t count = (size_t)1 << order;
+    if (order > PMM_MAX_ORDER || (idx & (count - 1)) != 0 || idx + count > total_pages)
+    {
+        return;
+    }
+
+    uint64_t rflags = spin_lock_irqsave(&g_pmm_lock);
+
+    bool whole = true;
+    for (size_t i = idx; i < idx + count; i++)
+    {
+        if (!bitmap_test(i) || ref_counts[i] != 1)
         {
-            bitmap_clear(bit);
-            if (bit < last_free_page)
-            {
-                last_free_page = bit;
-            }
+            whole = false;
+            break;
+        }
+    }
+
+    if (whole)
+    {
+        for (size_t i = idx; i < idx + count; i++)
+        {
+            bitmap_clear(i);
+            ref_counts[i] = 0;
         }
+        g_free_frames += count;
+        pmm_buddy_free(idx, order);
+        spin_unlock_irqrestore(&g_pmm_lock, rflags);
+        return;
+    }
+
+    spin_unlock_irqrestore(&g_pmm_lock, rflags);
+    for (size_t i = idx; i < idx + count; i++)
+    {
+        pmm_free_frame((uint64_t)i * PAGE_SIZE);
     }
 }
 
@@ -221,7 +839,7 @@ void pmm_free_frame(uint64_t phys_addr)
 void pmm_inc_ref(uint64_t frame_addr)
 {
     size_t idx = frame_addr / PAGE_SIZE;
-    ref_counts[idx] += 1;
+    __atomic_fetch_add(&ref_counts[idx], 1, __ATOMIC_RELAXED);
 }
 
 /**
@@ -231,13 +849,7 @@ void pmm_inc_ref(uint64_t frame_addr)
  */
 void pmm_dec_ref(uint64_t frame_addr)
 {
-    size_t idx = frame_addr / PAGE_SIZE;
-    ref_counts[idx] -= 1;
-
-    if (ref_counts[idx] == 0)
-    {
-        pmm_free_frame(frame_addr);
-    }
+    pmm_free_frame(frame_addr);
 }
 
 /**
@@ -247,5 +859,32 @@ void pmm_dec_ref(uint64_t frame_addr)
 uint32_t pmm_get_ref_count(uint64_t frame_addr)
 {
     size_t idx = frame_addr / PAGE_SIZE;
-    return ref_counts[idx];
-}
\ No newline at end of file
+    return __atomic_load_n(&ref_counts[idx], __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Fills `out` with the free memory and how it's split across the orders.
+ * Many small blocks and few big ones mean the free memory is fragmented.
+ */
+void pmm_get_stats(MemInfo_t *out)
+{
+    uint64_t rflags = spin_lock_irqsave(&g_pmm_lock);
+
+    memset(out, 0, sizeof(MemInfo_t));
+    out->total_frames = total_pages;
+    size_t mag_frames = __atomic_load_n(&g_mag_frames, __ATOMIC_RELAXED);
+    out->free_frames = g_free_frames + mag_frames + g_zero_frames;
+    out->magazine_frames = mag_frames;
+    out->zeroed_frames = g_zero_frames;
+    out->largest_free_order = -1;
+    for (uint32_t o = 0; o <= PMM_MAX_ORDER; o++)
+    {
+        out->free_blocks[o] = g_free_count[o];
+        if (g_free_count[o] > 0)
+        {
+            out->largest_free_order = (int32_t)o;
+        }
+    }
+
+    spin_unlock_irqrestore(&g_pmm_lock, rflags);
+}
@@ -5,14 +5,24 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#include "include/meminfo.h"
+
+#define PMM_MAX_ORDER (MEMINFO_NUM_ORDERS - 1) // largest block: 2^10 frames, 4 MiB
+
 struct limine_memmap_response;
 struct limine_hhdm_response;
 
 void pmm_init(struct limine_memmap_response *memmap_resp, struct limine_hhdm_response *hhdm_resp);
 uint64_t pmm_alloc_frame(void);
+uint64_t pmm_alloc_zeroed_frame(void);
+void pmm_refill_zeroed(void);
 void pmm_free_frame(uint64_t phys_addr);
+uint64_t pmm_alloc_frames(uint32_t order);
+void pmm_free_frames(uint64_t phys_addr, uint32_t order);
+size_t pmm_alloc_frames_batch(size_t n, uint64_t *out);
 void pmm_inc_ref(uint64_t frame_addr);
 void pmm_dec_ref(uint64_t frame_addr);
 uint32_t pmm_get_ref_count(uint64_t frame_addr);
+void pmm_get_stats(MemInfo_t *out);
 
 #endif
@@ -0,0 +1,264 @@
+/**
+ * @file slab.c
+ * @brief A slab allocator for the kernel objects that are created and destroyed all the time.
+ *
+ * Each object type gets its own cache. A cache carves blocks of whole pages
+ * (slabs) into slots of its object size, and keeps the slabs that still have
+ * free slots on a `partial` list. Allocating pops a slot from the first partial
+ * slab, and freeing pushes it back on the slab found by rounding the pointer
+ * down to the slab size, so both are O(1), and objects carry no header.
+ *
+ * Small objects fit many to a page, but with the header in the page, a single
+ * page only holds 3 objects of 1 KiB, or 1 of 2 KiB. So a cache picks the
+ * smallest slab that wastes no more than 1/16 of it.
+ *
+ * When a slab has no object left in use, its pages go straight back to the PMM.
+ */
+
+#include "slab.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "kern_defs.h"
+#include "drivers/serial.h"
+#include "utils/spinlock.h"
+#include "../string.h"
+
+#define SLAB_HDR_SIZE ((sizeof(kmem_slab_t) + 7) & ~7ULL)
+
+static kmem_cache_t *g_caches = NULL;
+static spinlock_t g_caches_lock = SPINLOCK_INIT; // guards the list; taken after a cache's own lock
+
+/**
+ * @brief Lays out the slabs of `cache`, and adds it to the global list.
+ * Called with the cache locked, on the first allocation.
+ */
+static void kmem_cache_setup(kmem_cache_t *cache)
+{
+    // a free slot holds the free-list link
+    size_t size = cache->obj_size < sizeof(void *) ? sizeof(void *) : cache->obj_size;
+    cache->obj_size = (size + 7) & ~7ULL;
+
+    uint32_t order = 0;
+    for (; order < SLAB_MAX_ORDER; order++)
+    {
+        size_t slab_size = PAGE_SIZE << order;
+        size_t waste = (slab_size - SLAB_HDR_SIZE) % cache->obj_size + SLAB_HDR_SIZE;
+        if (slab_size - SLAB_HDR_SIZE >= cache->obj_size && waste <= slab_size / 16)
+        {
+            break;
+        }
+    }
+    cache->slab_order = order;
+    cache->objs_per_slab = (uint32_t)(((PAGE_SIZE << order) - SLAB_HDR_SIZE) / cache->obj_size);
+
+    spin_lock(&g_caches_lock);
+    cache->next = g_caches;
+    g_caches = cache;
+    spin_unlock(&g_caches_lock);
+}
+
+static void slab_list_push(kmem_slab_t **head, kmem_slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head != NULL)
+    {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+static void slab_list_remove(kmem_slab_t **head, kmem_slab_t *slab)
+{
+    if (slab->prev != NULL)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        *head = slab->next;
+    }
+    if (slab->next != NULL)
+    {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+static inline kmem_slab_t *slab_of(void *obj, uint32_t order)
+{
+    return (kmem_slab_t *)((uint64_t)obj & ~(uint64_t)((PAGE_SIZE << order) - 1));
+}
+
+/**
+ * @brief Takes a block from the PMM and threads all its slots on the free list.
+ */
+static kmem_slab_t *kmem_slab_new(kmem_cache_t *cache)
+{
+    uint64_t phys = pmm_alloc_frames(cache->slab_order);
+    if (phys == 0)
+    {
+        return NULL;
+    }
+
+    kmem_slab_t *slab = (kmem_slab_t *)vmm_phys_to_hhdm(phys);
+    slab->cache = cache;
+    slab->self = slab;
+    slab->in_use = 0;
+    slab->free_list = NULL;
+
+    uint8_t *first = (uint8_t *)slab + SLAB_HDR_SIZE;
+    for (int64_t i = (int64_t)cache->objs_per_slab - 1; i >= 0; i--)
+    {
+        void **obj = (void **)(first + (uint64_t)i * cache->obj_size);
+        *obj = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    cache->slabs++;
+    cache->total_objs += cache->objs_per_slab;
+    return slab;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    uint64_t rflags = spin_lock_irqsave(&cache->lock);
+
+    if (cache->objs_per_slab == 0)
+    {
+        kmem_cache_setup(cache);
+        if (cache->objs_per_slab == 0)
+        {
+            spin_unlock_irqrestore(&cache->lock, rflags);
+            kprint("SLAB: object too large for a slab\n");
+            return NULL;
+        }
+    }
+
+    kmem_slab_t *slab = cache->partial;
+    if (slab == NULL)
+    {
+        slab = kmem_slab_new(cache);
+        if (slab == NULL)
+        {
+            spin_unlock_irqrestore(&cache->lock, rflags);
+            return NULL;
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void **obj = (void **)slab->free_list;
+    slab->free_list = *obj;
+    slab->in_use++;
+    if (slab->in_use == cache->objs_per_slab)
+    {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->active_objs++;
+    cache->allocs++;
+    spin_unlock_irqrestore(&cache->lock, rflags);
+
+    if (cache->ctor != NULL)
+    {
+        cache->ctor(obj);
+    }
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+    if (obj == NULL)
+    {
+        return;
+    }
+
+    kmem_slab_t *slab = slab_of(obj, cache->slab_order);
+    if (slab->cache != cache)
+    {
+        kprint("SLAB: object freed to the wrong cache\n");
+        return;
+    }
+
+    uint64_t rflags = spin_lock_irqsave(&cache->lock);
+
+    if (slab->in_use == cache->objs_per_slab)
+    {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    *(void **)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+    cache->active_objs--;
+    cache->frees++;
+
+    if (slab->in_use == 0)
+    {
+        slab_list_remove(&cache->partial, slab);
+        slab->cache = NULL;
+        slab->self = NULL;
+        cache->slabs--;
+        cache->total_objs -= cache->objs_per_slab;
+        cache->pages_freed++;
+        pmm_free_frames(vmm_hhdm_to_phys(slab), cache->slab_order);
+    }
+
+    spin_unlock_irqrestore(&cache->lock, rflags);
+}
+
+/**
+ * @brief Returns the cache `obj` was allocated from, read from its slab header.
+ *
+ * @details The slab size isn't known before the cache is, so we try each one,
+ * smallest first: the rounded-down address stays inside the slab of `obj` until
+ * it hits the header, and only a header points to itself, with a cache whose
+ * slabs are of that size.
+ * @return NULL if `obj` doesn't belong to any slab.
+ */
+kmem_cache_t *kmem_cache_of(void *obj)
+{
+    for (uint32_t order = 0; order <= SLAB_MAX_ORDER; order++)
+    {
+        kmem_slab_t *slab = slab_of(obj, order);
+        kmem_cache_t *cache = slab->cache;
+        if (slab->self == slab && cache != NULL && cache->slab_order == order &&
+            (uint64_t)obj >= (uint64_t)slab + SLAB_HDR_SIZE)
+        {
+            return cache;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Copies the stats of up to `max` caches into `out`.
+ * @return int the number of entries filled.
+ */
+int kmem_get_stats(SlabInfo_t *out, int max)
+{
+    uint64_t rflags = spin_lock_irqsave(&g_caches_lock);
+
+    int n = 0;
+    for (kmem_cache_t *c = g_caches; c != NULL && n < max; c = c->next, n++)
+    {
+        SlabInfo_t *info = &out[n];
+        memset(info, 0, sizeof(SlabInfo_t));
+        strncpy(info->name, c->name, SLABINFO_NAME_LEN - 1);
+        info->obj_size = c->obj_size;
+        info->objs_per_slab = c->objs_per_slab;
+        info->pages_per_slab = 1ULL << c->slab_order;
+        info->active_objs = c->active_objs;
+        info->total_objs = c->total_objs;
+        info->slabs = c->slabs;
+        info->allocs = c->allocs;
+        info->frees = c->frees;
+        info->pages_freed = c->pages_freed;
+    }
+
+    spin_unlock_irqrestore(&g_caches_lock, rflags);
+    return n;
+}
@@ -0,0 +1,71 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "include/slabinfo.h"
+#include "utils/spinlock.h"
+
+/**
+ * A slab is a block of 2^slab_order physical frames, reached through the HHDM.
+ * The header sits at the start of the block, and the objects fill the rest.
+ * Blocks are aligned to their size, so the slab of an object is found by
+ * rounding its address down to the slab size of its cache.
+ * Free objects are linked through their first 8 bytes.
+ */
+typedef struct kmem_slab
+{
+    struct kmem_cache *cache; // NULL once the slab is given back
+    struct kmem_slab *self;   // tells a header from object data, see kmem_cache_of
+    struct kmem_slab *prev;
+    struct kmem_slab *next;
+    void *free_list;
+    uint32_t in_use;
+} kmem_slab_t;
+
+#define SLAB_MAX_ORDER 3 // a slab is at most 8 pages
+
+/**
+ * A cache of equally-sized objects of one type.
+ * Caches are meant to be static, set up with KMEM_CACHE_INIT, so they can be
+ * used before any init code runs. A cache lays out its slabs and joins the
+ * global list (for the stats) on its first allocation.
+ */
+typedef struct kmem_cache
+{
+    spinlock_t lock; // guards the slabs and the stats
+    const char *name;
+    size_t obj_size;
+    void (*ctor)(void *obj); // called on every object handed out, may be NULL
+
+    uint32_t objs_per_slab; // 0 until the cache is set up
+    uint32_t slab_order;    // a slab is 2^slab_order pages
+    kmem_slab_t *partial;   // slabs with free objects left
+    kmem_slab_t *full;
+
+    uint64_t active_objs;
+    uint64_t total_objs;
+    uint64_t slabs;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t pages_freed;
+
+    struct kmem_cache *next;
+} kmem_cache_t;
+
+#define KMEM_CACHE_INIT_SIZE(cache_name, size, ctor_fn) \
+    {                                                   \
+        .name = (cache_name),                           \
+        .obj_size = (size),                             \
+        .ctor = (ctor_fn),                              \
+    }
+
+#define KMEM_CACHE_INIT(cache_name, type, ctor_fn) KMEM_CACHE_INIT_SIZE(cache_name, sizeof(type), ctor_fn)
+
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+kmem_cache_t *kmem_cache_of(void *obj);
+int kmem_get_stats(SlabInfo_t *out, int max);
+
+#endif
@@ -2,51 +2,106 @@
 #include "cpu.h"
 #include "vmm.h"
 #include "pmm.h"
-#include "kmalloc.h"
 #include "../string.h"
 #include "kern_defs.h"
 #include "utils/asm_instrs.h"
 #include "sched/sched.h"
 #include "drivers/serial.h"
+#include "arch/smp.h"
+#include "utils/spinlock.h"
 
 #include <stddef.h>
 
 uint64_t *kern_pml4 = NULL; // shared to other components
 
-static VmAllocatedList *g_vm_allocated_head;
-static VmFreeRegion *g_vm_free_head;
+static VmSpace g_kern_vm; // the kernel heap
+static bool g_huge_pages = true;
+
+// guards g_kern_vm and the kernel half of the page tables; a task's own space
+// is only ever changed by the task itself
+static spinlock_t g_vmm_lock = SPINLOCK_INIT;
+
+#define CR4_PGE (1 << 7)
+#define CR4_PCIDE (1 << 17)
+#define CPUID_EDX_PGE (1 << 13)
+#define CPUID_ECX_PCID (1 << 17)
+#define CR3_NOFLUSH (1ULL << 63) // keep the TLB entries of the PCID being loaded
+#define CR3_PCID_MASK 0xFFFULL
+#define PCID_COUNT 4096 // PCID 0 is never given out: it tags CR3 loads outside the scheduler
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+static bool g_pge_enabled = false;
+static bool g_pcid_enabled = false;
+static spinlock_t g_pcid_lock = SPINLOCK_INIT; // guards the PCIDs of all the tasks
+static Task *g_pcid_owner[PCID_COUNT];
+static uint16_t g_pcid_next = 1;
+static uint32_t g_tlb_stale = 0; // bit c: CPU c may hold stale entries we can't name, flush them all
+
+kmem_cache_t g_vm_area_cache = KMEM_CACHE_INIT("VmArea", VmArea, NULL);
+kmem_cache_t g_vm_free_cache = KMEM_CACHE_INIT("VmFreeRegion", VmFreeRegion, NULL);
 
 static inline size_t get_aligned_size(size_t size)
 {
     return (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 }
 
-static void get_vm_ctx(VmFreeRegion ***free_head_ptr, VmAllocatedList ***alloc_head_ptr)
+static VmSpace *get_vm_space(void)
 {
     Task *curr = get_curr_task();
 
-    if (curr != NULL && curr->pid > 0 && curr->vm_free_head != NULL)
+    if (curr != NULL && curr->pid > 0 && curr->vm.size != 0)
     {
-        *free_head_ptr = &curr->vm_free_head;
-        *alloc_head_ptr = &curr->vm_alloc_head;
+        return &curr->vm;
     }
-    else
+    return &g_kern_vm;
+}
+
+static int vm_area_cmp(const avl_node_t *a, const avl_node_t *b)
+{
+    uint64_t x = AVL_ENTRY(a, VmArea, node)->addr;
+    uint64_t y = AVL_ENTRY(b, VmArea, node)->addr;
+    return x < y ? -1 : x > y;
+}
+
+static int vm_free_addr_cmp(const avl_node_t *a, const avl_node_t *b)
+{
+    uint64_t x = AVL_ENTRY(a, VmFreeRegion, by_addr)->addr;
+    uint64_t y = AVL_ENTRY(b, VmFreeRegion, by_addr)->addr;
+    return x < y ? -1 : x > y;
+}
+
+static int vm_free_size_cmp(const avl_node_t *a, const avl_node_t *b)
+{
+    const VmFreeRegion *x = AVL_ENTRY(a, VmFreeRegion, by_size);
+    const VmFreeRegion *y = AVL_ENTRY(b, VmFreeRegion, by_size);
+    if (x->size != y->size)
     {
-        *free_head_ptr = &g_vm_free_head;
-        *alloc_head_ptr = &g_vm_allocated_head;
+        return x->size < y->size ? -1 : 1;
     }
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static void vm_free_insert(VmSpace *vs, VmFreeRegion *region)
+{
+    avl_insert(&vs->free_by_addr, &region->by_addr, vm_free_addr_cmp);
+    avl_insert(&vs->free_by_size, &region->by_size, vm_free_size_cmp);
+}
+
+static void vm_free_remove(VmSpace *vs, VmFreeRegion *region)
+{
+    avl_remove(&vs->free_by_addr, &region->by_addr, vm_free_addr_cmp);
+    avl_remove(&vs->free_by_size, &region->by_size, vm_free_size_cmp);
 }
 
 uint64_t vmm_new_pml4()
 {
-    uint64_t pml4_phys = pmm_alloc_frame();
+    uint64_t pml4_phys = pmm_alloc_zeroed_frame();
     if (pml4_phys == 0)
     {
         return 0;
     }
 
     void *pml4_virt = vmm_phys_to_hhdm(pml4_phys);
-    memset(pml4_virt, 0, PAGE_SIZE);
     memcpy(
         &((uint64_t *)pml4_virt)[256],
         &kern_pml4[256],
@@ -81,6 +136,13 @@ void vmm_free_table(uint64_t *table, int level)
         {
             continue;
         }
+        else if (level == 2 && (entry & VMM_FLAG_HUGE))
+        {
+            for (uint64_t j = 0; j < ENTRIES_NUM; j++)
+            {
+                pmm_free_frame(phys_addr + j * PAGE_SIZE);
+            }
+        }
         else
         {
             vmm_free_table(virt_addr, level - 1);
@@ -106,12 +168,15 @@ uint64_t pte_get_flags(uint64_t page_tab_entry)
     return page_tab_entry & (uint64_t)(0xFFF);
 }
 
-static uint64_t *vmm_walk_to_pte(uint64_t *pml4_virt, uint64_t virt_addr, uint8_t create_if_missing)
+/**
+ * @brief Walks down to the Page Directory entry of `virt_addr`.
+ * That entry maps a 2 MiB page itself if it has VMM_FLAG_HUGE, and points to a PT otherwise.
+ */
+static uint64_t *vmm_walk_to_pde(uint64_t *pml4_virt, uint64_t virt_addr, uint8_t create_if_missing)
 {
     size_t pml4_idx = (virt_addr >> PML4_INDEX) & 0x1FF; // PML4
     size_t pdpt_idx = (virt_addr >> PDPT_INDEX) & 0x1FF; // Page Directory Pointer Table
     size_t pd_idx = (virt_addr >> PD_INDEX) & 0x1FF;     // Page Directory
-    size_t pt_idx = (virt_addr >> PT_INDEX) & 0x1FF;     // Page Table
 
     uint64_t pml4_entry = pml4_virt[pml4_idx];
 
@@ -128,14 +193,13 @@ static uint64_t *vmm_walk_to_pte(uint64_t *pml4_virt, uint64_t virt_addr, uint8_
             - update the entry in PML4
             */
 
-            uint64_t new_tab_phys = pmm_alloc_frame();
+            uint64_t new_tab_phys = pmm_alloc_zeroed_frame();
             if (new_tab_phys == 0)
             {
                 return NULL;
             }
 
             pdpt_virt = (void *)vmm_phys_to_hhdm(new_tab_phys); // Note that our pmm already converts the addr to virt addr
-            memset(pdpt_virt, 0, PAGE_SIZE);
 
             pml4_virt[pml4_idx] = pte_set_addr(0, new_tab_phys) | VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER;
         }
@@ -157,13 +221,12 @@ static uint64_t *vmm_walk_to_pte(uint64_t *pml4_virt, uint64_t virt_addr, uint8_
     {
         if (create_if_missing)
         {
-            uint64_t new_phys_addr = pmm_alloc_frame();
+            uint64_t new_phys_addr = pmm_alloc_zeroed_frame();
             if (new_phys_addr == 0)
             {
                 return NULL;
             }
             pd_virt = (uint64_t *)vmm_phys_to_hhdm(new_phys_addr);
-            memset(pd_virt, 0, PAGE_SIZE);
             pdpt_virt[pdpt_idx] = pte_set_addr(0, new_phys_addr) | VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER;
         }
         else
@@ -177,21 +240,72 @@ static uint64_t *vmm_walk_to_pte(uint64_t *pml4_virt, uint64_t virt_addr, uint8_
         pd_virt = vmm_phys_to_hhdm(pd_phys);
     }
 
-    uint64_t pd_entry = pd_virt[pd_idx];
+    return &pd_virt[pd_idx];
+}
+
+/**
+ * @brief Turns the 2 MiB page mapped by `pde` into a PT of 512 pages, with
+ * the same frames and flags, so that a part of it can be changed on its own.
+ * Each frame of a 2 MiB page has its own ref_count, so they carry over as is.
+ * @return 0 on success, -1 if the PT could not be allocated.
+ */
+static int vmm_split_huge_page(uint64_t *pde, uint64_t virt_addr)
+{
+    uint64_t pt_phys = pmm_alloc_frame();
+    if (pt_phys == 0)
+    {
+        return -1;
+    }
+
+    uint64_t *pt_virt = (uint64_t *)vmm_phys_to_hhdm(pt_phys);
+    uint64_t base = pte_get_addr(*pde);
+    uint64_t flags = pte_get_flags(*pde) & ~(uint64_t)VMM_FLAG_HUGE;
+    for (uint64_t i = 0; i < ENTRIES_NUM; i++)
+    {
+        pt_virt[i] = (base + i * PAGE_SIZE) | flags;
+    }
+
+    *pde = pte_set_addr(0, pt_phys) | VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER;
+
+    // drop the 2 MiB TLB entry
+    uint64_t huge_addr = virt_addr & ~(uint64_t)(HUGE_PAGE_SIZE - 1);
+    __asm__ volatile("invlpg (%0)" ::"r"(huge_addr) : "memory");
+    return 0;
+}
+
+static uint64_t *vmm_walk_to_pte(uint64_t *pml4_virt, uint64_t virt_addr, uint8_t create_if_missing)
+{
+    size_t pt_idx = (virt_addr >> PT_INDEX) & 0x1FF; // Page Table
+
+    uint64_t *pde = vmm_walk_to_pde(pml4_virt, virt_addr, create_if_missing);
+    if (pde == NULL)
+    {
+        return NULL;
+    }
+
+    // a single page of a 2 MiB one is asked for: break the 2 MiB page up first
+    if ((*pde & VMM_FLAG_PRESENT) && (*pde & VMM_FLAG_HUGE))
+    {
+        if (vmm_split_huge_page(pde, virt_addr) < 0)
+        {
+            return NULL;
+        }
+    }
+
+    uint64_t pd_entry = *pde;
     uint64_t *pt_virt;
     if (!(pd_entry & VMM_FLAG_PRESENT))
     {
         if (create_if_missing)
         {
-            uint64_t new_phys_addr = pmm_alloc_frame();
+            uint64_t new_phys_addr = pmm_alloc_zeroed_frame();
             if (new_phys_addr == 0)
             {
                 return NULL;
             }
 
             pt_virt = (uint64_t *)vmm_phys_to_hhdm(new_phys_addr);
-            memset(pt_virt, 0, PAGE_SIZE);
-            pd_virt[pd_idx] = pte_set_addr(0, new_phys_addr) | VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER;
+            *pde = pte_set_addr(0, new_phys_addr) | VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER;
         }
         else
         {
@@ -209,8 +323,14 @@ static uint64_t *vmm_walk_to_pte(uint64_t *pml4_virt, uint64_t virt_addr, uint8_
 
 uint64_t vmm_virt2phys(uint64_t *pml4, uint64_t virt_addr)
 {
+    uint64_t *pde = vmm_walk_to_pde(pml4, virt_addr, 0);
+    if (pde != NULL && (*pde & VMM_FLAG_PRESENT) && (*pde & VMM_FLAG_HUGE))
+    {
+        return pte_get_addr(*pde) + (virt_addr & (HUGE_PAGE_SIZE - 1));
+    }
+
     uint64_t *pte = vmm_walk_to_pte(pml4, virt_addr, 0);
-    if (pte == NULL)
+    if (pte == NULL || !(*pte & VMM_FLAG_PRESENT))
     {
         return 0;
     }
@@ -243,6 +363,146 @@ void vmm_map_page(uint64_t *pml4_virt, uint64_t virt_addr, uint64_t phys_addr, u
     __asm__ volatile("invlpg (%0)" ::"r"(virt_addr) : "memory");
 }
 
+int vmm_map_huge_page(uint64_t *pml4_virt, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags)
+{
+    uint64_t *pde = vmm_walk_to_pde(pml4_virt, virt_addr, 1);
+
+    if (pde == NULL)
+    {
+        return -1;
+    }
+
+    if (*pde & VMM_FLAG_PRESENT)
+    {
+        if (!(*pde & VMM_FLAG_HUGE))
+        {
+            return -1; // there's a PT here, with pages of its own
+        }
+
+        uint64_t old_phys = pte_get_addr(*pde);
+        if (old_phys != phys_addr)
+        {
+            for (uint64_t i = 0; i < ENTRIES_NUM; i++)
+            {
+                pmm_dec_ref(old_phys + i * PAGE_SIZE);
+            }
+        }
+    }
+
+    *pde = pte_set_addr(0, phys_addr) | flags | VMM_FLAG_PRESENT | VMM_FLAG_HUGE;
+
+    __asm__ volatile("invlpg (%0)" ::"r"(virt_addr) : "memory");
+    return 0;
+}
+
+void vmm_set_huge_pages(bool enable)
+{
+    g_huge_pages = enable;
+}
+
+/**
+ * @brief Maps fresh frames at `virt_addr`, in `pml4` and in `mirror_pml4` if not NULL:
+ * a 2 MiB page when the address is 2 MiB-aligned, at least 2 MiB are left to
+ * map and the PMM has a 2 MiB block, a single page otherwise.
+ * The frames aren't zeroed.
+ * @return The number of 4 KiB pages mapped, 0 if out of memory.
+ */
+static uint64_t vmm_back_pages(uint64_t *pml4, uint64_t *mirror_pml4, uint64_t virt_addr, uint64_t pages_left, uint64_t flags)
+{
+    if (g_huge_pages && (virt_addr & (HUGE_PAGE_SIZE - 1)) == 0 && pages_left >= ENTRIES_NUM)
+    {
+        uint64_t phys_addr = pmm_alloc_frames(HUGE_PAGE_ORDER);
+        if (phys_addr != 0)
+        {
+            if (vmm_map_huge_page(pml4, virt_addr, phys_addr, flags) == 0)
+            {
+                if (mirror_pml4 != NULL)
+                {
+                    vmm_map_huge_page(mirror_pml4, virt_addr, phys_addr, flags);
+                }
+                return ENTRIES_NUM;
+            }
+            pmm_free_frames(phys_addr, HUGE_PAGE_ORDER);
+        }
+    }
+
+    uint64_t phys_addr = pmm_alloc_frame();
+    if (phys_addr == 0)
+    {
+        return 0;
+    }
+
+    vmm_map_page(pml4, virt_addr, phys_addr, flags);
+    if (mirror_pml4 != NULL)
+    {
+        vmm_map_page(mirror_pml4, virt_addr, phys_addr, flags);
+    }
+    return 1;
+}
+
+/**
+ * @brief Unmaps `npages` pages from `virt_addr`, and frees their frames if `free_frames`.
+ * 2 MiB pages that lie fully in the range go at once; the ones that stick out are split.
+ */
+static void vmm_unmap_range(uint64_t *pml4, uint64_t virt_addr, uint64_t npages, bool free_frames)
+{
+    uint64_t i = 0;
+    while (i < npages)
+    {
+        uint64_t addr = virt_addr + i * PAGE_SIZE;
+
+        uint64_t *pde = vmm_walk_to_pde(pml4, addr, 0);
+        if (pde != NULL && (*pde & VMM_FLAG_PRESENT) && (*pde & VMM_FLAG_HUGE) &&
+            (addr & (HUGE_PAGE_SIZE - 1)) == 0 && npages - i >= ENTRIES_NUM)
+        {
+            uint64_t phys_addr = pte_get_addr(*pde);
+            *pde = 0;
+            __asm__ volatile("invlpg (%0)" ::"r"(addr) : "memory");
+            if (free_frames)
+            {
+                for (uint64_t j = 0; j < ENTRIES_NUM; j++)
+                {
+                    pmm_free_frame(phys_addr + j * PAGE_SIZE);
+                }
+            }
+            i += ENTRIES_NUM;
+            continue;
+        }
+
+        uint64_t phys_addr = vmm_virt2phys(pml4, addr);
+        if (phys_addr != 0 && free_frames)
+        {
+            pmm_free_frame(phys_addr);
+        }
+        // also drops the reservation of a page that was never touched
+        vmm_unmap_page(pml4, addr);
+        i++;
+    }
+
+    // the kernel half is shared, the other CPUs may have it cached too
+    if (virt_addr >= VMM_USER_END && npages > 0)
+    {
+        smp_tlb_shootdown();
+    }
+}
+
+int vmm_reserve_page(uint64_t *pml4_virt, uint64_t virt_addr, uint64_t flags)
+{
+    uint64_t *pte = vmm_walk_to_pte(pml4_virt, virt_addr, 1);
+
+    if (pte == NULL)
+    {
+        return -1;
+    }
+
+    if (!(*pte & VMM_FLAG_PRESENT))
+    {
+        *pte = (flags & ~(uint64_t)VMM_FLAG_PRESENT) | VMM_PTE_DEMAND;
+    }
+
+    return 0;
+}
+
 void vmm_unmap_page(uint64_t *pml4, uint64_t virt_addr)
 {
     uint64_t *pte = vmm_walk_to_pte(pml4, virt_addr, 0);
@@ -257,189 +517,245 @@ void vmm_unmap_page(uint64_t *pml4, uint64_t virt_addr)
     __asm__ volatile("invlpg (%0)" ::"r"(virt_addr) : "memory");
 }
 
-uint64_t find_free_addr(VmFreeRegion **head_ref, size_t size)
+/**
+ * @brief The smallest free region of at least `size` bytes, the lowest one among equals.
+ */
+static VmFreeRegion *vm_free_best_fit(VmSpace *vs, size_t size)
+{
+    VmFreeRegion *best = NULL;
+    avl_node_t *n = vs->free_by_size;
+    while (n != NULL)
+    {
+        VmFreeRegion *region = AVL_ENTRY(n, VmFreeRegion, by_size);
+        if (region->size >= size)
+        {
+            best = region;
+            n = n->left;
+        }
+        else
+        {
+            n = n->right;
+        }
+    }
+    return best;
+}
+
+uint64_t find_free_addr(VmSpace *vs, size_t size)
 {
-    if (head_ref == NULL || *head_ref == NULL)
+    if (vs == NULL || vs->size == 0)
     {
-        kprint("VMM: empty or invalid VmFreeRegion list!\n");
+        kprint("VMM: empty or invalid VmSpace!\n");
         return 0;
     }
 
-    VmFreeRegion *curr = *head_ref;
-    VmFreeRegion *prev = NULL;
-    while (curr != NULL)
+    VmFreeRegion *best = vm_free_best_fit(vs, size);
+    if (best == NULL)
     {
-        if (curr->size > size)
-        {
-            uint64_t addr = curr->addr;
-            curr->addr += size;
-            curr->size -= size;
+        return 0;
+    }
 
-            return addr;
-        }
-        else if (curr->size == size)
-        {
-            uint64_t addr = curr->addr;
-            if (prev != NULL)
-            {
-                prev->next = curr->next;
-                curr->next = NULL;
-            }
-            else
-            {
-                *head_ref = curr->next;
-            }
-            kfree(curr);
+    uint64_t addr = best->addr;
+    if (best->size == size)
+    {
+        vm_free_remove(vs, best);
+        kmem_cache_free(&g_vm_free_cache, best);
+        return addr;
+    }
+
+    // moving the start keeps its place by address, only its size changes
+    avl_remove(&vs->free_by_size, &best->by_size, vm_free_size_cmp);
+    best->addr += size;
+    best->size -= size;
+    avl_insert(&vs->free_by_size, &best->by_size, vm_free_size_cmp);
+    return addr;
+}
+
+uint64_t find_free_addr_aligned(VmSpace *vs, size_t size, size_t align)
+{
+    if (align <= PAGE_SIZE)
+    {
+        return find_free_addr(vs, size);
+    }
+    if (vs == NULL || vs->size == 0)
+    {
+        kprint("VMM: empty or invalid VmSpace!\n");
+        return 0;
+    }
+
+    // a region that big has an aligned range of `size` wherever it starts
+    VmFreeRegion *best = vm_free_best_fit(vs, size + align - PAGE_SIZE);
+    if (best == NULL)
+    {
+        return 0;
+    }
+
+    uint64_t start = best->addr;
+    uint64_t end = best->addr + best->size;
+    uint64_t addr = (start + align - 1) & ~(uint64_t)(align - 1);
+
+    // the region keeps the part below `addr`, the part above goes back as a new one
+    if (addr > start)
+    {
+        avl_remove(&vs->free_by_size, &best->by_size, vm_free_size_cmp);
+        best->size = addr - start;
+        avl_insert(&vs->free_by_size, &best->by_size, vm_free_size_cmp);
+    }
+    else
+    {
+        vm_free_remove(vs, best);
+        kmem_cache_free(&g_vm_free_cache, best);
+    }
+    vmm_add_free_region(vs, addr + size, end - (addr + size));
+
+    return addr;
+}
 
+/**
+ * @brief Reserves a range for an eagerly backed allocation: 2 MiB-aligned if it
+ * can hold a 2 MiB page, so vmm_back_pages can map it with those.
+ */
+static uint64_t vmm_find_backed_addr(VmSpace *vs, size_t size)
+{
+    if (g_huge_pages && size >= HUGE_PAGE_SIZE)
+    {
+        uint64_t addr = find_free_addr_aligned(vs, size, HUGE_PAGE_SIZE);
+        if (addr != 0)
+        {
             return addr;
         }
-        prev = curr;
-        curr = curr->next;
     }
-
-    return 0;
+    return find_free_addr(vs, size);
 }
 
 void *vmm_alloc(size_t size)
 {
-    cli();
-    VmFreeRegion **free_head;
-    VmAllocatedList **alloc_head;
-    get_vm_ctx(&free_head, &alloc_head);
+    uint64_t rflags = spin_lock_irqsave(&g_vmm_lock);
+    VmSpace *vs = get_vm_space();
+
+    // a task's own allocations are only reserved here, and get their frames
+    // on first touch; the kernel's are backed right away
+    bool lazy = vs != &g_kern_vm;
 
     size_t aligned_size = get_aligned_size(size);
-    uint64_t virt_start_addr = find_free_addr(free_head, aligned_size);
+    uint64_t virt_start_addr = lazy ? find_free_addr(vs, aligned_size) : vmm_find_backed_addr(vs, aligned_size);
     if (virt_start_addr == 0)
     {
         kprint("VMM ALLOC: Out of memory\n");
-        sti();
+        spin_unlock_irqrestore(&g_vmm_lock, rflags);
         return NULL;
     }
 
     uint64_t npages = aligned_size / PAGE_SIZE;
     uint64_t i = 0;
-    uint64_t *pml4 = vmm_phys_to_hhdm(read_cr3());
+    uint64_t *pml4 = vmm_phys_to_hhdm(pte_get_addr(read_cr3()));
 
-    for (i = 0; i < npages; i++)
+    while (i < npages)
     {
-        uint64_t phys_addr = pmm_alloc_frame();
-        if (phys_addr == 0)
+        uint64_t virt_addr = virt_start_addr + i * PAGE_SIZE;
+        if (lazy)
         {
-            break;
+            if (vmm_reserve_page(pml4, virt_addr, VMM_FLAG_WRITABLE | VMM_FLAG_USER) < 0)
+            {
+                break;
+            }
+            i++;
+            continue;
         }
 
-        vmm_map_page(
-            pml4,
-            virt_start_addr + i * PAGE_SIZE,
-            phys_addr,
-            VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER);
+        uint64_t mapped = vmm_back_pages(pml4, NULL, virt_addr, npages - i, VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER | VMM_FLAG_GLOBAL);
+        if (mapped == 0)
+        {
+            break;
+        }
+        i += mapped;
     }
 
     if (i < npages) // Partial failure, roll back
     {
         kprint("VMM ALLOC: Out of memory\n");
-
-        for (uint64_t j = 0; j < i; j++)
-        {
-            uint64_t virt_addr = virt_start_addr + j * PAGE_SIZE;
-            uint64_t phys_addr = vmm_virt2phys(pml4, virt_addr);
-            vmm_unmap_page(pml4, virt_addr);
-            pmm_free_frame(phys_addr);
-        }
-
-        vmm_add_free_region(free_head, virt_start_addr, aligned_size);
-        sti();
+        vmm_unmap_range(pml4, virt_start_addr, i, true);
+        vmm_add_free_region(vs, virt_start_addr, aligned_size);
+        spin_unlock_irqrestore(&g_vmm_lock, rflags);
         return NULL;
     }
 
-    // append to the allocated list to keep track
-    if (vmm_add_allocated_mem(alloc_head, virt_start_addr, aligned_size, 0) < 0)
+    // append to the allocated areas to keep track
+    if (vmm_add_allocated_mem(vs, virt_start_addr, aligned_size, 0) < 0)
     {
-        for (uint64_t i = 0; i < npages; i++)
-        {
-            uint64_t virt_addr = virt_start_addr + i * PAGE_SIZE;
-            uint64_t phys_addr = vmm_virt2phys(pml4, virt_addr);
-            vmm_unmap_page(pml4, virt_addr);
-            pmm_free_frame(phys_addr);
-        }
-
-        vmm_add_free_region(free_head, virt_start_addr, aligned_size);
-        sti();
+        vmm_unmap_range(pml4, virt_start_addr, npages, true);
+        vmm_add_free_region(vs, virt_start_addr, aligned_size);
+        spin_unlock_irqrestore(&g_vmm_lock, rflags);
         return NULL;
     }
 
-    sti();
+    spin_unlock_irqrestore(&g_vmm_lock, rflags);
     return (void *)virt_start_addr;
 }
 
-void vmm_add_free_region(VmFreeRegion **head_ref, uint64_t addr, size_t size)
+void vmm_add_free_region(VmSpace *vs, uint64_t addr, size_t size)
 {
     if (size == 0)
     {
         return;
     }
 
-    VmFreeRegion *curr = *head_ref;
+    // the free regions right below and right above `addr`
     VmFreeRegion *prev = NULL;
-
-    while (curr != NULL && curr->addr < addr)
-    {
-        prev = curr;
-        curr = curr->next;
-    }
-
-    uint8_t merged = 0;
-
-    // Merge left with Prev
-    if (prev != NULL)
+    VmFreeRegion *next = NULL;
+    avl_node_t *n = vs->free_by_addr;
+    while (n != NULL)
     {
-        if (prev->addr + prev->size == addr)
+        VmFreeRegion *region = AVL_ENTRY(n, VmFreeRegion, by_addr);
+        if (region->addr < addr)
         {
-            // merge left
-            prev->size += size;
-            merged = 1;
-
-            // merge right?
-            if (curr != NULL && prev->addr + prev->size == curr->addr)
-            {
-                prev->size += curr->size;
-                prev->next = curr->next;
-                kfree(curr);
-            }
+            prev = region;
+            n = n->right;
+        }
+        else
+        {
+            next = region;
+            n = n->left;
         }
     }
 
-    // If not merged, need a new node
-    if (!merged)
+    // Merge left with Prev
+    if (prev != NULL && prev->addr + prev->size == addr)
     {
-        VmFreeRegion *new_node = (VmFreeRegion *)kmalloc(sizeof(VmFreeRegion));
-        if (new_node == NULL)
+        avl_remove(&vs->free_by_size, &prev->by_size, vm_free_size_cmp);
+        prev->size += size;
+
+        // merge right?
+        if (next != NULL && prev->addr + prev->size == next->addr)
         {
-            kprint("VMM FREE: Metadata allocation failed! Memory leaked\n");
-            return;
+            prev->size += next->size;
+            vm_free_remove(vs, next);
+            kmem_cache_free(&g_vm_free_cache, next);
         }
 
-        new_node->addr = addr;
-        new_node->size = size;
-        new_node->next = curr;
+        avl_insert(&vs->free_by_size, &prev->by_size, vm_free_size_cmp);
+        return;
+    }
 
-        if (prev != NULL)
-        {
-            prev->next = new_node;
-        }
-        else
-        {
-            *head_ref = new_node;
-        }
+    // Merge right with Next, which then starts at `addr`, still after Prev
+    if (next != NULL && addr + size == next->addr)
+    {
+        avl_remove(&vs->free_by_size, &next->by_size, vm_free_size_cmp);
+        next->addr = addr;
+        next->size += size;
+        avl_insert(&vs->free_by_size, &next->by_size, vm_free_size_cmp);
+        return;
+    }
 
-        // then try Merge right with Next
-        if (curr != NULL && new_node->addr + new_node->size == curr->addr)
-        {
-            new_node->size += curr->size;
-            new_node->next = curr->next;
-            kfree(curr);
-        }
+    VmFreeRegion *new_node = (VmFreeRegion *)kmem_cache_alloc(&g_vm_free_cache);
+    if (new_node == NULL)
+    {
+        kprint("VMM FREE: Metadata allocation failed! Memory leaked\n");
+        return;
     }
+
+    new_node->addr = addr;
+    new_node->size = size;
+    vm_free_insert(vs, new_node);
 }
 
 void vmm_free(void *ptr)
@@ -449,22 +765,21 @@ void vmm_free(void *ptr)
         return;
     }
 
-    VmFreeRegion **free_head;
-    VmAllocatedList **alloc_head;
-    get_vm_ctx(&free_head, &alloc_head);
+    uint64_t rflags = spin_lock_irqsave(&g_vmm_lock);
+    VmSpace *vs = get_vm_space();
 
-    // find and remove from the allocated list
-    VmAllocatedList *curr_node = vmm_pop_allocated_mem(alloc_head, (uint64_t)ptr);
+    // find and remove from the allocated areas
+    VmArea *curr_node = vmm_pop_allocated_mem(vs, (uint64_t)ptr);
 
     if (curr_node == NULL && (uint64_t)ptr >= KERN_HEAP_START)
     {
-        free_head = &g_vm_free_head;
-        alloc_head = &g_vm_allocated_head;
-        curr_node = vmm_pop_allocated_mem(alloc_head, (uint64_t)ptr);
+        vs = &g_kern_vm;
+        curr_node = vmm_pop_allocated_mem(vs, (uint64_t)ptr);
     }
 
     if (curr_node == NULL)
     {
+        spin_unlock_irqrestore(&g_vmm_lock, rflags);
         kprint("Trying to free a not allocated memory\n");
         return;
     }
@@ -474,153 +789,296 @@ void vmm_free(void *ptr)
     size_t aligned_size = get_aligned_size(size);
 
     uint64_t npages = aligned_size / PAGE_SIZE;
-    uint64_t *pml4 = vmm_phys_to_hhdm(read_cr3());
+    uint64_t *pml4 = vmm_phys_to_hhdm(pte_get_addr(read_cr3()));
     uint64_t virt_start_addr = (uint64_t)ptr;
 
     // Physical free
-    for (uint64_t i = 0; i < npages; i++)
-    {
-        uint64_t virt_addr = virt_start_addr + i * PAGE_SIZE;
-        uint64_t phys_addr = vmm_virt2phys(pml4, virt_addr);
-        if (phys_addr != 0)
-        {
-            if (!(curr_node->flags & VMM_FLAG_SHM))
-            {
-                pmm_free_frame(phys_addr);
-            }
-            vmm_unmap_page(pml4, virt_addr);
-        }
-    }
+    vmm_unmap_range(pml4, virt_start_addr, npages, !(curr_node->flags & VMM_FLAG_SHM));
     // Virtual Allocator Free
-    vmm_add_free_region(free_head, virt_start_addr, aligned_size);
-    kfree(curr_node);
+    vmm_add_free_region(vs, virt_start_addr, aligned_size);
+    kmem_cache_free(&g_vm_area_cache, curr_node);
+    spin_unlock_irqrestore(&g_vmm_lock, rflags);
 }
 
 void *vmm_realloc(void *ptr, size_t new_size)
 {
-    cli();
     if (ptr == NULL || new_size == 0)
     {
-        sti();
         return NULL;
     }
 
-    VmFreeRegion **free_head;
-    VmAllocatedList **alloc_head;
-    get_vm_ctx(&free_head, &alloc_head);
-
-    VmAllocatedList *vm_node = vmm_find_allocated_mem(alloc_head, (uint64_t)ptr);
-    if (vm_node == NULL)
+    uint64_t rflags = spin_lock_irqsave(&g_vmm_lock);
+    VmArea *vm_node = vmm_find_allocated_mem(get_vm_space(), (uint64_t)ptr);
+    if (vm_node == NULL || vm_node->addr != (uint64_t)ptr)
     {
+        spin_unlock_irqrestore(&g_vmm_lock, rflags);
         kprint("VMM_REALLOC failed: memory not allocated before\n");
-        sti();
         return NULL;
     }
 
     size_t curr_size = vm_node->size;
+    spin_unlock_irqrestore(&g_vmm_lock, rflags);
 
     void *new_ptr = vmm_alloc(new_size);
     if (new_ptr == NULL)
     {
         kprint("VMM_REALLOC failed: out of memory!\n");
-        sti();
         return NULL;
     }
     memcpy(new_ptr, ptr, (curr_size < new_size) ? curr_size : new_size);
     vmm_free(ptr);
-    sti();
     return new_ptr;
 }
 
+/**
+ * @brief Sets the G bit on every page mapped by `table` and below.
+ */
+static void vmm_mark_global(uint64_t *table, int level)
+{
+    for (int i = 0; i < 512; i++)
+    {
+        uint64_t entry = table[i];
+        if (!(entry & VMM_FLAG_PRESENT))
+        {
+            continue;
+        }
+
+        if (level == 1 || (level < 4 && (entry & VMM_FLAG_HUGE)))
+        {
+            table[i] = entry | VMM_FLAG_GLOBAL;
+            continue;
+        }
+
+        // the bootloader's tables may set NX (bit 63) on the way down
+        vmm_mark_global(vmm_phys_to_hhdm(entry & PTE_ADDR_MASK), level - 1);
+    }
+}
+
+/**
+ * @brief Makes the kernel half global, and turns PCIDs on if the CPU has them.
+ */
+static void vmm_tlb_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ecx, &edx, &ebx);
+
+    if (edx & CPUID_EDX_PGE)
+    {
+        // every address space shares the same entries 256-511 of the PML4
+        for (int i = 256; i < 512; i++)
+        {
+            uint64_t entry = kern_pml4[i];
+            if (entry & VMM_FLAG_PRESENT)
+            {
+                vmm_mark_global(vmm_phys_to_hhdm(entry & PTE_ADDR_MASK), 3);
+            }
+        }
+        g_pge_enabled = true;
+    }
+
+    if (ecx & CPUID_ECX_PCID)
+    {
+        g_pcid_enabled = true;
+        kprint("VMM: PCIDs enabled\n");
+    }
+
+    vmm_init_cpu();
+}
+
+void vmm_init_cpu(void)
+{
+    uint64_t cr4 = read_cr4();
+    if (g_pge_enabled)
+    {
+        cr4 |= CR4_PGE;
+        write_cr4(cr4);
+        write_cr3(read_cr3()); // reload the kernel half as global
+    }
+
+    if (g_pcid_enabled)
+    {
+        // PCIDE can only be set while the current PCID is 0
+        write_cr3(pte_get_addr(read_cr3()));
+        write_cr4(cr4 | CR4_PCIDE);
+    }
+}
+
+void vmm_pcid_release(Task *tsk)
+{
+    uint64_t rflags = spin_lock_irqsave(&g_pcid_lock);
+    if (tsk->pcid != 0)
+    {
+        g_pcid_owner[tsk->pcid] = NULL;
+        tsk->pcid = 0;
+    }
+    spin_unlock_irqrestore(&g_pcid_lock, rflags);
+}
+
+/**
+ * Changing CR4.PGE, either way, flushes every TLB entry, of all PCIDs, global ones too.
+ */
+void vmm_flush_all_tlb(void)
+{
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 ^ CR4_PGE);
+    write_cr4(cr4);
+}
+
+void vmm_switch_to(Task *tsk)
+{
+    if (!g_pcid_enabled)
+    {
+        write_cr3(tsk->pml4);
+        return;
+    }
+
+    uint32_t cpu = cpu_id();
+    uint32_t cpu_bit = 1U << cpu;
+    if (__atomic_load_n(&g_tlb_stale, __ATOMIC_RELAXED) & cpu_bit)
+    {
+        __atomic_fetch_and(&g_tlb_stale, ~cpu_bit, __ATOMIC_RELAXED);
+        vmm_flush_all_tlb();
+    }
+
+    spin_lock(&g_pcid_lock); // the scheduler calls this with interrupts off
+
+    // the entries under the task's PCID can only be trusted on the CPU it
+    // last ran on: elsewhere they may be older than its page tables
+    uint16_t pcid = tsk->pcid;
+    bool keep = pcid != 0 && tsk->pcid_cpu == cpu;
+
+    if (pcid == 0)
+    {
+        // hand out PCIDs round-robin; once all are taken, the oldest one is taken
+        // back from its task, which gets a new one the next time it runs
+        pcid = g_pcid_next;
+        g_pcid_next = pcid + 1 < PCID_COUNT ? pcid + 1 : 1;
+        if (g_pcid_owner[pcid] != NULL)
+        {
+            g_pcid_owner[pcid]->pcid = 0;
+        }
+        g_pcid_owner[pcid] = tsk;
+        tsk->pcid = pcid;
+    }
+    tsk->pcid_cpu = cpu;
+
+    spin_unlock(&g_pcid_lock);
+
+    // without CR3_NOFLUSH: drop what was left under this PCID on this CPU
+    write_cr3(tsk->pml4 | pcid | (keep ? CR3_NOFLUSH : 0));
+}
+
 void vmm_init()
 {
-    uint64_t pml4_phys = read_cr3();
+    uint64_t pml4_phys = pte_get_addr(read_cr3());
     kern_pml4 = vmm_phys_to_hhdm(pml4_phys);
 
-    g_vm_free_head = (VmFreeRegion *)kmalloc(sizeof(VmFreeRegion));
-    if (g_vm_free_head == NULL)
+    if (vmm_space_init(&g_kern_vm, KERN_HEAP_START, KERN_HEAP_SIZE) < 0)
     {
-        kprint("Failed to allocate memory for g_vm_free_head\n");
-        return;
+        kprint("Failed to allocate memory for the kernel heap space\n");
     }
 
-    g_vm_free_head->addr = KERN_HEAP_START;
-    g_vm_free_head->size = 0x10000000; // 256MB
-    g_vm_free_head->next = NULL;
+    vmm_tlb_init();
 }
 
-int8_t vmm_add_allocated_mem(VmAllocatedList **head_ref, uint64_t addr, size_t size, uint32_t flags)
+int8_t vmm_space_init(VmSpace *vs, uint64_t start, size_t size)
 {
-    VmAllocatedList *allocated_node = (VmAllocatedList *)kmalloc(sizeof(VmAllocatedList));
-    if (allocated_node == NULL)
+    memset(vs, 0, sizeof(VmSpace));
+
+    VmFreeRegion *region = (VmFreeRegion *)kmem_cache_alloc(&g_vm_free_cache);
+    if (region == NULL)
     {
-        kprint("VMM: Failed to alloc meta data node!\n");
         return -1;
     }
-    allocated_node->addr = addr;
-    allocated_node->size = size;
-    allocated_node->flags = flags;
-    allocated_node->next = *head_ref;
-    *head_ref = allocated_node;
 
+    region->addr = start;
+    region->size = size;
+    vm_free_insert(vs, region);
+    vs->size = size;
     return 0;
 }
 
-VmAllocatedList *vmm_pop_allocated_mem(VmAllocatedList **head_ref, uint64_t addr)
+void vmm_space_destroy(VmSpace *vs)
 {
-    VmAllocatedList *prev_node = NULL;
-    VmAllocatedList *curr_node = *head_ref;
-    while (curr_node != NULL)
+    // the iterator is done with a node once it returns it
+    avl_iter_t it;
+    avl_node_t *n;
+
+    avl_iter_init(&it, vs->areas);
+    while ((n = avl_iter_next(&it)) != NULL)
     {
-        if (curr_node->addr == addr)
-        {
-            break;
-        }
-        prev_node = curr_node;
-        curr_node = curr_node->next;
+        kmem_cache_free(&g_vm_area_cache, AVL_ENTRY(n, VmArea, node));
     }
 
-    if (curr_node != NULL)
+    avl_iter_init(&it, vs->free_by_addr);
+    while ((n = avl_iter_next(&it)) != NULL)
     {
-        if (prev_node == NULL)
-        {
-            *head_ref = curr_node->next;
-        }
-        else
-        {
-            prev_node->next = curr_node->next;
-        }
-        curr_node->next = NULL;
+        kmem_cache_free(&g_vm_free_cache, AVL_ENTRY(n, VmFreeRegion, by_addr));
     }
 
-    return curr_node;
+    memset(vs, 0, sizeof(VmSpace));
 }
 
-VmAllocatedList *vmm_find_allocated_mem(VmAllocatedList **head_ref, uint64_t addr)
+int8_t vmm_add_allocated_mem(VmSpace *vs, uint64_t addr, size_t size, uint32_t flags)
 {
-    VmAllocatedList *curr_node = (VmAllocatedList *)head_ref;
-    while (curr_node != NULL)
+    VmArea *area = (VmArea *)kmem_cache_alloc(&g_vm_area_cache);
+    if (area == NULL)
     {
-        if (curr_node->addr == addr)
+        kprint("VMM: Failed to alloc meta data node!\n");
+        return -1;
+    }
+    area->addr = addr;
+    area->size = size;
+    area->flags = flags;
+    avl_insert(&vs->areas, &area->node, vm_area_cmp);
+
+    return 0;
+}
+
+VmArea *vmm_pop_allocated_mem(VmSpace *vs, uint64_t addr)
+{
+    VmArea *area = vmm_find_allocated_mem(vs, addr);
+    if (area == NULL || area->addr != addr)
+    {
+        return NULL;
+    }
+
+    avl_remove(&vs->areas, &area->node, vm_area_cmp);
+    return area;
+}
+
+VmArea *vmm_find_allocated_mem(VmSpace *vs, uint64_t addr)
+{
+    avl_node_t *n = vs->areas;
+    while (n != NULL)
+    {
+        VmArea *area = AVL_ENTRY(n, VmArea, node);
+        if (addr < area->addr)
         {
-            break;
+            n = n->left;
+        }
+        else if (addr >= area->addr + area->size)
+        {
+            n = n->right;
+        }
+        else
+        {
+            return area;
         }
-        curr_node = curr_node->next;
     }
 
-    return curr_node;
+    return NULL;
 }
 
 uint64_t vmm_copy_hierarchy(uint64_t *parent_tbl_virt, int level)
 {
-    uint64_t child_tbl_phys = pmm_alloc_frame();
+    uint64_t child_tbl_phys = pmm_alloc_zeroed_frame();
     if (child_tbl_phys == 0)
     {
         return 0;
     }
 
     uint64_t *child_tbl_virt = (uint64_t *)vmm_phys_to_hhdm(child_tbl_phys);
-    memset(child_tbl_virt, 0, PAGE_SIZE);
 
     int limit = level == 4 ? 256 : 512;
 
@@ -636,6 +1094,19 @@ uint64_t vmm_copy_hierarchy(uint64_t *parent_tbl_virt, int level)
             }
 
             uint64_t parent_phys = pte_get_addr(entry);
+
+            if (level == 2 && (entry & VMM_FLAG_HUGE))
+            {
+                // share the whole 2 MiB page, the first write splits it and copies one page
+                parent_tbl_virt[i] &= ~VMM_FLAG_WRITABLE;
+                child_tbl_virt[i] = parent_tbl_virt[i];
+                for (uint64_t j = 0; j < ENTRIES_NUM; j++)
+                {
+                    pmm_inc_ref(parent_phys + j * PAGE_SIZE);
+                }
+                continue;
+            }
+
             uint64_t *virt_addr = vmm_phys_to_hhdm(parent_phys);
             uint64_t child_phys = vmm_copy_hierarchy(virt_addr, level - 1);
             child_tbl_virt[i] = child_phys | pte_get_flags(entry);
@@ -657,6 +1128,11 @@ uint64_t vmm_copy_hierarchy(uint64_t *parent_tbl_virt, int level)
             uint64_t entry = parent_tbl_virt[i];
             if ((entry & VMM_FLAG_PRESENT) == 0)
             {
+                // untouched pages stay reserved in the child, with no frame to share
+                if (entry & VMM_PTE_DEMAND)
+                {
+                    child_tbl_virt[i] = entry;
+                }
                 continue;
             }
 
@@ -674,124 +1150,97 @@ uint64_t vmm_copy_hierarchy(uint64_t *parent_tbl_virt, int level)
 
 void *vmm_alloc_global(size_t size)
 {
-    cli();
-    VmFreeRegion **free_head = &g_vm_free_head;
-    VmAllocatedList **alloc_head = &g_vm_allocated_head;
+    uint64_t rflags = spin_lock_irqsave(&g_vmm_lock);
+    VmSpace *vs = &g_kern_vm;
 
     size_t aligned_size = get_aligned_size(size);
-    uint64_t virt_start_addr = find_free_addr(free_head, aligned_size);
+    uint64_t virt_start_addr = vmm_find_backed_addr(vs, aligned_size);
 
     if (virt_start_addr == 0)
     {
         kprint("VMM GLOBAL ALLOC: Out of memory\n");
-        sti();
+        spin_unlock_irqrestore(&g_vmm_lock, rflags);
         return NULL;
     }
 
     uint64_t npages = aligned_size / PAGE_SIZE;
     uint64_t i = 0;
 
-    for (i = 0; i < npages; i++)
-    {
-        uint64_t phys_addr = pmm_alloc_frame();
-        if (phys_addr == 0)
-        {
-            break;
-        }
+    uint64_t curr_cr3 = pte_get_addr(read_cr3());
+    uint64_t kern_cr3 = vmm_hhdm_to_phys(kern_pml4);
+    uint64_t *curr_pml4 = curr_cr3 != kern_cr3 ? vmm_phys_to_hhdm(curr_cr3) : NULL;
 
+    while (i < npages)
+    {
         uint64_t virt_addr = virt_start_addr + i * PAGE_SIZE;
-
-        vmm_map_page(
-            kern_pml4,
-            virt_addr,
-            phys_addr,
-            VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE);
-
-        uint64_t curr_cr3 = read_cr3();
-        uint64_t kern_cr3 = vmm_hhdm_to_phys(kern_pml4);
-
-        if (curr_cr3 != kern_cr3)
+        uint64_t mapped = vmm_back_pages(kern_pml4, curr_pml4, virt_addr, npages - i, VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_GLOBAL);
+        if (mapped == 0)
         {
-            uint64_t *curr_pml4 = vmm_phys_to_hhdm(curr_cr3);
-            vmm_map_page(curr_pml4, virt_addr, phys_addr, VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE);
+            break;
         }
+        i += mapped;
     }
 
     if (i < npages) // Partial failure, roll back
     {
         kprint("VMM GLOBAL ALLOC: Out of memory\n");
-
-        for (uint64_t j = 0; j < i; j++)
-        {
-            uint64_t virt_addr = virt_start_addr + j * PAGE_SIZE;
-            uint64_t phys_addr = vmm_virt2phys(kern_pml4, virt_addr);
-            vmm_unmap_page(kern_pml4, virt_addr);
-            pmm_free_frame(phys_addr);
-        }
-
-        vmm_add_free_region(free_head, virt_start_addr, aligned_size);
-        sti();
+        vmm_unmap_range(kern_pml4, virt_start_addr, i, true);
+        vmm_add_free_region(vs, virt_start_addr, aligned_size);
+        spin_unlock_irqrestore(&g_vmm_lock, rflags);
         return NULL;
     }
 
-    // append to the allocated list to keep track
-    vmm_add_allocated_mem(alloc_head, virt_start_addr, aligned_size, 0);
-    sti();
+    // append to the allocated areas to keep track
+    vmm_add_allocated_mem(vs, virt_start_addr, aligned_size, 0);
+    spin_unlock_irqrestore(&g_vmm_lock, rflags);
     return (void *)virt_start_addr;
 }
 
-VmAllocatedList *vmm_copy_alloc_list(VmAllocatedList *node)
+int8_t vmm_copy_space(VmSpace *dst, VmSpace *src)
 {
-    if (node == NULL)
-    {
-        return NULL;
-    }
+    memset(dst, 0, sizeof(VmSpace));
+    dst->size = src->size;
 
-    VmAllocatedList *new_node = (VmAllocatedList *)kmalloc(sizeof(VmAllocatedList));
-    new_node->addr = node->addr;
-    new_node->size = node->size;
-    new_node->flags = node->flags;
-    new_node->next = vmm_copy_alloc_list(node->next);
+    avl_iter_t it;
+    avl_node_t *n;
 
-    return new_node;
-}
-
-VmFreeRegion *vmm_copy_free_list(VmFreeRegion *node)
-{
-    if (node == NULL)
+    avl_iter_init(&it, src->areas);
+    while ((n = avl_iter_next(&it)) != NULL)
     {
-        return NULL;
+        VmArea *area = AVL_ENTRY(n, VmArea, node);
+        VmArea *new_area = (VmArea *)kmem_cache_alloc(&g_vm_area_cache);
+        if (new_area == NULL)
+        {
+            vmm_space_destroy(dst);
+            return -1;
+        }
+        new_area->addr = area->addr;
+        new_area->size = area->size;
+        new_area->flags = area->flags;
+        avl_insert(&dst->areas, &new_area->node, vm_area_cmp);
     }
 
-    VmFreeRegion *new_node = (VmFreeRegion *)kmalloc(sizeof(VmFreeRegion));
-    new_node->addr = node->addr;
-    new_node->size = node->size;
-    new_node->next = vmm_copy_free_list(node->next);
+    avl_iter_init(&it, src->free_by_addr);
+    while ((n = avl_iter_next(&it)) != NULL)
+    {
+        VmFreeRegion *region = AVL_ENTRY(n, VmFreeRegion, by_addr);
+        VmFreeRegion *new_region = (VmFreeRegion *)kmem_cache_alloc(&g_vm_free_cache);
+        if (new_region == NULL)
+        {
+            vmm_space_destroy(dst);
+            return -1;
+        }
+        new_region->addr = region->addr;
+        new_region->size = region->size;
+        vm_free_insert(dst, new_region);
+    }
 
-    return new_node;
+    return 0;
 }
 
 void vmm_cleanup_task(Task *tsk)
 {
-    VmAllocatedList *a_curr = tsk->vm_alloc_head;
-    while (a_curr != NULL)
-    {
-        VmAllocatedList *next = a_curr->next;
-        kfree(a_curr);
-        a_curr = next;
-    }
-
-    tsk->vm_alloc_head = NULL;
-
-    VmFreeRegion *f_curr = tsk->vm_free_head;
-    while (f_curr != NULL)
-    {
-        VmFreeRegion *next = f_curr->next;
-        kfree(f_curr);
-        f_curr = next;
-    }
-
-    tsk->vm_free_head = NULL;
+    vmm_space_destroy(&tsk->vm);
 }
 
 /**
@@ -830,6 +1279,13 @@ int vmm_handle_cow(uint64_t fault_addr)
 
         void *hhdm_addr = (void *)vmm_phys_to_hhdm(phys_addr);
         memcpy(hhdm_addr, (void *)virt_addr, PAGE_SIZE);
+
+        // on a borrowed CR3 (PCID 0), the owner's PCID still maps the old frame,
+        // on whichever CPU it last ran
+        if (g_pcid_enabled && (read_cr3() & CR3_PCID_MASK) == 0)
+        {
+            __atomic_store_n(&g_tlb_stale, ~0U, __ATOMIC_RELAXED);
+        }
         uint64_t flags = pte_get_flags(*pte) | VMM_FLAG_WRITABLE;
         *pte = phys_addr | (flags & 0xFFF);
         pmm_dec_ref(old_phys);
@@ -839,6 +1295,34 @@ int vmm_handle_cow(uint64_t fault_addr)
     return 0;
 }
 
+/**
+ * @brief Handles #PF on a page reserved by vmm_reserve_page.
+ * Backs the page with a zeroed frame and maps it with the flags kept in the PTE.
+ * @return 0 if the page was populated, -1 if it was not reserved or memory ran out.
+ */
+int vmm_handle_demand(uint64_t fault_addr)
+{
+    uint64_t *pml4 = vmm_phys_to_hhdm(pte_get_addr(read_cr3()));
+    uint64_t *pte = vmm_walk_to_pte(pml4, fault_addr, 0);
+
+    if (pte == NULL || (*pte & VMM_FLAG_PRESENT) || !(*pte & VMM_PTE_DEMAND))
+    {
+        return -1;
+    }
+
+    uint64_t phys_addr = pmm_alloc_zeroed_frame();
+    if (phys_addr == 0)
+    {
+        return -1;
+    }
+
+    uint64_t flags = pte_get_flags(*pte) & ~(uint64_t)VMM_PTE_DEMAND;
+    *pte = phys_addr | flags | VMM_FLAG_PRESENT;
+
+    asm volatile("invlpg %0" : : "m"(*(char *)fault_addr) : "memory");
+    return 0;
+}
+
 /*
 More explanation, for learning notes :))
 A 64-bit virtual address (in practice, only 48 bits are used for addressing) is divided into the following parts
@@ -3,11 +3,27 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+
+#include "slab.h"
+#include "utils/avl.h"
 
 #define VMM_FLAG_PRESENT 1
 #define VMM_FLAG_WRITABLE (1 << 1)
 #define VMM_FLAG_USER (1 << 2)
 #define VMM_FLAG_SHM (1 << 3)
+#define VMM_FLAG_HUGE (1 << 7)   // PS: the PD entry maps a 2 MiB page
+#define VMM_FLAG_GLOBAL (1 << 8) // kept in the TLB across CR3 loads, for the kernel half
+
+// Software bit (ignored by the CPU) on a non-present PTE: the page is reserved
+// and gets a zeroed frame on first touch. The rest of the PTE keeps the flags
+// it will be mapped with.
+#define VMM_PTE_DEMAND (1 << 9)
+
+#define VMM_USER_END 0x0000800000000000ULL
+
+#define HUGE_PAGE_SIZE 0x200000
+#define HUGE_PAGE_ORDER 9 // 2^9 frames
 
 #define ENTRIES_NUM (4096 / sizeof(uint64_t))
 
@@ -19,21 +35,45 @@
 struct Task;
 extern uint64_t hhdm_offset;
 
-typedef struct VmAllocatedList
+/**
+ * An allocated range of a VM space, in the space's `areas` tree, by address.
+ */
+typedef struct VmArea
 {
+    avl_node_t node;
     uint64_t addr;
     size_t size;
     uint32_t flags;
-    struct VmAllocatedList *next;
-} VmAllocatedList;
+} VmArea;
 
+/**
+ * A free range of a VM space. It sits in two trees: by address, to find the
+ * neighbours it merges with when a range is released, and by size, for the
+ * best-fit search.
+ */
 typedef struct VmFreeRegion
 {
+    avl_node_t by_addr;
+    avl_node_t by_size;
     uint64_t addr;
     size_t size;
-    struct VmFreeRegion *next;
 } VmFreeRegion;
 
+/**
+ * A virtual address range handed out by the VMM: the kernel heap, or the
+ * mmap area of a task. Every lookup is O(log n) in the number of regions.
+ */
+typedef struct VmSpace
+{
+    avl_node_t *areas;        // VmArea, by address
+    avl_node_t *free_by_addr; // VmFreeRegion, by address
+    avl_node_t *free_by_size; // VmFreeRegion, by size then address
+    size_t size;              // 0 if the space isn't set up
+} VmSpace;
+
+extern kmem_cache_t g_vm_area_cache;
+extern kmem_cache_t g_vm_free_cache;
+
 /**
  * @brief Create a new pml4 page for a Task
  * It copies the kernel's entries 256-512
@@ -76,6 +116,27 @@ uint64_t vmm_virt2phys(uint64_t *pml4, uint64_t virt_addr);
  */
 void vmm_map_page(uint64_t *pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags);
 
+/**
+ * @brief Maps a 2 MiB page, 2 MiB-aligned on both sides, with a single PD entry.
+ * Mapping a single page inside it later splits it back into 4 KiB pages.
+ * @return 0 on success, -1 if the range is already mapped by a PT, or out of memory.
+ */
+int vmm_map_huge_page(uint64_t *pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags);
+
+/**
+ * @brief Turns the use of 2 MiB pages for kernel allocations on or off.
+ * They are on by default; benchmarks turn them off to compare.
+ */
+void vmm_set_huge_pages(bool enable);
+
+/**
+ * @brief Reserves a virtual page without backing it.
+ * Writes a non-present PTE tagged VMM_PTE_DEMAND, so that the first access
+ * faults into vmm_handle_demand. A page already mapped is left alone.
+ * @return 0 on success, -1 if a page table could not be allocated.
+ */
+int vmm_reserve_page(uint64_t *pml4, uint64_t virt_addr, uint64_t flags);
+
 /**
  * @brief Unmaps a virtual page.
  * This function clears the page table entry for a given virtual address, making it
@@ -84,17 +145,43 @@ void vmm_map_page(uint64_t *pml4, uint64_t virt_addr, uint64_t phys_addr, uint64
  */
 void vmm_unmap_page(uint64_t *pml4, uint64_t virt_addr);
 
+/**
+ * @brief Sets up `vs` as one free range of `size` bytes at `start`.
+ * @return 0 on success, -1 if out of memory.
+ */
+int8_t vmm_space_init(VmSpace *vs, uint64_t start, size_t size);
+
+/**
+ * @brief Frees every region of `vs`, and leaves it not set up.
+ */
+void vmm_space_destroy(VmSpace *vs);
+
 /**
  * @brief Finds a virtual address
- * Traverses the linked list to find a node that is large enough for requested size,
- * then return the virtual address of the node.
+ * Takes the smallest free range that is large enough for the requested size (best fit),
+ * and carves the size off its start.
+ * @return The virtual address, or 0 if no free range is large enough.
  */
-uint64_t find_free_addr(VmFreeRegion **head_ref, size_t size);
+uint64_t find_free_addr(VmSpace *vs, size_t size);
 
-void vmm_add_free_region(VmFreeRegion **head_ref, uint64_t addr, size_t size);
-int8_t vmm_add_allocated_mem(VmAllocatedList **head_ref, uint64_t addr, size_t size, uint32_t flags);
-VmAllocatedList *vmm_pop_allocated_mem(VmAllocatedList **head_ref, uint64_t addr);
-VmAllocatedList *vmm_find_allocated_mem(VmAllocatedList **head_ref, uint64_t addr);
+/**
+ * @brief Like find_free_addr, but the address is a multiple of `align`.
+ */
+uint64_t find_free_addr_aligned(VmSpace *vs, size_t size, size_t align);
+
+void vmm_add_free_region(VmSpace *vs, uint64_t addr, size_t size);
+int8_t vmm_add_allocated_mem(VmSpace *vs, uint64_t addr, size_t size, uint32_t flags);
+
+/**
+ * @brief Removes the area that starts at `addr` from `vs`.
+ * @return The area, for the caller to free to g_vm_area_cache, or NULL if none starts there.
+ */
+VmArea *vmm_pop_allocated_mem(VmSpace *vs, uint64_t addr);
+
+/**
+ * @brief Finds the area of `vs` that contains `addr`.
+ */
+VmArea *vmm_find_allocated_mem(VmSpace *vs, uint64_t addr);
 
 /**
  * @brief Allocates space in VM
@@ -130,6 +217,17 @@ uint64_t vmm_copy_hierarchy(uint64_t *parent_tbl_virt, int level);
  */
 void vmm_init();
 
+/**
+ * @brief Turns on, on the CPU running this, the TLB features vmm_init found.
+ * vmm_init does it for the BSP, and every AP calls it once.
+ */
+void vmm_init_cpu(void);
+
+/**
+ * @brief Flushes every TLB entry of the CPU running this, of all PCIDs, global ones too.
+ */
+void vmm_flush_all_tlb(void);
+
 /**
  * @brief Allocates pages in the global kernel address space.
  * Maps physical frames to the kernel's virtual address space and ensures
@@ -138,25 +236,36 @@ void vmm_init();
 void *vmm_alloc_global(size_t size);
 
 /**
- * @brief Deep copies the list of allocated memory regions.
- * Used primarily during fork() to duplicate the parent's allocation metadata.
+ * @brief Deep copies the regions of `src` into `dst`, which must not be set up.
+ * Used during fork() to duplicate the parent's allocation metadata.
+ * The trees are walked with an iterator, not recursively.
+ * @return 0 on success, -1 if out of memory (`dst` is left not set up).
+ */
+int8_t vmm_copy_space(VmSpace *dst, VmSpace *src);
+
+/**
+ * @brief Frees the VMM metadata of a task.
+ * Cleans up the trees tracking allocated and free virtual memory regions
+ * for the specified task.
  */
-VmAllocatedList *vmm_copy_alloc_list(VmAllocatedList *node);
+void vmm_cleanup_task(struct Task *tsk);
 
 /**
- * @brief Deep copies the list of free memory regions.
- * Used primarily during fork() to duplicate the parent's free list metadata.
+ * @brief Loads the address space of `tsk` into CR3.
+ * With PCIDs, each task's TLB entries are tagged with its own PCID and
+ * survive the switch, so CR3 is loaded without flushing them, as long as the
+ * task comes back to the CPU it last ran on.
  */
-VmFreeRegion *vmm_copy_free_list(VmFreeRegion *node);
+void vmm_switch_to(struct Task *tsk);
 
 /**
- * @brief Frees the VMM metadata lists for a task.
- * Cleans up the linked lists tracking allocated and free virtual memory regions
- * for the specified task.
+ * @brief Gives the PCID of `tsk` back. Must be called when the task gets a new
+ * PML4 or dies, since the TLB may still hold entries tagged for its old one.
  */
-void vmm_cleanup_task(struct Task *tsk);
+void vmm_pcid_release(struct Task *tsk);
 
 int vmm_handle_cow(uint64_t fault_addr);
+int vmm_handle_demand(uint64_t fault_addr);
 
 static inline void *vmm_phys_to_hhdm(uint64_t phys_addr)
 {
@@ -0,0 +1,115 @@
+#include "mutex.h"
+#include "utils/asm_instrs.h"
+
+/**
+ * @brief Takes `m`, sleeping until it's handed over if another task has it.
+ *
+ * @details The wait list and the handover are done under `m->lock`, so the
+ * unlock can't slip in between. If there's nobody else to run, the scheduler
+ * comes straight back, and we halt until the next interrupt, as blkq_wait does.
+ * Before the scheduler runs, there's no task to put to sleep, so we spin.
+ */
+void mutex_lock(mutex_t *m)
+{
+    sched_defer_kill();
+
+    uint64_t rflags = spin_lock_irqsave(&m->lock);
+    Task *curr_tsk = get_curr_task();
+    while (curr_tsk == NULL && m->locked)
+    {
+        spin_unlock(&m->lock);
+        pause();
+        spin_lock(&m->lock);
+    }
+    if (!m->locked)
+    {
+        m->locked = true;
+        m->owner = curr_tsk;
+        spin_unlock_irqrestore(&m->lock, rflags);
+        return;
+    }
+
+    curr_tsk->wait_next = NULL;
+    if (m->wait_tail != NULL)
+    {
+        m->wait_tail->wait_next = curr_tsk;
+    }
+    else
+    {
+        m->wait_head = curr_tsk;
+    }
+    m->wait_tail = curr_tsk;
+
+    while (m->owner != curr_tsk)
+    {
+        curr_tsk->state = TASK_WAITING;
+        spin_unlock(&m->lock);
+
+        schedule();
+        if (__atomic_load_n(&m->owner, __ATOMIC_ACQUIRE) != curr_tsk)
+        {
+            sti();
+            hlt();
+            cli();
+        }
+        spin_lock(&m->lock);
+    }
+
+    if (curr_tsk->state == TASK_WAITING)
+    {
+        curr_tsk->state = TASK_READY;
+    }
+    spin_unlock_irqrestore(&m->lock, rflags);
+}
+
+/**
+ * @return Whether `m` was free, and is ours now.
+ */
+bool mutex_trylock(mutex_t *m)
+{
+    sched_defer_kill();
+
+    uint64_t rflags = spin_lock_irqsave(&m->lock);
+    bool taken = !m->locked;
+    if (taken)
+    {
+        m->locked = true;
+        m->owner = get_curr_task();
+    }
+    spin_unlock_irqrestore(&m->lock, rflags);
+
+    if (!taken)
+    {
+        sched_allow_kill();
+    }
+    return taken;
+}
+
+/**
+ * @brief Lets go of `m`: the first waiter, if any, owns it from now on.
+ * A kill that came while we held it takes effect here.
+ */
+void mutex_unlock(mutex_t *m)
+{
+    uint64_t rflags = spin_lock_irqsave(&m->lock);
+    Task *next = m->wait_head;
+    if (next != NULL)
+    {
+        m->wait_head = next->wait_next;
+        if (m->wait_head == NULL)
+        {
+            m->wait_tail = NULL;
+        }
+        next->wait_next = NULL;
+        __atomic_store_n(&m->owner, next, __ATOMIC_RELEASE);
+        sched_wake_pid(next->pid);
+    }
+    else
+    {
+        m->locked = false;
+        m->owner = NULL;
+    }
+    spin_unlock_irqrestore(&m->lock, rflags);
+
+    sched_allow_kill();
+}
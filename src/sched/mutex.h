@@ -0,0 +1,30 @@
+#ifndef MUTEX_H
+#define MUTEX_H
+
+#include <stdbool.h>
+
+#include "sched/sched.h"
+#include "utils/spinlock.h"
+
+/**
+ * A sleeping lock, for data whose owner may wait on the disk meanwhile.
+ * Tasks that find it taken sleep on its wait list, in arrival order, and
+ * mutex_unlock hands it over to the first of them. The owner can't be killed
+ * until it unlocks, see sched_defer_kill.
+ */
+typedef struct mutex
+{
+    spinlock_t lock; // guards the fields below
+    bool locked;
+    Task *owner;
+    Task *wait_head; // linked through wait_next
+    Task *wait_tail;
+} mutex_t;
+
+#define MUTEX_INIT {.lock = SPINLOCK_INIT, .locked = false, .owner = NULL, .wait_head = NULL, .wait_tail = NULL}
+
+void mutex_lock(mutex_t *m);
+bool mutex_trylock(mutex_t *m);
+void mutex_unlock(mutex_t *m);
+
+#endif
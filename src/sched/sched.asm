@@ -47,8 +47,13 @@ switch_to_task:
 
     ret
 
+extern sched_tail
+
 global task_start_stub
 task_start_stub:
+    ; the first run of a task doesn't return into schedule(), finish the switch here
+    call sched_tail
+
     pop r15
     pop r14
     pop r13
@@ -64,6 +69,10 @@ task_start_stub:
     pop rcx
     pop rbx
 
+    ; nothing may interrupt between swapgs and iretq, which restores IF
+    cli
+    swapgs          ; the user GS base goes in, the per-CPU data waits in KERNEL_GS_BASE
+
     mov ax, 0x2B
     mov ds, ax
     mov es, ax
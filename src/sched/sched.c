@@ -1,7 +1,7 @@
 #include "sched.h"
 #include "mem/pmm.h"
 #include "mem/vmm.h"
-#include "mem/kmalloc.h"
+#include "mem/slab.h"
 #include "arch/gdt.h"
 #include "drivers/timer.h"
 #include "drivers/serial.h"
@@ -11,6 +11,9 @@
 #include "gui/window.h"
 #include "include/signal.h"
 #include "utils/asm_instrs.h"
+#include "utils/spinlock.h"
+#include "utils/avl.h"
+#include "arch/smp.h"
 #include "../string.h"
 
 #include <stddef.h>
@@ -20,19 +23,135 @@
 #define NEW_TASK_RFLAGS 0x202
 #define KERN_TSK_PID 0x0
 
-// Linked list for Tasks
-static Task *g_head_tsk = NULL;
-static Task *g_curr_tsk = NULL;
+#define SCHED_REBALANCE_TICKS 20 // between two periodic rebalances of a CPU
+#define SCHED_CACHE_HOT_TICKS 2  // a task that ran this recently still has a warm cache
+#define SCHED_LOAD_SCALE 100     // load_avg is in hundredths of a task
+#define SCHED_LOAD_SHIFT 3       // load_avg moves 1/8 of the way to nr_ready each tick
+#define SCHED_LOAD_MAX_STEPS 64  // ticks of load_avg decay worked out at once, after a tickless stretch
+#define SCHED_PID_HASH_SIZE 0x40 // buckets of the pid table, a power of 2
+#define SCHED_BOOST_TICKS 2      // ticks an input wakeup lets a task run in SCHED_RT
+#define SCHED_NICE_0_WEIGHT 1024
+#define SCHED_VRUNTIME_TICK 1024 // vruntime a nice 0 task gets per tick it runs
+#define SCHED_WAKEUP_CREDIT SCHED_VRUNTIME_TICK // how far behind the others a woken task may start
+
+// the weight of each nice level, from -20 to 19: one level is ~10% of CPU time
+static const uint32_t g_nice_weights[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15,
+};
+
+/*
+Each CPU has a run queue, which owns the tasks that run on that CPU. A task is
+put on the least loaded CPU when registered. Only the CPU whose run queue holds
+a task ever switches to it; other CPUs only change its state (to wake it up or
+kill it), under the lock of its run queue.
+
+A task is on at most one of the structures of its run queue, by state:
+- the ready queue of its class: TASK_READY, and no CPU runs it. A task that
+  stops running while still ready goes back on it in sched_tail, once its CPU
+  is off its stack.
+- the sleep tree, an AVL tree by wake_tick: TASK_SLEEPING. The timer tick only
+  looks at its leftmost tasks.
+- nothing: TASK_WAITING or TASK_ZOMBIE (whoever wakes it knows its pid), or running.
+So picking the next task, waking one and the timer tick don't depend on how
+many tasks are blocked. Tasks are found by pid through a hash table.
+
+Ready tasks are split by scheduling class, and a class runs only when the ones
+before it have nothing ready:
+- SCHED_RT: a FIFO, round robin each tick. Tasks woken by an input event get
+  there for SCHED_BOOST_TICKS, or until they block, so the GUI answers a key
+  right away whatever else runs. A task set to SCHED_RT stays there.
+- SCHED_NORMAL: an AVL tree by vruntime, the ticks a task ran scaled by the
+  weight of its nice level. The task that ran the least runs next, and the tick
+  switches away from a task once another one has run less.
+- SCHED_IDLE: a FIFO, runs only when nothing else is ready.
+
+Tasks move between run queues in two ways. A CPU that runs out of ready tasks
+steals one from the CPU with the most ready tasks, right away. And every
+SCHED_REBALANCE_TICKS, each CPU pulls a task from the busiest CPU if that one
+has at least two more ready tasks than itself. The periodic rebalance only
+takes tasks that haven't run for SCHED_CACHE_HOT_TICKS, so a task stays on the
+CPU whose cache holds its data, unless it would sit idle otherwise. A task a
+CPU is running (or switching away from) is never moved, and the kernel task
+stays on the BSP. Moving a task takes the locks of both run queues, the lower
+CPU's first.
+
+The current task of a CPU lives in its cpu_local_t. A CPU with no ready task
+runs its idle task, which isn't on any run queue. The BSP's idle loop is the
+kernel task (kmain's event loop), which is always ready.
+
+Ticks are one-shot: each CPU arms its timer for its next deadline (see
+sched_tick), and enqueueing a task on a CPU whose deadline is further away
+than a tick brings it forward, with IRQ_IPI_RESCHED for another CPU. A CPU
+with nothing to run and no sleeper doesn't tick at all; a busy CPU with tasks
+waiting kicks one of those, so it steals a task.
+
+Lock order: g_pid_lock, then run queues.
+*/
+typedef struct TaskFifo
+{
+    Task *head;
+    Task *tail;
+} TaskFifo;
+
+typedef struct RunQueue
+{
+    spinlock_t lock;
+    TaskFifo rt;
+    avl_node_t *fair; // SCHED_NORMAL tasks, by vruntime
+    TaskFifo idle;
+    uint64_t min_vruntime; // only grows, where woken and moved-in tasks start
+    avl_node_t *sleepers;
+    uint32_t nr_queued; // on the ready queues
+    uint32_t nr_tasks;
+    bool running; // the CPU runs one of these tasks, not its idle task
+
+    // read by the other CPUs without the lock, to pick whom to steal from
+    volatile uint32_t nr_ready; // nr_queued, plus the running task
+    uint64_t load_avg;          // nr_ready averaged over the last ticks, in 1/SCHED_LOAD_SCALE
+
+    uint64_t last_tick;    // when sched_tick last accounted for the time
+    uint64_t last_balance; // when the CPU last tried the periodic rebalance
+    uint64_t next_tick;    // the deadline its timer is armed for, or TIMER_NEVER
+
+    uint64_t ticks;
+    uint64_t idle_ticks;
+    uint64_t switches;
+    uint64_t steals;   // tasks pulled when this CPU had nothing to run
+    uint64_t balanced; // tasks pulled by the periodic rebalance
+    uint64_t stolen;   // tasks other CPUs took from this one
+
+    uint64_t input_frames; // input wakeups answered by a draw
+    uint64_t input_cycles; // TSC cycles from the wakeup to the draw, summed
+    uint64_t input_cycles_max;
+} RunQueue;
+
+static RunQueue g_rqs[MAX_CPUS];
+
+static Task *g_pid_hash[SCHED_PID_HASH_SIZE]; // chained through pid_next
+static spinlock_t g_pid_lock = SPINLOCK_INIT;
 static int g_next_pid = KERN_TSK_PID + 1; // value "0" is our OS kernel
 
 extern uint64_t *kern_pml4;
-extern void tss_set_stack(uint64_t stk_ptr);
-extern uint64_t kern_stk_ptr;
 
 extern void switch_to_task(uint64_t *prev_rsp_ptr, uint64_t next_rsp, uint8_t *prev_fpu, uint8_t *next_fpu);
 extern void task_start_stub(void);
 
+static void task_ctor(void *obj)
+{
+    memset(obj, 0, sizeof(Task));
+}
+
+static kmem_cache_t g_task_cache = KMEM_CACHE_INIT("Task", Task, task_ctor);
+
 inline static void sched_clean_gui(Task *tsk);
+static void sched_check_kill(void);
 inline static void sched_clean_fds(Task *tsk);
 
 static uint8_t *get_aligned_fpu_region(Task *tsk)
@@ -52,50 +171,57 @@ static uint8_t *get_aligned_fpu_region(Task *tsk)
  */
 Task *sched_new_task(void)
 {
-    Task *new_tsk = (Task *)kmalloc(sizeof(Task));
-    new_tsk->pid = g_next_pid++;
+    Task *new_tsk = (Task *)kmem_cache_alloc(&g_task_cache);
+    if (new_tsk == NULL)
+    {
+        kprint("SCHED_NEW_TASK failed: OOM\n");
+        return NULL;
+    }
+    new_tsk->pid = __atomic_fetch_add(&g_next_pid, 1, __ATOMIC_RELAXED);
     new_tsk->next = NULL;
+    new_tsk->prev = NULL;
     new_tsk->kern_stk_top = 0;
     new_tsk->state = TASK_WAITING;
     new_tsk->pml4 = vmm_new_pml4();
-    new_tsk->parent = g_curr_tsk;
+    new_tsk->parent = get_curr_task();
     new_tsk->heap_end = USER_HEAP_START;
     new_tsk->win = NULL;
     new_tsk->pending_signals = 0;
+    new_tsk->kill_defer = 0;
+    new_tsk->kill_pending = false;
     new_tsk->wait_next = NULL;
     new_tsk->wake_tick = -1;
     new_tsk->fg_pid = -1;
+    new_tsk->policy = SCHED_NORMAL;
+    new_tsk->sched_class = SCHED_NORMAL;
+    new_tsk->nice = 0;
+    new_tsk->weight = SCHED_NICE_0_WEIGHT;
 
     uint8_t *fpu_ptr = get_aligned_fpu_region(new_tsk);
     memset(fpu_ptr, 0, 512);
     *((uint32_t *)(fpu_ptr + 0x18)) = 0x1F80; // set MXCS to avoid exceptions in float math
 
-    VmFreeRegion *vm_free_head = (VmFreeRegion *)kmalloc(sizeof(VmFreeRegion));
-    if (vm_free_head == NULL)
+    if (vmm_space_init(&new_tsk->vm, USER_MMAP_START, USER_MMAP_SIZE) < 0)
     {
         kprint("SCHED_NEW_TASK failed: OOM\n");
+        kmem_cache_free(&g_task_cache, new_tsk);
         return NULL;
     }
 
-    new_tsk->vm_free_head = vm_free_head;
-    new_tsk->vm_free_head->addr = USER_MMAP_START;
-    new_tsk->vm_free_head->size = USER_MMAP_SIZE;
-    new_tsk->vm_free_head->next = NULL;
-    new_tsk->vm_alloc_head = NULL;
-
     EventBuf *event_queue = (EventBuf *)vmm_alloc_global(sizeof(EventBuf));
     if (event_queue == NULL)
     {
         kprint("SCHED_NEW_TASK failed: OOM\n");
-        kfree(vm_free_head);
+        vmm_space_destroy(&new_tsk->vm);
+        kmem_cache_free(&g_task_cache, new_tsk);
         return NULL;
     }
     new_tsk->event_queue = event_queue;
     event_queue_init(new_tsk->event_queue);
 
-    if (g_curr_tsk != NULL) // has parent -> copy dir from him
+    if (new_tsk->parent != NULL) // has parent -> copy dir from him
     {
-        strcpy(new_tsk->cwd, g_curr_tsk->cwd);
+        strcpy(new_tsk->cwd, new_tsk->parent->cwd);
     }
     else // else, it's the first task, root is "/"
     {
@@ -193,51 +319,367 @@ void task_context_reset(Task *tsk, uint64_t entry, uint64_t rsp)
  */
 void sched_destroy_task(Task *tsk)
 {
+    // a task that just exited or was killed may still be on its kernel stack,
+    // until its CPU is done switching away from it: let others run meanwhile
+    while (__atomic_load_n(&tsk->on_cpu, __ATOMIC_ACQUIRE))
+    {
+        schedule();
+    }
+
     if (tsk->kern_stk_top != 0)
     {
         pmm_free_frame(vmm_hhdm_to_phys((void *)(tsk->kern_stk_top - PAGE_SIZE)));
     }
 
+    vmm_pcid_release(tsk);
     vmm_ret_pml4(tsk->pml4);
     vmm_cleanup_task(tsk);
     sched_clean_gui(tsk);
-    kfree(tsk);
+    kmem_cache_free(&g_task_cache, tsk);
 }
 
-void sched_unlink_task(Task *tsk)
+static inline Task **pid_bucket(int pid)
+{
+    return &g_pid_hash[(uint32_t)pid & (SCHED_PID_HASH_SIZE - 1)];
+}
+
+/**
+ * @brief Puts `tsk` in the pid table. Called with g_pid_lock held.
+ */
+static void pid_hash_add(Task *tsk)
 {
-    // find the task's predecessor
-    Task *prev = tsk;
-    while (prev->next != tsk)
+    Task **bucket = pid_bucket(tsk->pid);
+    tsk->pid_next = *bucket;
+    *bucket = tsk;
+}
+
+/**
+ * @brief Takes `tsk` out of the pid table. Called with g_pid_lock held.
+ */
+static void pid_hash_remove(Task *tsk)
+{
+    Task **pp = pid_bucket(tsk->pid);
+    while (*pp != NULL && *pp != tsk)
     {
-        prev = prev->next;
+        pp = &(*pp)->pid_next;
     }
+    if (*pp != NULL)
+    {
+        *pp = tsk->pid_next;
+    }
+    tsk->pid_next = NULL;
+}
 
-    // unlink it
-    Task *next_tsk = tsk->next;
-    prev->next = next_tsk;
+static inline void rq_update_ready(RunQueue *rq)
+{
+    rq->nr_ready = rq->nr_queued + (rq->running ? 1 : 0);
+}
+
+static void fifo_push(TaskFifo *fifo, Task *tsk)
+{
+    tsk->next = NULL;
+    tsk->prev = fifo->tail;
+    if (fifo->tail != NULL)
+    {
+        fifo->tail->next = tsk;
+    }
+    else
+    {
+        fifo->head = tsk;
+    }
+    fifo->tail = tsk;
+}
+
+static void fifo_remove(TaskFifo *fifo, Task *tsk)
+{
+    if (tsk->prev != NULL)
+    {
+        tsk->prev->next = tsk->next;
+    }
+    else
+    {
+        fifo->head = tsk->next;
+    }
+    if (tsk->next != NULL)
+    {
+        tsk->next->prev = tsk->prev;
+    }
+    else
+    {
+        fifo->tail = tsk->prev;
+    }
+    tsk->next = NULL;
+    tsk->prev = NULL;
+}
 
-    if (tsk == g_head_tsk)
+static int vruntime_cmp(const avl_node_t *a, const avl_node_t *b)
+{
+    const Task *ta = AVL_ENTRY(a, Task, run_node);
+    const Task *tb = AVL_ENTRY(b, Task, run_node);
+    if (ta->vruntime != tb->vruntime)
+    {
+        return ta->vruntime < tb->vruntime ? -1 : 1;
+    }
+    return (ta->pid > tb->pid) - (ta->pid < tb->pid);
+}
+
+static avl_node_t *avl_leftmost(avl_node_t *n)
+{
+    if (n == NULL)
+    {
+        return NULL;
+    }
+    while (n->left != NULL)
+    {
+        n = n->left;
+    }
+    return n;
+}
+
+/**
+ * @brief Makes the CPU of `rq`, locked, tick within a tick from now at the
+ * latest, if it's armed for later or not armed at all.
+ */
+static void rq_kick(RunQueue *rq)
+{
+    uint64_t soon = timer_get_ticks() + 1;
+    if (rq->next_tick <= soon)
+    {
+        return;
+    }
+
+    rq->next_tick = soon;
+    uint32_t id = (uint32_t)(rq - g_rqs);
+    if (id == cpu_id())
+    {
+        timer_arm(soon);
+    }
+    else
+    {
+        smp_send_resched(id);
+    }
+}
+
+/**
+ * @brief Puts `tsk` on the ready queue of its class, in `rq`, locked.
+ */
+static void rq_enqueue(RunQueue *rq, Task *tsk)
+{
+    switch (tsk->sched_class)
+    {
+    case SCHED_RT:
+        fifo_push(&rq->rt, tsk);
+        break;
+    case SCHED_IDLE:
+        fifo_push(&rq->idle, tsk);
+        break;
+    default:
+        avl_insert(&rq->fair, &tsk->run_node, vruntime_cmp);
+        break;
+    }
+    tsk->queued = true;
+    rq->nr_queued++;
+    rq_update_ready(rq);
+    rq_kick(rq);
+}
+
+/**
+ * @brief Takes `tsk` off the ready queue of its class, in `rq`, locked.
+ */
+static void rq_dequeue(RunQueue *rq, Task *tsk)
+{
+    switch (tsk->sched_class)
+    {
+    case SCHED_RT:
+        fifo_remove(&rq->rt, tsk);
+        break;
+    case SCHED_IDLE:
+        fifo_remove(&rq->idle, tsk);
+        break;
+    default:
+        avl_remove(&rq->fair, &tsk->run_node, vruntime_cmp);
+        break;
+    }
+    tsk->queued = false;
+    rq->nr_queued--;
+    rq_update_ready(rq);
+}
+
+/**
+ * @return The ready task of `rq` to run next, left on its queue, or NULL.
+ */
+static Task *rq_peek(RunQueue *rq)
+{
+    if (rq->rt.head != NULL)
+    {
+        return rq->rt.head;
+    }
+    avl_node_t *n = avl_leftmost(rq->fair);
+    if (n != NULL)
+    {
+        return AVL_ENTRY(n, Task, run_node);
+    }
+    return rq->idle.head;
+}
+
+/**
+ * @return Whether `next` should take the CPU from `curr`, which used up a tick.
+ */
+static bool sched_preempts(const Task *next, const Task *curr)
+{
+    if (next->sched_class != curr->sched_class)
+    {
+        return next->sched_class < curr->sched_class;
+    }
+    if (next->sched_class == SCHED_NORMAL)
+    {
+        return next->vruntime < curr->vruntime;
+    }
+    return true; // round robin
+}
+
+/**
+ * @brief Keeps a task that joins `rq` from starting far behind its tasks, which
+ * would let it run alone for as long as it slept. Called before it's queued.
+ */
+static void rq_place(RunQueue *rq, Task *tsk)
+{
+    if (rq->min_vruntime > SCHED_WAKEUP_CREDIT && tsk->vruntime < rq->min_vruntime - SCHED_WAKEUP_CREDIT)
+    {
+        tsk->vruntime = rq->min_vruntime - SCHED_WAKEUP_CREDIT;
+    }
+}
+
+static int sleep_cmp(const avl_node_t *a, const avl_node_t *b)
+{
+    const Task *ta = AVL_ENTRY(a, Task, sleep_node);
+    const Task *tb = AVL_ENTRY(b, Task, sleep_node);
+    if (ta->wake_tick != tb->wake_tick)
     {
-        g_head_tsk = next_tsk;
-        if (tsk == next_tsk)
+        return ta->wake_tick < tb->wake_tick ? -1 : 1;
+    }
+    return (ta->pid > tb->pid) - (ta->pid < tb->pid);
+}
+
+/**
+ * @brief Puts `tsk` on the sleep tree of `rq`, locked, which must be the run
+ * queue of this CPU: its timer is brought forward to the wake tick if needed.
+ */
+static void rq_sleep(RunQueue *rq, Task *tsk)
+{
+    avl_insert(&rq->sleepers, &tsk->sleep_node, sleep_cmp);
+    tsk->in_sleepq = true;
+
+    if ((uint64_t)tsk->wake_tick < rq->next_tick)
+    {
+        rq->next_tick = (uint64_t)tsk->wake_tick;
+        timer_arm(rq->next_tick);
+    }
+}
+
+static void rq_unsleep(RunQueue *rq, Task *tsk)
+{
+    avl_remove(&rq->sleepers, &tsk->sleep_node, sleep_cmp);
+    tsk->in_sleepq = false;
+}
+
+/**
+ * @return The sleeping task of `rq` due first, or NULL.
+ */
+static Task *rq_first_sleeper(RunQueue *rq)
+{
+    avl_node_t *n = avl_leftmost(rq->sleepers);
+    return n != NULL ? AVL_ENTRY(n, Task, sleep_node) : NULL;
+}
+
+/**
+ * @brief Takes `tsk` off its ready queue or the sleep tree, whichever it's on.
+ */
+static void rq_forget(RunQueue *rq, Task *tsk)
+{
+    if (tsk->queued)
+    {
+        rq_dequeue(rq, tsk);
+    }
+    if (tsk->in_sleepq)
+    {
+        rq_unsleep(rq, tsk);
+    }
+}
+
+/**
+ * @brief Makes a waiting or sleeping task of `rq` (locked) ready.
+ * A task still on its CPU is queued by sched_tail, once the CPU is off its stack.
+ */
+static void rq_wake(RunQueue *rq, Task *tsk)
+{
+    if (tsk->state != TASK_WAITING && tsk->state != TASK_SLEEPING)
+    {
+        return;
+    }
+
+    if (tsk->in_sleepq)
+    {
+        rq_unsleep(rq, tsk);
+    }
+    tsk->state = TASK_READY;
+    if (!tsk->on_cpu)
+    {
+        rq_place(rq, tsk);
+        rq_enqueue(rq, tsk);
+    }
+}
+
+/**
+ * @brief Locks the run queue `tsk` is on. Interrupts must be off.
+ * The task may move to another CPU until that lock is held, so we check again once it is.
+ */
+static RunQueue *rq_lock_of(Task *tsk)
+{
+    while (1)
+    {
+        RunQueue *rq = &g_rqs[__atomic_load_n(&tsk->cpu, __ATOMIC_RELAXED)];
+        spin_lock(&rq->lock);
+        if (rq == &g_rqs[tsk->cpu])
         {
-            g_head_tsk = NULL;
+            return rq;
         }
+        spin_unlock(&rq->lock);
     }
 }
 
+void sched_unlink_task(Task *tsk)
+{
+    uint64_t rflags = spin_lock_irqsave(&g_pid_lock);
+    pid_hash_remove(tsk);
+    spin_unlock(&g_pid_lock);
+
+    RunQueue *rq = rq_lock_of(tsk);
+    rq_forget(rq, tsk);
+    rq->nr_tasks--;
+    spin_unlock_irqrestore(&rq->lock, rflags);
+}
+
 void sched_init(void)
 {
+    // the first sched_tick of each CPU charges the time since now, not since boot
+    uint64_t now = timer_get_ticks();
+    for (uint32_t c = 0; c < MAX_CPUS; c++)
+    {
+        g_rqs[c].next_tick = TIMER_NEVER;
+        g_rqs[c].last_tick = now;
+        g_rqs[c].last_balance = now;
+    }
+
     /*
     When our OS starts running, it's the very first program, but annonymous (no pid)
     so we need to keep track our OS as Task 0 (Kernel Task).
     */
 
-    Task *kern_tsk = (Task *)kmalloc(sizeof(Task));
+    Task *kern_tsk = (Task *)kmem_cache_alloc(&g_task_cache);
     kern_tsk->pid = 0;
     kern_tsk->state = TASK_READY;
-    kern_tsk->pml4 = read_cr3();
+    kern_tsk->pml4 = pte_get_addr(read_cr3());
     kern_tsk->wake_tick = -1;
     kern_tsk->fg_pid = -1;
 
@@ -273,10 +715,60 @@ void sched_init(void)
     // *(--sp) = 0; // R14
     // *(--sp) = 0; // R15
     // kern_tsk->kern_stk_rsp = (uint64_t)sp;
-    kern_tsk->next = kern_tsk;
+    kern_tsk->next = NULL;
     kern_tsk->wait_next = NULL;
-    g_head_tsk = kern_tsk;
-    g_curr_tsk = kern_tsk;
+    kern_tsk->cpu = 0;
+    kern_tsk->on_cpu = true;
+    kern_tsk->policy = SCHED_NORMAL;
+    kern_tsk->sched_class = SCHED_NORMAL;
+    kern_tsk->weight = SCHED_NICE_0_WEIGHT;
+
+    g_rqs[0].nr_tasks = 1;
+    g_rqs[0].running = true;
+    rq_update_ready(&g_rqs[0]);
+    pid_hash_add(kern_tsk);
+
+    cpu_local_t *cpu = this_cpu();
+    cpu->curr_tsk = kern_tsk;
+    cpu->kern_stk_ptr = kern_tsk->kern_stk_top;
+}
+
+/**
+ * @brief Turns the code running on an AP into the idle task of its CPU.
+ * It runs with the kernel's page tables and never leaves the kernel, so it
+ * needs no kernel stack of its own: it stays on the one it was started on.
+ */
+void sched_init_cpu(void)
+{
+    cpu_local_t *cpu = this_cpu();
+
+    Task *idle_tsk = (Task *)kmem_cache_alloc(&g_task_cache);
+    if (idle_tsk == NULL)
+    {
+        kprint("PANIC: Idle Task OOM\n");
+        hcf();
+    }
+    idle_tsk->pid = KERN_TSK_PID;
+    idle_tsk->state = TASK_READY;
+    idle_tsk->pml4 = vmm_hhdm_to_phys(kern_pml4);
+    idle_tsk->wake_tick = -1;
+    idle_tsk->fg_pid = -1;
+    idle_tsk->next = NULL;
+    idle_tsk->cpu = cpu->id;
+    idle_tsk->on_cpu = true;
+    idle_tsk->policy = SCHED_IDLE;
+    idle_tsk->sched_class = SCHED_IDLE;
+    idle_tsk->weight = SCHED_NICE_0_WEIGHT;
+    strcpy(idle_tsk->cwd, "/");
+
+    uint8_t *fpu_ptr = get_aligned_fpu_region(idle_tsk);
+    *((uint32_t *)(fpu_ptr + 0x18)) = 0x1F80;
+
+    cpu->idle_tsk = idle_tsk;
+    cpu->curr_tsk = idle_tsk;
+
+    // the CPU only comes up now: its first tick charges nothing before
+    g_rqs[cpu->id].last_tick = timer_get_ticks();
 }
 
 void task_idle(void)
@@ -284,158 +776,486 @@ void task_idle(void)
     asm volatile("sti");
     for (;;)
     {
+        pmm_refill_zeroed();
         asm("hlt");
     }
 }
 
-void schedule(void)
+/**
+ * @brief Ends a switch, on the task switched to, with interrupts off: the task
+ * switched away from is off its stack now. If it's still ready, it goes back
+ * on its ready queue, if it's sleeping, on the sleep tree, and either way, it's
+ * free to move to another CPU or be reaped. A task that blocks loses its input
+ * boost. New tasks get here from task_start_stub.
+ */
+void sched_tail(void)
 {
-    if (g_head_tsk == NULL)
+    cpu_local_t *cpu = this_cpu();
+    Task *prev_tsk = cpu->prev_tsk;
+    if (prev_tsk == NULL)
     {
         return;
     }
+    cpu->prev_tsk = NULL;
 
-    Task *next_tsk;
-
-    if (g_curr_tsk == NULL)
+    if (prev_tsk == cpu->idle_tsk)
     {
-        next_tsk = g_head_tsk;
+        prev_tsk->on_cpu = false;
+        return;
     }
-    else
-    {
-        next_tsk = g_curr_tsk->next;
-        if (next_tsk == NULL)
-        {
-            next_tsk = g_head_tsk;
-        }
-
-        Task *start_tsk = next_tsk;
-        while (next_tsk->state != TASK_READY)
-        {
-            next_tsk = next_tsk->next;
-            if (next_tsk == NULL)
-            {
-                next_tsk = g_head_tsk;
-            }
 
-            if (next_tsk == start_tsk)
-            {
-                next_tsk = g_head_tsk;
-                break;
-            }
-        }
+    // it can't have moved while on_cpu
+    RunQueue *rq = &g_rqs[prev_tsk->cpu];
+    spin_lock(&rq->lock);
+    if (prev_tsk->state != TASK_READY)
+    {
+        prev_tsk->sched_class = prev_tsk->policy;
+        prev_tsk->boost_ticks = 0;
     }
-
-    if (next_tsk == NULL)
+    if (prev_tsk->state == TASK_READY)
     {
-        kprint("[SCHEDULE]: PANIC next_tsk is NULL\n");
-        return;
+        rq_enqueue(rq, prev_tsk);
     }
-
-    if (next_tsk == g_curr_tsk)
+    else if (prev_tsk->state == TASK_SLEEPING)
     {
-        // kprint("Only 1 task, no switch!\n");
-        return;
+        rq_sleep(rq, prev_tsk);
     }
+    __atomic_store_n(&prev_tsk->on_cpu, false, __ATOMIC_RELEASE);
+    spin_unlock(&rq->lock);
+}
 
-    Task *prev_tsk = g_curr_tsk;
-    g_curr_tsk = next_tsk;
+/**
+ * @brief Switches the CPU from `prev_tsk` to `next_tsk`, with interrupts off.
+ * `next_tsk` must have been marked on_cpu under the lock of its run queue, so
+ * no other CPU can steal it meanwhile.
+ * With `save_prev`, `prev_tsk` later runs again from here; without, it has exited.
+ */
+static void sched_switch(cpu_local_t *cpu, Task *prev_tsk, bool save_prev, Task *next_tsk)
+{
+    cpu->curr_tsk = next_tsk;
+    cpu->prev_tsk = prev_tsk;
+    prev_tsk->last_ran = timer_get_ticks();
+    g_rqs[cpu->id].switches++;
 
-    tss_set_stack(next_tsk->kern_stk_top);
-    kern_stk_ptr = next_tsk->kern_stk_top;
+    if (next_tsk->kern_stk_top != 0)
+    {
+        tss_set_stack(next_tsk->kern_stk_top);
+        cpu->kern_stk_ptr = next_tsk->kern_stk_top;
+    }
 
     // Process Isolation
     // store the pml4 of the task to the CR3
-    write_cr3(next_tsk->pml4);
+    vmm_switch_to(next_tsk);
 
     /*
     Context Switching
     We do save current RSP value into &prev_tsk->kern_stk_rsp
     and pass new RSP value from next_tsk->kern_stk_rsp
     */
-    uint8_t *prev_fpu = (prev_tsk != NULL) ? get_aligned_fpu_region(prev_tsk) : NULL;
     uint8_t *next_fpu = get_aligned_fpu_region(next_tsk);
-    if (prev_tsk == NULL)
+    if (!save_prev)
     {
         switch_to_task(NULL, next_tsk->kern_stk_rsp, NULL, next_fpu);
     }
     else
     {
-        switch_to_task(&prev_tsk->kern_stk_rsp, next_tsk->kern_stk_rsp, prev_fpu, next_fpu);
+        switch_to_task(&prev_tsk->kern_stk_rsp, next_tsk->kern_stk_rsp, get_aligned_fpu_region(prev_tsk), next_fpu);
     }
 
-    // CPU is now running g_curr_tsk, which is the next_tsk right above this comment.
-    // The g_curr_tsk just woke up after being putting to sleep for some time.
-    // This is the best place to check for Pending Signals
+    sched_tail();
+}
+
+/**
+ * @brief Picks a ready task of `src` to move to another CPU, an SCHED_NORMAL
+ * one first, then SCHED_IDLE. SCHED_RT tasks stay, they wait for a tick at most.
+ * Called with the lock of `src` held.
+ * @param cold_only skip the tasks that ran in the last SCHED_CACHE_HOT_TICKS
+ * @return The task, or NULL if there's none.
+ */
+static Task *sched_pick_migrant(RunQueue *src, bool cold_only, uint64_t now)
+{
+    avl_iter_t it;
+    avl_iter_init(&it, src->fair);
+    avl_node_t *n;
+    while ((n = avl_iter_next(&it)) != NULL)
+    {
+        Task *t = AVL_ENTRY(n, Task, run_node);
+        if (t->pid != KERN_TSK_PID && (!cold_only || now - t->last_ran >= SCHED_CACHE_HOT_TICKS))
+        {
+            return t;
+        }
+    }
+
+    for (Task *t = src->idle.head; t != NULL; t = t->next)
+    {
+        if (t->pid != KERN_TSK_PID && (!cold_only || now - t->last_ran >= SCHED_CACHE_HOT_TICKS))
+        {
+            return t;
+        }
+    }
+
+    return NULL;
+}
 
-    if (g_curr_tsk->pending_signals & (1 << (SIGINT - 1)))
+/**
+ * @brief The online CPU, other than `self`, with the most ready tasks.
+ * Reads the nr_ready of the others without their locks, so it may be a bit stale.
+ * @return The CPU, or -1 if there's no other online CPU.
+ */
+static int sched_busiest_cpu(uint32_t self, uint32_t *out_ready)
+{
+    int busiest = -1;
+    uint32_t most = 0;
+    for (uint32_t c = 0; c < smp_cpu_count(); c++)
+    {
+        uint32_t ready = g_rqs[c].nr_ready;
+        if (c != self && smp_cpu(c)->online && (busiest < 0 || ready > most))
+        {
+            busiest = (int)c;
+            most = ready;
+        }
+    }
+
+    *out_ready = most;
+    return busiest;
+}
+
+/**
+ * @brief Moves a ready task from the busiest other CPU to this one.
+ * Called with interrupts off and no run queue lock held.
+ *
+ * @param idle this CPU has nothing to run: any task will do, and it's marked
+ * on_cpu before the locks are dropped, since the caller switches to it right
+ * away. Otherwise, only a task whose cache went cold is taken.
+ * @return The task moved, or NULL.
+ */
+static Task *sched_pull(cpu_local_t *cpu, bool idle)
+{
+    uint32_t src_ready;
+    int src_cpu = sched_busiest_cpu(cpu->id, &src_ready);
+    // the busiest CPU runs one of its ready tasks itself
+    if (src_cpu < 0 || src_ready < 2)
+    {
+        return NULL;
+    }
+
+    RunQueue *dst = &g_rqs[cpu->id];
+    RunQueue *src = &g_rqs[src_cpu];
+    RunQueue *first = (uint32_t)src_cpu < cpu->id ? src : dst;
+    RunQueue *second = (first == src) ? dst : src;
+    spin_lock(&first->lock);
+    spin_lock(&second->lock);
+
+    Task *t = sched_pick_migrant(src, !idle, timer_get_ticks());
+    if (t != NULL)
+    {
+        rq_dequeue(src, t);
+        src->nr_tasks--;
+        src->stolen++;
+
+        // keep its lead or lag on the tasks around it
+        t->vruntime = t->vruntime - src->min_vruntime + dst->min_vruntime;
+        t->cpu = cpu->id;
+        dst->nr_tasks++;
+        if (idle)
+        {
+            t->on_cpu = true;
+            dst->running = true;
+            rq_update_ready(dst);
+            dst->steals++;
+        }
+        else
+        {
+            rq_enqueue(dst, t);
+            dst->balanced++;
+        }
+    }
+
+    spin_unlock(&second->lock);
+    spin_unlock(&first->lock);
+    return t;
+}
+
+/**
+ * @brief Picks the task this CPU runs next, with interrupts off: the first
+ * ready task of its best class, or `prev_tsk` if it's still ready and alone, or
+ * a task stolen from another CPU, or the idle task. The task is marked on_cpu.
+ * @return The task, `prev_tsk` if there's no need to switch, or NULL on the BSP
+ * if there's nothing to run (its kernel task never blocks for long).
+ */
+static Task *sched_pick(cpu_local_t *cpu, Task *prev_tsk)
+{
+    RunQueue *rq = &g_rqs[cpu->id];
+    spin_lock(&rq->lock);
+
+    Task *next_tsk = rq_peek(rq);
+    if (next_tsk != NULL)
+    {
+        rq_dequeue(rq, next_tsk);
+    }
+    else if (prev_tsk != cpu->idle_tsk && prev_tsk->state == TASK_READY)
+    {
+        next_tsk = prev_tsk;
+    }
+
+    if (next_tsk != NULL)
+    {
+        next_tsk->on_cpu = true;
+        rq->running = true;
+        rq_update_ready(rq);
+        spin_unlock(&rq->lock);
+        return next_tsk;
+    }
+    spin_unlock(&rq->lock);
+
+    next_tsk = sched_pull(cpu, true);
+    if (next_tsk != NULL)
+    {
+        return next_tsk;
+    }
+
+    spin_lock(&rq->lock);
+    rq->running = false;
+    rq_update_ready(rq);
+    spin_unlock(&rq->lock);
+    return cpu->idle_tsk;
+}
+
+void schedule(void)
+{
+    sched_check_kill();
+
+    uint64_t rflags = get_rflags();
+    cli();
+
+    cpu_local_t *cpu = this_cpu();
+    Task *prev_tsk = cpu->curr_tsk;
+    Task *next_tsk = sched_pick(cpu, prev_tsk);
+
+    if (next_tsk == NULL || next_tsk == prev_tsk)
+    {
+        // kprint("Only 1 task, no switch!\n");
+        irq_restore(rflags);
+        return;
+    }
+
+    sched_switch(cpu, prev_tsk, true, next_tsk);
+    irq_restore(rflags);
+
+    // CPU is now running the task that called schedule() earlier, which was
+    // switched back to just now, after being put to sleep for some time.
+    // This is the best place to check for Pending Signals
+    Task *curr_tsk = get_curr_task();
+    if (curr_tsk->pending_signals & (1 << (SIGINT - 1)))
     {
         kprint("Signal SIGINT detected! Killing process...\n");
-        g_curr_tsk->pending_signals &= ~(1 << (SIGINT - 1));
+        curr_tsk->pending_signals &= ~(1 << (SIGINT - 1));
         sched_exit(0);
     }
+    sched_check_kill();
 }
 
 void sched_block()
 {
-    g_curr_tsk->state = TASK_WAITING;
+    get_curr_task()->state = TASK_WAITING;
     schedule();
 }
 
+/**
+ * @brief Finds the task `pid`.
+ * @return The task, with the lock of its run queue held and interrupts off
+ * (their state before goes to `rflags`), or NULL with no lock held.
+ */
+static Task *sched_find_locked(int pid, RunQueue **rq_out, uint64_t *rflags)
+{
+    uint64_t flags = spin_lock_irqsave(&g_pid_lock);
+
+    Task *t = *pid_bucket(pid);
+    while (t != NULL && t->pid != pid)
+    {
+        t = t->pid_next;
+    }
+    if (t == NULL)
+    {
+        spin_unlock_irqrestore(&g_pid_lock, flags);
+        return NULL;
+    }
+
+    // with g_pid_lock held, the task can't be unlinked, nor freed
+    *rq_out = rq_lock_of(t);
+    *rflags = flags;
+    spin_unlock(&g_pid_lock);
+    return t;
+}
+
 void sched_wake_pid(int pid)
 {
-    Task *t = sched_find_task(pid);
-    if (t == NULL || t->state == TASK_ZOMBIE || t->state == TASK_DEAD)
+    RunQueue *rq;
+    uint64_t rflags;
+    Task *t = sched_find_locked(pid, &rq, &rflags);
+    if (t == NULL)
     {
         return;
     }
 
-    t->state = TASK_READY;
+    rq_wake(rq, t);
+    spin_unlock_irqrestore(&rq->lock, rflags);
 }
 
-void sched_exit(int code)
+/**
+ * @brief Wakes the task `pid` for an input event meant for it, and lets it run
+ * in SCHED_RT for a while, ahead of the CPU-bound tasks. Its CPU is told to
+ * switch to it right away, rather than at its next tick.
+ * The time until it draws next is counted as the latency of the input.
+ */
+void sched_wake_input(int pid)
 {
-    if (g_curr_tsk->pid == 0)
+    RunQueue *rq;
+    uint64_t rflags;
+    Task *t = sched_find_locked(pid, &rq, &rflags);
+    if (t == NULL)
     {
-        kprint("Kernel cannot exit!\n");
         return;
     }
 
-    cli();
+    if (t->input_tsc == 0)
+    {
+        t->input_tsc = rdtsc();
+    }
+
+    if (t->policy == SCHED_NORMAL)
+    {
+        if (t->queued)
+        {
+            rq_dequeue(rq, t);
+            t->sched_class = SCHED_RT;
+            rq_enqueue(rq, t);
+        }
+        else
+        {
+            t->sched_class = SCHED_RT;
+        }
+        t->boost_ticks = SCHED_BOOST_TICKS;
+    }
+    rq_wake(rq, t);
 
-    // unlink it
-    Task *task_to_exit = g_curr_tsk;
-    Task *next_tsk = task_to_exit->next;
+    cpu_local_t *cpu = smp_cpu(t->cpu);
+    Task *curr = cpu->curr_tsk;
+    bool resched = t->queued && (curr == cpu->idle_tsk || t->sched_class < curr->sched_class);
+    spin_unlock_irqrestore(&rq->lock, rflags);
 
-    while (next_tsk->state != TASK_READY)
+    if (resched)
     {
-        next_tsk = next_tsk->next;
-        if (next_tsk == task_to_exit)
+        smp_send_resched(cpu->id);
+    }
+}
+
+/**
+ * @brief Called when the current task draws to its window: ends the latency
+ * of the input event that woke it, if any, and makes sure the kernel task,
+ * which puts the windows on the screen, runs within a tick.
+ */
+void sched_task_drew(void)
+{
+    Task *curr = get_curr_task();
+    if (curr->input_tsc != 0)
+    {
+        uint64_t cycles = rdtsc() - curr->input_tsc;
+        curr->input_tsc = 0;
+
+        // it's running, so it stays on this run queue
+        RunQueue *rq = &g_rqs[curr->cpu];
+        uint64_t rflags = spin_lock_irqsave(&rq->lock);
+        rq->input_frames++;
+        rq->input_cycles += cycles;
+        if (cycles > rq->input_cycles_max)
         {
-            kprint("PANIC: NO valid task to switch to!\n");
-            for (;;)
-                ;
+            rq->input_cycles_max = cycles;
         }
+        spin_unlock_irqrestore(&rq->lock, rflags);
+    }
+
+    // the kernel task stays on the BSP, and may be halted with its timer far off
+    RunQueue *krq = &g_rqs[0];
+    if (krq->next_tick > timer_get_ticks() + 1)
+    {
+        uint64_t rflags = spin_lock_irqsave(&krq->lock);
+        rq_kick(krq);
+        spin_unlock_irqrestore(&krq->lock, rflags);
+    }
+}
+
+/**
+ * @brief Sets the scheduling class and nice level of the task `pid`.
+ * @return 0, or -1 if there's no such task or the values are out of range.
+ */
+int sched_set_priority(int pid, int policy, int nice)
+{
+    if (policy != SCHED_RT && policy != SCHED_NORMAL && policy != SCHED_IDLE)
+    {
+        return -1;
+    }
+    if (nice < NICE_MIN || nice > NICE_MAX)
+    {
+        return -1;
     }
 
-    if (g_head_tsk == task_to_exit)
+    RunQueue *rq;
+    uint64_t rflags;
+    Task *t = sched_find_locked(pid, &rq, &rflags);
+    if (t == NULL)
     {
-        g_head_tsk = next_tsk;
+        return -1;
     }
 
-    g_curr_tsk = next_tsk;
+    bool requeue = t->queued;
+    if (requeue)
+    {
+        rq_dequeue(rq, t);
+    }
+    t->policy = (uint8_t)policy;
+    t->sched_class = (uint8_t)policy;
+    t->boost_ticks = 0;
+    t->nice = (int8_t)nice;
+    t->weight = g_nice_weights[nice - NICE_MIN];
+    if (requeue)
+    {
+        rq_place(rq, t);
+        rq_enqueue(rq, t);
+    }
 
-    tss_set_stack(next_tsk->kern_stk_top);
-    kern_stk_ptr = next_tsk->kern_stk_top;
+    spin_unlock_irqrestore(&rq->lock, rflags);
+    return 0;
+}
 
-    write_cr3(next_tsk->pml4);
+void sched_exit(int code)
+{
+    Task *task_to_exit = get_curr_task();
+    if (task_to_exit->pid == 0)
+    {
+        kprint("Kernel cannot exit!\n");
+        return;
+    }
 
     // sched_destroy_task(task_to_exit);
-    task_to_exit->state = TASK_ZOMBIE;
-    task_to_exit->ret_val = code;
-    sched_wake_pid(task_to_exit->parent->pid);
     sched_clean_gui(task_to_exit);
     sched_clean_fds(task_to_exit);
+    task_to_exit->ret_val = code;
+
+    cli();
+
+    cpu_local_t *cpu = this_cpu();
+    RunQueue *rq = &g_rqs[cpu->id];
+
+    spin_lock(&rq->lock);
+    task_to_exit->state = TASK_ZOMBIE;
+    spin_unlock(&rq->lock);
+
+    // the parent may reap us from another CPU as soon as it's woken up:
+    // sched_destroy_task waits until we are off our stack
+    sched_wake_pid(task_to_exit->parent->pid);
+
+    Task *next_tsk = sched_pick(cpu, task_to_exit);
 
     kprint("Task exited. Switching to next...\n");
     if (next_tsk == NULL)
@@ -443,61 +1263,139 @@ void sched_exit(int code)
         kprint("PANIC: Next task is NULL!\n");
         hcf();
     }
-    uint8_t *next_fpu = get_aligned_fpu_region(next_tsk);
-    switch_to_task(NULL, next_tsk->kern_stk_rsp, NULL, next_fpu);
+    sched_switch(cpu, task_to_exit, false, next_tsk);
 }
 
 void sched_kill(int pid)
 {
     // Suicide
-    if (pid == g_curr_tsk->pid)
+    if (pid == get_curr_task()->pid)
     {
         sched_exit(-1);
         return;
     }
 
-    // Assassinate
-    Task *tgt_tsk = sched_find_task(pid);
+    // Assassinate: the target runs its own sched_exit, see sched_check_kill,
+    // so its window and files aren't torn down under it from another CPU
+    RunQueue *rq;
+    uint64_t rflags;
+    Task *tgt_tsk = sched_find_locked(pid, &rq, &rflags);
     if (tgt_tsk == NULL)
     {
         kprint("SCHED: Kill failed, PID not found\n");
         return;
     }
 
-    // close the ui immediately to make it look fast
-    sched_clean_gui(tgt_tsk);
-    tgt_tsk->state = TASK_ZOMBIE;
-    tgt_tsk->ret_val = -1;
-
-    if (tgt_tsk->parent != NULL)
+    tgt_tsk->kill_pending = true;
+    // else it may own the block cache, or have a request on its stack in flight:
+    // it exits in sched_allow_kill
+    if (tgt_tsk->kill_defer == 0)
     {
-        sched_wake_pid(tgt_tsk->parent->pid);
+        rq_wake(rq, tgt_tsk);
+        // running elsewhere: its CPU may not tick again for long, make it switch away now
+        if (tgt_tsk->on_cpu && tgt_tsk->cpu != cpu_id())
+        {
+            smp_send_resched(tgt_tsk->cpu);
+        }
     }
+    spin_unlock_irqrestore(&rq->lock, rflags);
 }
 
-Task *get_curr_task()
+/**
+ * @brief Exits the current task if it was killed, and nothing holds the kill back.
+ * Called by schedule, on the way in and on the way back.
+ */
+static void sched_check_kill(void)
 {
-    return g_curr_tsk;
+    Task *curr_tsk = get_curr_task();
+    if (curr_tsk == NULL || !__atomic_load_n(&curr_tsk->kill_pending, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    uint64_t rflags = get_rflags();
+    cli();
+    RunQueue *rq = rq_lock_of(curr_tsk);
+    bool die = curr_tsk->kill_defer == 0 && curr_tsk->kill_pending;
+    if (die)
+    {
+        // sched_exit may sleep on a mutex: it mustn't come back here
+        curr_tsk->kill_pending = false;
+    }
+    spin_unlock(&rq->lock);
+    irq_restore(rflags);
+
+    if (die)
+    {
+        sched_exit(-1);
+    }
 }
 
-Task *sched_find_task(int pid)
+/**
+ * @brief Makes the current task unkillable until the matching sched_allow_kill.
+ * Calls nest. Used around what a dead task would leave broken: a block
+ * request on its stack still in flight, or the block cache left owned.
+ */
+void sched_defer_kill(void)
 {
-    if (g_head_tsk == NULL)
+    uint64_t rflags = get_rflags();
+    cli();
+    Task *curr_tsk = get_curr_task();
+    if (curr_tsk != NULL)
     {
-        return NULL;
+        // sched_kill decides under the run queue lock
+        RunQueue *rq = rq_lock_of(curr_tsk);
+        curr_tsk->kill_defer++;
+        spin_unlock(&rq->lock);
     }
+    irq_restore(rflags);
+}
 
-    Task *t = g_head_tsk;
-    do
+/**
+ * @brief Ends a sched_defer_kill. Once none is left, a kill that came
+ * meanwhile takes effect: the task exits here.
+ */
+void sched_allow_kill(void)
+{
+    uint64_t rflags = get_rflags();
+    cli();
+    Task *curr_tsk = get_curr_task();
+    bool die = false;
+    if (curr_tsk != NULL)
     {
-        if (t->pid == pid)
+        RunQueue *rq = rq_lock_of(curr_tsk);
+        curr_tsk->kill_defer--;
+        die = curr_tsk->kill_defer == 0 && curr_tsk->kill_pending;
+        if (die)
         {
-            return t;
+            // sched_exit may sleep on a mutex: it mustn't come back here
+            curr_tsk->kill_pending = false;
         }
-        t = t->next;
-    } while (t != g_head_tsk);
+        spin_unlock(&rq->lock);
+    }
+    irq_restore(rflags);
 
-    return NULL;
+    if (die)
+    {
+        sched_exit(-1);
+    }
+}
+
+Task *get_curr_task()
+{
+    return this_cpu()->curr_tsk;
+}
+
+Task *sched_find_task(int pid)
+{
+    RunQueue *rq;
+    uint64_t rflags;
+    Task *t = sched_find_locked(pid, &rq, &rflags);
+    if (t != NULL)
+    {
+        spin_unlock_irqrestore(&rq->lock, rflags);
+    }
+    return t;
 }
 
 int64_t get_curr_task_pid()
@@ -513,7 +1411,9 @@ int64_t get_curr_task_pid()
 
 void sched_send_signal(int pid, uint32_t sig_code)
 {
-    Task *tsk = sched_find_task(pid);
+    RunQueue *rq;
+    uint64_t rflags;
+    Task *tsk = sched_find_locked(pid, &rq, &rflags);
     if (tsk == NULL)
     {
         kprint("SCHED_SEND_SIGNAL failed: No task found for the id\n");
@@ -521,26 +1421,43 @@ void sched_send_signal(int pid, uint32_t sig_code)
     }
 
     tsk->pending_signals |= 1 << (sig_code - 1);
+    spin_unlock_irqrestore(&rq->lock, rflags);
 }
 
 /**
- * @brief Registers a task to the linked list of tasks
+ * @brief Registers a task to the run queue of the CPU with the fewest ready
+ * tasks, then the fewest tasks.
  */
 void sched_register_task(Task *tsk)
 {
-    if (g_head_tsk == NULL)
+    uint32_t best = 0;
+    for (uint32_t c = 1; c < smp_cpu_count(); c++)
     {
-        g_head_tsk = tsk;
-        tsk->next = tsk; // (loop)
-        g_curr_tsk = tsk;
-    }
-    else
-    {
-        tsk->next = g_head_tsk->next;
-        g_head_tsk->next = tsk;
+        RunQueue *rq = &g_rqs[c];
+        RunQueue *best_rq = &g_rqs[best];
+        if (smp_cpu(c)->online &&
+            (rq->nr_ready < best_rq->nr_ready ||
+             (rq->nr_ready == best_rq->nr_ready && rq->nr_tasks < best_rq->nr_tasks)))
+        {
+            best = c;
+        }
     }
 
+    // found by pid only once it's on its run queue
+    RunQueue *rq = &g_rqs[best];
+    uint64_t rflags = spin_lock_irqsave(&g_pid_lock);
+    spin_lock(&rq->lock);
+
+    tsk->cpu = best;
+    tsk->last_ran = timer_get_ticks();
     tsk->state = TASK_READY;
+    tsk->vruntime = rq->min_vruntime;
+    rq->nr_tasks++;
+    rq_enqueue(rq, tsk);
+    pid_hash_add(tsk);
+
+    spin_unlock(&rq->lock);
+    spin_unlock_irqrestore(&g_pid_lock, rflags);
 }
 
 /**
@@ -598,11 +1515,22 @@ Task *task_factory_fork(Task *parent_tsk)
     uint64_t kern_stk = pmm_alloc_frame();
     if (kern_stk == 0)
     {
-        kfree(child_tsk);
+        kmem_cache_free(&g_task_cache, child_tsk);
         return NULL;
     }
     child_tsk->kern_stk_top = (uint64_t)vmm_phys_to_hhdm(kern_stk) + PAGE_SIZE;
 
+    // the child got a fresh mmap area from sched_new_task, replace it with the parent's
+    vmm_cleanup_task(child_tsk);
+    if (vmm_copy_space(&child_tsk->vm, &parent_tsk->vm) < 0)
+    {
+        kprint("FORK failed: OOM\n");
+        pmm_free_frame(kern_stk);
+        vmm_free_table(vmm_phys_to_hhdm(new_pml4), 4);
+        kmem_cache_free(&g_task_cache, child_tsk);
+        return NULL;
+    }
+
     // copy environment
     memcpy(child_tsk->fd_tbl, parent_tsk->fd_tbl, MAX_OPEN_FILES * sizeof(file_handle_t *));
 
@@ -619,8 +1547,10 @@ Task *task_factory_fork(Task *parent_tsk)
     child_tsk->parent = parent_tsk;
     child_tsk->state = TASK_READY;
     child_tsk->win = parent_tsk->win;
-    child_tsk->vm_alloc_head = vmm_copy_alloc_list(parent_tsk->vm_alloc_head);
-    child_tsk->vm_free_head = vmm_copy_free_list(parent_tsk->vm_free_head);
+    child_tsk->policy = parent_tsk->policy;
+    child_tsk->sched_class = parent_tsk->policy;
+    child_tsk->nice = parent_tsk->nice;
+    child_tsk->weight = parent_tsk->weight;
 
     // convert the parent's syscall stack to the child's iretq stack
     uint64_t *parent_sp = (uint64_t *)parent_tsk->kern_stk_top - 13; // right rsp is at R15, totally 8 pushes to the sp
@@ -696,24 +1626,174 @@ inline static void sched_clean_fds(Task *tsk)
     }
 }
 
-void sched_check_sleeping_tasks()
+/**
+ * @brief The CPU, other than `self`, with nothing to run and no tick coming
+ * soon, or -1. Reads the other run queues without their locks.
+ */
+static int sched_tickless_cpu(uint32_t self, uint64_t now)
 {
-    if (g_head_tsk == NULL)
+    for (uint32_t c = 0; c < smp_cpu_count(); c++)
     {
-        return;
+        if (c != self && smp_cpu(c)->online && !g_rqs[c].running && g_rqs[c].next_tick > now + 1)
+        {
+            return (int)c;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Called by every CPU on its timer interrupt, and on IRQ_IPI_RESCHED.
+ * Charges the running task for the ticks since the last call, wakes the
+ * sleeping tasks of this CPU whose time has come, updates its load, and every
+ * SCHED_REBALANCE_TICKS, pulls a task from a CPU busier than itself. Then arms
+ * the timer for the next deadline:
+ * - a tick from now if tasks are waiting for the CPU, or it's switching tasks,
+ * - else the next sleeper to wake up, or if it runs a task, the next rebalance,
+ * - else never: it has nothing to do until a task is put on its run queue.
+ * @return Whether the CPU should switch to another task.
+ */
+bool sched_tick(void)
+{
+    cpu_local_t *cpu = this_cpu();
+    RunQueue *rq = &g_rqs[cpu->id];
+    uint64_t rflags = spin_lock_irqsave(&rq->lock);
+
+    uint64_t now = timer_get_ticks();
+    uint64_t elapsed = now - rq->last_tick; // 0 when kicked early
+    rq->last_tick = now;
+    Task *curr = cpu->curr_tsk;
+    bool busy = curr != NULL && curr != cpu->idle_tsk;
+
+    if (busy && elapsed > 0)
+    {
+        if (curr->policy == SCHED_NORMAL)
+        {
+            curr->vruntime += elapsed * SCHED_VRUNTIME_TICK * SCHED_NICE_0_WEIGHT / curr->weight;
+        }
+        if (curr->boost_ticks > 0)
+        {
+            curr->boost_ticks = elapsed >= curr->boost_ticks ? 0 : curr->boost_ticks - (uint32_t)elapsed;
+            if (curr->boost_ticks == 0)
+            {
+                curr->sched_class = curr->policy;
+            }
+        }
+
+        uint64_t min_vr = curr->sched_class == SCHED_NORMAL ? curr->vruntime : UINT64_MAX;
+        avl_node_t *left = avl_leftmost(rq->fair);
+        if (left != NULL && AVL_ENTRY(left, Task, run_node)->vruntime < min_vr)
+        {
+            min_vr = AVL_ENTRY(left, Task, run_node)->vruntime;
+        }
+        if (min_vr != UINT64_MAX && min_vr > rq->min_vruntime)
+        {
+            rq->min_vruntime = min_vr;
+        }
+    }
+
+    Task *t;
+    while ((t = rq_first_sleeper(rq)) != NULL && (uint64_t)t->wake_tick <= now)
+    {
+        rq_wake(rq, t);
+        t->wake_tick = -1;
+    }
+
+    uint32_t nr_ready = rq->nr_ready;
+    for (uint64_t i = 0; i < elapsed && i < SCHED_LOAD_MAX_STEPS; i++)
+    {
+        rq->load_avg += ((uint64_t)nr_ready * SCHED_LOAD_SCALE >> SCHED_LOAD_SHIFT) - (rq->load_avg >> SCHED_LOAD_SHIFT);
+    }
+    rq->ticks += elapsed;
+    if (!busy)
+    {
+        rq->idle_ticks += elapsed;
+    }
+
+    // an idle CPU looks for work to steal whenever it's woken up
+    Task *next = rq_peek(rq);
+    bool killed = busy && curr->kill_pending && curr->kill_defer == 0;
+    bool resched = !busy || killed || curr->state != TASK_READY || (next != NULL && sched_preempts(next, curr));
+    bool rebalance = now - rq->last_balance >= SCHED_REBALANCE_TICKS;
+    if (rebalance)
+    {
+        rq->last_balance = now;
+    }
+    bool kick = busy && rq->nr_queued > 0;
+
+    uint64_t deadline = TIMER_NEVER;
+    if (rq->nr_queued > 0 || (busy && resched))
+    {
+        deadline = now + 1;
+    }
+    else
+    {
+        if (busy)
+        {
+            deadline = rq->last_balance + SCHED_REBALANCE_TICKS;
+        }
+        t = rq_first_sleeper(rq);
+        if (t != NULL && (uint64_t)t->wake_tick < deadline)
+        {
+            deadline = (uint64_t)t->wake_tick;
+        }
     }
+    rq->next_tick = deadline;
+    timer_arm(deadline);
+
+    spin_unlock(&rq->lock);
 
-    int64_t curr_tick = timer_get_ticks();
+    if (rebalance)
+    {
+        uint32_t src_ready;
+        if (sched_busiest_cpu(cpu->id, &src_ready) >= 0 && src_ready >= nr_ready + 2)
+        {
+            sched_pull(cpu, false);
+        }
+    }
 
-    Task *t = g_head_tsk;
-    do
+    // the other CPUs don't tick while idle: wake one up to steal a waiting task
+    if (kick)
     {
-        if (t->state == TASK_SLEEPING && curr_tick >= t->wake_tick)
+        int idle_cpu = sched_tickless_cpu(cpu->id, now);
+        if (idle_cpu >= 0)
         {
-            t->state = TASK_READY;
-            t->wake_tick = -1;
+            smp_send_resched((uint32_t)idle_cpu);
         }
+    }
 
-        t = t->next;
-    } while (t != g_head_tsk);
-}
\ No newline at end of file
+    irq_restore(rflags);
+    return resched;
+}
+
+/**
+ * @brief Copies the load and balancing counters of up to `max` CPUs into `out`.
+ * @return The number of CPUs copied.
+ */
+int sched_get_stats(SchedInfo_t *out, int max)
+{
+    int n = 0;
+    for (uint32_t c = 0; c < smp_cpu_count() && n < max; c++, n++)
+    {
+        RunQueue *rq = &g_rqs[c];
+        uint64_t rflags = spin_lock_irqsave(&rq->lock);
+
+        out[n].cpu = c;
+        out[n].online = smp_cpu(c)->online;
+        out[n].nr_tasks = rq->nr_tasks;
+        out[n].nr_ready = rq->nr_ready;
+        out[n].load_avg = rq->load_avg;
+        out[n].ticks = rq->ticks;
+        out[n].idle_ticks = rq->idle_ticks;
+        out[n].switches = rq->switches;
+        out[n].steals = rq->steals;
+        out[n].balanced = rq->balanced;
+        out[n].stolen = rq->stolen;
+        out[n].input_frames = rq->input_frames;
+        out[n].input_cycles = rq->input_cycles;
+        out[n].input_cycles_max = rq->input_cycles_max;
+
+        spin_unlock_irqrestore(&rq->lock, rflags);
+    }
+    return n;
+}
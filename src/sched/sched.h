@@ -10,7 +10,10 @@
 #include "mem/vmm.h"
 #include "fs/vfs.h"
 #include "event/event.h"
+#include "include/schedinfo.h"
+#include "utils/avl.h"
 #include <stdint.h>
+#include <stdbool.h>
 
 #define MAX_OPEN_FILES 0x10 // each task has at most 16 files open
 #define MAX_CWD_LEN 0x100
@@ -24,14 +27,30 @@ typedef struct Task
     uint64_t kern_stk_top;
     int pid;
     short int state;
-    struct Task *next;
+    struct Task *next; // ready FIFO of its run queue
+    struct Task *prev;
+    struct Task *pid_next; // pid hash chain
     file_handle_t *fd_tbl[MAX_OPEN_FILES];
-    uint64_t pml4; // phys_addr of pml4
+    uint64_t pml4;     // phys_addr of pml4
+    uint16_t pcid;     // tags its TLB entries, 0 until it first runs
+    uint32_t pcid_cpu; // the CPU whose TLB may hold entries under `pcid`
+    uint32_t cpu;      // the CPU whose run queue it's on
+    bool on_cpu;       // a CPU is running it, or still switching away from it
+    bool queued;       // on the ready FIFO
+    bool in_sleepq;    // on the sleep tree, by wake_tick
+    uint64_t last_ran; // tick it last stopped running, tells whether its cache is still warm
+    uint8_t policy;      // SCHED_RT, SCHED_NORMAL or SCHED_IDLE, from sched_set_priority
+    uint8_t sched_class; // the class it's queued in: its policy, or SCHED_RT while boosted
+    int8_t nice;
+    uint32_t weight;      // of its nice level, see g_nice_weights
+    uint32_t boost_ticks; // left of the SCHED_RT boost an input wakeup gave it
+    uint64_t vruntime;    // ticks run, scaled by weight, for SCHED_NORMAL
+    avl_node_t run_node;  // in the SCHED_NORMAL tree of its run queue
+    uint64_t input_tsc;   // TSC when an input event woke it, 0 once it drew
     struct Task *parent;
     int ret_val; // exit code
     uint64_t heap_end;
-    VmFreeRegion *vm_free_head;
-    VmAllocatedList *vm_alloc_head;
+    VmSpace vm; // the mmap area
 
     char cwd[MAX_CWD_LEN];
 
@@ -40,11 +59,14 @@ typedef struct Task
 
     // Signal
     uint32_t pending_signals;
+    uint32_t kill_defer; // sched_defer_kill depth: a kill waits until it's back to 0
+    bool kill_pending;   // killed: exits the next time it runs with kill_defer at 0
 
     uint8_t fpu_regs[512 + 16];
 
     struct Task *wait_next;
     int64_t wake_tick;
+    avl_node_t sleep_node;
     EventBuf *event_queue;
     int fg_pid;
 } Task;
@@ -55,12 +77,19 @@ void task_context_reset(Task *task, uint64_t entry, uint64_t rsp);
 void sched_destroy_task(Task *task);
 void sched_unlink_task(Task *task);
 void sched_init(void);
+void sched_init_cpu(void);
 void schedule(void);
+void sched_tail(void);
 void task_idle(void);
 void sched_block();
 void sched_wake_pid(int pid);
+void sched_wake_input(int pid);
+void sched_task_drew(void);
+int sched_set_priority(int pid, int policy, int nice);
 void sched_exit(int code);
 void sched_kill(int pid);
+void sched_defer_kill(void);
+void sched_allow_kill(void);
 Task *get_curr_task(void);
 Task *sched_find_task(int pid);
 int64_t get_curr_task_pid();
@@ -69,6 +98,7 @@ void sched_send_signal(int pid, uint32_t sig_code);
 void sched_register_task(Task *task);
 Task *task_factory_create(uint64_t entry, uint64_t rsp);
 Task *task_factory_fork(Task *parent);
-void sched_check_sleeping_tasks(void);
+bool sched_tick(void);
+int sched_get_stats(SchedInfo_t *out, int max);
 
 #endif
\ No newline at end of file
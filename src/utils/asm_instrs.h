@@ -29,6 +29,13 @@ static inline void pause(void)
     asm volatile("pause");
 }
 
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 static inline uint64_t get_rflags(void)
 {
     uint64_t rflags;
@@ -36,4 +43,15 @@ static inline uint64_t get_rflags(void)
     return rflags;
 }
 
+/**
+ * @brief Turns interrupts back on if they were on when `rflags` was read.
+ */
+static inline void irq_restore(uint64_t rflags)
+{
+    if (rflags & (1 << 9))
+    {
+        sti();
+    }
+}
+
 #endif
\ No newline at end of file
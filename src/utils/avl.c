@@ -0,0 +1,185 @@
+/**
+ * @file avl.c
+ * @brief An intrusive AVL tree.
+ *
+ * Every node keeps the height of its subtree, and the heights of the two
+ * children of any node differ by at most 1, which bounds the height of the
+ * tree to about 1.44 * log2(n). Insert and remove walk down once and fix the
+ * heights on the way back up with at most two rotations per level, so both
+ * are O(log n), and the recursion is only as deep as the tree.
+ */
+
+#include "avl.h"
+
+static inline int32_t avl_height(const avl_node_t *n)
+{
+    return n != NULL ? n->height : 0;
+}
+
+static inline void avl_update(avl_node_t *n)
+{
+    int32_t hl = avl_height(n->left);
+    int32_t hr = avl_height(n->right);
+    n->height = 1 + (hl > hr ? hl : hr);
+}
+
+static avl_node_t *avl_rotate_right(avl_node_t *n)
+{
+    avl_node_t *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    avl_update(n);
+    avl_update(l);
+    return l;
+}
+
+static avl_node_t *avl_rotate_left(avl_node_t *n)
+{
+    avl_node_t *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    avl_update(n);
+    avl_update(r);
+    return r;
+}
+
+/**
+ * @brief Restores the AVL property at `n`, whose children are balanced.
+ * @return The new root of the subtree.
+ */
+static avl_node_t *avl_balance(avl_node_t *n)
+{
+    avl_update(n);
+    int32_t bf = avl_height(n->left) - avl_height(n->right);
+
+    if (bf > 1)
+    {
+        if (avl_height(n->left->left) < avl_height(n->left->right))
+        {
+            n->left = avl_rotate_left(n->left);
+        }
+        return avl_rotate_right(n);
+    }
+    if (bf < -1)
+    {
+        if (avl_height(n->right->right) < avl_height(n->right->left))
+        {
+            n->right = avl_rotate_right(n->right);
+        }
+        return avl_rotate_left(n);
+    }
+    return n;
+}
+
+static avl_node_t *avl_insert_at(avl_node_t *root, avl_node_t *node, avl_cmp_fn cmp)
+{
+    if (root == NULL)
+    {
+        node->left = NULL;
+        node->right = NULL;
+        node->height = 1;
+        return node;
+    }
+
+    if (cmp(node, root) < 0)
+    {
+        root->left = avl_insert_at(root->left, node, cmp);
+    }
+    else
+    {
+        root->right = avl_insert_at(root->right, node, cmp);
+    }
+    return avl_balance(root);
+}
+
+/**
+ * @brief Unlinks the leftmost node of the subtree into `min`.
+ * @return The new root of the subtree.
+ */
+static avl_node_t *avl_pop_min(avl_node_t *root, avl_node_t **min)
+{
+    if (root->left == NULL)
+    {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = avl_pop_min(root->left, min);
+    return avl_balance(root);
+}
+
+static avl_node_t *avl_remove_at(avl_node_t *root, avl_node_t *node, avl_cmp_fn cmp)
+{
+    if (root == NULL)
+    {
+        return NULL; // not in the tree
+    }
+
+    if (root != node)
+    {
+        if (cmp(node, root) < 0)
+        {
+            root->left = avl_remove_at(root->left, node, cmp);
+        }
+        else
+        {
+            root->right = avl_remove_at(root->right, node, cmp);
+        }
+        return avl_balance(root);
+    }
+
+    if (root->right == NULL)
+    {
+        return root->left;
+    }
+
+    // the in-order successor takes the place of the removed node
+    avl_node_t *succ;
+    avl_node_t *right = avl_pop_min(root->right, &succ);
+    succ->left = root->left;
+    succ->right = right;
+    return avl_balance(succ);
+}
+
+void avl_insert(avl_node_t **root, avl_node_t *node, avl_cmp_fn cmp)
+{
+    *root = avl_insert_at(*root, node, cmp);
+}
+
+void avl_remove(avl_node_t **root, avl_node_t *node, avl_cmp_fn cmp)
+{
+    *root = avl_remove_at(*root, node, cmp);
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 0;
+}
+
+static void avl_iter_push_left(avl_iter_t *it, avl_node_t *n)
+{
+    while (n != NULL)
+    {
+        it->stack[it->top++] = n;
+        n = n->left;
+    }
+}
+
+void avl_iter_init(avl_iter_t *it, avl_node_t *root)
+{
+    it->top = 0;
+    avl_iter_push_left(it, root);
+}
+
+/**
+ * @return The next node in order, or NULL at the end.
+ */
+avl_node_t *avl_iter_next(avl_iter_t *it)
+{
+    if (it->top == 0)
+    {
+        return NULL;
+    }
+
+    avl_node_t *n = it->stack[--it->top];
+    avl_iter_push_left(it, n->right);
+    return n;
+}
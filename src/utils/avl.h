@@ -0,0 +1,43 @@
+#ifndef AVL_H
+#define AVL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * An intrusive AVL tree: the node is embedded in the object it sorts, and a
+ * single object can sit in several trees through several nodes.
+ * The tree never allocates. Keys must be unique under the compare function.
+ */
+typedef struct avl_node
+{
+    struct avl_node *left;
+    struct avl_node *right;
+    int32_t height;
+} avl_node_t;
+
+// < 0, 0, > 0 like strcmp
+typedef int (*avl_cmp_fn)(const avl_node_t *a, const avl_node_t *b);
+
+#define AVL_ENTRY(ptr, type, member) ((type *)((uint8_t *)(ptr) - offsetof(type, member)))
+
+// an AVL tree of height 48 holds at least 12 billion nodes
+#define AVL_MAX_HEIGHT 48
+
+/**
+ * In-order iterator. It keeps its own stack, so it walks without recursion,
+ * and the node it just returned may be freed before the next call.
+ */
+typedef struct avl_iter
+{
+    avl_node_t *stack[AVL_MAX_HEIGHT];
+    int32_t top;
+} avl_iter_t;
+
+void avl_insert(avl_node_t **root, avl_node_t *node, avl_cmp_fn cmp);
+void avl_remove(avl_node_t **root, avl_node_t *node, avl_cmp_fn cmp);
+
+void avl_iter_init(avl_iter_t *it, avl_node_t *root);
+avl_node_t *avl_iter_next(avl_iter_t *it);
+
+#endif
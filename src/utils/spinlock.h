@@ -0,0 +1,62 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+#include "asm_instrs.h"
+
+/**
+ * A test-and-test-and-set spinlock.
+ *
+ * Turning interrupts off only keeps the other code of the same CPU out; the
+ * data shared between CPUs is guarded by a spinlock instead. A lock that an
+ * interrupt handler may take too must be held with interrupts off, through
+ * spin_lock_irqsave, or the handler would spin on its own CPU forever.
+ * Nothing may sleep (schedule) with a spinlock held.
+ */
+typedef struct spinlock
+{
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT {.locked = 0}
+
+// runs the TLB flush another CPU may be waiting on, see smp.c
+void smp_tlb_poll(void);
+
+static inline void spin_lock(spinlock_t *lock)
+{
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        // wait on a plain read, which keeps the cache line shared
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED) != 0)
+        {
+            smp_tlb_poll();
+            pause();
+        }
+    }
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Turns interrupts off and takes the lock.
+ * @return The RFLAGS to give back to spin_unlock_irqrestore.
+ */
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock)
+{
+    uint64_t rflags = get_rflags();
+    cli();
+    spin_lock(lock);
+    return rflags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t rflags)
+{
+    spin_unlock(lock);
+    irq_restore(rflags);
+}
+
+#endif